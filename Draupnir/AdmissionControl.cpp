@@ -0,0 +1,185 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/AdmissionControl.cpp
+//
+// summary:	Implements the rate limits of the connections accepted by the target
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "AdmissionControl.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace
+{
+	// The bucket holds the tokens of this many seconds of the rate
+	const double BurstSeconds = 2.0;
+	// The counters are logged at most this often
+	const std::chrono::seconds ReportInterval(10);
+	// Least recently seen sources checked for an idle one when the table is full
+	const size_t EvictionProbes = 8;
+} // namespace
+
+namespace Draupnir
+{
+	const size_t AdmissionControl::MaxSources;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	AdmissionControl::AdmissionControl(unsigned globalRate, unsigned sourceRate)
+		: m_globalRate(globalRate)
+		, m_sourceRate(sourceRate)
+		, m_global{ globalRate * BurstSeconds, std::chrono::steady_clock::now() }
+		, m_accepted(0)
+		, m_globalRejected(0)
+		, m_sourceRejected(0)
+		, m_handshakeRejected(0)
+		, m_reported()
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t AdmissionControl::GetSourceKey(const struct sockaddr_storage& address) noexcept
+	{
+		const uint64_t IPv4 = 1ull << 32;
+		if (AF_INET == address.ss_family)
+			return IPv4 | ntohl(reinterpret_cast<const struct sockaddr_in&>(address).sin_addr.s_addr);
+		if (AF_INET6 != address.ss_family)
+			return 0;
+
+		// The IPv4 peers of the dual-stack socket are the same as the others,
+		// and an IPv6 host usually owns the whole /64
+		const struct in6_addr& ip = reinterpret_cast<const struct sockaddr_in6&>(address).sin6_addr;
+		const bool isMapped = IN6_IS_ADDR_V4MAPPED(&ip);
+		uint64_t key = 0;
+		for (size_t idx = isMapped ? 12 : 0; idx < (isMapped ? 16u : 8u); ++idx)
+			key = key << 8 | ip.s6_addr[idx];
+		return isMapped ? IPv4 | key : key;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool AdmissionControl::Take(Bucket& bucket, double rate, std::chrono::steady_clock::time_point now) noexcept
+	{
+		const double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+		bucket.tokens = std::min(rate * BurstSeconds, bucket.tokens + rate * elapsed);
+		bucket.refilled = now;
+		if (bucket.tokens < 1.0)
+			return false;
+		bucket.tokens -= 1.0;
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool AdmissionControl::Admit(const struct sockaddr_storage& address)
+	{
+		if (0 == m_globalRate && 0 == m_sourceRate)
+		{
+			m_accepted.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// The source is checked first, so the noisy one doesn't take the
+		// tokens of the whole target
+		if (m_sourceRate)
+		{
+			const uint64_t key = GetSourceKey(address);
+			auto source = m_sources.find(key);
+			if (m_sources.end() == source)
+			{
+				if (m_sources.size() >= MaxSources && !ForgetIdleSource(now))
+				{
+					m_sourceRejected.fetch_add(1, std::memory_order_relaxed);
+					Report(now);
+					return false;
+				}
+				m_recent.push_back(key);
+				source = m_sources.emplace(key,
+					Source{ Bucket{ m_sourceRate * BurstSeconds, now }, std::prev(m_recent.end()) }).first;
+			}
+			else
+			{
+				m_recent.splice(m_recent.end(), m_recent, source->second.recent);
+			}
+
+			if (!Take(source->second.bucket, m_sourceRate, now))
+			{
+				m_sourceRejected.fetch_add(1, std::memory_order_relaxed);
+				Report(now);
+				return false;
+			}
+		}
+
+		if (m_globalRate && !Take(m_global, m_globalRate, now))
+		{
+			m_globalRejected.fetch_add(1, std::memory_order_relaxed);
+			Report(now);
+			return false;
+		}
+
+		m_accepted.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void AdmissionControl::RejectHandshake()
+	{
+		m_accepted.fetch_sub(1, std::memory_order_relaxed);
+		m_handshakeRejected.fetch_add(1, std::memory_order_relaxed);
+
+		const auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Report(now);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool AdmissionControl::ForgetIdleSource(std::chrono::steady_clock::time_point now)
+	{
+		// The source whose bucket is full again is no different from a new one.
+		// Only a few of the least recently seen are checked, so the admission
+		// stays cheap while the table is full of the flooding sources
+		auto recent = m_recent.begin();
+		for (size_t probe = 0; probe < EvictionProbes && m_recent.end() != recent; ++probe, ++recent)
+		{
+			const auto source = m_sources.find(*recent);
+			const Bucket& bucket = source->second.bucket;
+			const double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+			if (bucket.tokens + m_sourceRate * elapsed >= m_sourceRate * BurstSeconds)
+			{
+				m_recent.erase(recent);
+				m_sources.erase(source);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	AdmissionControl::Stats AdmissionControl::GetStats() const noexcept
+	{
+		Stats stats;
+		stats.accepted = m_accepted.load(std::memory_order_relaxed);
+		stats.globalRejected = m_globalRejected.load(std::memory_order_relaxed);
+		stats.sourceRejected = m_sourceRejected.load(std::memory_order_relaxed);
+		stats.handshakeRejected = m_handshakeRejected.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void AdmissionControl::Report(std::chrono::steady_clock::time_point now)
+	{
+		// Logging every rejected connection would make a flood of the log
+		if (now - m_reported < ReportInterval)
+			return;
+		m_reported = now;
+
+		const Stats stats = GetStats();
+		INFO_LOG << "admission: " << stats.accepted << " connection(s) accepted, rejected "
+			<< stats.globalRejected << " over the target's rate, " << stats.sourceRejected
+			<< " over the source's rate, " << stats.handshakeRejected << " over the handshake limit, "
+			<< m_sources.size() << " source(s) tracked";
+	}
+} // namespace Draupnir
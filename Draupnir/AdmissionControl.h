@@ -0,0 +1,94 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/AdmissionControl.h
+//
+// summary:	Declares the rate limits of the connections accepted by the target
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/socket.h>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Rate limits checked by the reactors right after accept(),
+	/// 			before anything is allocated for the connection. The whole
+	/// 			target and every source address have a token bucket, which
+	/// 			holds up to twice the rate and loses a token per connection.
+	/// 			The rejected connection costs a close(). The counters of the
+	/// 			rejections are reported to the log from time to time, while
+	/// 			the connections are rejected.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class AdmissionControl
+	{
+	public:
+		struct Stats
+		{
+			uint64_t accepted;
+			// Over the rate of the whole target or of the source
+			uint64_t globalRejected;
+			uint64_t sourceRejected;
+			// Over the limit of the sessions without the handshake completed
+			uint64_t handshakeRejected;
+		};
+
+		// Sources tracked at once, the least recently seen idle ones are
+		// forgotten beyond that
+		static const size_t MaxSources = 64 * 1024;
+
+		// The rates are connections per second, 0 if unlimited
+		AdmissionControl(unsigned globalRate, unsigned sourceRate);
+		AdmissionControl(const AdmissionControl&) = delete;
+		AdmissionControl& operator =(const AdmissionControl&) = delete;
+
+		// Take the tokens of the connection from the address, may be called from any thread
+		bool Admit(const struct sockaddr_storage& address);
+		// The admitted connection is rejected later over the handshake limit
+		void RejectHandshake();
+
+		Stats GetStats() const noexcept;
+
+	private:
+		struct Bucket
+		{
+			double tokens;
+			std::chrono::steady_clock::time_point refilled;
+		};
+
+		struct Source
+		{
+			Bucket bucket;
+			// Position of the source in the order of the connections
+			std::list<uint64_t>::iterator recent;
+		};
+
+		const double m_globalRate;
+		const double m_sourceRate;
+		std::mutex m_mutex;
+		Bucket m_global;
+		std::unordered_map<uint64_t, Source> m_sources;
+		// Keys of the sources, the least recently seen first
+		std::list<uint64_t> m_recent;
+
+		std::atomic<uint64_t> m_accepted;
+		std::atomic<uint64_t> m_globalRejected;
+		std::atomic<uint64_t> m_sourceRejected;
+		std::atomic<uint64_t> m_handshakeRejected;
+		std::chrono::steady_clock::time_point m_reported;
+
+		static uint64_t GetSourceKey(const struct sockaddr_storage& address) noexcept;
+		static bool Take(Bucket& bucket, double rate, std::chrono::steady_clock::time_point now) noexcept;
+		// Forget one of the least recently seen sources if it's idle, false if none is
+		bool ForgetIdleSource(std::chrono::steady_clock::time_point now);
+		// Log the counters unless they have been logged recently, called under the lock
+		void Report(std::chrono::steady_clock::time_point now);
+	};
+} // namespace Draupnir
@@ -0,0 +1,952 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/BenchmarkConductor.cpp
+//
+// summary:	Implements the benchmark conductor class
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "BenchmarkConductor.h"
+#include "BufferPool.h"
+#include "ChannelStream.h"
+#include "CompressedStream.h"
+#include "FileTransfer.h"
+#include "TLSPolicy.h"
+#include "ThreadRNG.h"
+#include "Config.h"
+#include "Logger.h"
+#include "Poller.h"
+
+#include <botan/aead.h>
+#include <botan/auto_rng.h>
+#include <botan/ecdsa.h>
+#include <botan/rsa.h>
+#include <botan/x509self.h>
+#include <botan/tls_client.h>
+#include <botan/tls_server.h>
+#include <botan/tls_session_manager.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	double ToSeconds(Clock::duration duration)
+	{
+		return std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
+	}
+
+	// Operand of the logging benchmark as costly as dumping a buffer, counts its calls
+	std::string Describe(unsigned long& calls)
+	{
+		++calls;
+		return std::string(64, 'x');
+	}
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Endpoint of the TLS connection running in memory: the
+	/// 			emitted records are collected to be passed to the peer.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class MemoryEndpoint final : public Botan::TLS::Callbacks
+	{
+	public:
+		std::vector<uint8_t> output;
+		bool activated = false;
+
+		void tls_emit_data(const uint8_t data[], size_t size) override
+		{
+			output.insert(output.end(), data, data + size);
+		}
+
+		void tls_record_received(uint64_t seqNo __attribute__((unused)),
+			const uint8_t data[] __attribute__((unused)),
+			size_t size __attribute__((unused))) override
+		{
+		}
+
+		void tls_alert(Botan::TLS::Alert alert) override
+		{
+			if (alert.is_fatal())
+				throw std::runtime_error("TLS alert: " + alert.type_string());
+		}
+
+		bool tls_session_established(const Botan::TLS::Session& session __attribute__((unused))) override
+		{
+			return false;
+		}
+
+		void tls_session_activated() override
+		{
+			activated = true;
+		}
+
+		// The certificate is generated by the benchmark itself
+		void tls_verify_cert_chain(
+			const std::vector<Botan::X509_Certificate>& certChain __attribute__((unused)),
+			const std::vector<std::shared_ptr<const Botan::OCSP::Response>>& ocspResponses __attribute__((unused)),
+			const std::vector<Botan::Certificate_Store*>& trustedRoots __attribute__((unused)),
+			Botan::Usage_Type usage __attribute__((unused)),
+			const std::string& hostname __attribute__((unused)),
+			const Botan::TLS::Policy& policy __attribute__((unused))) override
+		{
+		}
+	};
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Credentials of the benchmarked server. </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class MemoryCredentials final : public Botan::Credentials_Manager
+	{
+		const Botan::X509_Certificate m_cert;
+		Botan::Private_Key& m_key;
+
+	public:
+		MemoryCredentials(const Botan::X509_Certificate& cert, Botan::Private_Key& key)
+			: m_cert(cert)
+			, m_key(key)
+		{}
+
+		std::vector<Botan::X509_Certificate> cert_chain(
+			const std::vector<std::string>& certKeyTypes __attribute__((unused)),
+			const std::string& type,
+			const std::string& context __attribute__((unused))) override
+		{
+			if ("tls-server" == type)
+				return { m_cert };
+			return {};
+		}
+
+		Botan::Private_Key* private_key_for(
+			const Botan::X509_Certificate& cert __attribute__((unused)),
+			const std::string& type __attribute__((unused)),
+			const std::string& context __attribute__((unused))) override
+		{
+			return &m_key;
+		}
+	};
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Endpoint of the TLS connection over a blocking socket, the
+	/// 			received records are passed to the handler.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class SocketEndpoint final : public Botan::TLS::Callbacks
+	{
+		const int m_handle;
+		const std::function<void(const uint8_t*, size_t)> m_handler;
+		std::vector<uint8_t> m_buffer;
+
+	public:
+		bool activated = false;
+
+		SocketEndpoint(int handle, std::function<void(const uint8_t*, size_t)> handler)
+			: m_handle(handle)
+			, m_handler(std::move(handler))
+			, m_buffer(64 * 1024)
+		{}
+
+		// Wait for the data of the peer and pass it to the TLS channel
+		void Receive(Botan::TLS::Channel& channel)
+		{
+			const ssize_t count = read(m_handle, m_buffer.data(), m_buffer.size());
+			if (-1 == count && EINTR == errno)
+				return;
+			if (-1 == count)
+				throw std::runtime_error("read error: " + std::string(strerror(errno)));
+			if (0 == count)
+				throw std::runtime_error("connection is closed by the peer");
+			channel.received_data(m_buffer.data(), static_cast<size_t>(count));
+		}
+
+		void tls_emit_data(const uint8_t data[], size_t size) override
+		{
+			while (size)
+			{
+				const ssize_t count = write(m_handle, data, size);
+				if (-1 == count && EINTR == errno)
+					continue;
+				if (-1 == count)
+					throw std::runtime_error("write error: " + std::string(strerror(errno)));
+				data += count;
+				size -= static_cast<size_t>(count);
+			}
+		}
+
+		void tls_record_received(uint64_t seqNo __attribute__((unused)), const uint8_t data[], size_t size) override
+		{
+			m_handler(data, size);
+		}
+
+		void tls_alert(Botan::TLS::Alert alert) override
+		{
+			if (alert.is_fatal())
+				throw std::runtime_error("TLS alert: " + alert.type_string());
+		}
+
+		bool tls_session_established(const Botan::TLS::Session& session __attribute__((unused))) override
+		{
+			return false;
+		}
+
+		void tls_session_activated() override
+		{
+			activated = true;
+		}
+
+		void tls_verify_cert_chain(
+			const std::vector<Botan::X509_Certificate>& certChain __attribute__((unused)),
+			const std::vector<std::shared_ptr<const Botan::OCSP::Response>>& ocspResponses __attribute__((unused)),
+			const std::vector<Botan::Certificate_Store*>& trustedRoots __attribute__((unused)),
+			Botan::Usage_Type usage __attribute__((unused)),
+			const std::string& hostname __attribute__((unused)),
+			const Botan::TLS::Policy& policy __attribute__((unused))) override
+		{
+		}
+	};
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	File of the benchmark, removed when it's over. </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class TemporaryFile final
+	{
+		std::string m_path;
+
+	public:
+		TemporaryFile()
+		{
+			const char* dir = getenv("TMPDIR");
+			std::string pattern = std::string(dir && *dir ? dir : "/tmp") + "/draupnir-benchmark-XXXXXX";
+			Draupnir::SocketHandle handle(mkstemp(&pattern[0]));
+			if (!handle)
+				throw std::runtime_error("failed to create " + pattern + ": " + strerror(errno));
+			m_path = pattern;
+		}
+		TemporaryFile(const TemporaryFile&) = delete;
+		TemporaryFile& operator =(const TemporaryFile&) = delete;
+
+		~TemporaryFile()
+		{
+			unlink(m_path.c_str());
+		}
+
+		const std::string& GetPath() const noexcept
+		{
+			return m_path;
+		}
+	};
+
+	std::unique_ptr<Botan::Private_Key> MakeKey(const std::string& algorithm, Botan::RandomNumberGenerator& rng)
+	{
+		// Same parameters as the embedded keys get from the botan utility
+		if ("ECDSA" == algorithm)
+			return std::unique_ptr<Botan::Private_Key>(new Botan::ECDSA_PrivateKey(rng, Botan::EC_Group("secp256r1")));
+		if ("RSA" == algorithm)
+			return std::unique_ptr<Botan::Private_Key>(new Botan::RSA_PrivateKey(rng, 3072));
+		throw std::invalid_argument("unsupported key algorithm " + algorithm);
+	}
+} // namespace
+
+namespace Draupnir
+{
+	const std::chrono::seconds BenchmarkConductor::Duration(3);
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	BenchmarkConductor::BenchmarkConductor(std::shared_ptr<Config> config)
+		: Conductor(config)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int BenchmarkConductor::Run()
+	{
+		struct Case
+		{
+			const char* name;
+			void (BenchmarkConductor::*run)() const;
+		};
+
+		static const Case cases[] =
+		{
+			{ "handshake", &BenchmarkConductor::BenchmarkHandshakes },
+			{ "cipher", &BenchmarkConductor::BenchmarkCiphers },
+			{ "session", &BenchmarkConductor::BenchmarkFirstBytes },
+			{ "compression", &BenchmarkConductor::BenchmarkCompression },
+			{ "transfer", &BenchmarkConductor::BenchmarkTransfer },
+			{ "logging", &BenchmarkConductor::BenchmarkLogging },
+			{ "poller", &BenchmarkConductor::BenchmarkPollers }
+		};
+
+		const std::string& name = GetConfig().GetBenchmark();
+		bool found = false;
+		for (const auto& benchmark : cases)
+		{
+			if ("all" != name && name != benchmark.name)
+				continue;
+
+			DEBUG_LOG << "running benchmark " << benchmark.name;
+			(this->*benchmark.run)();
+			found = true;
+		}
+
+		if (!found)
+			throw std::invalid_argument("unknown benchmark " + name + ", run with -h for reference");
+		return EXIT_SUCCESS;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkHandshakes() const
+	{
+		for (const char* algorithm : { "ECDSA", "RSA" })
+			BenchmarkHandshake(algorithm);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkHandshake(const std::string& algorithm) const
+	{
+		Botan::AutoSeeded_RNG rng;
+		std::unique_ptr<Botan::Private_Key> key = MakeKey(algorithm, rng);
+		const Botan::X509_Certificate cert = Botan::X509::create_self_signed_cert(
+			Botan::X509_Cert_Options("draupnir"), *key, "SHA-256", rng);
+
+		MemoryCredentials serverCreds(cert, *key);
+		Botan::Credentials_Manager clientCreds;
+		const TLSPolicy policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange(), algorithm);
+		// Every handshake is the full one
+		Botan::TLS::Session_Manager_Noop sessions;
+
+		// Both sides run on this thread, the time spent by the server is
+		// accounted separately to get the capacity of a target core
+		unsigned long handshakes = 0;
+		Clock::duration serverTime = Clock::duration::zero();
+		const auto start = Clock::now();
+		const auto deadline = start + Duration;
+		while (Clock::now() < deadline)
+		{
+			MemoryEndpoint server;
+			MemoryEndpoint client;
+			Botan::TLS::Server serverTLS(server, sessions, serverCreds, policy, rng);
+			Botan::TLS::Client clientTLS(client, sessions, clientCreds, policy, rng,
+				Botan::TLS::Server_Information("draupnir"));
+
+			while (!server.activated || !client.activated)
+			{
+				if (client.output.empty() && server.output.empty())
+					throw std::runtime_error(algorithm + " handshake is stalled");
+
+				std::vector<uint8_t> records;
+				records.swap(client.output);
+				if (!records.empty())
+				{
+					const auto serverStart = Clock::now();
+					serverTLS.received_data(records);
+					serverTime += Clock::now() - serverStart;
+				}
+
+				records.clear();
+				records.swap(server.output);
+				if (!records.empty())
+					clientTLS.received_data(records);
+			}
+			++handshakes;
+		}
+
+		const double elapsed = ToSeconds(Clock::now() - start);
+		std::cout << std::fixed << std::setprecision(1)
+			<< "handshake/" << std::left << std::setw(6) << algorithm << std::right
+			<< handshakes << " handshakes in " << elapsed << " s: "
+			<< handshakes / elapsed << " per second for both sides, "
+			<< handshakes / ToSeconds(serverTime) << " per second for the server"
+			<< std::endl;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkCiphers() const
+	{
+		std::cout << "hardware AES is " << (TLSPolicy::HasHardwareAES() ? "available" : "not available")
+			<< std::endl;
+
+		// Measure the suites in the order of preference of the configured policy
+		const TLSPolicy policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange());
+		for (const auto& cipher : policy.allowed_ciphers())
+			BenchmarkCipher(cipher);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkCipher(const std::string& cipher) const
+	{
+		// Full-sized TLS 1.2 records with the explicit nonce and the record
+		// header as the associated data
+		const size_t RecordSize = 16 * 1024;
+		const size_t NonceSize = 12;
+		const size_t HeaderSize = 13;
+
+		Botan::AutoSeeded_RNG rng;
+		std::unique_ptr<Botan::AEAD_Mode> aead = Botan::AEAD_Mode::create_or_throw(cipher, Botan::ENCRYPTION);
+		aead->set_key(rng.random_vec(aead->key_spec().maximum_keylength()));
+
+		std::vector<uint8_t> nonce(NonceSize);
+		std::vector<uint8_t> header(HeaderSize);
+		Botan::secure_vector<uint8_t> record = rng.random_vec(RecordSize);
+		uint64_t sequence = 0;
+
+		unsigned long records = 0;
+		const auto start = Clock::now();
+		const auto deadline = start + Duration;
+		while (Clock::now() < deadline)
+		{
+			// Check the clock once per batch to keep it out of the measurement
+			for (unsigned batch = 0; batch < 64; ++batch, ++records, ++sequence)
+			{
+				memcpy(nonce.data() + NonceSize - sizeof(sequence), &sequence, sizeof(sequence));
+				memcpy(header.data(), &sequence, sizeof(sequence));
+
+				record.resize(RecordSize);
+				aead->set_associated_data(header.data(), header.size());
+				aead->start(nonce.data(), nonce.size());
+				aead->finish(record);
+			}
+		}
+
+		const double elapsed = ToSeconds(Clock::now() - start);
+		std::cout << std::fixed << std::setprecision(1)
+			<< "cipher/" << std::left << std::setw(17) << cipher << std::right
+			<< records << " records in " << elapsed << " s: "
+			<< records * RecordSize / elapsed / (1024 * 1024) << " MB/s"
+			<< std::endl;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkFirstBytes() const
+	{
+		Botan::AutoSeeded_RNG rng;
+		std::unique_ptr<Botan::Private_Key> key = MakeKey("ECDSA", rng);
+		const Botan::X509_Certificate cert = Botan::X509::create_self_signed_cert(
+			Botan::X509_Cert_Options("draupnir"), *key, "SHA-256", rng);
+
+		MemoryCredentials serverCreds(cert, *key);
+		Botan::Credentials_Manager clientCreds;
+		const TLSPolicy policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange(), "ECDSA");
+		Botan::TLS::Session_Manager_Noop sessions;
+
+		// The same client hello is replayed to every new server endpoint
+		std::vector<uint8_t> clientHello;
+		{
+			MemoryEndpoint client;
+			Botan::TLS::Client clientTLS(client, sessions, clientCreds, policy, rng,
+				Botan::TLS::Server_Information("draupnir"));
+			clientHello.swap(client.output);
+		}
+
+		// Measure the time from the accepted connection to the first flight of
+		// the server, with the generator of every session seeded on its own and
+		// with the generator of the thread
+		for (const bool shared : { false, true })
+		{
+			unsigned long sessionsCreated = 0;
+			const auto start = Clock::now();
+			const auto deadline = start + Duration;
+			while (Clock::now() < deadline)
+			{
+				MemoryEndpoint server;
+				std::unique_ptr<Botan::AutoSeeded_RNG> sessionRng(shared ? nullptr : new Botan::AutoSeeded_RNG);
+				Botan::RandomNumberGenerator& serverRng = shared
+					? static_cast<Botan::RandomNumberGenerator&>(ThreadRNG::GetInstance())
+					: *sessionRng;
+
+				Botan::TLS::Server serverTLS(server, sessions, serverCreds, policy, serverRng);
+				serverTLS.received_data(clientHello);
+				if (server.output.empty())
+					throw std::runtime_error("server sent nothing in response to the client hello");
+				++sessionsCreated;
+			}
+
+			const double elapsed = ToSeconds(Clock::now() - start);
+			std::cout << std::fixed << std::setprecision(1)
+				<< "session/" << std::left << std::setw(15) << (shared ? "thread-rng" : "session-rng") << std::right
+				<< sessionsCreated << " sessions in " << elapsed << " s: "
+				<< elapsed * 1000000 / sessionsCreated << " us from accept to the first byte"
+				<< std::endl;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkCompression() const
+	{
+		// Directory listing alike output of a shell and the data of no use to compress
+		std::ostringstream listing;
+		for (unsigned line = 0; line < 4096; ++line)
+		{
+			listing << "-rw-r--r-- 1 draupnir draupnir " << std::setw(8) << line * 7919 % 100000
+				<< " Oct " << std::setw(2) << line % 28 + 1 << " 12:" << std::setw(2) << std::setfill('0')
+				<< line % 60 << std::setfill(' ') << " file" << line << ".txt\n";
+		}
+		const std::string text = listing.str();
+		Botan::AutoSeeded_RNG rng;
+		const Botan::secure_vector<uint8_t> random = rng.random_vec(text.size());
+
+		BenchmarkCompressedStream("text", reinterpret_cast<const uint8_t*>(text.data()), text.size());
+		BenchmarkCompressedStream("random", random.data(), random.size());
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkCompressedStream(const std::string& name, const uint8_t* data, size_t size) const
+	{
+		// Output of the shell comes in pieces of the pseudo terminal reads
+		const size_t ChunkSize = 4096;
+
+		CompressedStream sender;
+		CompressedStream receiver;
+		std::vector<uint8_t> frames;
+		std::vector<uint8_t> restored;
+		Clock::duration decodeTime = Clock::duration::zero();
+		uint64_t framed = 0;
+
+		const auto start = Clock::now();
+		const auto deadline = start + Duration;
+		while (Clock::now() < deadline)
+		{
+			for (size_t pos = 0; pos < size; pos += ChunkSize)
+			{
+				frames.clear();
+				sender.Encode(data + pos, std::min(ChunkSize, size - pos), frames);
+				framed += frames.size();
+
+				const auto decodeStart = Clock::now();
+				restored.clear();
+				receiver.Decode(frames.data(), frames.size(), restored);
+				decodeTime += Clock::now() - decodeStart;
+			}
+		}
+
+		const double elapsed = ToSeconds(Clock::now() - start);
+		const auto& stats = sender.GetStats();
+		std::cout << std::fixed << std::setprecision(1)
+			<< "compression/" << std::left << std::setw(7) << name << std::right
+			<< stats.inputBytes / elapsed / (1024 * 1024) << " MB/s through both ends, "
+			<< stats.inputBytes / ToSeconds(decodeTime) / (1024 * 1024) << " MB/s to decode, "
+			<< std::setprecision(3) << static_cast<double>(framed) / stats.inputBytes << " framed to input, "
+			<< stats.disabled << " pauses"
+			<< std::endl;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkTransfer() const
+	{
+		const size_t ChunkSize = 1024 * 1024;
+		const uint64_t FileSize = 1024ull * ChunkSize;
+
+		// Incompressible file, hot in the page cache like a just written one
+		TemporaryFile source;
+		TemporaryFile destination;
+		{
+			Botan::AutoSeeded_RNG rng;
+			const Botan::secure_vector<uint8_t> chunk = rng.random_vec(ChunkSize);
+			SocketHandle file(open(source.GetPath().c_str(), O_WRONLY | O_CLOEXEC));
+			if (!file)
+				throw std::runtime_error("failed to open " + source.GetPath() + ": " + strerror(errno));
+			for (uint64_t position = 0; position < FileSize; position += ChunkSize)
+			{
+				if (static_cast<ssize_t>(ChunkSize) != pwrite(file.get(), chunk.data(), ChunkSize, static_cast<off_t>(position)))
+					throw std::runtime_error("failed to write " + source.GetPath());
+			}
+		}
+
+		Botan::AutoSeeded_RNG rng;
+		std::unique_ptr<Botan::Private_Key> key = MakeKey("ECDSA", rng);
+		const Botan::X509_Certificate cert = Botan::X509::create_self_signed_cert(
+			Botan::X509_Cert_Options("draupnir"), *key, "SHA-256", rng);
+		MemoryCredentials serverCreds(cert, *key);
+		Botan::Credentials_Manager clientCreds;
+		const TLSPolicy policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange(), "ECDSA");
+		Botan::TLS::Session_Manager_Noop sessions;
+
+		// Both ends are connected over the loopback interface
+		SocketHandle listener(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+		if (!listener)
+			throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
+		struct sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addressSize = sizeof(address);
+		POSIX_CHECK(bind(listener.get(), reinterpret_cast<struct sockaddr*>(&address), addressSize));
+		POSIX_CHECK(listen(listener.get(), 1));
+		POSIX_CHECK(getsockname(listener.get(), reinterpret_cast<struct sockaddr*>(&address), &addressSize));
+		SocketHandle clientSocket(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+		if (!clientSocket)
+			throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
+		POSIX_CHECK(connect(clientSocket.get(), reinterpret_cast<struct sockaddr*>(&address), addressSize));
+		SocketHandle serverSocket(accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC));
+		if (!serverSocket)
+			throw std::runtime_error("failed to accept connection: " + std::string(strerror(errno)));
+
+		// The receiving end runs on its own thread as the target would, writing
+		// the file and returning the window the way the sessions do
+		std::exception_ptr receiverError;
+		std::thread receiverThread([&]()
+		{
+			try
+			{
+				FileReceiver receiver(destination.GetPath());
+				ChannelStream stream;
+				std::vector<uint8_t> messages;
+				uint32_t credit = 0;
+				bool isOver = false;
+				std::unique_ptr<Botan::TLS::Server> tls;
+				SocketEndpoint endpoint(serverSocket.get(), [&](const uint8_t* data, size_t size)
+				{
+					stream.Read(data, size, [&](ChannelStream::MessageType type, uint16_t id,
+						const uint8_t* payload, size_t length)
+					{
+						if (ChannelStream::Size == type)
+						{
+							receiver.SetSize(ChannelStream::ReadOffset(payload, length));
+						}
+						else if (ChannelStream::Data == type)
+						{
+							receiver.Write(payload, length);
+							while (receiver.IsHashingDue())
+							{
+								receiver.StartHashing()();
+								receiver.OnHashed();
+							}
+							credit += static_cast<uint32_t>(length);
+							if (credit >= ChannelStream::TransferCreditThreshold)
+							{
+								ChannelStream::AppendValue(messages, ChannelStream::Window, id, credit);
+								credit = 0;
+							}
+						}
+						else if (ChannelStream::Digest == type)
+						{
+							receiver.SetDigest(payload, length);
+							while (receiver.IsHashingDue())
+							{
+								receiver.StartHashing()();
+								receiver.OnHashed();
+							}
+							const bool isValid = receiver.Finish();
+							ChannelStream::AppendValue(messages, ChannelStream::Exit, id, isValid ? 0 : 1);
+							isOver = true;
+						}
+					});
+					if (!messages.empty())
+					{
+						tls->send(messages.data(), messages.size());
+						messages.clear();
+					}
+				});
+				tls.reset(new Botan::TLS::Server(endpoint, sessions, serverCreds, policy, rng));
+				while (!isOver)
+					endpoint.Receive(*tls);
+			}
+			catch (...)
+			{
+				receiverError = std::current_exception();
+				shutdown(serverSocket.get(), SHUT_RDWR);
+			}
+		});
+
+		// The sending end runs here
+		Botan::AutoSeeded_RNG clientRng;
+		FileSender sender(source.GetPath());
+		ChannelStream stream;
+		std::vector<uint8_t> messages;
+		uint64_t window = ChannelStream::TransferWindow;
+		int status = -1;
+		SocketEndpoint endpoint(clientSocket.get(), [&](const uint8_t* data, size_t size)
+		{
+			stream.Read(data, size, [&](ChannelStream::MessageType type, uint16_t id __attribute__((unused)),
+				const uint8_t* payload, size_t length)
+			{
+				if (ChannelStream::Window == type)
+					window += ChannelStream::ReadValue(payload, length);
+				else if (ChannelStream::Exit == type)
+					status = static_cast<int>(ChannelStream::ReadValue(payload, length));
+			});
+		});
+
+		Clock::duration sendTime = Clock::duration::zero();
+		Clock::time_point start;
+		try
+		{
+			Botan::TLS::Client tls(endpoint, sessions, clientCreds, policy, clientRng,
+				Botan::TLS::Server_Information("draupnir"));
+			while (!endpoint.activated)
+				endpoint.Receive(tls);
+
+			start = Clock::now();
+			sender.Start(0);
+			ChannelStream::AppendOffset(messages, ChannelStream::Size, 0, sender.GetSize());
+			while (status < 0)
+			{
+				if (!sender.IsOver())
+				{
+					const auto appendStart = Clock::now();
+					window -= sender.Append(messages, 0, window);
+					// The file is hashed once its data is out, the digest follows
+					if (sender.GetPosition() == sender.GetSize())
+					{
+						while (sender.IsHashingDue())
+						{
+							sender.StartHashing()();
+							sender.OnHashed();
+						}
+						sender.Append(messages, 0, window);
+					}
+					sendTime += Clock::now() - appendStart;
+				}
+				if (!messages.empty())
+				{
+					tls.send(messages.data(), messages.size());
+					messages.clear();
+				}
+				// Wait for the window or the verdict
+				if (0 == window || sender.IsOver())
+					endpoint.Receive(tls);
+			}
+		}
+		catch (...)
+		{
+			shutdown(clientSocket.get(), SHUT_RDWR);
+			receiverThread.join();
+			if (receiverError)
+				std::rethrow_exception(receiverError);
+			throw;
+		}
+		const double elapsed = ToSeconds(Clock::now() - start);
+		receiverThread.join();
+		if (receiverError)
+			std::rethrow_exception(receiverError);
+		if (0 != status)
+			throw std::runtime_error("transferred file doesn't match the source");
+
+		const double megabytes = static_cast<double>(FileSize) / (1024 * 1024);
+		std::cout << std::fixed << std::setprecision(1)
+			<< "transfer/loopback " << megabytes << " MB in " << elapsed << " s: "
+			<< megabytes / elapsed << " MB/s, "
+			<< megabytes / ToSeconds(sendTime) << " MB/s to read, hash and frame"
+			<< std::endl;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkLogging() const
+	{
+		if (Logger::IsEnabled(LOG_DEBUG))
+		{
+			std::cout << "logging/disabled skipped: debug logging is enabled" << std::endl;
+			return;
+		}
+
+		// The statement filtered at the call site against the printer built
+		// and dropped by the logger, as every statement was before
+		const struct
+		{
+			const char* name;
+			bool isFiltered;
+		}
+		variants[] = { { "disabled", true }, { "unfiltered", false } };
+
+		for (const auto& variant : variants)
+		{
+			unsigned long statements = 0;
+			unsigned long calls = 0;
+			const auto start = Clock::now();
+			const auto deadline = start + Duration;
+			while (Clock::now() < deadline)
+			{
+				// Check the clock once per batch to keep it out of the measurement
+				for (unsigned batch = 0; batch < 1024; ++batch, ++statements)
+				{
+					if (variant.isFiltered)
+						DEBUG_LOG << "statement " << statements << ": " << Describe(calls);
+					else
+						Logger::GetInstance().Debug() << "statement " << statements << ": " << Describe(calls);
+				}
+			}
+
+			const double elapsed = ToSeconds(Clock::now() - start);
+			std::cout << std::fixed << std::setprecision(2)
+				<< "logging/" << std::left << std::setw(11) << variant.name << std::right
+				<< statements << " statements in " << std::setprecision(1) << elapsed << " s: "
+				<< std::setprecision(2) << elapsed * 1e9 / statements << " ns per statement, "
+				<< calls << " operand(s) evaluated"
+				<< std::endl;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkPollers() const
+	{
+		// A single busy session, then many of them as under heavy output of
+		// the shells
+		for (const size_t sessions : { 1, 256 })
+		{
+			for (const Poller::Backend backend : { Poller::Epoll, Poller::Uring })
+				BenchmarkPoller(backend, sessions);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BenchmarkConductor::BenchmarkPoller(Poller::Backend backend, size_t sessions) const
+	{
+		const std::unique_ptr<Poller> poller = Poller::Create(backend);
+		CompletionIo* const io = poller->GetCompletionIo();
+		if (Poller::Uring == backend && !io)
+		{
+			std::cout << "poller/io_uring skipped: io_uring is not available" << std::endl;
+			return;
+		}
+
+		// Every round fills the sources of all the sessions, as the shells fill
+		// their PTYs, and the backend relays the data to the sinks, as the
+		// reactors send it to the peers. Only the system calls of the relay
+		// are counted, the sources are filled and the sinks drained aside
+		const size_t chunkSize = 16 * 1024;
+		const size_t roundSize = 64 * 1024;
+		std::vector<SocketHandle> feeders(sessions);
+		std::vector<SocketHandle> sources(sessions);
+		std::vector<SocketHandle> sinks(sessions);
+		std::vector<SocketHandle> drains(sessions);
+		for (size_t idx = 0; idx < sessions; ++idx)
+		{
+			int pair[2];
+			POSIX_CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair));
+			sources[idx].reset(pair[0]);
+			feeders[idx].reset(pair[1]);
+			POSIX_CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair));
+			sinks[idx].reset(pair[0]);
+			drains[idx].reset(pair[1]);
+		}
+
+		// The reads of io_uring land in the provided buffers, which are written
+		// to the sinks as they are and provided again once written
+		BufferPool buffers;
+		std::vector<BufferPool::Buffer> provided;
+		for (size_t idx = 0; io && idx < 2 * sessions; ++idx)
+		{
+			provided.push_back(buffers.Acquire(chunkSize));
+			io->ProvideBuffer(provided.back().Data(), provided.back().Size());
+		}
+		for (size_t idx = 0; idx < sessions; ++idx)
+		{
+			if (io)
+				io->QueueRead(sources[idx].get(), idx);
+			else
+				poller->Add(sources[idx].get(), EPOLLIN | EPOLLET, idx);
+		}
+
+		std::vector<uint8_t> payload(roundSize, 'x');
+		BufferPool::Buffer buffer = buffers.Acquire(chunkSize);
+		std::vector<struct epoll_event> events(sessions);
+		std::vector<CompletionIo::Completion> completions;
+		unsigned long rounds = 0;
+		uint64_t systemCalls = 0;
+		const uint64_t initialCalls = io ? io->GetSystemCalls() : 0;
+		const auto start = Clock::now();
+		const auto deadline = start + Duration;
+		while (Clock::now() < deadline)
+		{
+			for (const SocketHandle& feeder : feeders)
+			{
+				if (static_cast<ssize_t>(roundSize) != write(feeder.get(), payload.data(), roundSize))
+					throw std::runtime_error("failed to fill the source: " + std::string(strerror(errno)));
+			}
+
+			for (size_t pending = sessions * roundSize; pending;)
+			{
+				const int count = poller->Wait(events.data(), static_cast<int>(events.size()), 1000);
+				POSIX_CHECK(count);
+				if (io)
+					io->TakeCompletions(completions);
+				if (0 == count && completions.empty())
+					throw std::runtime_error(std::string(poller->GetName()) + " missed the data of the sources");
+
+				// Readiness: the wait, then every reported source is read until
+				// EAGAIN and each chunk is written with a system call of its own
+				if (!io)
+					++systemCalls;
+				for (int idx = 0; idx < count; ++idx)
+				{
+					const size_t session = events[idx].data.u64;
+					while (true)
+					{
+						const ssize_t received = read(sources[session].get(), buffer.Data(), buffer.Size());
+						++systemCalls;
+						if (received <= 0)
+							break;
+
+						++systemCalls;
+						if (received != write(sinks[session].get(), buffer.Data(), static_cast<size_t>(received)))
+							throw std::runtime_error("failed to relay the data: " + std::string(strerror(errno)));
+						pending -= static_cast<size_t>(received);
+					}
+				}
+
+				// Completions: the data read is queued to the sink right away,
+				// together with the next read of the source. The data is all the
+				// same, so the order of the writes to a sink doesn't matter here
+				for (const auto& completion : completions)
+				{
+					const size_t session = completion.data & 0xFFFFFFFF;
+					if (CompletionIo::Write == completion.operation)
+					{
+						if (completion.result <= 0)
+							throw std::runtime_error("failed to relay the data: " + std::string(strerror(-completion.result)));
+						pending -= static_cast<size_t>(completion.result);
+						io->ReturnBuffer(static_cast<int>(completion.data >> 32));
+						continue;
+					}
+
+					if (completion.result > 0)
+					{
+						const struct iovec iov = { completion.buffer, static_cast<size_t>(completion.result) };
+						io->QueueWrite(sinks[session].get(), &iov, 1,
+							(static_cast<uint64_t>(completion.bufferId) << 32) | session);
+					}
+					else if (-ENOBUFS != completion.result)
+					{
+						throw std::runtime_error("failed to read the source: " + std::string(strerror(-completion.result)));
+					}
+					io->QueueRead(sources[session].get(), session);
+				}
+			}
+
+			uint8_t drained[chunkSize];
+			for (const SocketHandle& drain : drains)
+			{
+				while (read(drain.get(), drained, sizeof(drained)) > 0)
+				{
+				}
+			}
+			++rounds;
+		}
+
+		const double elapsed = ToSeconds(Clock::now() - start);
+		if (io)
+			systemCalls = io->GetSystemCalls() - initialCalls;
+		const double megabytes = static_cast<double>(rounds) * sessions * roundSize / (1024 * 1024);
+		std::cout << std::fixed << std::setprecision(2)
+			<< "poller/" << std::left << std::setw(9) << poller->GetName() << std::right
+			<< std::setw(3) << sessions << " session(s): " << std::setprecision(0)
+			<< megabytes / elapsed << " MB/s, " << std::setprecision(2)
+			<< static_cast<double>(systemCalls) / megabytes << " system calls per MB"
+			<< std::endl;
+	}
+} // namespace Draupnir
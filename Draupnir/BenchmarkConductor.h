@@ -0,0 +1,49 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/BenchmarkConductor.h
+//
+// summary:	Declares the benchmark conductor class
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conductor.h"
+#include "Poller.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Runs the built-in micro benchmarks of the hot paths on the
+	/// 			current thread, so the results are per core. Every case
+	/// 			runs for a fixed time and prints its own rates.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class BenchmarkConductor final : public Conductor
+	{
+		// Time every measurement runs for
+		static const std::chrono::seconds Duration;
+
+		void BenchmarkHandshakes() const;
+		void BenchmarkHandshake(const std::string& algorithm) const;
+		void BenchmarkCiphers() const;
+		void BenchmarkCipher(const std::string& cipher) const;
+		void BenchmarkFirstBytes() const;
+		void BenchmarkCompression() const;
+		void BenchmarkCompressedStream(const std::string& name, const uint8_t* data, size_t size) const;
+		void BenchmarkTransfer() const;
+		void BenchmarkLogging() const;
+		void BenchmarkPollers() const;
+		void BenchmarkPoller(Poller::Backend backend, size_t sessions) const;
+
+	public:
+		virtual ~BenchmarkConductor() = default;
+		int Run() override;
+
+	protected:
+		friend class Conductor;
+		BenchmarkConductor(std::shared_ptr<Config> config);
+	};
+} // namespace Draupnir
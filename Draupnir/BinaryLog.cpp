@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/BinaryLog.cpp
+//
+// summary:	Implements the binary form of the log shared by the logger and the decoder
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "BinaryLog.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace Draupnir
+{
+	const char BinaryLog::Magic[8] = { 'D', 'R', 'A', 'U', 'P', 'L', 'O', 'G' };
+	const uint32_t BinaryLog::Version;
+	const uint32_t BinaryLog::ByteOrder;
+	const size_t BinaryLog::MaxEvent;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BinaryLog::Encoder::PutRaw(ArgumentType type, const void* value, size_t size)
+	{
+		if (m_capacity - m_size < 1 + size)
+		{
+			// The arguments after the dropped one would take its place
+			m_size = m_capacity;
+			return;
+		}
+		m_buffer[m_size++] = type;
+		memcpy(m_buffer + m_size, value, size);
+		m_size += size;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BinaryLog::Encoder::Put(const char* text, size_t size)
+	{
+		const uint16_t length = static_cast<uint16_t>(std::min<size_t>(size,
+			m_capacity - m_size < 1 + sizeof(length) ? 0 : m_capacity - m_size - 1 - sizeof(length)));
+		PutRaw(String, &length, sizeof(length));
+		if (m_size == m_capacity)
+			return;
+		memcpy(m_buffer + m_size, text, length);
+		m_size += length;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool BinaryLog::ReadArgument(const uint8_t*& data, const uint8_t* end, Argument& argument)
+	{
+		if (data == end)
+			return false;
+
+		argument.type = static_cast<ArgumentType>(*data);
+		argument.text = nullptr;
+		argument.size = 0;
+		size_t size = 0;
+		void* value = nullptr;
+		switch (argument.type)
+		{
+		case Signed:
+			size = sizeof(argument.integer);
+			value = &argument.integer;
+			break;
+		case Unsigned:
+			size = sizeof(argument.unsignedInteger);
+			value = &argument.unsignedInteger;
+			break;
+		case Double:
+			size = sizeof(argument.real);
+			value = &argument.real;
+			break;
+		case Boolean:
+			size = sizeof(argument.boolean);
+			value = &argument.boolean;
+			break;
+		case Character:
+			size = sizeof(argument.character);
+			value = &argument.character;
+			break;
+		case String:
+		{
+			uint16_t length = 0;
+			if (static_cast<size_t>(end - data) < 1 + sizeof(length))
+				return false;
+			memcpy(&length, data + 1, sizeof(length));
+			if (static_cast<size_t>(end - data) < 1 + sizeof(length) + length)
+				return false;
+			argument.text = reinterpret_cast<const char*>(data + 1 + sizeof(length));
+			argument.size = length;
+			data += 1 + sizeof(length) + length;
+			return true;
+		}
+		default:
+			return false;
+		}
+
+		if (static_cast<size_t>(end - data) < 1 + size)
+			return false;
+		memcpy(value, data + 1, size);
+		data += 1 + size;
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BinaryLog::AppendArgument(std::string& output, const Argument& argument)
+	{
+		char text[32];
+		int size = 0;
+		switch (argument.type)
+		{
+		case Signed:
+			size = snprintf(text, sizeof(text), "%lld", static_cast<long long>(argument.integer));
+			break;
+		case Unsigned:
+			size = snprintf(text, sizeof(text), "%llu", static_cast<unsigned long long>(argument.unsignedInteger));
+			break;
+		case Double:
+			// The same as the default precision of the streams
+			size = snprintf(text, sizeof(text), "%g", argument.real);
+			break;
+		case Boolean:
+			output += argument.boolean ? '1' : '0';
+			return;
+		case Character:
+			output += argument.character;
+			return;
+		case String:
+			output.append(argument.text, argument.size);
+			return;
+		}
+		if (size > 0)
+			output.append(text, std::min(static_cast<size_t>(size), sizeof(text) - 1));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BinaryLog::Render(std::string& output, const char* format, const uint8_t* arguments, size_t size)
+	{
+		const uint8_t* const end = arguments + size;
+		Argument argument;
+		for (const char* position = format; *position; )
+		{
+			const char* placeholder = strstr(position, "{}");
+			if (!placeholder)
+			{
+				output += position;
+				break;
+			}
+
+			output.append(position, placeholder);
+			if (ReadArgument(arguments, end, argument))
+				AppendArgument(output, argument);
+			else
+				output += "{}";
+			position = placeholder + 2;
+		}
+	}
+} // namespace Draupnir
@@ -0,0 +1,183 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/BinaryLog.h
+//
+// summary:	Declares the binary form of the log shared by the logger and the decoder
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Binary log: the file header and the records, every one is a
+	/// 			header and a body of its size in the byte order of the host.
+	/// 			The format of an event is written once before its first
+	/// 			event, which keeps only the identifier of the format and
+	/// 			the arguments, each a type byte and the raw value. The time
+	/// 			of the records is taken by the steady clock, the clock
+	/// 			records give its offset to the wall clock.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class BinaryLog
+	{
+	public:
+		enum RecordType : uint8_t
+		{
+			// Offset of the wall clock to the steady one in nanoseconds
+			Clock = 1,
+			// Identifier, line, file and text of the format, both null-terminated
+			Format,
+			// Identifier of the format and the arguments
+			Event,
+			// Text of the message
+			Text
+		};
+
+		enum ArgumentType : uint8_t
+		{
+			Signed = 'i',
+			Unsigned = 'u',
+			Double = 'd',
+			Boolean = 'b',
+			Character = 'c',
+			// 16-bit length and the bytes
+			String = 's'
+		};
+
+		struct FileHeader
+		{
+			char magic[8];
+			uint32_t version;
+			// Reads differently if the byte order isn't the one of the host
+			uint32_t byteOrder;
+		};
+
+		struct RecordHeader
+		{
+			// Steady clock in nanoseconds
+			int64_t time;
+			uint32_t size;
+			uint8_t type;
+			uint8_t level;
+			uint16_t reserved;
+		};
+
+		struct Argument
+		{
+			ArgumentType type;
+			union
+			{
+				int64_t integer;
+				uint64_t unsignedInteger;
+				double real;
+				bool boolean;
+				char character;
+			};
+			const char* text;
+			size_t size;
+		};
+
+		static const char Magic[8];
+		static const uint32_t Version = 1;
+		static const uint32_t ByteOrder = 0x01020304;
+		// Identifier of the format and the arguments, the longer strings are cut
+		static const size_t MaxEvent = 1024;
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Puts the arguments of an event into a fixed buffer. Once
+		/// 			the buffer is full the rest of the arguments are dropped,
+		/// 			the formats print the missing ones as they are.
+		/// </summary>
+		////////////////////////////////////////////////////////////////////////////
+		class Encoder
+		{
+		public:
+			Encoder(uint8_t* buffer, size_t capacity)
+				: m_buffer(buffer)
+				, m_capacity(capacity)
+				, m_size(0)
+			{}
+
+			size_t GetSize() const noexcept
+			{
+				return m_size;
+			}
+
+			void Put(const std::string& value)
+			{
+				Put(value.data(), value.size());
+			}
+
+			void Put(const char* value)
+			{
+				Put(value ? value : "", value ? strlen(value) : 0);
+			}
+
+			void Put(bool value)
+			{
+				PutRaw(Boolean, &value, sizeof(value));
+			}
+
+			void Put(char value)
+			{
+				PutRaw(Character, &value, sizeof(value));
+			}
+
+			void Put(double value)
+			{
+				PutRaw(Double, &value, sizeof(value));
+			}
+
+			// Would be taken for a boolean otherwise
+			void Put(const void* value) = delete;
+
+			// The handles are put as the values they hold
+			template<class T, T TNull>
+			void Put(const UniqueHandle<T, TNull>& value)
+			{
+				Put(static_cast<T>(value));
+			}
+
+			template<class T>
+			typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type Put(T value)
+			{
+				typedef typename std::conditional<std::is_enum<T>::value,
+					std::underlying_type<T>, std::common_type<T>>::type::type Integer;
+				if (std::is_signed<Integer>::value)
+				{
+					const int64_t integer = static_cast<int64_t>(value);
+					PutRaw(Signed, &integer, sizeof(integer));
+				}
+				else
+				{
+					const uint64_t integer = static_cast<uint64_t>(value);
+					PutRaw(Unsigned, &integer, sizeof(integer));
+				}
+			}
+
+			void Put(const char* text, size_t size);
+
+		private:
+			uint8_t* const m_buffer;
+			const size_t m_capacity;
+			size_t m_size;
+
+			void PutRaw(ArgumentType type, const void* value, size_t size);
+		};
+
+		// Take the next argument, false once they are over or broken
+		static bool ReadArgument(const uint8_t*& data, const uint8_t* end, Argument& argument);
+		// Put the value of the argument the way the text log would
+		static void AppendArgument(std::string& output, const Argument& argument);
+		// Substitute the arguments for the {} of the format
+		static void Render(std::string& output, const char* format, const uint8_t* arguments, size_t size);
+	};
+} // namespace Draupnir
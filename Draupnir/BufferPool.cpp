@@ -0,0 +1,124 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/BufferPool.cpp
+//
+// summary:	Implements the pool of I/O buffers shared by the event loops
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "BufferPool.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	// Number of consecutive reads using less than a quarter of the buffer
+	// after which the descriptor gets a smaller buffer
+	const uint8_t ShrinkAfterReads = 8;
+} // namespace
+
+namespace Draupnir
+{
+	const size_t BufferPool::MinBufferSize;
+	const size_t BufferPool::MaxBufferSize;
+	const size_t BufferPool::Alignment;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	BufferPool::BufferPool()
+		: m_stats()
+		, m_overflow(Allocate(OverflowSize))
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	BufferPool::~BufferPool()
+	{
+		for (auto& freeList : m_free)
+		{
+			for (uint8_t* data : freeList)
+				free(data);
+		}
+		free(m_overflow);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint8_t* BufferPool::Allocate(size_t size)
+	{
+		void* data = nullptr;
+		if (0 != posix_memalign(&data, Alignment, size))
+			throw std::bad_alloc();
+		return static_cast<uint8_t*>(data);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	BufferPool::Buffer BufferPool::Acquire(size_t size)
+	{
+		unsigned sizeClass = 0;
+		while (sizeClass + 1 < SizeClasses && (MinBufferSize << sizeClass) < size)
+			++sizeClass;
+
+		++m_stats.acquired;
+		auto& freeList = m_free[sizeClass];
+		if (freeList.empty())
+		{
+			++m_stats.allocated;
+			return Buffer(this, Allocate(MinBufferSize << sizeClass), sizeClass);
+		}
+
+		// Most recently released buffer is the most likely to be in cache
+		uint8_t* data = freeList.back();
+		freeList.pop_back();
+		--m_stats.cached;
+		return Buffer(this, data, sizeClass);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BufferPool::Release(uint8_t* data, unsigned sizeClass)
+	{
+		m_free[sizeClass].push_back(data);
+		++m_stats.cached;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned BufferPool::GetSizeClass(int fd) const
+	{
+		const size_t index = static_cast<size_t>(fd);
+		return index < m_history.size() ? m_history[index].sizeClass : 0;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BufferPool::Account(int fd, size_t received, size_t bufferSize)
+	{
+		const size_t index = static_cast<size_t>(fd);
+		if (index >= m_history.size())
+			m_history.resize(index + 1, FdHistory());
+
+		auto& history = m_history[index];
+		if (received > bufferSize)
+		{
+			// The buffer was too small to take everything in one read
+			if (history.sizeClass + 1u < SizeClasses)
+				++history.sizeClass;
+			history.lowReads = 0;
+		}
+		else if (received < bufferSize / 4)
+		{
+			if (++history.lowReads >= ShrinkAfterReads && history.sizeClass > 0)
+			{
+				--history.sizeClass;
+				history.lowReads = 0;
+			}
+		}
+		else
+		{
+			history.lowReads = 0;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void BufferPool::Forget(int fd)
+	{
+		const size_t index = static_cast<size_t>(fd);
+		if (index < m_history.size())
+			m_history[index] = FdHistory();
+	}
+} // namespace Draupnir
@@ -0,0 +1,185 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/BufferPool.h
+//
+// summary:	Declares the pool of I/O buffers shared by the event loops
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Pool of cache-aligned I/O buffers of power-of-two sizes from
+	/// 			4 KB up to 256 KB. Released buffers are kept in per-size free
+	/// 			lists, so once warmed up the pool never touches the heap.
+	/// 			The pool is not thread-safe: every event loop owns its own.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class BufferPool
+	{
+	public:
+		static const size_t MinBufferSize = 4 * 1024;
+		static const size_t MaxBufferSize = 256 * 1024;
+		static const size_t Alignment = 64;
+
+		struct Stats
+		{
+			// Buffers handed out
+			uint64_t acquired;
+			// Buffers allocated on the heap because the free list was empty
+			uint64_t allocated;
+			// Buffers kept in free lists at the moment
+			uint64_t cached;
+		};
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Move-only handle of the pooled buffer, returns the buffer
+		/// 			to the pool on destruction.
+		/// </summary>
+		////////////////////////////////////////////////////////////////////////////
+		class Buffer
+		{
+			friend class BufferPool;
+			BufferPool* m_pool;
+			uint8_t* m_data;
+			unsigned m_sizeClass;
+
+			Buffer(BufferPool* pool, uint8_t* data, unsigned sizeClass)
+				: m_pool(pool)
+				, m_data(data)
+				, m_sizeClass(sizeClass)
+			{}
+
+		public:
+			Buffer()
+				: m_pool(nullptr)
+				, m_data(nullptr)
+				, m_sizeClass(0)
+			{}
+
+			Buffer(Buffer&& other) noexcept
+				: m_pool(other.m_pool)
+				, m_data(other.m_data)
+				, m_sizeClass(other.m_sizeClass)
+			{
+				other.m_data = nullptr;
+			}
+
+			Buffer& operator =(Buffer&& other) noexcept
+			{
+				if (this != &other)
+				{
+					Reset();
+					m_pool = other.m_pool;
+					m_data = other.m_data;
+					m_sizeClass = other.m_sizeClass;
+					other.m_data = nullptr;
+				}
+				return *this;
+			}
+
+			~Buffer()
+			{
+				Reset();
+			}
+
+			void Reset()
+			{
+				if (m_data)
+					m_pool->Release(m_data, m_sizeClass);
+				m_data = nullptr;
+			}
+
+			uint8_t* Data() const noexcept
+			{
+				return m_data;
+			}
+
+			size_t Size() const noexcept
+			{
+				return MinBufferSize << m_sizeClass;
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return nullptr != m_data;
+			}
+		};
+
+		BufferPool();
+		BufferPool(const BufferPool&) = delete;
+		BufferPool& operator =(const BufferPool&) = delete;
+		~BufferPool();
+
+		// Get the buffer of at least the given size (clamped to the supported range)
+		Buffer Acquire(size_t size);
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Reads from the descriptor with a single readv() into the
+		/// 			pooled buffer sized from the recent throughput of the
+		/// 			descriptor, plus the shared overflow area. Every received
+		/// 			chunk is passed to the consumer.
+		/// </summary>
+		///
+		/// <returns>	The result of readv(). </returns>
+		////////////////////////////////////////////////////////////////////////////
+		template<typename Consumer>
+		ssize_t Read(int fd, Consumer&& consume)
+		{
+			Buffer buf = Acquire(MinBufferSize << GetSizeClass(fd));
+			struct iovec iov[2] =
+			{
+				{ buf.Data(), buf.Size() },
+				{ m_overflow, OverflowSize }
+			};
+
+			const ssize_t count = readv(fd, iov, 2);
+			if (count <= 0)
+				return count;
+
+			const size_t size = static_cast<size_t>(count);
+			consume(buf.Data(), std::min(size, buf.Size()));
+			if (size > buf.Size())
+				consume(m_overflow, size - buf.Size());
+			Account(fd, size, buf.Size());
+			return count;
+		}
+
+		// Forget the throughput history of the closed descriptor
+		void Forget(int fd);
+
+		const Stats& GetStats() const noexcept
+		{
+			return m_stats;
+		}
+
+	private:
+		static const unsigned SizeClasses = 7;
+		static const size_t OverflowSize = 64 * 1024;
+
+		struct FdHistory
+		{
+			uint8_t sizeClass;
+			uint8_t lowReads;
+		};
+
+		std::array<std::vector<uint8_t*>, SizeClasses> m_free;
+		std::vector<FdHistory> m_history;
+		Stats m_stats;
+		uint8_t* m_overflow;
+
+		static uint8_t* Allocate(size_t size);
+		void Release(uint8_t* data, unsigned sizeClass);
+		unsigned GetSizeClass(int fd) const;
+		void Account(int fd, size_t received, size_t bufferSize);
+	};
+} // namespace Draupnir
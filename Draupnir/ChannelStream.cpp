@@ -0,0 +1,130 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/ChannelStream.cpp
+//
+// summary:	Implements the channel protocol multiplexing the session traffic
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "ChannelStream.h"
+
+#include <algorithm>
+
+namespace Draupnir
+{
+	const size_t ChannelStream::HeaderSize;
+	const size_t ChannelStream::MaxPayload;
+	const uint32_t ChannelStream::InitialWindow;
+	const uint32_t ChannelStream::CreditThreshold;
+	const uint32_t ChannelStream::TransferWindow;
+	const uint32_t ChannelStream::TransferCreditThreshold;
+	const char ChannelStream::ShellKind[] = "shell";
+	const char ChannelStream::ExecKind[] = "exec";
+	const char ChannelStream::PushKind[] = "push";
+	const char ChannelStream::PullKind[] = "pull";
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChannelStream::Append(std::vector<uint8_t>& output, MessageType type, uint16_t channel,
+		const uint8_t* payload, size_t size)
+	{
+		uint8_t* const target = AppendHeader(output, type, channel, size);
+		if (size)
+			std::copy(payload, payload + size, target);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint8_t* ChannelStream::AppendHeader(std::vector<uint8_t>& output, MessageType type, uint16_t channel, size_t size)
+	{
+		if (size > MaxPayload)
+			throw std::length_error("channel message of " + std::to_string(size) + " bytes is too long");
+
+		const uint8_t header[HeaderSize] =
+		{
+			type,
+			static_cast<uint8_t>(channel >> 8),
+			static_cast<uint8_t>(channel),
+			static_cast<uint8_t>(size >> 8),
+			static_cast<uint8_t>(size)
+		};
+		output.insert(output.end(), header, header + HeaderSize);
+		output.resize(output.size() + size);
+		return output.data() + output.size() - size;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChannelStream::AppendData(std::vector<uint8_t>& output, uint16_t channel, const uint8_t* data, size_t size,
+		MessageType type)
+	{
+		while (size)
+		{
+			const size_t chunk = std::min(size, MaxPayload);
+			Append(output, type, channel, data, chunk);
+			data += chunk;
+			size -= chunk;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChannelStream::AppendValue(std::vector<uint8_t>& output, MessageType type, uint16_t channel,
+		uint32_t value, const std::string& text)
+	{
+		std::vector<uint8_t> payload =
+		{
+			static_cast<uint8_t>(value >> 24),
+			static_cast<uint8_t>(value >> 16),
+			static_cast<uint8_t>(value >> 8),
+			static_cast<uint8_t>(value)
+		};
+		payload.insert(payload.end(), text.begin(), text.end());
+		Append(output, type, channel, payload.data(), payload.size());
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint32_t ChannelStream::ReadValue(const uint8_t* payload, size_t size)
+	{
+		if (size < sizeof(uint32_t))
+			throw std::runtime_error("channel message carries no value");
+
+		return static_cast<uint32_t>(payload[0]) << 24 | static_cast<uint32_t>(payload[1]) << 16
+			| static_cast<uint32_t>(payload[2]) << 8 | payload[3];
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChannelStream::AppendOffset(std::vector<uint8_t>& output, MessageType type, uint16_t channel, uint64_t offset)
+	{
+		uint8_t payload[sizeof(offset)];
+		for (size_t idx = 0; idx < sizeof(offset); ++idx)
+			payload[idx] = static_cast<uint8_t>(offset >> (8 * (sizeof(offset) - 1 - idx)));
+		Append(output, type, channel, payload, sizeof(payload));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t ChannelStream::ReadOffset(const uint8_t* payload, size_t size)
+	{
+		if (size != sizeof(uint64_t))
+			throw std::runtime_error("channel message carries no offset");
+
+		uint64_t offset = 0;
+		for (size_t idx = 0; idx < sizeof(offset); ++idx)
+			offset = offset << 8 | payload[idx];
+		return offset;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChannelStream::AppendOpen(std::vector<uint8_t>& output, uint16_t channel, uint32_t window,
+		const std::string& kind, const std::string& argument)
+	{
+		// The kind never contains the terminating zero, the argument may
+		AppendValue(output, Open, channel, window, argument.empty() ? kind : kind + '\0' + argument);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChannelStream::ReadOpen(const uint8_t* payload, size_t size, uint32_t& window,
+		std::string& kind, std::string& argument)
+	{
+		window = ReadValue(payload, size);
+		const uint8_t* const begin = payload + sizeof(window);
+		const uint8_t* const end = payload + size;
+		const uint8_t* const separator = std::find(begin, end, '\0');
+		kind.assign(begin, separator);
+		argument.assign(separator == end ? end : separator + 1, end);
+	}
+} // namespace Draupnir
@@ -0,0 +1,153 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/ChannelStream.h
+//
+// summary:	Declares the channel protocol multiplexing the session traffic
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Channels carried by one TLS connection. Every message is a
+	/// 			type byte, a 16-bit channel identifier and a 16-bit length
+	/// 			of the payload. The control opens a channel with the window
+	/// 			it's ready to receive, the target confirms it with its own
+	/// 			window or closes it with the reason. The data is sent only
+	/// 			within the window of the receiver, which grants more by the
+	/// 			window messages as it consumes the data. A command reports
+	/// 			its exit status before the close. The receiver of a file
+	/// 			tells the offset to resume from, the sender replies with
+	/// 			the size, the rest of the file and its digest. A channel
+	/// 			is over once either end sends the close message, there's
+	/// 			no reply. The keepalive isn't bound to a channel.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class ChannelStream
+	{
+	public:
+		enum MessageType : uint8_t
+		{
+			// Window and kind of the channel
+			Open = 1,
+			// Window
+			Confirm,
+			// Data
+			Data,
+			// Credit added to the window
+			Window,
+			// Optional reason if the channel failed
+			Close,
+			// Data of the error stream of the command
+			ErrorData,
+			// No more data comes from the sender
+			Eof,
+			// Exit status of the command
+			Exit,
+			// Size of the file the receiver already has
+			Offset,
+			// Size of the whole file sent
+			Size,
+			// Digest of the whole file, follows its data
+			Digest,
+			// Probe of the idle target, the control answers with the same
+			Keepalive
+		};
+
+		static const size_t HeaderSize = 5;
+		// Largest payload, a message fits a TLS record
+		static const size_t MaxPayload = 16 * 1024 - HeaderSize;
+		// Window granted on open, the credit is returned once a quarter of it is consumed
+		static const uint32_t InitialWindow = 256 * 1024;
+		static const uint32_t CreditThreshold = InitialWindow / 4;
+		// Window of the file transfer channels, which should keep a fast link
+		// with a long round trip busy rather than the terminal responsive
+		static const uint32_t TransferWindow = 4 * 1024 * 1024;
+		static const uint32_t TransferCreditThreshold = TransferWindow / 4;
+		// Kind of the channel running the login shell on a PTY
+		static const char ShellKind[];
+		// Kind of the channel running the command given on open over pipes
+		static const char ExecKind[];
+		// Kinds of the channels sending the file given on open to the target and back
+		static const char PushKind[];
+		static const char PullKind[];
+
+		static void Append(std::vector<uint8_t>& output, MessageType type, uint16_t channel,
+			const uint8_t* payload = nullptr, size_t size = 0);
+		// Append the header of the message and room for its payload, which is
+		// returned to be filled in place
+		static uint8_t* AppendHeader(std::vector<uint8_t>& output, MessageType type, uint16_t channel, size_t size);
+		// Split the data into the data or the error data messages
+		static void AppendData(std::vector<uint8_t>& output, uint16_t channel, const uint8_t* data, size_t size,
+			MessageType type = Data);
+		// Append the message carrying the window or the exit status, followed by the text if any
+		static void AppendValue(std::vector<uint8_t>& output, MessageType type, uint16_t channel,
+			uint32_t value, const std::string& text = std::string());
+		// Window or exit status carried by the confirm, window and exit messages
+		static uint32_t ReadValue(const uint8_t* payload, size_t size);
+		// File offset or size carried by the offset and size messages
+		static void AppendOffset(std::vector<uint8_t>& output, MessageType type, uint16_t channel, uint64_t offset);
+		static uint64_t ReadOffset(const uint8_t* payload, size_t size);
+		// Open message carries the window, the kind and the argument of the channel
+		static void AppendOpen(std::vector<uint8_t>& output, uint16_t channel, uint32_t window,
+			const std::string& kind, const std::string& argument = std::string());
+		static void ReadOpen(const uint8_t* payload, size_t size, uint32_t& window,
+			std::string& kind, std::string& argument);
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Passes every complete message of the received data to the
+		/// 			handler, the tail of a split message is kept until the
+		/// 			rest of it comes.
+		/// </summary>
+		///
+		/// <param name="handler">	Called as handler(type, channel, payload, size). </param>
+		////////////////////////////////////////////////////////////////////////////
+		template<typename Handler>
+		void Read(const uint8_t* data, size_t size, Handler&& handler)
+		{
+			// Parse the received data in place unless a message is split between the records
+			if (m_partial.empty())
+			{
+				const size_t consumed = Parse(data, size, handler);
+				m_partial.assign(data + consumed, data + size);
+			}
+			else
+			{
+				m_partial.insert(m_partial.end(), data, data + size);
+				// The handler may send, keep the buffer out of its way
+				std::vector<uint8_t> buffer;
+				buffer.swap(m_partial);
+				const size_t consumed = Parse(buffer.data(), buffer.size(), handler);
+				m_partial.assign(buffer.begin() + consumed, buffer.end());
+			}
+		}
+
+	private:
+		std::vector<uint8_t> m_partial;
+
+		template<typename Handler>
+		static size_t Parse(const uint8_t* data, size_t size, Handler& handler)
+		{
+			size_t pos = 0;
+			while (size - pos >= HeaderSize)
+			{
+				const uint8_t type = data[pos];
+				const uint16_t channel = static_cast<uint16_t>(data[pos + 1] << 8 | data[pos + 2]);
+				const size_t length = static_cast<size_t>(data[pos + 3]) << 8 | data[pos + 4];
+				if (size - pos - HeaderSize < length)
+					break;
+				if (type < Open || type > Keepalive)
+					throw std::runtime_error("invalid channel message type " + std::to_string(type));
+
+				pos += HeaderSize + length;
+				handler(static_cast<MessageType>(type), channel, data + pos - length, length);
+			}
+			return pos;
+		}
+	};
+} // namespace Draupnir
@@ -0,0 +1,132 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/ChildReaper.cpp
+//
+// summary:	Implements the reaper of the shells and commands run by the target sessions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "ChildReaper.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace
+{
+	sigset_t GetChildSignals()
+	{
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGCHLD);
+		return signals;
+	}
+
+	// Block the signal first, so it's never delivered the usual way once
+	// the descriptor is there
+	int CreateSignalHandle()
+	{
+		const sigset_t signals = GetChildSignals();
+		const int error = pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+		if (error)
+			throw std::runtime_error("failed to block SIGCHLD: " + std::string(strerror(error)));
+		return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	}
+} // namespace
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	ChildReaper::ChildReaper()
+		: m_signals(CreateSignalHandle())
+	{
+		if (!m_signals)
+			throw std::runtime_error("failed to create signalfd: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChildReaper::RestoreSignals() noexcept
+	{
+		const sigset_t signals = GetChildSignals();
+		sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChildReaper::Watch(pid_t pid, Handler handler)
+	{
+		int status = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const auto early = m_early.find(pid);
+			if (m_early.end() == early)
+			{
+				m_handlers.emplace(pid, std::move(handler));
+				return;
+			}
+			status = early->second;
+			m_early.erase(early);
+		}
+		handler(status);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChildReaper::HangUp(pid_t pid)
+	{
+		// Reaping takes the same lock, so a child still watched here is not
+		// waited for until the signal is sent
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_handlers.count(pid))
+			kill(-pid, SIGHUP);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ChildReaper::Reap()
+	{
+		// The signals of the children exited meanwhile are merged into one,
+		// so the queue is only drained and the children are waited for by
+		// the status instead
+		struct signalfd_siginfo info[16];
+		while (read(m_signals.get(), info, sizeof(info)) > 0)
+			;
+		if (EAGAIN != errno && EINTR != errno)
+			throw std::runtime_error("failed to read signalfd: " + std::string(strerror(errno)));
+
+		// The handlers are called outside the lock, they may watch more children
+		std::vector<std::pair<Handler, int>> exited;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			while (true)
+			{
+				int status = 0;
+				const pid_t pid = waitpid(-1, &status, WNOHANG);
+				if (0 == pid || (-1 == pid && ECHILD == errno))
+					break;
+				if (-1 == pid && EINTR == errno)
+					continue;
+				if (-1 == pid)
+					throw std::runtime_error("failed to wait for children: " + std::string(strerror(errno)));
+
+				const auto watched = m_handlers.find(pid);
+				if (m_handlers.end() == watched)
+				{
+					m_early.emplace(pid, status);
+					continue;
+				}
+				exited.emplace_back(std::move(watched->second), status);
+				m_handlers.erase(watched);
+			}
+		}
+
+		if (!exited.empty())
+			DEBUG_LOG << exited.size() << " child process(es) reaped";
+		for (auto& child : exited)
+			child.first(child.second);
+	}
+} // namespace Draupnir
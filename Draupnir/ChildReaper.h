@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/ChildReaper.h
+//
+// summary:	Declares the reaper of the shells and commands run by the target sessions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/types.h>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Reaps the child processes of the whole target. SIGCHLD is
+	/// 			blocked and received through a signalfd polled by the
+	/// 			conductor's loop, which waits for all the exited children
+	/// 			at once and passes their statuses to the handlers watching
+	/// 			them. The handlers run on the conductor's thread and post
+	/// 			the status to the reactor of the session.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class ChildReaper
+	{
+	public:
+		// Called with the status reported by waitpid()
+		typedef std::function<void(int status)> Handler;
+
+		// Must be created before the threads of the target are started: SIGCHLD
+		// is blocked in the calling thread and those threads inherit the mask.
+		// The writer of the logger, which may be started earlier, blocks all
+		// the signals itself
+		ChildReaper();
+		ChildReaper(const ChildReaper&) = delete;
+		ChildReaper& operator =(const ChildReaper&) = delete;
+
+		// Called in the forked child before exec: the programs expect SIGCHLD
+		// to be delivered as usual
+		static void RestoreSignals() noexcept;
+
+		// Pass the exit status of the child to the handler, may be called from any thread
+		void Watch(pid_t pid, Handler handler);
+		// Hang up the process group of the watched child unless it's reaped
+		// already, its identifier could belong to another process by then.
+		// May be called from any thread
+		void HangUp(pid_t pid);
+		// Wait for the exited children, called once the handle is readable
+		void Reap();
+
+		int GetHandle() const noexcept
+		{
+			return m_signals.get();
+		}
+
+	private:
+		SocketHandle m_signals;
+		std::mutex m_mutex;
+		std::unordered_map<pid_t, Handler> m_handlers;
+		// Children reaped before they are watched: the child may exit right
+		// after fork(), before its parent gets to Watch()
+		std::unordered_map<pid_t, int> m_early;
+	};
+} // namespace Draupnir
@@ -0,0 +1,86 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/CompletionIo.h
+//
+// summary:	Declares the interface of the completion-based I/O of the event loops
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Accept, read and write requests queued by the event loop and
+	/// 			completed by the kernel. The requests are only queued by the
+	/// 			calls below, the whole batch goes to the kernel on Submit()
+	/// 			or together with the next Poller::Wait(), which also returns
+	/// 			once any request is complete. Every request is completed
+	/// 			exactly once, cancelled ones with ECANCELED.
+	///
+	/// 			Reads don't name a buffer: the kernel picks one of the
+	/// 			buffers provided with ProvideBuffer() when the data arrives,
+	/// 			so idle descriptors hold no memory. The buffer belongs to
+	/// 			the caller until it's returned with ReturnBuffer().
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class CompletionIo
+	{
+	public:
+		enum Operation
+		{
+			Accept,
+			Read,
+			Write
+		};
+
+		struct Completion
+		{
+			// Identifier returned when the request was queued
+			uint64_t id;
+			// Data passed when the request was queued
+			uint64_t data;
+			Operation operation;
+			// Accepted descriptor or number of bytes transferred, -errno on failure
+			int32_t result;
+			// Provided buffer holding the data read, -1 if none
+			int bufferId;
+			uint8_t* buffer;
+		};
+
+		CompletionIo() = default;
+		CompletionIo(const CompletionIo&) = delete;
+		CompletionIo& operator =(const CompletionIo&) = delete;
+
+		// Accept the connection into the non-blocking descriptor, the address
+		// and its length must stay valid until completion
+		virtual uint64_t QueueAccept(int fd, struct sockaddr_storage* addr, socklen_t* addrLen, uint64_t data) = 0;
+		// Read into one of the provided buffers
+		virtual uint64_t QueueRead(int fd, uint64_t data) = 0;
+		// Write the data, only the data itself must stay valid until completion
+		virtual uint64_t QueueWrite(int fd, const struct iovec* iov, size_t count, uint64_t data) = 0;
+		// Cancel the request which completion is still pending
+		virtual void Cancel(uint64_t id) = 0;
+		// Pass the queued requests to the kernel without waiting
+		virtual void Submit() = 0;
+
+		// Hand the buffer over to the kernel for reads, returns its identifier
+		virtual int ProvideBuffer(uint8_t* data, size_t size) = 0;
+		// Give back the buffer reported with the completion of a read
+		virtual void ReturnBuffer(int bufferId) = 0;
+
+		// Move the completions collected by Poller::Wait() to the vector
+		virtual void TakeCompletions(std::vector<Completion>& completions) = 0;
+
+		// System calls made to submit the requests and wait for them
+		virtual uint64_t GetSystemCalls() const noexcept = 0;
+
+	protected:
+		~CompletionIo() = default;
+	};
+} // namespace Draupnir
@@ -0,0 +1,216 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/CompressedStream.cpp
+//
+// summary:	Implements the compression stage of the session traffic
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "CompressedStream.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+
+namespace
+{
+	enum FrameType : uint8_t
+	{
+		RawFrame = 0,
+		CompressedFrame = 1
+	};
+
+	using Draupnir::CompressedStream;
+
+	// Data carried by a frame, so the raw frame fits a TLS record
+	const size_t MaxFrameInput = 16 * 1024 - CompressedStream::HeaderSize;
+	// Smaller data, like the keystrokes and their echo, is never compressed
+	const size_t MinCompressedInput = 64;
+	// Fastest deflate level, the data is usually the terminal output
+	const size_t CompressionLevel = 1;
+
+	// Amount of data the compression is measured on before the decision
+	const uint64_t SampleSize = 256 * 1024;
+	// The compression is a loss if it saves less than this
+	const double MaxRatio = 0.9;
+	// or if the compressor is slower than this, in bytes per second
+	const double MinSpeed = 32.0 * 1024 * 1024;
+	// Data sent raw after a loss before the compression is tried again
+	const uint64_t PauseSize = 16 * 1024 * 1024;
+
+	void AppendFrame(std::vector<uint8_t>& output, FrameType type, const uint8_t* data, size_t size)
+	{
+		output.push_back(type);
+		output.push_back(static_cast<uint8_t>(size >> 8));
+		output.push_back(static_cast<uint8_t>(size));
+		output.insert(output.end(), data, data + size);
+	}
+} // namespace
+
+namespace Draupnir
+{
+	const size_t CompressedStream::HeaderSize;
+	const char CompressedStream::CompressedProtocol[] = "draupnir-deflate";
+	const char CompressedStream::PlainProtocol[] = "draupnir";
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool CompressedStream::IsAvailable()
+	{
+		return Botan::make_compressor("deflate") != nullptr;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::vector<std::string> CompressedStream::GetOfferedProtocols(bool isCompressionEnabled)
+	{
+		if (isCompressionEnabled && IsAvailable())
+			return { CompressedProtocol, PlainProtocol };
+		return { PlainProtocol };
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	CompressedStream::CompressedStream()
+		: m_compressor(Botan::make_compressor("deflate"))
+		, m_decompressor(Botan::make_decompressor("deflate"))
+		, m_sampleInput(0)
+		, m_sampleOutput(0)
+		, m_sampleTime(0)
+		, m_pausedBytes(0)
+		, m_stats()
+	{
+		if (!m_compressor || !m_decompressor)
+			throw std::runtime_error("deflate is not supported by Botan");
+
+		m_compressor->start(CompressionLevel);
+		m_decompressor->start();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void CompressedStream::Encode(const uint8_t* data, size_t size, std::vector<uint8_t>& output)
+	{
+		m_stats.inputBytes += size;
+		while (size)
+		{
+			const size_t chunk = std::min(size, MaxFrameInput);
+			if (ShouldCompress(chunk))
+			{
+				// The flush ends the deflate block at the frame boundary, so the
+				// peer restores all the data at once and the window is kept
+				const auto start = std::chrono::steady_clock::now();
+				m_buffer.assign(data, data + chunk);
+				m_compressor->update(m_buffer, 0, true);
+				const auto elapsed = std::chrono::steady_clock::now() - start;
+
+				AppendFrame(output, CompressedFrame, m_buffer.data(), m_buffer.size());
+				Measure(chunk, m_buffer.size(), elapsed);
+			}
+			else
+			{
+				AppendFrame(output, RawFrame, data, chunk);
+			}
+			data += chunk;
+			size -= chunk;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool CompressedStream::ShouldCompress(size_t size)
+	{
+		if (m_pausedBytes)
+		{
+			m_pausedBytes -= std::min<uint64_t>(m_pausedBytes, size);
+			return false;
+		}
+		return size >= MinCompressedInput;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void CompressedStream::Measure(size_t input, size_t output, std::chrono::nanoseconds time)
+	{
+		m_stats.compressedInput += input;
+		m_stats.compressedOutput += output;
+		m_stats.compressTime += time;
+
+		m_sampleInput += input;
+		m_sampleOutput += output;
+		m_sampleTime += time;
+		if (m_sampleInput < SampleSize)
+			return;
+
+		const double ratio = static_cast<double>(m_sampleOutput) / m_sampleInput;
+		const double speed = m_sampleInput / std::max(std::chrono::duration<double>(m_sampleTime).count(), 1e-9);
+		if (ratio > MaxRatio || speed < MinSpeed)
+		{
+			// The window still holds the old data, the peer's one stays in sync
+			// as it only sees the compressed frames
+			m_pausedBytes = PauseSize;
+			++m_stats.disabled;
+			DEBUG_LOG << "compression is paused, ratio " << ratio
+				<< ", " << speed / (1024 * 1024) << " MB/s";
+		}
+
+		m_sampleInput = 0;
+		m_sampleOutput = 0;
+		m_sampleTime = std::chrono::nanoseconds(0);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void CompressedStream::Decode(const uint8_t* data, size_t size, std::vector<uint8_t>& output)
+	{
+		m_stats.receivedBytes += size;
+		const size_t outputSize = output.size();
+
+		// Parse the received data in place unless a frame is split between the records
+		if (m_partialFrame.empty())
+		{
+			const size_t consumed = DecodeFrames(data, size, output);
+			m_partialFrame.assign(data + consumed, data + size);
+		}
+		else
+		{
+			m_partialFrame.insert(m_partialFrame.end(), data, data + size);
+			const size_t consumed = DecodeFrames(m_partialFrame.data(), m_partialFrame.size(), output);
+			m_partialFrame.erase(m_partialFrame.begin(), m_partialFrame.begin() + consumed);
+		}
+		m_stats.decodedBytes += output.size() - outputSize;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	size_t CompressedStream::DecodeFrames(const uint8_t* data, size_t size, std::vector<uint8_t>& output)
+	{
+		size_t pos = 0;
+		while (size - pos >= HeaderSize)
+		{
+			const uint8_t type = data[pos];
+			const size_t length = static_cast<size_t>(data[pos + 1]) << 8 | data[pos + 2];
+			if (size - pos - HeaderSize < length)
+				break;
+
+			const uint8_t* payload = data + pos + HeaderSize;
+			if (RawFrame == type)
+			{
+				output.insert(output.end(), payload, payload + length);
+			}
+			else if (CompressedFrame == type)
+			{
+				m_buffer.assign(payload, payload + length);
+				m_decompressor->update(m_buffer);
+				output.insert(output.end(), m_buffer.begin(), m_buffer.end());
+			}
+			else
+			{
+				throw std::runtime_error("invalid frame type " + std::to_string(type));
+			}
+			pos += HeaderSize + length;
+		}
+		return pos;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::ostream& operator <<(std::ostream& out, const CompressedStream::Stats& stats)
+	{
+		out << stats.compressedInput << " of " << stats.inputBytes << " bytes sent compressed to "
+			<< stats.compressedOutput << " in " << std::chrono::duration<double, std::milli>(stats.compressTime).count()
+			<< " ms, paused " << stats.disabled << " times; " << stats.receivedBytes << " bytes received, "
+			<< stats.decodedBytes << " restored";
+		return out;
+	}
+} // namespace Draupnir
@@ -0,0 +1,102 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/CompressedStream.h
+//
+// summary:	Declares the compression stage of the session traffic
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <botan/compression.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Compression stage between the console and TLS, used when
+	/// 			both ends agreed on it by the application protocol of the
+	/// 			handshake. The data is sent as frames of a type byte and a
+	/// 			16-bit length followed by either the raw data or the output
+	/// 			of a deflate stream flushed at the frame end, so the window
+	/// 			is kept across the frames. The frames are compressed until
+	/// 			the measured ratio or speed shows it's a loss, then sent raw
+	/// 			for a while before the compression is tried again.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class CompressedStream
+	{
+	public:
+		struct Stats
+		{
+			// Data passed to Encode() and the part of it that went compressed
+			uint64_t inputBytes;
+			uint64_t compressedInput;
+			// Output of the compressor and the time it took
+			uint64_t compressedOutput;
+			std::chrono::nanoseconds compressTime;
+			// Number of times the compression was found to be a loss
+			unsigned disabled;
+			// Frames passed to Decode() and the data restored from them
+			uint64_t receivedBytes;
+			uint64_t decodedBytes;
+		};
+
+		// Application protocols offered in the handshake, the compressed one first
+		static const char CompressedProtocol[];
+		static const char PlainProtocol[];
+		// Type byte and 16-bit big endian length of the payload
+		static const size_t HeaderSize = 3;
+
+		// The compression is built into Botan
+		static bool IsAvailable();
+		// Application protocols the client offers, in the order of preference
+		static std::vector<std::string> GetOfferedProtocols(bool isCompressionEnabled);
+
+		CompressedStream();
+		CompressedStream(const CompressedStream&) = delete;
+		CompressedStream& operator =(const CompressedStream&) = delete;
+
+		// Append the frames carrying the data to the output
+		void Encode(const uint8_t* data, size_t size, std::vector<uint8_t>& output);
+		// Append the data of the complete frames received so far to the output
+		void Decode(const uint8_t* data, size_t size, std::vector<uint8_t>& output);
+
+		const Stats& GetStats() const noexcept
+		{
+			return m_stats;
+		}
+
+		// The compressor is not paused after a loss
+		bool IsCompressing() const noexcept
+		{
+			return 0 == m_pausedBytes;
+		}
+
+	private:
+		std::unique_ptr<Botan::Compression_Algorithm> m_compressor;
+		std::unique_ptr<Botan::Decompression_Algorithm> m_decompressor;
+		Botan::secure_vector<uint8_t> m_buffer;
+		// Tail of an incomplete frame received
+		std::vector<uint8_t> m_partialFrame;
+
+		// Measurement of the compression since the last decision
+		uint64_t m_sampleInput;
+		uint64_t m_sampleOutput;
+		std::chrono::nanoseconds m_sampleTime;
+		// Data to send raw before the compression is tried again
+		uint64_t m_pausedBytes;
+		Stats m_stats;
+
+		bool ShouldCompress(size_t size);
+		void Measure(size_t input, size_t output, std::chrono::nanoseconds time);
+		size_t DecodeFrames(const uint8_t* data, size_t size, std::vector<uint8_t>& output);
+	};
+
+	// Human-readable summary of the statistics for the log
+	std::ostream& operator <<(std::ostream& out, const CompressedStream::Stats& stats);
+} // namespace Draupnir
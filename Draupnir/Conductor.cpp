@@ -5,7 +5,9 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "Conductor.h"
+#include "BenchmarkConductor.h"
 #include "ControlConductor.h"
+#include "FleetConductor.h"
 #include "TargetConductor.h"
 #include "Config.h"
 #include "Logger.h"
@@ -33,6 +35,10 @@ namespace Draupnir
 			return std::shared_ptr<Conductor>(new TargetConductor(config));
 		case Config::Control:
 			return std::shared_ptr<Conductor>(new ControlConductor(config));
+		case Config::Benchmark:
+			return std::shared_ptr<Conductor>(new BenchmarkConductor(config));
+		case Config::Fleet:
+			return std::shared_ptr<Conductor>(new FleetConductor(config));
 		default:
 			throw std::logic_error("invalid mode");
 		}
@@ -36,6 +36,7 @@ namespace Draupnir
 		/// <returns>	A std::shared_ptr&lt;Conductor&gt; </returns>
 		////////////////////////////////////////////////////////////////////////////
 		static std::shared_ptr<Conductor> Create(std::shared_ptr<Config> config);
-		virtual void Run() = 0;
+		// Returns the exit status of the process
+		virtual int Run() = 0;
 	};
 } // namespace Draupnir
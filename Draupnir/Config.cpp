@@ -12,7 +12,12 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
 
 namespace Draupnir
@@ -22,9 +27,31 @@ namespace Draupnir
 		: m_mode(Undefined)
 		, m_peer(nullptr)
 		, m_isVerbose(false)
+		, m_isBinaryLogEnabled(false)
+		, m_workers(0)
+		, m_poller(Poller::Epoll)
+		, m_handshakeThreads(0)
+		, m_isHandshakeThreadsSet(false)
+		, m_maxHandshakes(256)
+		, m_handshakeTimeout(10)
+		, m_idleTimeout(0)
+		, m_keepaliveInterval(30)
+		, m_acceptRate(0)
+		, m_sourceRate(20)
+		, m_coalescingWindow(2)
+		, m_connectTimeout(10000)
+		, m_cipher(TLSPolicy::AutoCipher)
+		, m_keyExchange(TLSPolicy::X25519)
+		, m_isCompressionEnabled(true)
+		, m_shells(1)
+		, m_transfer(NoTransfer)
+		, m_peerPort(0)
+		, m_isSessionCacheSet(false)
+		, m_parallelism(64)
+		, m_hostTimeout(0)
 	{
 		ParseCommandLine(argc, argv);
-		assert(m_peer && "peer's address not specified");
+		assert((Benchmark == m_mode || Fleet == m_mode || m_peer) && "peer's address not specified");
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -36,10 +63,67 @@ namespace Draupnir
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	void Config::ParseCommandLine(int argc, char* const argv[])
 	{
+		// Options without the short form
+		enum
+		{
+			HandshakeThreads = 256,
+			MaxHandshakes,
+			SessionCache,
+			Cipher,
+			KeyExchange,
+			CoalescingWindow,
+			Compression,
+			Shells,
+			PushFile,
+			PullFile,
+			Parallelism,
+			HostTimeout,
+			ConnectTimeout,
+			HandshakeTimeout,
+			IdleTimeout,
+			Keepalive,
+			AcceptRate,
+			SourceRate,
+			BinaryLogFile
+		};
+
+		static const struct option longOptions[] =
+		{
+			{ "control", required_argument, nullptr, 'c' },
+			{ "target", required_argument, nullptr, 't' },
+			{ "workers", required_argument, nullptr, 'w' },
+			{ "poller", required_argument, nullptr, 'p' },
+			{ "benchmark", required_argument, nullptr, 'b' },
+			{ "exec", required_argument, nullptr, 'e' },
+			{ "fleet", required_argument, nullptr, 'f' },
+			{ "handshake-threads", required_argument, nullptr, HandshakeThreads },
+			{ "max-handshakes", required_argument, nullptr, MaxHandshakes },
+			{ "handshake-timeout", required_argument, nullptr, HandshakeTimeout },
+			{ "idle-timeout", required_argument, nullptr, IdleTimeout },
+			{ "keepalive", required_argument, nullptr, Keepalive },
+			{ "accept-rate", required_argument, nullptr, AcceptRate },
+			{ "source-rate", required_argument, nullptr, SourceRate },
+			{ "session-cache", required_argument, nullptr, SessionCache },
+			{ "cipher", required_argument, nullptr, Cipher },
+			{ "kex", required_argument, nullptr, KeyExchange },
+			{ "coalesce-window", required_argument, nullptr, CoalescingWindow },
+			{ "connect-timeout", required_argument, nullptr, ConnectTimeout },
+			{ "compression", required_argument, nullptr, Compression },
+			{ "shells", required_argument, nullptr, Shells },
+			{ "push", required_argument, nullptr, PushFile },
+			{ "pull", required_argument, nullptr, PullFile },
+			{ "parallel", required_argument, nullptr, Parallelism },
+			{ "host-timeout", required_argument, nullptr, HostTimeout },
+			{ "binary-log", no_argument, nullptr, BinaryLogFile },
+			{ "verbose", no_argument, nullptr, 'v' },
+			{ "help", no_argument, nullptr, 'h' },
+			{ nullptr, 0, nullptr, 0 }
+		};
+
 		int opt = 0;
-		while ((opt = getopt(argc, argv, "c:t:vh")) != -1)
+		while ((opt = getopt_long(argc, argv, "c:t:w:p:b:e:f:vh", longOptions, nullptr)) != -1)
 		{
-			switch (static_cast<char>(opt))
+			switch (opt)
 			{
 			case 'c':
 				m_mode = Control;
@@ -49,6 +133,108 @@ namespace Draupnir
 				m_mode = Target;
 				m_peer = StringToAddress(optarg);
 				break;
+			case 'b':
+				m_mode = Benchmark;
+				m_benchmark = optarg;
+				break;
+			case 'f':
+				m_mode = Fleet;
+				ReadFleet(optarg);
+				break;
+			case 'e':
+				m_command = optarg;
+				if (m_command.empty())
+					throw std::invalid_argument("command to run should not be empty");
+				break;
+			case 'w':
+				m_workers = ParseNumber(optarg, "number of workers");
+				break;
+			case 'p':
+				if (0 == strcmp(optarg, "epoll"))
+					m_poller = Poller::Epoll;
+				else if (0 == strcmp(optarg, "uring"))
+					m_poller = Poller::Uring;
+				else
+					throw std::invalid_argument("unknown poller " + std::string(optarg) + ", use epoll or uring");
+				break;
+			case HandshakeThreads:
+				m_handshakeThreads = ParseNumber(optarg, "number of handshake threads", 0);
+				m_isHandshakeThreadsSet = true;
+				break;
+			case MaxHandshakes:
+				m_maxHandshakes = ParseNumber(optarg, "maximum number of handshakes");
+				break;
+			case HandshakeTimeout:
+				m_handshakeTimeout = ParseNumber(optarg, "handshake timeout");
+				break;
+			case IdleTimeout:
+				m_idleTimeout = ParseNumber(optarg, "idle timeout", 0);
+				break;
+			case Keepalive:
+				m_keepaliveInterval = ParseNumber(optarg, "keepalive interval", 0);
+				break;
+			case AcceptRate:
+				m_acceptRate = ParseNumber(optarg, "accept rate", 0);
+				break;
+			case SourceRate:
+				m_sourceRate = ParseNumber(optarg, "source accept rate", 0);
+				break;
+			case Cipher:
+				if (0 == strcmp(optarg, "auto"))
+					m_cipher = TLSPolicy::AutoCipher;
+				else if (0 == strcmp(optarg, "aes"))
+					m_cipher = TLSPolicy::AES;
+				else if (0 == strcmp(optarg, "chacha20"))
+					m_cipher = TLSPolicy::ChaCha20;
+				else
+					throw std::invalid_argument("unknown cipher " + std::string(optarg) + ", use auto, aes or chacha20");
+				break;
+			case KeyExchange:
+				if (0 == strcmp(optarg, "x25519"))
+					m_keyExchange = TLSPolicy::X25519;
+				else if (0 == strcmp(optarg, "cecpq1"))
+					m_keyExchange = TLSPolicy::CECPQ1;
+				else
+					throw std::invalid_argument("unknown key exchange " + std::string(optarg) + ", use x25519 or cecpq1");
+				break;
+			case CoalescingWindow:
+				m_coalescingWindow = ParseNumber(optarg, "coalescing window", 0);
+				break;
+			case ConnectTimeout:
+				m_connectTimeout = ParseNumber(optarg, "connect timeout");
+				break;
+			case Compression:
+				if (0 == strcmp(optarg, "on"))
+					m_isCompressionEnabled = true;
+				else if (0 == strcmp(optarg, "off"))
+					m_isCompressionEnabled = false;
+				else
+					throw std::invalid_argument("invalid compression mode " + std::string(optarg) + ", use on or off");
+				break;
+			case Shells:
+				m_shells = ParseNumber(optarg, "number of shells");
+				if (m_shells > std::numeric_limits<uint16_t>::max())
+					throw std::invalid_argument("too many shells: " + std::string(optarg));
+				break;
+			case PushFile:
+				ParseTransfer(optarg, Push);
+				break;
+			case PullFile:
+				ParseTransfer(optarg, Pull);
+				break;
+			case Parallelism:
+				m_parallelism = ParseNumber(optarg, "number of parallel targets");
+				break;
+			case HostTimeout:
+				m_hostTimeout = ParseNumber(optarg, "target timeout", 0);
+				break;
+			case SessionCache:
+				m_sessionCache = optarg;
+				m_isSessionCacheSet = true;
+				break;
+			case BinaryLogFile:
+				m_isBinaryLogEnabled = true;
+				break;
 			case 'v':
 				m_isVerbose = true;
 				Logger::GetInstance().SetVerboseMode(m_isVerbose);
@@ -60,12 +246,102 @@ namespace Draupnir
 			}
 		}
 
+		// The level is the final one whatever the order of the options
+		if (m_isBinaryLogEnabled)
+			Logger::GetInstance().EnableBinaryChannel(m_isVerbose ? LOG_DEBUG : LOG_INFO);
+
 		if (Undefined == m_mode)
-			throw std::runtime_error("either -c or -t option should be specified, run with -h for reference");
+			throw std::runtime_error("either -c, -t, -f or -b option should be specified, run with -h for reference");
+
+		if (NoTransfer != m_transfer && !m_command.empty())
+			throw std::invalid_argument("file transfer and command can't be combined");
+
+		if (Fleet == m_mode && NoTransfer != m_transfer)
+			throw std::invalid_argument("fleet mode runs a command, file transfer isn't supported");
+
+		if (0 == m_workers)
+		{
+			// By default run one reactor per online CPU
+			const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			m_workers = cpus > 0 ? static_cast<unsigned>(cpus) : 1;
+		}
+
+		if (!m_isHandshakeThreadsSet)
+			m_handshakeThreads = m_workers;
+
+		if (!m_isSessionCacheSet)
+		{
+			// By default keep the TLS sessions in the user's cache directory
+			const char* cacheHome = getenv("XDG_CACHE_HOME");
+			const char* home = getenv("HOME");
+			if (cacheHome && *cacheHome)
+				m_sessionCache = std::string(cacheHome) + "/draupnir";
+			else if (home && *home)
+				m_sessionCache = std::string(home) + "/.cache/draupnir";
+		}
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	Config::EndPoint* Config::StringToAddress(const char* str) const
+	unsigned Config::ParseNumber(const char* str, const char* what, unsigned minimum) const
+	{
+		char* end = nullptr;
+		errno = 0;
+		const unsigned long value = strtoul(str, &end, 10);
+		if (errno || end == str || *end || value < minimum || value > std::numeric_limits<unsigned>::max())
+			throw std::invalid_argument(std::string("invalid ") + what + ": " + str);
+		return static_cast<unsigned>(value);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void Config::ParseTransfer(const char* str, Transfer transfer)
+	{
+		if (NoTransfer != m_transfer)
+			throw std::invalid_argument("only one file can be transferred at once");
+
+		// The source goes first, so it's the local path for the push and the
+		// remote one for the pull
+		const std::string paths(str);
+		const auto separator = paths.find(':');
+		if (std::string::npos == separator || 0 == separator || paths.size() - 1 == separator)
+			throw std::invalid_argument("file transfer should be given as \"source:destination\"");
+
+		m_transfer = transfer;
+		m_localPath = paths.substr(Push == m_transfer ? 0 : separator + 1,
+			Push == m_transfer ? separator : std::string::npos);
+		m_remotePath = paths.substr(Push == m_transfer ? separator + 1 : 0,
+			Push == m_transfer ? std::string::npos : separator);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void Config::ReadFleet(const char* path)
+	{
+		std::ifstream file(path);
+		if (!file)
+			throw std::runtime_error("failed to open fleet list " + std::string(path));
+
+		// A target per line, blank lines and the comments after # are skipped
+		m_fleet.clear();
+		std::string line;
+		while (std::getline(file, line))
+		{
+			line.erase(std::min(line.find('#'), line.size()));
+			const auto begin = line.find_first_not_of(" \t\r");
+			if (std::string::npos == begin)
+				continue;
+			const auto end = line.find_last_not_of(" \t\r");
+			const std::string host = line.substr(begin, end - begin + 1);
+			if (std::string::npos == host.find(':'))
+				throw std::invalid_argument("target " + host + " should be in form \"host:port\"");
+			m_fleet.push_back(host);
+		}
+
+		if (m_fleet.empty())
+			throw std::invalid_argument("fleet list " + std::string(path) + " has no targets");
+		DEBUG_LOG << m_fleet.size() << " targets are read from " << path;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	Config::EndPoint* Config::StringToAddress(const char* str)
 	{
 		const struct addrinfo hints =
 		{
@@ -94,7 +370,7 @@ namespace Draupnir
 		const std::string port = host.substr(portPos + 1);
 		host.resize(portPos);
 
-		Logger::GetInstance().Debug() << "getting information for address to "
+		DEBUG_LOG << "getting information for address to "
 			<< (Target == m_mode ? "listen" : "connect") << " to " << host << ':' << port;
 
 		struct addrinfo* res = nullptr;
@@ -102,6 +378,8 @@ namespace Draupnir
 		if (0 != (err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)))
 			throw std::runtime_error("failed to get address of " + std::string(str) + " " + gai_strerror(err));
 
+		m_peerHost = host;
+		m_peerPort = static_cast<uint16_t>(ParseNumber(port.c_str(), "port", 0));
 		return res;
 	}
 
@@ -112,6 +390,51 @@ namespace Draupnir
 			<< "Available options are:\n"
 			<< "\t-c host:port\tstart in control mode, where host:port is the address of target\n"
 			<< "\t-t [host:port]\tstart in target mode, host:port is the address to listen (default is 0.0.0.0:19680)\n"
+			<< "\t-b name\t\trun the benchmark: handshake, cipher, session, compression, transfer, logging,\n"
+			<< "\t\t\tpoller or all\n"
+			<< "\t-e command\tin control mode, run the command over pipes instead of the shell: the input\n"
+			<< "\t\t\tgoes to its stdin, stdout and stderr are kept apart and its exit status is returned\n"
+			<< "\t-f file\t\tstart in fleet mode: run the command given by -e, or the input as a shell\n"
+			<< "\t\t\tscript, on every target of the file, one host:port per line, and print\n"
+			<< "\t\t\ta JSON line with the output, exit status and timing of each target to\n"
+			<< "\t\t\tstdout, while the log goes to stderr\n"
+			<< "\t-w N\t\tnumber of reactor threads in target mode (default is number of online CPUs)\n"
+			<< "\t-p name\t\tI/O backend: epoll (default) or uring, which submits the accepts, reads\n"
+			<< "\t\t\tand writes of the target in batches and reads into buffers registered\n"
+			<< "\t\t\twith io_uring, falls back to epoll when io_uring is not available\n"
+			<< "\t--handshake-threads N\tnumber of TLS handshake threads in target mode, 0 to handshake\n"
+			<< "\t\t\t\ton the reactors (default is the number of reactors)\n"
+			<< "\t--max-handshakes N\tmaximum number of TLS handshakes in progress, the connections over\n"
+			<< "\t\t\t\tit are closed right away (default is 256)\n"
+			<< "\t--accept-rate N\t\tconnections per second the target accepts, bursts of twice as many\n"
+			<< "\t\t\t\tare let in, 0 for no limit (default)\n"
+			<< "\t--source-rate N\t\tthe same for every source address, IPv6 ones by /64 (default is 20)\n"
+			<< "\t--handshake-timeout S\ttime to complete the TLS handshake in target mode (default is 10)\n"
+			<< "\t--idle-timeout S\ttime to keep the session the peer sends nothing to in target mode,\n"
+			<< "\t\t\t\t0 for no limit (default)\n"
+			<< "\t--keepalive S\t\ttime the session is idle before the target probes the peer, the control\n"
+			<< "\t\t\t\tanswers, 0 to disable (default is 30)\n"
+			<< "\t--coalesce-window MS\ttime to hold the shell output to send it in fewer TLS records,\n"
+			<< "\t\t\t\t0 to send it right away (default is 2)\n"
+			<< "\t--connect-timeout MS\ttime to connect to the target in control mode, all its addresses\n"
+			<< "\t\t\t\tare tried in parallel 250 ms apart (default is 10000)\n"
+			<< "\t--cipher name\t\tTLS cipher: auto (default, AES-GCM with hardware AES or ChaCha20-Poly1305),\n"
+			<< "\t\t\t\taes or chacha20\n"
+			<< "\t--kex name\t\tTLS key exchange: x25519 (default) or cecpq1\n"
+			<< "\t--compression mode\tcompress the session traffic when both ends agree: on (default),\n"
+			<< "\t\t\t\tpaused while it doesn't pay off, or off\n"
+			<< "\t--shells N\t\tnumber of shells to open over the connection in control mode, the input\n"
+			<< "\t\t\t\tgoes to all of them (default is 1)\n"
+			<< "\t--push local:remote\tsend the file to the target in control mode, an interrupted\n"
+			<< "\t\t\t\ttransfer is resumed and the result is verified by SHA-256 before it\n"
+			<< "\t\t\t\treplaces the remote file\n"
+			<< "\t--pull remote:local\treceive the file from the target in control mode, the same way\n"
+			<< "\t--parallel N\t\tnumber of targets served at once in fleet mode (default is 64)\n"
+			<< "\t--host-timeout S\ttime given to every target in fleet mode, 0 for no limit (default)\n"
+			<< "\t--session-cache dir\tdirectory to keep TLS sessions in control mode, empty to disable\n"
+			<< "\t\t\t\t(default is $XDG_CACHE_HOME/draupnir or ~/.cache/draupnir)\n"
+			<< "\t--binary-log\t\talso write the log in the binary form to draupnir-PID-TIME.blog,\n"
+			<< "\t\t\t\tread by draupnir-logdump\n"
 			<< "\t-v\t\tenable verbose mode\n"
 			<< "\t-h\t\tshow this message"
 			<< std::endl;
@@ -135,4 +458,160 @@ namespace Draupnir
 	{
 		return m_isVerbose;
 	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetWorkerCount() const
+	{
+		return m_workers;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	Poller::Backend Config::GetPollerBackend() const
+	{
+		return m_poller;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetHandshakeThreadCount() const
+	{
+		return m_handshakeThreads;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetMaxHandshakes() const
+	{
+		return m_maxHandshakes;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::string& Config::GetPeerHost() const
+	{
+		return m_peerHost;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint16_t Config::GetPeerPort() const
+	{
+		return m_peerPort;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::seconds Config::GetHandshakeTimeout() const
+	{
+		return std::chrono::seconds(m_handshakeTimeout);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::seconds Config::GetIdleTimeout() const
+	{
+		return std::chrono::seconds(m_idleTimeout);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::seconds Config::GetKeepaliveInterval() const
+	{
+		return std::chrono::seconds(m_keepaliveInterval);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetAcceptRate() const
+	{
+		return m_acceptRate;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetSourceRate() const
+	{
+		return m_sourceRate;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::milliseconds Config::GetCoalescingWindow() const
+	{
+		return std::chrono::milliseconds(m_coalescingWindow);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::milliseconds Config::GetConnectTimeout() const
+	{
+		return std::chrono::milliseconds(m_connectTimeout);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TLSPolicy::Cipher Config::GetCipher() const
+	{
+		return m_cipher;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TLSPolicy::KeyExchange Config::GetKeyExchange() const
+	{
+		return m_keyExchange;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool Config::IsCompressionEnabled() const
+	{
+		return m_isCompressionEnabled;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetShellCount() const
+	{
+		return m_shells;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::string& Config::GetCommand() const
+	{
+		return m_command;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	Config::Transfer Config::GetTransfer() const
+	{
+		return m_transfer;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::string& Config::GetLocalPath() const
+	{
+		return m_localPath;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::string& Config::GetRemotePath() const
+	{
+		return m_remotePath;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::string& Config::GetSessionCache() const
+	{
+		return m_sessionCache;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::vector<std::string>& Config::GetFleet() const
+	{
+		return m_fleet;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	unsigned Config::GetParallelism() const
+	{
+		return m_parallelism;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::seconds Config::GetHostTimeout() const
+	{
+		return std::chrono::seconds(m_hostTimeout);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	const std::string& Config::GetBenchmark() const
+	{
+		return m_benchmark;
+	}
 } // namespace Draupnir
@@ -6,6 +6,14 @@
 
 #pragma once
 
+#include "Poller.h"
+#include "TLSPolicy.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -17,7 +25,8 @@ namespace Draupnir
 		typedef struct addrinfo EndPoint;
 
 		void ParseCommandLine(int argc, char* const argv[]);
-		EndPoint* StringToAddress(const char* str) const;
+		EndPoint* StringToAddress(const char* str);
+		unsigned ParseNumber(const char* str, const char* what, unsigned minimum = 1) const;
 		[[noreturn]] void ExitWithHelp() const;
 
 	public:
@@ -25,7 +34,19 @@ namespace Draupnir
 		{
 			Undefined,
 			Target,
-			Control
+			Control,
+			Benchmark,
+			// Control of many targets at once
+			Fleet
+		};
+
+		enum Transfer
+		{
+			NoTransfer,
+			// Local file is sent to the target
+			Push,
+			// File of the target is received
+			Pull
 		};
 
 		explicit Config(int argc, char* const argv[]);
@@ -33,11 +54,89 @@ namespace Draupnir
 
 		Mode GetMode() const;
 		const EndPoint* GetPeerAddress() const;
+		// Host and port of the peer as given in the command line
+		const std::string& GetPeerHost() const;
+		uint16_t GetPeerPort() const;
 		bool IsVerbose() const;
+		// Number of reactor threads serving the target mode
+		unsigned GetWorkerCount() const;
+		Poller::Backend GetPollerBackend() const;
+		// Number of threads running TLS handshakes off the reactors, 0 if disabled
+		unsigned GetHandshakeThreadCount() const;
+		// Maximum number of TLS handshakes in progress at once
+		unsigned GetMaxHandshakes() const;
+		// Time the target gives the peer to complete the TLS handshake
+		std::chrono::seconds GetHandshakeTimeout() const;
+		// Time the target keeps the session the peer sends nothing to, 0 if unlimited
+		std::chrono::seconds GetIdleTimeout() const;
+		// Time the session is idle before the target probes the peer, 0 if disabled
+		std::chrono::seconds GetKeepaliveInterval() const;
+		// Connections per second the target accepts in total and from a single source, 0 if unlimited
+		unsigned GetAcceptRate() const;
+		unsigned GetSourceRate() const;
+		// Time the control mode is given to connect to the target
+		std::chrono::milliseconds GetConnectTimeout() const;
+		// Time the small console output is held to be sent in fewer TLS records, 0 if disabled
+		std::chrono::milliseconds GetCoalescingWindow() const;
+		// Cipher and key exchange offered in TLS handshakes
+		TLSPolicy::Cipher GetCipher() const;
+		TLSPolicy::KeyExchange GetKeyExchange() const;
+		// Compression of the session traffic is offered or accepted
+		bool IsCompressionEnabled() const;
+		// Number of shells the control mode opens over the connection
+		unsigned GetShellCount() const;
+		// Command the control mode runs instead of the shell, empty for the shell
+		const std::string& GetCommand() const;
+		// File the control mode transfers instead of running the shell
+		Transfer GetTransfer() const;
+		const std::string& GetLocalPath() const;
+		const std::string& GetRemotePath() const;
+		// Directory of the TLS sessions kept between the control mode runs, empty if disabled
+		const std::string& GetSessionCache() const;
+		// Targets of the fleet mode as host:port
+		const std::vector<std::string>& GetFleet() const;
+		// Number of the fleet targets served at once
+		unsigned GetParallelism() const;
+		// Time given to every target of the fleet, 0 if unlimited
+		std::chrono::seconds GetHostTimeout() const;
+		// Name of the benchmark to run in the benchmark mode, "all" to run every one
+		const std::string& GetBenchmark() const;
 
 	private:
+		void ParseTransfer(const char* str, Transfer transfer);
+		void ReadFleet(const char* path);
+
 		Mode m_mode;
 		EndPoint* m_peer;
 		bool m_isVerbose;
+		bool m_isBinaryLogEnabled;
+		unsigned m_workers;
+		Poller::Backend m_poller;
+		unsigned m_handshakeThreads;
+		bool m_isHandshakeThreadsSet;
+		unsigned m_maxHandshakes;
+		unsigned m_handshakeTimeout;
+		unsigned m_idleTimeout;
+		unsigned m_keepaliveInterval;
+		unsigned m_acceptRate;
+		unsigned m_sourceRate;
+		unsigned m_coalescingWindow;
+		unsigned m_connectTimeout;
+		TLSPolicy::Cipher m_cipher;
+		TLSPolicy::KeyExchange m_keyExchange;
+		bool m_isCompressionEnabled;
+		unsigned m_shells;
+		std::string m_command;
+		Transfer m_transfer;
+		std::string m_localPath;
+		std::string m_remotePath;
+		std::string m_peerHost;
+		uint16_t m_peerPort;
+		std::string m_sessionCache;
+		bool m_isSessionCacheSet;
+		std::string m_benchmark;
+		std::vector<std::string> m_fleet;
+		unsigned m_parallelism;
+		unsigned m_hostTimeout;
 	};
 } // namespace Draupnir
@@ -6,18 +6,130 @@
 
 #include "ControlConductor.h"
 #include "CredentialsManager.h"
+#include "Poller.h"
+#include "ThreadRNG.h"
 #include "Config.h"
 #include "Logger.h"
 
-#include <iostream>
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
 
 #include <sys/socket.h>
+#include <netdb.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+
+namespace
+{
+	// Time given to a connection attempt before the next address is tried
+	// in parallel, as recommended by RFC 8305
+	const std::chrono::milliseconds ConnectionAttemptDelay(250);
+
+	// Order the addresses for the connection attempts: the families alternate,
+	// starting with the one preferred by the resolver
+	std::vector<const struct addrinfo*> OrderAddresses(const struct addrinfo* addresses)
+	{
+		std::vector<const struct addrinfo*> preferred;
+		std::vector<const struct addrinfo*> others;
+		for (const struct addrinfo* addr = addresses; addr; addr = addr->ai_next)
+			(addr->ai_family == addresses->ai_family ? preferred : others).push_back(addr);
+
+		std::vector<const struct addrinfo*> ordered;
+		for (size_t idx = 0; idx < std::max(preferred.size(), others.size()); ++idx)
+		{
+			if (idx < preferred.size())
+				ordered.push_back(preferred[idx]);
+			if (idx < others.size())
+				ordered.push_back(others[idx]);
+		}
+		return ordered;
+	}
+
+	// The client has nothing else to serve meanwhile, the file is hashed in
+	// line, all the slices due at once
+	template<class TTransfer>
+	void HashInLine(TTransfer& transfer)
+	{
+		while (transfer.IsHashingDue())
+		{
+			transfer.StartHashing()();
+			transfer.OnHashed();
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Status flags of a standard stream, restored on destruction.
+	/// 			The terminal's streams share the flags, so the flags of
+	/// 			all of them are saved before any is changed.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class StreamFlags
+	{
+	public:
+		explicit StreamFlags(int fd)
+			: m_fd(fd)
+			, m_flags(fcntl(fd, F_GETFL, 0))
+		{
+			if (-1 == m_flags)
+				throw std::runtime_error("failed to get attributes of FD " + std::to_string(fd)
+					+ ": " + std::string(strerror(errno)));
+		}
+
+		StreamFlags(const StreamFlags&) = delete;
+		StreamFlags& operator =(const StreamFlags&) = delete;
+
+		~StreamFlags()
+		{
+			fcntl(m_fd, F_SETFL, m_flags);
+		}
+
+		void SetNonBlocking()
+		{
+			POSIX_CHECK(fcntl(m_fd, F_SETFL, m_flags | O_NONBLOCK));
+		}
+
+		void Restore()
+		{
+			POSIX_CHECK(fcntl(m_fd, F_SETFL, m_flags));
+		}
+
+	private:
+		const int m_fd;
+		const int m_flags;
+	};
+
+	std::string FormatAddress(const struct addrinfo* addr)
+	{
+		char host[NI_MAXHOST];
+		char port[NI_MAXSERV];
+		if (0 != getnameinfo(addr->ai_addr, addr->ai_addrlen, host, sizeof(host), port, sizeof(port),
+			NI_NUMERICHOST | NI_NUMERICSERV))
+			return "unknown address";
+		return AF_INET6 == addr->ai_family ? '[' + std::string(host) + "]:" + port : std::string(host) + ':' + port;
+	}
+
+	// Regular files and some devices, like /dev/null, are always ready and
+	// can't be added to epoll
+	bool IsPollable(int fd)
+	{
+		Draupnir::SocketHandle probe(epoll_create1(EPOLL_CLOEXEC));
+		if (!probe)
+			throw std::runtime_error("failed to create epoll instance: " + std::string(strerror(errno)));
+
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		if (0 == epoll_ctl(probe.get(), EPOLL_CTL_ADD, fd, &event))
+			return true;
+		if (EPERM != errno)
+			throw std::runtime_error("failed to poll descriptor " + std::to_string(fd) + ": " + strerror(errno));
+		return false;
+	}
+} // namespace
 
 namespace Draupnir
 {
@@ -25,63 +137,207 @@ namespace Draupnir
 	ControlConductor::ControlConductor(std::shared_ptr<Config> config)
 		: Conductor(config)
 		, m_socket(ConnectSocket())
-		, m_sessionMgr(m_rng)
-		, m_tls(*this, m_sessionMgr, m_creds, m_policy, m_rng)
+		, m_outbound(m_buffers)
+		, m_stdout(STDOUT_FILENO, m_buffers)
+		, m_stderr(STDERR_FILENO, m_buffers)
+		, m_isSocketPaused(false)
+		, m_policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange())
+		, m_creds(CredentialsManager::Client)
+		, m_sessionStore(GetConfig().GetSessionCache())
+		, m_handshakeStart(std::chrono::steady_clock::now())
+		, m_tls(*this, m_sessionStore, m_creds, m_policy, ThreadRNG::GetInstance(),
+			Botan::TLS::Server_Information(GetConfig().GetPeerHost(), GetConfig().GetPeerPort()),
+			Botan::TLS::Protocol_Version::latest_tls_version(),
+			CompressedStream::GetOfferedProtocols(GetConfig().IsCompressionEnabled()))
+		, m_isMultiplexed(false)
+		, m_isInputOver(false)
+		, m_exitStatus(-1)
+		, m_transferBytes(0)
 	{
+		// The local file is checked before anything is sent
+		if (Config::Push == GetConfig().GetTransfer())
+			m_fileSender.reset(new FileSender(GetConfig().GetLocalPath()));
+		else if (Config::Pull == GetConfig().GetTransfer())
+			m_fileReceiver.reset(new FileReceiver(GetConfig().GetLocalPath()));
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	SocketHandle ControlConductor::ConnectSocket() const
 	{
-		const auto addr = GetConfig().GetPeerAddress();
-		SocketHandle sock(socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, 0));
-		if (!sock)
-			throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
+		const std::vector<const struct addrinfo*> addresses = OrderAddresses(GetConfig().GetPeerAddress());
+		const auto connectStart = std::chrono::steady_clock::now();
+		const auto deadline = connectStart + GetConfig().GetConnectTimeout();
 
-		Logger::GetInstance().Debug() << "connecting...";
-		if (-1 == connect(sock.get(), addr->ai_addr, addr->ai_addrlen))
+		SocketHandle pollHandle(epoll_create1(EPOLL_CLOEXEC));
+		if (!pollHandle)
+			throw std::runtime_error("failed to poll on connect: " + std::string(strerror(errno)));
+
+		// Attempts in progress by the index of their address, the ones over are closed
+		struct Attempt
+		{
+			SocketHandle sock;
+			std::chrono::steady_clock::time_point start;
+		};
+		std::vector<Attempt> attempts(addresses.size());
+		size_t next = 0;
+		size_t inProgress = 0;
+		auto nextAttempt = connectStart;
+		std::string lastError = "no address to connect to";
+
+		while (true)
 		{
-			if (errno != EINPROGRESS)
-				throw std::runtime_error("failed to connect: " + std::string(strerror(errno)));
+			// A new attempt starts once the previous one is given the delay
+			// without success, or right away after a failure
+			auto now = std::chrono::steady_clock::now();
+			while (next < addresses.size() && (now >= nextAttempt || 0 == inProgress))
+			{
+				const struct addrinfo* addr = addresses[next];
+				Attempt& attempt = attempts[next];
+				attempt.start = now;
+				DEBUG_LOG << "connecting to " << FormatAddress(addr) << "...";
+
+				attempt.sock.reset(socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+				if (!attempt.sock)
+				{
+					lastError = "failed to create socket: " + std::string(strerror(errno));
+					DEBUG_LOG << lastError;
+				}
+				else if (0 == connect(attempt.sock.get(), addr->ai_addr, addr->ai_addrlen))
+				{
+					DEBUG_LOG << "connection established to " << FormatAddress(addr);
+					return std::move(attempt.sock);
+				}
+				else if (EINPROGRESS != errno)
+				{
+					lastError = "failed to connect to " + FormatAddress(addr) + ": " + strerror(errno);
+					DEBUG_LOG << lastError;
+					attempt.sock.reset();
+				}
+				else
+				{
+					struct epoll_event connectionEvent;
+					connectionEvent.data.u64 = next;
+					connectionEvent.events = EPOLLOUT;
+					POSIX_CHECK(epoll_ctl(pollHandle.get(), EPOLL_CTL_ADD, attempt.sock.get(), &connectionEvent));
+					++inProgress;
+					nextAttempt = now + ConnectionAttemptDelay;
+				}
+				++next;
+			}
 
-			SocketHandle pollHandle(epoll_create1(0));
-			if (!pollHandle)
-				throw std::runtime_error("failed to poll on connect: " + std::string(strerror(errno)));
+			if (0 == inProgress)
+				throw std::runtime_error(lastError);
+			if (now >= deadline)
+				throw std::runtime_error("failed to connect in " + std::to_string(GetConfig().GetConnectTimeout().count())
+					+ " ms: " + lastError);
 
-			struct epoll_event connectionEvent;
-			connectionEvent.data.fd = sock.get();
-			connectionEvent.events = EPOLLOUT | EPOLLIN;
-			POSIX_CHECK(epoll_ctl(pollHandle.get(), EPOLL_CTL_ADD, sock.get(), &connectionEvent));
+			// Wake up for the next attempt or the deadline, whichever comes first
+			const auto wakeUp = next < addresses.size() ? std::min(nextAttempt, deadline) : deadline;
+			const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wakeUp - now).count() + 1;
+			struct epoll_event receivedEvents[8];
+			const int numEvents = epoll_wait(pollHandle.get(), receivedEvents, 8, static_cast<int>(timeout));
+			if (-1 == numEvents && EINTR == errno)
+				continue;
+			POSIX_CHECK(numEvents);
 
-			struct epoll_event receivedEvent;
-			POSIX_CHECK(epoll_wait(pollHandle.get(), &receivedEvent, 1, -1));
+			now = std::chrono::steady_clock::now();
+			for (int idx = 0; idx < numEvents; ++idx)
+			{
+				const size_t index = static_cast<size_t>(receivedEvents[idx].data.u64);
+				Attempt& attempt = attempts[index];
+				const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - attempt.start);
 
-			int retVal = -1;
-			socklen_t retValLen = sizeof(retVal);
-			POSIX_CHECK(getsockopt(sock.get(), SOL_SOCKET, SO_ERROR, &retVal, &retValLen));
+				int retVal = -1;
+				socklen_t retValLen = sizeof(retVal);
+				POSIX_CHECK(getsockopt(attempt.sock.get(), SOL_SOCKET, SO_ERROR, &retVal, &retValLen));
+				if (0 == retVal)
+				{
+					// The rest of the attempts are closed along with the vector
+					DEBUG_LOG << "connection established to " << FormatAddress(addresses[index]) << " in "
+						<< elapsed.count() / 1000.0 << " ms, " << std::chrono::duration_cast<std::chrono::microseconds>(
+						now - connectStart).count() / 1000.0 << " ms since the first attempt";
+					return std::move(attempt.sock);
+				}
 
-			if (retVal != 0)
-				throw std::runtime_error("failed to connect: " + std::string(strerror(retVal)));
+				lastError = "failed to connect to " + FormatAddress(addresses[index]) + ": " + strerror(retVal);
+				DEBUG_LOG << lastError << " after " << elapsed.count() / 1000.0 << " ms";
+				attempt.sock.reset();
+				--inProgress;
+				// The failed attempt gives its turn to the next address
+				nextAttempt = now;
+			}
 		}
+	}
 
-		Logger::GetInstance().Debug() << "connection established";
-		return sock;
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::Send(const uint8_t* data, size_t size)
+	{
+		if (m_compression)
+		{
+			m_sentFrames.clear();
+			m_compression->Encode(data, size, m_sentFrames);
+			data = m_sentFrames.data();
+			size = m_sentFrames.size();
+		}
+		m_tls.send(data, size);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::SendMessages()
+	{
+		Send(m_messages.data(), m_messages.size());
+		m_messages.clear();
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void ControlConductor::WriteToSocket(const std::vector<uint8_t>&& buf) const
+	void ControlConductor::tls_session_activated()
 	{
-		auto size = buf.size();
-		auto pos = buf.data();
-		while (size)
+		// The target agreed to frame the traffic in both directions
+		if (m_tls.application_protocol() == CompressedStream::CompressedProtocol)
 		{
-			const ssize_t res = write(m_socket.get(), pos, size);
-			if (-1 == res && (errno != EINTR || errno != EAGAIN))
-				throw std::runtime_error("failed to write: " + std::string(strerror(errno)));
+			m_compression.reset(new CompressedStream());
+			DEBUG_LOG << "session traffic is compressed";
+		}
 
-			size -= static_cast<size_t>(res);
-			pos += res;
+		const std::string& command = GetConfig().GetCommand();
+		const unsigned shells = GetConfig().GetShellCount();
+		m_isMultiplexed = !m_tls.application_protocol().empty();
+		if (!m_isMultiplexed)
+		{
+			if (!command.empty() || Config::NoTransfer != GetConfig().GetTransfer())
+			{
+				ERROR_LOG << "target doesn't support channels, the command or the transfer can't be run";
+				m_tls.close();
+			}
+			else if (shells > 1)
+			{
+				ERROR_LOG << "target doesn't support channels, a single shell is opened";
+			}
+			return;
+		}
+
+		// The transfer and the command run alone, the input can't be shared with the shells
+		if (Config::NoTransfer != GetConfig().GetTransfer())
+		{
+			OpenTransfer();
 		}
+		else if (!command.empty())
+		{
+			m_channels.push_back(Channel{ 0, 0, {}, 0, true, false });
+			ChannelStream::AppendOpen(m_messages, 0, ChannelStream::InitialWindow, ChannelStream::ExecKind, command);
+		}
+		else
+		{
+			for (unsigned id = 0; id < shells; ++id)
+			{
+				m_channels.push_back(Channel{ static_cast<uint16_t>(id), 0, {}, 0, true, false });
+				ChannelStream::AppendOpen(m_messages, static_cast<uint16_t>(id),
+					ChannelStream::InitialWindow, ChannelStream::ShellKind);
+			}
+		}
+		SendMessages();
+		// The input could be over before the handshake
+		SendInputEof();
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -89,14 +345,329 @@ namespace Draupnir
 		uint64_t seqNo __attribute__((unused)),
 		const uint8_t data[],
 		size_t size)
-	{		
-		std::cout << std::string(data, data + size);
+	{
+		if (m_compression)
+		{
+			m_receivedData.clear();
+			m_compression->Decode(data, size, m_receivedData);
+			data = m_receivedData.data();
+			size = m_receivedData.size();
+		}
+
+		if (!m_isMultiplexed)
+		{
+			WriteOutput(nullptr, m_stdout, data, size);
+			return;
+		}
+
+		m_channelStream.Read(data, size,
+			[this](ChannelStream::MessageType type, uint16_t id, const uint8_t* payload, size_t length)
+			{
+				OnChannelMessage(type, id, payload, length);
+			});
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::OnChannelMessage(ChannelStream::MessageType type, uint16_t id,
+		const uint8_t* payload, size_t size)
+	{
+		// The idle target checks the connection is still there
+		if (ChannelStream::Keepalive == type)
+		{
+			ChannelStream::Append(m_messages, ChannelStream::Keepalive, id);
+			SendMessages();
+			return;
+		}
+
+		const auto found = std::find_if(m_channels.begin(), m_channels.end(),
+			[id](const Channel& channel) { return channel.id == id; });
+		if (ChannelStream::Open == type)
+			throw std::runtime_error("target tried to open channel " + std::to_string(id));
+		if (m_channels.end() == found)
+			return;
+
+		Channel& channel = *found;
+		switch (type)
+		{
+		case ChannelStream::Confirm:
+			DEBUG_LOG << "channel " << id << " is opened";
+			channel.sendWindow += ChannelStream::ReadValue(payload, size);
+			SendBacklog(channel);
+			break;
+		case ChannelStream::Data:
+		case ChannelStream::ErrorData:
+			if (m_fileReceiver && ChannelStream::Data == type)
+			{
+				m_fileReceiver->Write(payload, size);
+				HashInLine(*m_fileReceiver);
+				m_transferBytes += size;
+			}
+			else
+			{
+				WriteOutput(&channel, ChannelStream::Data == type ? m_stdout : m_stderr, payload, size);
+			}
+			// Return the consumed output to the target's window in batches
+			channel.pendingCredit += static_cast<uint32_t>(size);
+			if (channel.pendingCredit >= (m_fileReceiver ? ChannelStream::TransferCreditThreshold
+				: ChannelStream::CreditThreshold))
+			{
+				ChannelStream::AppendValue(m_messages, ChannelStream::Window, id, channel.pendingCredit);
+				channel.pendingCredit = 0;
+				SendMessages();
+			}
+			break;
+		case ChannelStream::Window:
+			channel.sendWindow += ChannelStream::ReadValue(payload, size);
+			SendBacklog(channel);
+			if (m_fileSender)
+				SendFile(channel);
+			break;
+		case ChannelStream::Exit:
+			m_exitStatus = static_cast<int>(ChannelStream::ReadValue(payload, size));
+			DEBUG_LOG << "command of channel " << id << " exited with status " << m_exitStatus;
+			if (m_fileSender)
+				ReportTransfer();
+			break;
+		case ChannelStream::Offset:
+			if (!m_fileSender)
+				throw std::runtime_error("target requested the file not being sent");
+			m_fileSender->Start(ChannelStream::ReadOffset(payload, size));
+			if (m_fileSender->GetPosition())
+				INFO_LOG << "resuming " << GetConfig().GetRemotePath() << " from " << m_fileSender->GetPosition();
+			ChannelStream::AppendOffset(m_messages, ChannelStream::Size, id, m_fileSender->GetSize());
+			SendFile(channel);
+			break;
+		case ChannelStream::Size:
+			if (!m_fileReceiver)
+				throw std::runtime_error("target sent the file not being received");
+			m_fileReceiver->SetSize(ChannelStream::ReadOffset(payload, size));
+			break;
+		case ChannelStream::Digest:
+			if (!m_fileReceiver)
+				throw std::runtime_error("target sent the file not being received");
+			m_fileReceiver->SetDigest(payload, size);
+			HashInLine(*m_fileReceiver);
+			m_exitStatus = m_fileReceiver->Finish() ? EXIT_SUCCESS : EXIT_FAILURE;
+			ReportTransfer();
+			// The target waits for the verdict to release the file
+			ChannelStream::Append(m_messages, ChannelStream::Close, id);
+			SendMessages();
+			CloseChannel(found);
+			break;
+		case ChannelStream::Close:
+			if (size)
+				ERROR_LOG << "channel " << id << " failed: " << std::string(payload, payload + size);
+			else
+				DEBUG_LOG << "channel " << id << " is over";
+			CloseChannel(found);
+			break;
+		default:
+			throw std::runtime_error("unexpected channel message " + std::to_string(type));
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::OnInput(const uint8_t* data, size_t size)
+	{
+		if (!m_isMultiplexed)
+		{
+			Send(data, size);
+			return;
+		}
+
+		// Every shell gets the input, those not ready for it keep it aside
+		for (auto& channel : m_channels)
+		{
+			channel.backlog.insert(channel.backlog.end(), data, data + size);
+			SendBacklog(channel);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::SendBacklog(Channel& channel)
+	{
+		const size_t sent = static_cast<size_t>(std::min<uint64_t>(channel.backlog.size(), channel.sendWindow));
+		if (!sent)
+			return;
+
+		ChannelStream::AppendData(m_messages, channel.id, channel.backlog.data(), sent);
+		channel.sendWindow -= sent;
+		channel.backlog.erase(channel.backlog.begin(), channel.backlog.begin() + sent);
+		SendMessages();
+		if (channel.backlog.empty())
+			SendInputEof();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::CloseChannel(std::vector<Channel>::iterator channel)
+	{
+		m_channels.erase(channel);
+		// Nothing is left to do over the connection
+		if (m_channels.empty())
+			m_tls.close();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::OpenTransfer()
+	{
+		const Config& config = GetConfig();
+		m_channels.push_back(Channel{ 0, 0, {}, 0, true, false });
+		m_transferStart = std::chrono::steady_clock::now();
+		if (m_fileSender)
+		{
+			ChannelStream::AppendOpen(m_messages, 0, ChannelStream::TransferWindow,
+				ChannelStream::PushKind, config.GetRemotePath());
+			return;
+		}
+
+		// The target sends the rest of the file once it knows the offset
+		ChannelStream::AppendOpen(m_messages, 0, ChannelStream::TransferWindow,
+			ChannelStream::PullKind, config.GetRemotePath());
+		ChannelStream::AppendOffset(m_messages, ChannelStream::Offset, 0, m_fileReceiver->GetOffset());
+		if (m_fileReceiver->GetOffset())
+			INFO_LOG << "resuming " << config.GetLocalPath() << " from " << m_fileReceiver->GetOffset();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::SendFile(Channel& channel)
+	{
+		const size_t sent = m_fileSender->Append(m_messages, channel.id, channel.sendWindow);
+		channel.sendWindow -= sent;
+		m_transferBytes += sent;
+
+		// The file is hashed once its data is out, while the network is still
+		// busy with it, and the digest follows
+		if (m_fileSender->GetPosition() == m_fileSender->GetSize() && m_fileSender->IsHashingDue())
+		{
+			HashInLine(*m_fileSender);
+			m_fileSender->Append(m_messages, channel.id, channel.sendWindow);
+		}
+		if (!m_messages.empty())
+			SendMessages();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::ReportTransfer() const
+	{
+		const double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(
+			std::chrono::steady_clock::now() - m_transferStart).count();
+		if (m_exitStatus != EXIT_SUCCESS)
+		{
+			ERROR_LOG << "transferred file doesn't match the source, it's discarded to be sent again";
+			return;
+		}
+		INFO_LOG << (m_fileSender ? "pushed " : "pulled ") << m_transferBytes << " bytes in " << elapsed << " s, "
+			<< (elapsed > 0 ? m_transferBytes / elapsed / (1024 * 1024) : 0) << " MB/s";
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::OnInputOver()
+	{
+		DEBUG_LOG << "end of input reached";
+		m_isInputOver = true;
+		SendInputEof();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::SendInputEof()
+	{
+		// The raw stream has no way to tell the end of the input
+		if (!m_isInputOver || !m_isMultiplexed)
+			return;
+
+		bool isSent = false;
+		for (auto& channel : m_channels)
+		{
+			if (channel.isEofSent || !channel.backlog.empty())
+				continue;
+			ChannelStream::Append(m_messages, ChannelStream::Eof, channel.id);
+			channel.isEofSent = true;
+			isSent = true;
+		}
+		if (isSent)
+			SendMessages();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::ReadInput()
+	{
+		while (!m_isInputOver && !IsInputPaused())
+		{
+			const ssize_t count = m_buffers.Read(STDIN_FILENO, [this](const uint8_t* data, size_t size)
+			{
+				OnInput(data, size);
+			});
+			if (count == -1)
+			{
+				if (EINTR == errno)
+					continue;
+				throw std::runtime_error("input read error: " + std::string(strerror(errno)));
+			}
+			if (count == 0)
+				OnInputOver();
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::WriteOutput(Channel* channel, Output& out, const uint8_t* data, size_t size)
+	{
+		// Output of a single shell or the command goes as is, right from the record
+		if (!channel || m_channels.size() < 2)
+		{
+			out.queue.Write(out.fd, data, size);
+			return;
+		}
+
+		// Tell the lines of the shells apart
+		m_prefixedOutput.clear();
+		for (size_t idx = 0; idx < size; ++idx)
+		{
+			if (channel->atLineStart)
+				m_prefixedOutput += '[' + std::to_string(channel->id) + "] ";
+			m_prefixedOutput += static_cast<char>(data[idx]);
+			channel->atLineStart = '\n' == data[idx];
+		}
+		out.queue.Write(out.fd, reinterpret_cast<const uint8_t*>(m_prefixedOutput.data()), m_prefixedOutput.size());
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::UpdateOutputInterest(Poller& poller, Output& out)
+	{
+		if (!out.isPollable || out.queue.IsEmpty() == !out.isPolled)
+			return;
+
+		if (out.isPolled)
+			poller.Remove(out.fd);
+		else
+			poller.Add(out.fd, EPOLLOUT, out.fd);
+		out.isPolled = !out.isPolled;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ControlConductor::DrainOutput(Output& out)
+	{
+		while (!out.queue.Flush(out.fd))
+		{
+			struct pollfd pollHandle = { out.fd, POLLOUT, 0 };
+			if (-1 == poll(&pollHandle, 1, -1) && EINTR != errno)
+				throw std::runtime_error("failed to wait for the output: " + std::string(strerror(errno)));
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool ControlConductor::IsInputPaused() const
+	{
+		// Nothing can be sent before the handshake is over
+		if (!m_tls.is_active() || m_outbound.IsCongested())
+			return true;
+		return std::any_of(m_channels.begin(), m_channels.end(),
+			[](const Channel& channel) { return !channel.backlog.empty(); });
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	void ControlConductor::tls_emit_data(const uint8_t data[], size_t size)
 	{
-		WriteToSocket(std::vector<uint8_t>(data, data + size));
+		m_outbound.Write(m_socket.get(), data, size);
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -104,12 +675,12 @@ namespace Draupnir
 	{
 		if (Botan::TLS::Alert::CLOSE_NOTIFY == alert.type())
 		{
-			Logger::GetInstance().Debug() << "TLS close notitification received, closing the socket";
+			DEBUG_LOG << "TLS close notitification received, closing the socket";
 			m_tls.close();
 		}
 		else
 		{
-			Logger::GetInstance().Error() << "TLS alert: " << alert.type_string();
+			ERROR_LOG << "TLS alert: " << alert.type_string();
 		}
 	}
 
@@ -117,10 +688,15 @@ namespace Draupnir
 	bool ControlConductor::tls_session_established(const Botan::TLS::Session& session)
 	{
 		const auto& info = session.server_info();
-		Logger::GetInstance().Debug() << "TLS session with " << info.hostname()
+		DEBUG_LOG << "TLS session with " << info.hostname()
 		    << ":" << info.port() << " established";
-		Logger::GetInstance().Debug() << session.version().to_string() << " using "
+		DEBUG_LOG << session.version().to_string() << " using "
 			<< session.ciphersuite().to_string();
+
+		const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - m_handshakeStart);
+		INFO_LOG << (m_sessionStore.IsResumed(session) ? "resumed" : "full")
+			<< " TLS handshake completed in " << latency.count() / 1000.0 << " ms";
 		return true; // enable caching of the session in the configured session manager
 	}
 
@@ -136,85 +712,181 @@ namespace Draupnir
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void ControlConductor::Run()
+	void ControlConductor::ReadHandle(Poller& poller, int fd)
 	{
-		Logger& log = Logger::GetInstance();
-		log.Info() << "Draupnir is started in control mode";
+		// We have a data on the socket waiting to be read. We must read whatever
+		// data is available completely, as we are running in edge-triggered mode
+		// and won't get a notification again for the same data
+		while (!m_tls.is_closed())
+		{
+			// Leave the input unread while the server doesn't keep up with it
+			if (fd == STDIN_FILENO && IsInputPaused())
+				break;
 
-		SocketHandle pollHandle(epoll_create1(0));
-		if (!pollHandle)
-			throw std::runtime_error("failed to poll after connect: " + std::string(strerror(errno)));
+			// Leave the records unread while the output doesn't keep up with them,
+			// they are read once it drains
+			if (fd != STDIN_FILENO && IsOutputPaused())
+			{
+				m_isSocketPaused = true;
+				break;
+			}
 
-		struct epoll_event event;
-		event.data.fd = m_socket.get();
-		event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
-		POSIX_CHECK(epoll_ctl(pollHandle.get(), EPOLL_CTL_ADD, m_socket.get(), &event));
+			const ssize_t count = m_buffers.Read(fd, [this, fd](const uint8_t* data, size_t size)
+			{
+				if (fd == STDIN_FILENO)
+					OnInput(data, size);
+				else
+					m_tls.received_data(data, size);
+			});
+			if (count == -1)
+			{
+				// If errno == EAGAIN, that means we have read all the data.
+				// So go back to the main loop.
+				if(EAGAIN == errno)
+					break;
+				throw std::runtime_error("socket read error: " + std::string(strerror(errno)));
+			}
+			else if (count == 0)
+			{
+				// Nothing more will come from the closed input
+				if (fd == STDIN_FILENO)
+				{
+					poller.Remove(fd);
+					OnInputOver();
+				}
+				else
+				{
+					// The records sent before the close are processed by now
+					DEBUG_LOG << "server has closed the connection";
+					m_tls.close();
+				}
+				break;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int ControlConductor::Run()
+	{
+		INFO_LOG << "Draupnir is started in control mode";
+
+		std::unique_ptr<Poller> poller = Poller::Create(GetConfig().GetPollerBackend());
+		DEBUG_LOG << "using " << poller->GetName() << " for event notification";
+		poller->Add(m_socket.get(), EPOLLIN | EPOLLRDHUP, m_socket.get());
 		
-		// Make STDIN non blocking
-		int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-		if (-1 == flags)
-			throw std::runtime_error("failed to get socket attibutes: " + std::string(strerror(errno)));
+		// The streams are left as they were found on any exit
+		StreamFlags stdinFlags(STDIN_FILENO);
+		StreamFlags stdoutFlags(STDOUT_FILENO);
 
-		flags |= O_NONBLOCK;
-		POSIX_CHECK(fcntl(STDIN_FILENO, F_SETFL, flags));
+		// The file transfer doesn't take any input
+		const bool isInputUsed = Config::NoTransfer == GetConfig().GetTransfer();
+		if (isInputUsed)
+			stdinFlags.SetNonBlocking();
 		
-		// Add STDIN to the polling cycle
-		event.data.fd = STDIN_FILENO;
-		POSIX_CHECK(epoll_ctl(pollHandle.get(), EPOLL_CTL_ADD, STDIN_FILENO, &event));
+		// Add STDIN to the polling cycle unless it's always ready
+		const uint32_t inputEvents = EPOLLIN | EPOLLRDHUP;
+		const bool isStdinPollable = isInputUsed && IsPollable(STDIN_FILENO);
+		if (isStdinPollable)
+			poller->Add(STDIN_FILENO, inputEvents, STDIN_FILENO);
+		uint32_t socketEvents = inputEvents;
+		uint32_t stdinEvents = inputEvents;
+
+		// Write the output without blocking the connection, the descriptors
+		// that can't be polled never block anyway
+		m_stdout.isPollable = IsPollable(m_stdout.fd);
+		m_stderr.isPollable = IsPollable(m_stderr.fd);
+		if (m_stdout.isPollable)
+			stdoutFlags.SetNonBlocking();
 		
 		while (!m_tls.is_closed())
 		{			
+			// Don't sleep while the input that can't be polled is waiting to be read
+			const bool isInputReady = isInputUsed && !isStdinPollable && !m_isInputOver && !IsInputPaused();
 			std::vector<struct epoll_event> events(64);
-			const int numEvents = epoll_wait(pollHandle.get(), events.data(), events.size(), -1);
+			const int numEvents = poller->Wait(events.data(), events.size(), isInputReady ? 0 : -1);
+			if (-1 == numEvents && EINTR == errno)
+				continue;
 			POSIX_CHECK(numEvents);
 			
 			for (int idx = 0; idx < numEvents; ++idx)
 			{
 				
 				const auto& event = events[idx];
-				const auto& fd = event.data.fd;
-				
-				if ((event.events & EPOLLERR) || (event.events & EPOLLHUP) ||
-					(!(event.events & EPOLLIN)))
-				{
-					close(fd);
-					throw std::runtime_error("read failed on FD " + std::to_string(fd));
-				}					
+				const int fd = static_cast<int>(event.data.u64);
 
-				if (event.events & EPOLLRDHUP)
-				{
-					Logger::GetInstance().Debug() << "server has closed the connection";
-					m_tls.close();									
-				}						
-
-				// We have a data on the socket waiting to be read. We must read whatever
-				// data is available completely, as we are running in edge-triggered mode
-				// and won't get a notification again for the same data
-				while(true)
+				// The output is ready to take more of the queued data
+				if (fd == m_stdout.fd || fd == m_stderr.fd)
 				{
-					std::vector<uint8_t> buf(512);
-					const ssize_t count = read(fd, buf.data(), buf.size());
-					if (count == -1)
-					{
-						// If errno == EAGAIN, that means we have read all the data.
-						// So go back to the main loop.
-						if(EAGAIN == errno)
-							break;
-						throw std::runtime_error("socket read error: " + std::string(strerror(errno)));
-					}
-					else if (count == 0)
-						break;								
-
-					if (fd == STDIN_FILENO)
-					{					
-						m_tls.send(buf.data(), count);
-					}
-					else
-					{									
-						m_tls.received_data(buf.data(), count);
-					}
+					Output& output = fd == m_stdout.fd ? m_stdout : m_stderr;
+					output.queue.Flush(output.fd);
+					continue;
 				}
-			}			
+				
+				// The input whose writer is gone reports the hangup along with
+				// the data left, it's read until the end of file
+				if (fd != STDIN_FILENO && (event.events & (EPOLLERR | EPOLLHUP)))
+					throw std::runtime_error("read failed on FD " + std::to_string(fd));
+
+				if (event.events & EPOLLOUT)
+					m_outbound.Flush(m_socket.get());
+
+				if (!(event.events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+					continue;
+
+				ReadHandle(*poller, fd);
+			}
+
+			// Catch up with the records left unread while the output was congested
+			if (m_isSocketPaused && !IsOutputPaused() && !m_tls.is_closed())
+			{
+				m_isSocketPaused = false;
+				ReadHandle(*poller, m_socket.get());
+			}
+
+			if (isInputUsed && !isStdinPollable && !m_tls.is_closed())
+				ReadInput();
+
+			// Wait for the socket to become writable only while there's something
+			// to write, and pause the input while the queue is above the watermark.
+			// The socket isn't polled for the records while the output is congested
+			const uint32_t wantedSocketEvents = (m_isSocketPaused ? 0u : inputEvents)
+				| (m_outbound.IsEmpty() ? 0u : EPOLLOUT);
+			if (wantedSocketEvents != socketEvents)
+			{
+				poller->Modify(m_socket.get(), wantedSocketEvents, m_socket.get());
+				socketEvents = wantedSocketEvents;
+			}
+
+			const uint32_t wantedStdinEvents = IsInputPaused() ? 0u : inputEvents;
+			if (isStdinPollable && !m_isInputOver && wantedStdinEvents != stdinEvents)
+			{
+				poller->Modify(STDIN_FILENO, wantedStdinEvents, STDIN_FILENO);
+				stdinEvents = wantedStdinEvents;
+			}
+
+			UpdateOutputInterest(*poller, m_stdout);
+			UpdateOutputInterest(*poller, m_stderr);
 		}
+
+		// Best effort to deliver the close notification
+		m_outbound.Flush(m_socket.get());
+
+		// The output is written in full before exit, with the descriptors as they were
+		stdinFlags.Restore();
+		stdoutFlags.Restore();
+		DrainOutput(m_stdout);
+		DrainOutput(m_stderr);
+
+		if (m_compression)
+			DEBUG_LOG << "compression: " << m_compression->GetStats();
+
+		const auto& stats = m_buffers.GetStats();
+		DEBUG_LOG << "buffers: " << stats.acquired << " acquired, " << stats.allocated
+			<< " allocated, " << stats.cached << " cached";
+
+		// The status of the command, or a failure if it never got to exit
+		if (GetConfig().GetCommand().empty() && Config::NoTransfer == GetConfig().GetTransfer())
+			return EXIT_SUCCESS;
+		return m_exitStatus < 0 ? EXIT_FAILURE : m_exitStatus;
 	}
 } // namespace Draupnir
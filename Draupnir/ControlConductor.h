@@ -7,29 +7,101 @@
 #pragma once
 
 #include "Posix.h"
+#include "BufferPool.h"
+#include "OutboundQueue.h"
 #include "Conductor.h"
 #include "TLSPolicy.h"
 #include "CredentialsManager.h"
+#include "SessionStore.h"
+#include "CompressedStream.h"
+#include "ChannelStream.h"
+#include "FileTransfer.h"
 
-#include <botan/auto_rng.h>
 #include <botan/tls_client.h>
-#include <botan/tls_session_manager.h>
 
+#include <chrono>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace Draupnir
 {
+	class Poller;
+
 	class ControlConductor final : public Conductor, private Botan::TLS::Callbacks
 	{
 		SocketHandle m_socket;
+		BufferPool m_buffers;
+		OutboundQueue m_outbound;
+
+		// Standard output or error written directly from the received records,
+		// whatever the descriptor can't take at once is queued
+		struct Output
+		{
+			const int fd;
+			OutboundQueue queue;
+			// Regular files are always ready and can't be polled
+			bool isPollable;
+			bool isPolled;
+
+			Output(int handle, BufferPool& buffers)
+				: fd(handle)
+				, queue(buffers)
+				, isPollable(false)
+				, isPolled(false)
+			{
+			}
+		};
+		Output m_stdout;
+		Output m_stderr;
+		// The records are left unread while the output is congested
+		bool m_isSocketPaused;
 
-		TLSPolicy m_policy;
+		const TLSPolicy m_policy;
 		CredentialsManager m_creds;
-		Botan::AutoSeeded_RNG m_rng;
-		Botan::TLS::Session_Manager_In_Memory m_sessionMgr;
+		SessionStore m_sessionStore;
+		// The client sends its hello right on construction
+		std::chrono::steady_clock::time_point m_handshakeStart;
 		Botan::TLS::Client m_tls;
+		// Compression stage if negotiated in the handshake
+		std::unique_ptr<CompressedStream> m_compression;
+		std::vector<uint8_t> m_sentFrames;
+		std::vector<uint8_t> m_receivedData;
+
+		// Shell or command opened over the multiplexed connection
+		struct Channel
+		{
+			uint16_t id;
+			// Input the target is ready to receive and the input waiting for it
+			uint64_t sendWindow;
+			std::vector<uint8_t> backlog;
+			// Output written and not yet returned to the target's window
+			uint32_t pendingCredit;
+			// The next output starts a line and is prefixed with the channel
+			bool atLineStart;
+			// The end of the input is passed on after the backlog
+			bool isEofSent;
+		};
+
+		// The traffic is split into channels, the targets negotiating no
+		// application protocol run a single shell over the raw stream
+		bool m_isMultiplexed;
+		ChannelStream m_channelStream;
+		std::vector<Channel> m_channels;
+		std::vector<uint8_t> m_messages;
+		std::string m_prefixedOutput;
+		// Nothing more comes from stdin
+		bool m_isInputOver;
+		// Exit status reported for the command or the file transfer, -1 until then
+		int m_exitStatus;
+		// File pushed to the target or pulled from it
+		std::unique_ptr<FileSender> m_fileSender;
+		std::unique_ptr<FileReceiver> m_fileReceiver;
+		std::chrono::steady_clock::time_point m_transferStart;
+		uint64_t m_transferBytes;
 
 		// Botan::TLS::Callbacks implementation
+		void tls_session_activated() final override;
 		void tls_record_received(uint64_t seqNo, const uint8_t data[], size_t size) final override;
 		void tls_emit_data(const uint8_t data[], size_t size) final override;
 		void tls_alert(Botan::TLS::Alert alert) final override;
@@ -42,10 +114,36 @@ namespace Draupnir
 			const Botan::TLS::Policy& policy) final override;
 
 		SocketHandle ConnectSocket() const;
-		void WriteToSocket(const std::vector<uint8_t>&& buf) const;
+		void Send(const uint8_t* data, size_t size);
+		void SendMessages();
+		void OnInput(const uint8_t* data, size_t size);
+		void OnInputOver();
+		// Read stdin which can't be polled, such as a regular file
+		void ReadInput();
+		void SendInputEof();
+		void OnChannelMessage(ChannelStream::MessageType type, uint16_t id, const uint8_t* payload, size_t size);
+		void SendBacklog(Channel& channel);
+		void OpenTransfer();
+		void SendFile(Channel& channel);
+		void ReportTransfer() const;
+		void CloseChannel(std::vector<Channel>::iterator channel);
+		void WriteOutput(Channel* channel, Output& out, const uint8_t* data, size_t size);
+		// Poll the output for writability only while there's something queued
+		void UpdateOutputInterest(Poller& poller, Output& out);
+		// Write the rest of the output before exit
+		void DrainOutput(Output& out);
+		// Read the socket or stdin, whatever is available
+		void ReadHandle(Poller& poller, int fd);
+		// The socket is left unread until the output catches up with it
+		bool IsOutputPaused() const
+		{
+			return m_stdout.queue.IsCongested() || m_stderr.queue.IsCongested();
+		}
+		// The input is left unread until the target catches up with it
+		bool IsInputPaused() const;
 	public:
 		virtual ~ControlConductor() = default;
-		void Run() final;
+		int Run() final;
 
 	protected:
 		friend class Conductor;
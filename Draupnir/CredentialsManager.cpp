@@ -9,28 +9,47 @@
 
 #include <botan/pkcs8.h>
 #include <botan/data_src.h>
+#include <botan/system_rng.h>
 
 #include <algorithm>
 #include <iterator>
 #include <sstream>
 
 // These are external references to the symbols created by OBJCOPY
-extern uint8_t _binary_key_rsa_start[];
-extern uint8_t _binary_key_rsa_end[];
-extern uint8_t _binary_cert_rsa_start[];
-extern uint8_t _binary_cert_rsa_end[];
+extern uint8_t _binary_key_pem_start[];
+extern uint8_t _binary_key_pem_end[];
+extern uint8_t _binary_cert_pem_start[];
+extern uint8_t _binary_cert_pem_end[];
 
-namespace Draupnir
+namespace
 {
-std::vector<uint8_t> certBuffer(_binary_cert_rsa_start, _binary_cert_rsa_end);
-std::vector<uint8_t> keyBuffer(_binary_key_rsa_start, _binary_key_rsa_end);
+	Botan::X509_Certificate LoadCertificate()
+	{
+		Botan::DataSource_Memory certDataSource(_binary_cert_pem_start,
+			static_cast<size_t>(_binary_cert_pem_end - _binary_cert_pem_start));
+		return Botan::X509_Certificate(certDataSource);
+	}
+} // namespace
 
+namespace Draupnir
+{
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-CredentialsManager::CredentialsManager()
-	: m_cert(certBuffer)
+CredentialsManager::CredentialsManager(Role role)
+	: m_role(role)
+	, m_cert(LoadCertificate())
+	, m_fingerprint(m_cert.fingerprint())
+	, m_trustedStore(m_cert)
 {
-	Botan::DataSource_Memory keyDataSource(keyBuffer);
+	if (Server != m_role)
+		return;
+
+	Botan::DataSource_Memory keyDataSource(_binary_key_pem_start,
+		static_cast<size_t>(_binary_key_pem_end - _binary_key_pem_start));
 	m_key = Botan::PKCS8::load_key(keyDataSource);
+
+	// Session tickets are encrypted with the key shared by the whole process,
+	// so a ticket issued by any reactor is accepted by all of them
+	m_ticketKey = Botan::SymmetricKey(Botan::system_rng(), 32);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -38,9 +57,9 @@ std::vector<Botan::Certificate_Store*> CredentialsManager::trusted_certificate_a
 	const std::string& type,
 	const std::string& context)
 {
-	Logger::GetInstance().Debug() << "trusted certificate authorities are requested for "
+	DEBUG_LOG << "trusted certificate authorities are requested for "
 		<< type << '/' << context;
-	return { new Botan::Certificate_Store_In_Memory(m_cert) };
+	return { &m_trustedStore };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -56,9 +75,9 @@ std::vector<Botan::X509_Certificate> CredentialsManager::cert_chain(
 	std::copy(certKeyTypes.begin(),
 		certKeyTypes.end(),
 		std::ostream_iterator<std::string>(buf, ", "));
-	Logger::GetInstance().Debug() << buf.str();
+	DEBUG_LOG << buf.str();
 
-	if ("tls-server" == type)
+	if ("tls-server" == type && Server == m_role)
 		result.push_back(m_cert);
 
 	return result;
@@ -70,12 +89,23 @@ Botan::Private_Key* CredentialsManager::private_key_for(
 	const std::string& type,
 	const std::string& context)
 {
-	Logger::GetInstance().Debug() << "private key is requested for " << type << '/'
-		<< context << ": " << cert.fingerprint();
+	DEBUG_LOG << "private key is requested for " << type << '/'
+		<< context << ": " << m_fingerprint;
 
-	if (m_cert == cert)
+	if (m_key && m_cert == cert)
 		return m_key.get();
 	else
 		return nullptr;
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+Botan::SymmetricKey CredentialsManager::psk(
+	const std::string& type,
+	const std::string& context,
+	const std::string& identity)
+{
+	if (Server == m_role && "tls-server" == type && "session-ticket" == context)
+		return m_ticketKey;
+	return Botan::Credentials_Manager::psk(type, context, identity);
+}
 } // namespace Draupnir
@@ -7,17 +7,30 @@
 #pragma once
 
 #include <botan/credentials_manager.h>
+#include <botan/certstor.h>
 #include <memory>
 
 namespace Draupnir
 {
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Embedded credentials, decoded once and shared by all the
+	/// 			TLS connections of the process. Nothing changes after the
+	/// 			construction, so the handshake threads use the instance
+	/// 			concurrently. The private key is decoded by the server only.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
 	class CredentialsManager final : public Botan::Credentials_Manager
 	{
-		Botan::X509_Certificate m_cert;
-		std::unique_ptr<Botan::Private_Key> m_key;
-
 	public:
-		CredentialsManager();
+		enum Role
+		{
+			Client,
+			Server
+		};
+
+		explicit CredentialsManager(Role role);
+		CredentialsManager(const CredentialsManager&) = delete;
+		CredentialsManager& operator =(const CredentialsManager&) = delete;
 
 		std::vector<Botan::Certificate_Store*> trusted_certificate_authorities(
 			const std::string& type,
@@ -30,5 +43,18 @@ namespace Draupnir
 			const Botan::X509_Certificate& cert,
 			const std::string& type,
 			const std::string& context) final override;
+		Botan::SymmetricKey psk(
+			const std::string& type,
+			const std::string& context,
+			const std::string& identity) final override;
+
+	private:
+		const Role m_role;
+		const Botan::X509_Certificate m_cert;
+		const std::string m_fingerprint;
+		Botan::Certificate_Store_In_Memory m_trustedStore;
+		// Set in the server role only
+		std::unique_ptr<Botan::Private_Key> m_key;
+		Botan::SymmetricKey m_ticketKey;
 	};
 } // namespace Draupnir
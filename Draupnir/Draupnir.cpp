@@ -20,11 +20,10 @@ try
 	std::shared_ptr<Config> config = std::make_shared<Config>(argc, argv);
 	std::shared_ptr<Conductor> conductor = Conductor::Create(config);
 
-	conductor->Run();
-	return EXIT_SUCCESS;
+	return conductor->Run();
 }
 catch(const std::exception& e)
 {
-	Draupnir::Logger::GetInstance().Error() << "terminated: " << e.what();
+	ERROR_LOG << "terminated: " << e.what();
 	return EXIT_FAILURE;
 }
@@ -0,0 +1,51 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/EpollPoller.cpp
+//
+// summary:	Implements the epoll-based poller
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "EpollPoller.h"
+
+#include <cerrno>
+#include <string>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	EpollPoller::EpollPoller()
+		: m_poll(epoll_create1(EPOLL_CLOEXEC))
+	{
+		if (!m_poll)
+			throw std::runtime_error("failed to create poll: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void EpollPoller::Add(int fd, uint32_t events, uint64_t data)
+	{
+		struct epoll_event event;
+		event.data.u64 = data;
+		event.events = events | EPOLLET;
+		POSIX_CHECK(epoll_ctl(m_poll.get(), EPOLL_CTL_ADD, fd, &event));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void EpollPoller::Modify(int fd, uint32_t events, uint64_t data)
+	{
+		struct epoll_event event;
+		event.data.u64 = data;
+		event.events = events | EPOLLET;
+		POSIX_CHECK(epoll_ctl(m_poll.get(), EPOLL_CTL_MOD, fd, &event));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void EpollPoller::Remove(int fd)
+	{
+		POSIX_CHECK(epoll_ctl(m_poll.get(), EPOLL_CTL_DEL, fd, nullptr));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int EpollPoller::Wait(struct epoll_event* events, int maxEvents, int timeoutMs)
+	{
+		return epoll_wait(m_poll.get(), events, maxEvents, timeoutMs);
+	}
+} // namespace Draupnir
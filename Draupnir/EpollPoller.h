@@ -0,0 +1,31 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/EpollPoller.h
+//
+// summary:	Declares the epoll-based poller
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Poller.h"
+#include "Posix.h"
+
+namespace Draupnir
+{
+	class EpollPoller final : public Poller
+	{
+		SocketHandle m_poll;
+
+	public:
+		EpollPoller();
+
+		void Add(int fd, uint32_t events, uint64_t data) override;
+		void Modify(int fd, uint32_t events, uint64_t data) override;
+		void Remove(int fd) override;
+		int Wait(struct epoll_event* events, int maxEvents, int timeoutMs) override;
+
+		const char* GetName() const override
+		{
+			return "epoll";
+		}
+	};
+} // namespace Draupnir
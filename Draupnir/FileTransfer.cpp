@@ -0,0 +1,355 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/FileTransfer.cpp
+//
+// summary:	Implements both ends of the file transfer channel
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "FileTransfer.h"
+#include "ChannelStream.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace
+{
+	// Files are read and written in chunks of this size: large enough to keep
+	// the system calls out of the profile, small enough to stay in the cache
+	// while hashed and framed
+	const size_t ChunkSize = 256 * 1024;
+	const char HashName[] = "SHA-256";
+	// A hashing task reads at most this much, so the transfers sharing the
+	// worker take turns
+	const uint64_t HashSlice = 16 * 1024 * 1024;
+	// Data messages a chunk is sent in
+	const size_t MaxChunkMessages = (ChunkSize + Draupnir::ChannelStream::MaxPayload - 1)
+		/ Draupnir::ChannelStream::MaxPayload;
+
+	// Read the whole range or throw, the file shouldn't shrink meanwhile
+	void ReadFully(int fd, uint8_t* data, size_t size, uint64_t position)
+	{
+		while (size)
+		{
+			const ssize_t count = pread(fd, data, size, static_cast<off_t>(position));
+			if (-1 == count && EINTR == errno)
+				continue;
+			if (-1 == count)
+				throw std::runtime_error("failed to read file: " + std::string(strerror(errno)));
+			if (0 == count)
+				throw std::runtime_error("file is truncated during the transfer");
+
+			data += count;
+			size -= static_cast<size_t>(count);
+			position += static_cast<uint64_t>(count);
+		}
+	}
+
+	// The same for the scattered read
+	void ReadFully(int fd, struct iovec* vectors, int count, uint64_t position)
+	{
+		while (count)
+		{
+			const ssize_t read = preadv(fd, vectors, count, static_cast<off_t>(position));
+			if (-1 == read && EINTR == errno)
+				continue;
+			if (-1 == read)
+				throw std::runtime_error("failed to read file: " + std::string(strerror(errno)));
+			if (0 == read)
+				throw std::runtime_error("file is truncated during the transfer");
+
+			// Skip the buffers filled and the filled part of the next one
+			position += static_cast<uint64_t>(read);
+			size_t rest = static_cast<size_t>(read);
+			for (; count && rest >= vectors->iov_len; ++vectors, --count)
+				rest -= vectors->iov_len;
+			if (count)
+			{
+				vectors->iov_base = static_cast<uint8_t*>(vectors->iov_base) + rest;
+				vectors->iov_len -= rest;
+			}
+		}
+	}
+
+	uint64_t GetRegularFileSize(int fd, const std::string& path)
+	{
+		struct stat info;
+		POSIX_CHECK(fstat(fd, &info));
+		if (!S_ISREG(info.st_mode))
+			throw std::runtime_error(path + " is not a regular file");
+		return static_cast<uint64_t>(info.st_size);
+	}
+} // namespace
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FileHash::FileHash(int fd)
+		: m_handle(fcntl(fd, F_DUPFD_CLOEXEC, 0))
+		, m_position(0)
+		, m_hash(Botan::HashFunction::create_or_throw(HashName))
+	{
+		if (!m_handle)
+			throw std::runtime_error("failed to duplicate file handle: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileHash::Update(uint64_t end)
+	{
+		m_buffer.resize(ChunkSize);
+		while (m_position < end)
+		{
+			const size_t chunk = static_cast<size_t>(std::min<uint64_t>(ChunkSize, end - m_position));
+			ReadFully(m_handle.get(), m_buffer.data(), chunk, m_position);
+			m_hash->update(m_buffer.data(), chunk);
+			m_position += chunk;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::vector<uint8_t> FileHash::Final()
+	{
+		std::vector<uint8_t>().swap(m_buffer);
+		return m_hash->final_stdvec();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FileSender::FileSender(const std::string& path)
+		: m_handle(open(path.c_str(), O_RDONLY | O_CLOEXEC))
+		, m_size(0)
+		, m_position(0)
+		, m_isStarted(false)
+		, m_isHashing(false)
+		, m_isDigestSent(false)
+	{
+		if (!m_handle)
+			throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+		m_size = GetRegularFileSize(m_handle.get(), path);
+		m_hash = std::make_shared<FileHash>(m_handle.get());
+
+		// The file is read once from the start to the end
+		posix_fadvise(m_handle.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileSender::Start(uint64_t offset)
+	{
+		if (m_isStarted)
+			throw std::runtime_error("file transfer is already started");
+		if (offset > m_size)
+			throw std::runtime_error("receiver has " + std::to_string(offset) + " bytes of the file of "
+				+ std::to_string(m_size) + " bytes");
+
+		m_position = offset;
+		m_isStarted = true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::function<void()> FileSender::StartHashing()
+	{
+		// The file is complete, it's hashed slice by slice up to the end
+		m_isHashing = true;
+		const std::shared_ptr<FileHash> hash = m_hash;
+		const uint64_t end = std::min(m_size, m_hash->GetPosition() + HashSlice);
+		return [hash, end]() { hash->Update(end); };
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	size_t FileSender::Append(std::vector<uint8_t>& output, uint16_t channel, uint64_t window)
+	{
+		if (!m_isStarted || m_isDigestSent)
+			return 0;
+
+		size_t appended = 0;
+		while (m_position < m_size && appended < window)
+		{
+			const size_t chunk = static_cast<size_t>(std::min<uint64_t>({
+				ChunkSize, m_size - m_position, window - appended }));
+			AppendChunk(output, channel, chunk);
+			m_position += chunk;
+			appended += chunk;
+		}
+
+		if (m_position == m_size && !m_isHashing && m_hash->GetPosition() == m_size)
+		{
+			const std::vector<uint8_t> digest = m_hash->Final();
+			ChannelStream::Append(output, ChannelStream::Digest, channel, digest.data(), digest.size());
+			m_isDigestSent = true;
+		}
+		return appended;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileSender::AppendChunk(std::vector<uint8_t>& output, uint16_t channel, size_t size)
+	{
+		// The messages are laid out first and the chunk is scattered into their
+		// payloads. A mapping would save even this copy, but a file truncated
+		// by someone else during the transfer would kill the process with SIGBUS
+		const size_t start = output.size();
+		const size_t messages = (size + ChannelStream::MaxPayload - 1) / ChannelStream::MaxPayload;
+		output.reserve(start + size + messages * ChannelStream::HeaderSize);
+
+		struct iovec vectors[MaxChunkMessages];
+		for (size_t idx = 0, rest = size; idx < messages; ++idx)
+		{
+			const size_t payload = std::min(rest, ChannelStream::MaxPayload);
+			vectors[idx].iov_base = ChannelStream::AppendHeader(output, ChannelStream::Data, channel, payload);
+			vectors[idx].iov_len = payload;
+			rest -= payload;
+		}
+
+		try
+		{
+			ReadFully(m_handle.get(), vectors, static_cast<int>(messages), m_position);
+		}
+		catch (...)
+		{
+			// The messages without the data must not be sent
+			output.resize(start);
+			throw;
+		}
+	}
+
+	const char FileReceiver::PartSuffix[] = ".draupnir-part";
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FileReceiver::FileReceiver(const std::string& path)
+		: m_path(path)
+		, m_partPath(path + PartSuffix)
+		, m_offset(OpenFile())
+		, m_size(0)
+		, m_isSizeKnown(false)
+		, m_position(m_offset)
+		, m_hash(std::make_shared<FileHash>(m_handle.get()))
+		, m_isHashing(false)
+		, m_isDigestReceived(false)
+	{
+		m_buffer.reserve(ChunkSize);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t FileReceiver::OpenFile()
+	{
+		// The destination is only replaced at the end, but the transfer
+		// shouldn't go all the way to find it can't be
+		struct stat info;
+		if (0 == stat(m_path.c_str(), &info) && !S_ISREG(info.st_mode))
+			throw std::runtime_error(m_path + " is not a regular file");
+
+		m_handle.reset(open(m_partPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+		if (!m_handle)
+			throw std::runtime_error("failed to open " + m_partPath + ": " + strerror(errno));
+		return GetRegularFileSize(m_handle.get(), m_partPath);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileReceiver::SetSize(uint64_t size)
+	{
+		if (m_isSizeKnown)
+			throw std::runtime_error("size of the file is already known");
+		if (size < m_offset)
+		{
+			// Left by the transfer of another file, the next attempt starts over
+			POSIX_CHECK(ftruncate(m_handle.get(), 0));
+			throw std::runtime_error(m_partPath + " of " + std::to_string(m_offset)
+				+ " bytes is larger than the sent file of " + std::to_string(size) + " bytes, it's discarded");
+		}
+
+		m_size = size;
+		m_isSizeKnown = true;
+		if (size == m_offset)
+			return;
+
+		// Reserve the blocks at once to keep the file contiguous and to fail
+		// early without the space. The size is left as is, so an interrupted
+		// transfer still resumes from the data actually written
+		if (-1 == fallocate(m_handle.get(), FALLOC_FL_KEEP_SIZE, static_cast<off_t>(m_offset),
+			static_cast<off_t>(size - m_offset)))
+		{
+			if (EOPNOTSUPP != errno)
+				throw std::runtime_error("failed to allocate " + std::to_string(size - m_offset) + " bytes: "
+					+ strerror(errno));
+			DEBUG_LOG << "file system doesn't support preallocation";
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileReceiver::Write(const uint8_t* data, size_t size)
+	{
+		if (!m_isSizeKnown)
+			throw std::runtime_error("file data is received before its size");
+		if (m_position + m_buffer.size() + size > m_size)
+			throw std::runtime_error("more data is received than the size of the file");
+
+		m_buffer.insert(m_buffer.end(), data, data + size);
+		if (m_buffer.size() >= ChunkSize)
+			Flush();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileReceiver::Flush()
+	{
+		size_t written = 0;
+		while (written < m_buffer.size())
+		{
+			const ssize_t count = pwrite(m_handle.get(), m_buffer.data() + written, m_buffer.size() - written,
+				static_cast<off_t>(m_position + written));
+			if (-1 == count && EINTR == errno)
+				continue;
+			if (-1 == count)
+				throw std::runtime_error("failed to write file: " + std::string(strerror(errno)));
+			written += static_cast<size_t>(count);
+		}
+		m_position += written;
+		m_buffer.clear();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::function<void()> FileReceiver::StartHashing()
+	{
+		// The data received before is part of the digest, it's hashed first
+		m_isHashing = true;
+		const std::shared_ptr<FileHash> hash = m_hash;
+		const uint64_t end = std::min(m_position, m_hash->GetPosition() + HashSlice);
+		return [hash, end]() { hash->Update(end); };
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FileReceiver::SetDigest(const uint8_t* digest, size_t size)
+	{
+		if (m_isDigestReceived)
+			throw std::runtime_error("digest of the file is already received");
+		Flush();
+		if (!m_isSizeKnown || m_position != m_size)
+			throw std::runtime_error("file is incomplete, " + std::to_string(m_position) + " of "
+				+ std::to_string(m_size) + " bytes received");
+
+		m_digest.assign(digest, digest + size);
+		m_isDigestReceived = true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool FileReceiver::Finish()
+	{
+		if (!IsOver())
+			throw std::runtime_error("file is not hashed yet");
+
+		if (m_hash->Final() != m_digest)
+		{
+			POSIX_CHECK(ftruncate(m_handle.get(), 0));
+			return false;
+		}
+
+		if (-1 == rename(m_partPath.c_str(), m_path.c_str()))
+			throw std::runtime_error("failed to move " + m_partPath + " to " + m_path + ": " + strerror(errno));
+		return true;
+	}
+} // namespace Draupnir
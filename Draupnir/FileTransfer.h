@@ -0,0 +1,220 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/FileTransfer.h
+//
+// summary:	Declares both ends of the file transfer channel
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+
+#include <botan/hash.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Digest of the transferred file, computed by reading the file
+	/// 			back rather than on the way of the data. The hash keeps its
+	/// 			own handle of the file, so it can be updated on another
+	/// 			thread while the transfer goes on, one update at a time.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class FileHash
+	{
+	public:
+		explicit FileHash(int fd);
+		FileHash(const FileHash&) = delete;
+		FileHash& operator =(const FileHash&) = delete;
+
+		// Part of the file hashed so far
+		uint64_t GetPosition() const noexcept
+		{
+			return m_position;
+		}
+
+		// Hash the file from the position up to the end
+		void Update(uint64_t end);
+		std::vector<uint8_t> Final();
+
+	private:
+		SocketHandle m_handle;
+		uint64_t m_position;
+		std::vector<uint8_t> m_buffer;
+		std::unique_ptr<Botan::HashFunction> m_hash;
+	};
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Sending end of the file transfer. The file is read in large
+	/// 			chunks, each by a single system call straight into the
+	/// 			payloads of the channel messages, while the whole of it is
+	/// 			hashed aside, the part the receiver already has included,
+	/// 			and the digest follows the data once both are over.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class FileSender
+	{
+	public:
+		explicit FileSender(const std::string& path);
+		FileSender(const FileSender&) = delete;
+		FileSender& operator =(const FileSender&) = delete;
+
+		uint64_t GetSize() const noexcept
+		{
+			return m_size;
+		}
+
+		// Send the file from the offset the receiver has reported
+		void Start(uint64_t offset);
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Appends the data messages of the file within the window,
+		/// 			followed by the digest message once the file is over
+		/// 			and hashed.
+		/// </summary>
+		///
+		/// <returns>	The amount of the file data appended. </returns>
+		////////////////////////////////////////////////////////////////////////////
+		size_t Append(std::vector<uint8_t>& output, uint16_t channel, uint64_t window);
+
+		// The file is started and not hashed yet, nor is it being hashed
+		bool IsHashingDue() const noexcept
+		{
+			return m_isStarted && !m_isHashing && m_hash->GetPosition() < m_size;
+		}
+
+		// Task hashing the next slice of the file, may be run on any thread.
+		// OnHashed() is called on the thread of the transfer once it's over
+		std::function<void()> StartHashing();
+
+		void OnHashed() noexcept
+		{
+			m_isHashing = false;
+		}
+
+		bool IsStarted() const noexcept
+		{
+			return m_isStarted;
+		}
+
+		// Offset of the next data to send
+		uint64_t GetPosition() const noexcept
+		{
+			return m_position;
+		}
+
+		// The digest is appended, nothing more to send
+		bool IsOver() const noexcept
+		{
+			return m_isDigestSent;
+		}
+
+	private:
+		SocketHandle m_handle;
+		uint64_t m_size;
+		uint64_t m_position;
+		bool m_isStarted;
+		bool m_isHashing;
+		bool m_isDigestSent;
+		std::shared_ptr<FileHash> m_hash;
+
+		// Read the next chunk of the file straight into the data messages
+		void AppendChunk(std::vector<uint8_t>& output, uint16_t channel, size_t size);
+	};
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Receiving end of the file transfer. The data goes to a part
+	/// 			file next to the destination, which replaces it only once
+	/// 			the digest matches, so an existing file is never taken for
+	/// 			the start of the transfer. A part file left by a transfer
+	/// 			interrupted before is resumed from its size. The rest of
+	/// 			the file is preallocated once the size is known and written
+	/// 			in large chunks, which are hashed aside after they are
+	/// 			written. A part file failing the digest check is truncated,
+	/// 			so the next attempt starts over.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class FileReceiver
+	{
+	public:
+		explicit FileReceiver(const std::string& path);
+		FileReceiver(const FileReceiver&) = delete;
+		FileReceiver& operator =(const FileReceiver&) = delete;
+
+		// Part files are named after the destination with this suffix
+		static const char PartSuffix[];
+
+		// Size of the part file before the transfer, the sender resumes from there
+		uint64_t GetOffset() const noexcept
+		{
+			return m_offset;
+		}
+
+		// Data received by this transfer
+		uint64_t GetReceived() const noexcept
+		{
+			return m_position + m_buffer.size() - m_offset;
+		}
+
+		void SetSize(uint64_t size);
+		void Write(const uint8_t* data, size_t size);
+
+		// The hash is behind the written data and isn't being updated
+		bool IsHashingDue() const noexcept
+		{
+			return !m_isHashing && m_hash->GetPosition() < m_position;
+		}
+
+		// Task hashing the next slice of the data written so far, may be run
+		// on any thread. OnHashed() is called on the thread of the transfer
+		// once it's over
+		std::function<void()> StartHashing();
+
+		void OnHashed() noexcept
+		{
+			m_isHashing = false;
+		}
+
+		// Write the rest of the data and keep the digest of the sender until
+		// the whole file is hashed
+		void SetDigest(const uint8_t* digest, size_t size);
+
+		// The digest is received and the whole file is hashed
+		bool IsOver() const noexcept
+		{
+			return m_isDigestReceived && !m_isHashing && m_hash->GetPosition() == m_size;
+		}
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Checks the digest of the whole file, which is moved to
+		/// 			the destination if valid.
+		/// </summary>
+		///
+		/// <returns>	true if the file matches the digest of the sender. </returns>
+		////////////////////////////////////////////////////////////////////////////
+		bool Finish();
+
+	private:
+		const std::string m_path;
+		const std::string m_partPath;
+		SocketHandle m_handle;
+		const uint64_t m_offset;
+		uint64_t m_size;
+		bool m_isSizeKnown;
+		// Position of the buffered data in the file
+		uint64_t m_position;
+		std::vector<uint8_t> m_buffer;
+		std::shared_ptr<FileHash> m_hash;
+		bool m_isHashing;
+		std::vector<uint8_t> m_digest;
+		bool m_isDigestReceived;
+
+		uint64_t OpenFile();
+		void Flush();
+	};
+} // namespace Draupnir
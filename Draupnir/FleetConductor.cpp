@@ -0,0 +1,248 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/FleetConductor.cpp
+//
+// summary:	Implements the fleet conductor class
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "FleetConductor.h"
+#include "CompressedStream.h"
+#include "Config.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace
+{
+	// Without the command the input is run as a script
+	const char ScriptCommand[] = "/bin/sh";
+	// Resolutions in progress at once, the threads mostly wait for the DNS
+	const size_t MaxResolvers = 8;
+} // namespace
+
+namespace Draupnir
+{
+	const uint64_t FleetConductor::MailboxToken;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FleetConductor::FleetConductor(std::shared_ptr<Config> config)
+		: Conductor(config)
+		, m_policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange())
+		, m_creds(CredentialsManager::Client)
+		, m_protocols(CompressedStream::GetOfferedProtocols(GetConfig().IsCompressionEnabled()))
+		, m_command(GetConfig().GetCommand().empty() ? ScriptCommand : GetConfig().GetCommand())
+		, m_poller(Poller::Create(GetConfig().GetPollerBackend()))
+		, m_context{ *m_poller, m_buffers, m_policy, m_creds, m_protocols,
+			GetConfig().GetSessionCache(), m_command, m_input }
+		, m_succeeded(0)
+		, m_failed(0)
+		, m_nextResolved(0)
+		, m_isStopping(false)
+	{
+		// The results are the output, the log shouldn't get in between
+		Logger::GetInstance().SetConsoleHandle(STDERR_FILENO);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FleetConductor::~FleetConductor()
+	{
+		StopResolvers();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::ReadInput()
+	{
+		// Every target gets the same input, so it's read once before connecting
+		if (isatty(STDIN_FILENO))
+			INFO_LOG << "reading the input for the targets, end it with Ctrl-D";
+
+		uint8_t buffer[64 * 1024];
+		while (true)
+		{
+			const ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+			if (-1 == count && EINTR == errno)
+				continue;
+			if (-1 == count)
+				throw std::runtime_error("input read error: " + std::string(strerror(errno)));
+			if (0 == count)
+				break;
+			m_input.insert(m_input.end(), buffer, buffer + count);
+		}
+		DEBUG_LOG << m_input.size() << " bytes of input are read";
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::StartResolvers()
+	{
+		const size_t count = std::min(MaxResolvers, GetConfig().GetFleet().size());
+		m_resolvers.reserve(count);
+		for (size_t idx = 0; idx < count; ++idx)
+			m_resolvers.emplace_back(&FleetConductor::Resolve, this);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::StopResolvers()
+	{
+		// The resolutions in progress are waited for, the rest is skipped
+		m_isStopping.store(true, std::memory_order_relaxed);
+		for (auto& thread : m_resolvers)
+			thread.join();
+		m_resolvers.clear();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::Resolve()
+	{
+		const auto& fleet = GetConfig().GetFleet();
+		while (!m_isStopping.load(std::memory_order_relaxed))
+		{
+			const size_t token = m_nextResolved.fetch_add(1, std::memory_order_relaxed);
+			if (token >= fleet.size())
+				return;
+
+			std::shared_ptr<FleetSession::Address> address =
+				std::make_shared<FleetSession::Address>(FleetSession::Resolve(fleet[token]));
+			m_mailbox.Post([this, token, address]() { m_resolved.emplace_back(token, address); });
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::StartSessions()
+	{
+		// A target slow to resolve doesn't hold back the ones after it
+		const auto& fleet = GetConfig().GetFleet();
+		while (!m_resolved.empty() && m_sessions.size() < GetConfig().GetParallelism())
+		{
+			// The index in the list is the token of the session in the poller,
+			// so the events of the finished sessions are never misrouted
+			const uint64_t token = m_resolved.front().first;
+			const std::shared_ptr<FleetSession::Address> address = std::move(m_resolved.front().second);
+			m_resolved.pop_front();
+			std::unique_ptr<FleetSession> session(
+				new FleetSession(fleet[token], std::move(*address), token, m_context));
+			if (session->IsOver())
+				Report(*session);
+			else
+				m_sessions.emplace(token, std::move(session));
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::ExpireSessions()
+	{
+		const auto timeout = GetConfig().GetHostTimeout();
+		if (0 == timeout.count())
+			return;
+
+		const auto now = std::chrono::steady_clock::now();
+		for (auto& session : m_sessions)
+		{
+			if (now - session.second->GetStartTime() >= timeout)
+				session.second->Abort("timed out after " + std::to_string(timeout.count()) + " s");
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::ReapSessions()
+	{
+		for (auto session = m_sessions.begin(); session != m_sessions.end(); )
+		{
+			if (!session->second->IsOver())
+			{
+				++session;
+				continue;
+			}
+			Report(*session->second);
+			session = m_sessions.erase(session);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetConductor::Report(FleetSession& session)
+	{
+		session.Dispose();
+		if (0 == session.GetExitStatus())
+			++m_succeeded;
+		else
+			++m_failed;
+
+		// The results are streamed as the targets finish
+		std::cout << session.GetResult() << std::endl;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int FleetConductor::GetWaitTimeout() const
+	{
+		const auto timeout = GetConfig().GetHostTimeout();
+		if (0 == timeout.count() || m_sessions.empty())
+			return -1;
+
+		auto deadline = std::chrono::steady_clock::time_point::max();
+		for (const auto& session : m_sessions)
+			deadline = std::min(deadline, session.second->GetStartTime() + timeout);
+
+		// Round up not to wake up right before the deadline
+		const auto left = deadline - std::chrono::steady_clock::now();
+		const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+		return static_cast<int>(std::max<decltype(ms)>(ms, 0));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int FleetConductor::Run()
+	{
+		INFO_LOG << "Draupnir is started in fleet mode";
+		DEBUG_LOG << "using " << m_poller->GetName() << " for event notification";
+
+		ReadInput();
+
+		const auto& fleet = GetConfig().GetFleet();
+		const auto start = std::chrono::steady_clock::now();
+		m_poller->Add(m_mailbox.GetHandle(), EPOLLIN, MailboxToken);
+		StartResolvers();
+
+		std::vector<struct epoll_event> events(256);
+		while (m_succeeded + m_failed < fleet.size())
+		{
+			const int numEvents = m_poller->Wait(events.data(), static_cast<int>(events.size()), GetWaitTimeout());
+			if (-1 == numEvents && EINTR == errno)
+				continue;
+			POSIX_CHECK(numEvents);
+
+			for (int idx = 0; idx < numEvents; ++idx)
+			{
+				if (MailboxToken == events[idx].data.u64)
+				{
+					m_mailbox.Dispatch();
+					continue;
+				}
+
+				// Events of the session disposed of in this round are dropped
+				const auto session = m_sessions.find(events[idx].data.u64);
+				if (m_sessions.end() != session)
+					session->second->OnEvent(events[idx].events);
+			}
+
+			ExpireSessions();
+			ReapSessions();
+			StartSessions();
+		}
+		StopResolvers();
+
+		const double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(
+			std::chrono::steady_clock::now() - start).count();
+		INFO_LOG << fleet.size() << " targets done in " << elapsed << " s: " << m_succeeded << " succeeded, "
+			<< m_failed << " failed";
+
+		const auto& stats = m_buffers.GetStats();
+		DEBUG_LOG << "buffers: " << stats.acquired << " acquired, " << stats.allocated
+			<< " allocated, " << stats.cached << " cached";
+
+		return m_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+} // namespace Draupnir
@@ -0,0 +1,87 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/FleetConductor.h
+//
+// summary:	Declares the fleet conductor class
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "BufferPool.h"
+#include "Conductor.h"
+#include "TLSPolicy.h"
+#include "CredentialsManager.h"
+#include "FleetSession.h"
+#include "Mailbox.h"
+#include "Poller.h"
+
+#include <atomic>
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Runs the same command on many targets from a single event
+	/// 			loop. The targets are resolved ahead by a few threads, as
+	/// 			the resolver blocks, and connected in the order they are
+	/// 			resolved as the slots free up, up to the configured number
+	/// 			at once. Every one of them gets the whole input. The result
+	/// 			of each target is printed as a JSON line once it's over,
+	/// 			stdout is left to the results.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class FleetConductor final : public Conductor
+	{
+		BufferPool m_buffers;
+		const TLSPolicy m_policy;
+		CredentialsManager m_creds;
+		const std::vector<std::string> m_protocols;
+		std::string m_command;
+		std::vector<uint8_t> m_input;
+		std::unique_ptr<Poller> m_poller;
+		const FleetSession::Context m_context;
+
+		// Sessions in progress by the index of their target in the list
+		std::unordered_map<uint64_t, std::unique_ptr<FleetSession>> m_sessions;
+		unsigned m_succeeded;
+		unsigned m_failed;
+
+		// Resolver threads take the targets in turn and post the addresses
+		// back to the event loop, which starts the sessions from the queue
+		Mailbox m_mailbox;
+		std::deque<std::pair<uint64_t, std::shared_ptr<FleetSession::Address>>> m_resolved;
+		std::atomic<size_t> m_nextResolved;
+		std::atomic<bool> m_isStopping;
+		std::vector<std::thread> m_resolvers;
+
+		// Poller token of the mailbox, the targets have their indices
+		static const uint64_t MailboxToken = ~0ull;
+
+		void ReadInput();
+		void StartResolvers();
+		void StopResolvers();
+		void Resolve();
+		void StartSessions();
+		void ExpireSessions();
+		void ReapSessions();
+		// Print the result of the session and dispose of it
+		void Report(FleetSession& session);
+		// Time until the first session in progress runs out of it, -1 if unlimited
+		int GetWaitTimeout() const;
+
+	public:
+		virtual ~FleetConductor();
+		int Run() final;
+
+	protected:
+		friend class Conductor;
+		FleetConductor(std::shared_ptr<Config> config);
+	};
+} // namespace Draupnir
@@ -0,0 +1,611 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/FleetSession.cpp
+//
+// summary:	Implements the connection to one target of the fleet
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "FleetSession.h"
+#include "CredentialsManager.h"
+#include "TLSPolicy.h"
+#include "ThreadRNG.h"
+#include "Poller.h"
+#include "Logger.h"
+
+#include <botan/base64.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+namespace
+{
+	// Length of the well-formed UTF-8 sequence at the position, 0 if there's none
+	size_t GetSequenceLength(const std::string& value, size_t pos)
+	{
+		const auto byte = [&value](size_t idx) { return static_cast<unsigned char>(value[idx]); };
+		const unsigned char lead = byte(pos);
+		if (lead < 0x80)
+			return 1;
+
+		size_t length = 0;
+		unsigned char low = 0x80;
+		unsigned char high = 0xBF;
+		if (lead >= 0xC2 && lead <= 0xDF)
+		{
+			length = 2;
+		}
+		else if (lead >= 0xE0 && lead <= 0xEF)
+		{
+			// Neither the overlong forms nor the surrogates
+			length = 3;
+			low = 0xE0 == lead ? 0xA0 : 0x80;
+			high = 0xED == lead ? 0x9F : 0xBF;
+		}
+		else if (lead >= 0xF0 && lead <= 0xF4)
+		{
+			// Neither the overlong forms nor the code points above U+10FFFF
+			length = 4;
+			low = 0xF0 == lead ? 0x90 : 0x80;
+			high = 0xF4 == lead ? 0x8F : 0xBF;
+		}
+		if (0 == length || value.size() - pos < length || byte(pos + 1) < low || byte(pos + 1) > high)
+			return 0;
+		for (size_t idx = 2; idx < length; ++idx)
+		{
+			if (byte(pos + idx) < 0x80 || byte(pos + idx) > 0xBF)
+				return 0;
+		}
+		return length;
+	}
+
+	bool IsText(const std::string& value)
+	{
+		for (size_t pos = 0, length = 0; pos < value.size(); pos += length)
+		{
+			length = GetSequenceLength(value, pos);
+			if (0 == length)
+				return false;
+		}
+		return true;
+	}
+
+	// Append the string as a JSON string literal, the bytes that aren't UTF-8
+	// are replaced, JSON has no room for them
+	void AppendString(std::ostringstream& out, const std::string& value)
+	{
+		out << '"';
+		for (size_t pos = 0, length = 0; pos < value.size(); pos += length)
+		{
+			length = GetSequenceLength(value, pos);
+			if (0 == length)
+			{
+				out << "\\ufffd";
+				length = 1;
+				continue;
+			}
+			if (length > 1)
+			{
+				out.write(value.data() + pos, static_cast<std::streamsize>(length));
+				continue;
+			}
+
+			const char c = value[pos];
+			switch (c)
+			{
+			case '"':
+				out << "\\\"";
+				break;
+			case '\\':
+				out << "\\\\";
+				break;
+			case '\n':
+				out << "\\n";
+				break;
+			case '\r':
+				out << "\\r";
+				break;
+			case '\t':
+				out << "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char escaped[8];
+					snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+					out << escaped;
+				}
+				else
+				{
+					out << c;
+				}
+			}
+		}
+		out << '"';
+	}
+
+	// Append the output of the command as the field of the name, in base64
+	// unless it's text, and the field telling which one it is
+	void AppendOutput(std::ostringstream& out, const char* name, const std::string& value)
+	{
+		const bool isText = IsText(value);
+		out << ",\"" << name << "\":";
+		if (isText)
+			AppendString(out, value);
+		else
+			out << '"' << Botan::base64_encode(reinterpret_cast<const uint8_t*>(value.data()), value.size()) << '"';
+		out << ",\"" << name << "_base64\":" << (isText ? "false" : "true");
+	}
+
+	// Milliseconds between the points, null if the later one is never reached
+	void AppendInterval(std::ostringstream& out, std::chrono::steady_clock::time_point from,
+		std::chrono::steady_clock::time_point to)
+	{
+		if (to.time_since_epoch().count() == 0)
+		{
+			out << "null";
+			return;
+		}
+		out << std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() / 1000.0;
+	}
+} // namespace
+
+namespace Draupnir
+{
+	const size_t FleetSession::MaxOutput;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FleetSession::FleetSession(const std::string& host, Address&& address, uint64_t token, const Context& context)
+		: m_host(host)
+		, m_hostName(address.hostName)
+		, m_port(address.port)
+		, m_token(token)
+		, m_context(context)
+		, m_outbound(context.buffers)
+		, m_events(0)
+		, m_addresses(std::move(address.list))
+		, m_nextAddress(m_addresses.get())
+		, m_sessionStore(context.sessionCache)
+		, m_sendWindow(0)
+		, m_inputSent(0)
+		, m_isEofSent(false)
+		, m_pendingCredit(0)
+		, m_isTruncated(false)
+		, m_exitStatus(-1)
+		, m_isResumed(false)
+		, m_isOver(false)
+		, m_startTime(std::chrono::steady_clock::now())
+	{
+		if (!address.error.empty())
+		{
+			Finish(address.error);
+			return;
+		}
+
+		try
+		{
+			if (!Connect())
+				Finish();
+		}
+		catch (const std::exception& e)
+		{
+			Finish(e.what());
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	FleetSession::Address FleetSession::Resolve(const std::string& host)
+	{
+		Address address;
+
+		// The port goes after the last colon, IPv6 addresses may be given in brackets
+		const auto portPos = host.rfind(':');
+		if (std::string::npos == portPos || 0 == portPos)
+		{
+			address.error = "target address should be in form \"host:port\"";
+			return address;
+		}
+
+		address.hostName = host.substr(0, portPos);
+		if (address.hostName.size() > 2 && '[' == address.hostName.front() && ']' == address.hostName.back())
+			address.hostName = address.hostName.substr(1, address.hostName.size() - 2);
+
+		const std::string port = host.substr(portPos + 1);
+		char* end = nullptr;
+		const unsigned long number = strtoul(port.c_str(), &end, 10);
+		if (port.empty() || *end || 0 == number || number > 65535)
+		{
+			address.error = "invalid port of the target: " + port;
+			return address;
+		}
+		address.port = static_cast<uint16_t>(number);
+
+		struct addrinfo hints = {};
+		hints.ai_flags = AI_NUMERICSERV;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* res = nullptr;
+		const int err = getaddrinfo(address.hostName.c_str(), port.c_str(), &hints, &res);
+		if (0 != err)
+			address.error = "failed to get address of " + host + ": " + gai_strerror(err);
+		address.list.reset(res);
+		return address;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool FleetSession::Connect()
+	{
+		for (; m_nextAddress; m_nextAddress = m_nextAddress->ai_next)
+		{
+			const struct addrinfo* addr = m_nextAddress;
+			m_socket.reset(socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+			if (!m_socket)
+			{
+				m_error = "failed to create socket: " + std::string(strerror(errno));
+				continue;
+			}
+
+			if (-1 == connect(m_socket.get(), addr->ai_addr, addr->ai_addrlen) && EINPROGRESS != errno)
+			{
+				m_error = "failed to connect: " + std::string(strerror(errno));
+				m_socket.reset();
+				continue;
+			}
+
+			// The socket becomes writable once the connection is either
+			// established or refused
+			m_nextAddress = m_nextAddress->ai_next;
+			m_events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+			m_context.poller.Add(m_socket.get(), m_events, m_token);
+			return true;
+		}
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::OnEvent(uint32_t events)
+	{
+		if (m_isOver)
+			return;
+
+		try
+		{
+			if (!m_tls)
+			{
+				int error = 0;
+				socklen_t errorLen = sizeof(error);
+				POSIX_CHECK(getsockopt(m_socket.get(), SOL_SOCKET, SO_ERROR, &error, &errorLen));
+				if (error)
+				{
+					// Try the rest of the addresses of the target
+					m_error = "failed to connect: " + std::string(strerror(error));
+					Dispose();
+					if (!Connect())
+						Finish();
+					return;
+				}
+				if (!(events & EPOLLOUT))
+					return;
+				OnConnected();
+			}
+			else
+			{
+				if (events & EPOLLOUT)
+					m_outbound.Flush(m_socket.get());
+				if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					OnReadable();
+			}
+
+			if (!m_isOver)
+				UpdateInterest();
+		}
+		catch (const std::exception& e)
+		{
+			Finish(e.what());
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::OnConnected()
+	{
+		m_connectTime = std::chrono::steady_clock::now();
+		m_error.clear();
+		DEBUG_LOG << "connected to " << m_host;
+
+		// The client sends its hello right on construction
+		m_tls.reset(new Botan::TLS::Client(*this, m_sessionStore, m_context.creds, m_context.policy,
+			ThreadRNG::GetInstance(), Botan::TLS::Server_Information(m_hostName, m_port),
+			Botan::TLS::Protocol_Version::latest_tls_version(), m_context.protocols));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::OnReadable()
+	{
+		// The socket is polled in edge-triggered mode, read everything available
+		while (!m_isOver)
+		{
+			const ssize_t count = m_context.buffers.Read(m_socket.get(), [this](const uint8_t* data, size_t size)
+			{
+				m_tls->received_data(data, size);
+			});
+			if (-1 == count)
+			{
+				if (EAGAIN == errno)
+					break;
+				if (EINTR == errno)
+					continue;
+				throw std::runtime_error("socket read error: " + std::string(strerror(errno)));
+			}
+			if (0 == count)
+			{
+				// The exit status is all that matters once it's received
+				const bool isComplete = m_tls->is_closed() || m_exitStatus >= 0;
+				Finish(isComplete ? std::string() : "connection is closed by the target");
+				return;
+			}
+		}
+
+		if (m_tls->is_closed())
+			Finish();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::UpdateInterest()
+	{
+		// Wait for the socket to become writable only while there's something to write
+		const uint32_t wanted = EPOLLIN | EPOLLRDHUP | (m_outbound.IsEmpty() ? 0u : EPOLLOUT);
+		if (wanted == m_events)
+			return;
+		m_context.poller.Modify(m_socket.get(), wanted, m_token);
+		m_events = wanted;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::SendMessages()
+	{
+		const uint8_t* data = m_messages.data();
+		size_t size = m_messages.size();
+		if (m_compression)
+		{
+			m_sentFrames.clear();
+			m_compression->Encode(data, size, m_sentFrames);
+			data = m_sentFrames.data();
+			size = m_sentFrames.size();
+		}
+		m_tls->send(data, size);
+		m_messages.clear();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::SendInput()
+	{
+		// The input is already in memory, only the window of the target limits it
+		const std::vector<uint8_t>& input = m_context.input;
+		const size_t count = static_cast<size_t>(std::min<uint64_t>(input.size() - m_inputSent, m_sendWindow));
+		if (count)
+		{
+			ChannelStream::AppendData(m_messages, 0, input.data() + m_inputSent, count);
+			m_sendWindow -= count;
+			m_inputSent += count;
+		}
+		if (input.size() == m_inputSent && !m_isEofSent)
+		{
+			ChannelStream::Append(m_messages, ChannelStream::Eof, 0);
+			m_isEofSent = true;
+		}
+		if (!m_messages.empty())
+			SendMessages();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::Collect(std::string& stream, const uint8_t* data, size_t size)
+	{
+		const size_t kept = std::min(size, MaxOutput - stream.size());
+		stream.append(data, data + kept);
+		if (kept < size)
+			m_isTruncated = true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::Abort(const std::string& reason)
+	{
+		Finish(reason);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::Finish(const std::string& error)
+	{
+		if (m_isOver)
+			return;
+
+		if (!error.empty())
+			m_error = error;
+		m_isOver = true;
+		m_endTime = std::chrono::steady_clock::now();
+
+		if (m_error.empty())
+			DEBUG_LOG << m_host << " is done with status " << m_exitStatus;
+		else
+			DEBUG_LOG << m_host << " failed: " << m_error;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::Dispose()
+	{
+		if (!m_socket)
+			return;
+
+		// Best effort to deliver the close notification
+		if (m_tls && m_tls->is_closed() && !m_outbound.IsEmpty())
+		{
+			try
+			{
+				m_outbound.Flush(m_socket.get());
+			}
+			catch (const std::exception& e)
+			{
+				DEBUG_LOG << "failed to close the connection to " << m_host << ": " << e.what();
+			}
+		}
+		m_context.poller.Remove(m_socket.get());
+		m_socket.reset();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::string FleetSession::GetResult() const
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3);
+		out << "{\"host\":";
+		AppendString(out, m_host);
+		out << ",\"status\":";
+		if (m_exitStatus < 0)
+			out << "null";
+		else
+			out << m_exitStatus;
+		out << ",\"error\":";
+		if (m_error.empty())
+			out << "null";
+		else
+			AppendString(out, m_error);
+		out << ",\"resumed\":" << (m_isResumed ? "true" : "false");
+		out << ",\"connect_ms\":";
+		AppendInterval(out, m_startTime, m_connectTime);
+		out << ",\"handshake_ms\":";
+		AppendInterval(out, m_connectTime, m_handshakeTime);
+		out << ",\"total_ms\":";
+		AppendInterval(out, m_startTime, m_endTime);
+		out << ",\"truncated\":" << (m_isTruncated ? "true" : "false");
+		AppendOutput(out, "stdout", m_output);
+		AppendOutput(out, "stderr", m_errorOutput);
+		out << '}';
+		return out.str();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::tls_session_activated()
+	{
+		m_handshakeTime = std::chrono::steady_clock::now();
+		if (m_tls->application_protocol() == CompressedStream::CompressedProtocol)
+			m_compression.reset(new CompressedStream());
+
+		// The command runs over a channel, the raw stream has no exit status
+		if (m_tls->application_protocol().empty())
+		{
+			m_error = "target doesn't support channels";
+			m_tls->close();
+			return;
+		}
+
+		ChannelStream::AppendOpen(m_messages, 0, ChannelStream::InitialWindow,
+			ChannelStream::ExecKind, m_context.command);
+		SendMessages();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::tls_record_received(
+		uint64_t seqNo __attribute__((unused)),
+		const uint8_t data[],
+		size_t size)
+	{
+		if (m_compression)
+		{
+			m_receivedData.clear();
+			m_compression->Decode(data, size, m_receivedData);
+			data = m_receivedData.data();
+			size = m_receivedData.size();
+		}
+
+		m_channelStream.Read(data, size,
+			[this](ChannelStream::MessageType type, uint16_t id, const uint8_t* payload, size_t length)
+			{
+				// The only channel is opened by this end
+				if (0 == id)
+					OnChannelMessage(type, payload, length);
+			});
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::OnChannelMessage(ChannelStream::MessageType type, const uint8_t* payload, size_t size)
+	{
+		switch (type)
+		{
+		case ChannelStream::Confirm:
+		case ChannelStream::Window:
+			m_sendWindow += ChannelStream::ReadValue(payload, size);
+			SendInput();
+			break;
+		case ChannelStream::Data:
+		case ChannelStream::ErrorData:
+			Collect(ChannelStream::Data == type ? m_output : m_errorOutput, payload, size);
+			// The dropped output is consumed as well, the command shouldn't stall on it
+			m_pendingCredit += static_cast<uint32_t>(size);
+			if (m_pendingCredit >= ChannelStream::CreditThreshold)
+			{
+				ChannelStream::AppendValue(m_messages, ChannelStream::Window, 0, m_pendingCredit);
+				m_pendingCredit = 0;
+				SendMessages();
+			}
+			break;
+		case ChannelStream::Exit:
+			m_exitStatus = static_cast<int>(ChannelStream::ReadValue(payload, size));
+			break;
+		case ChannelStream::Keepalive:
+			ChannelStream::Append(m_messages, ChannelStream::Keepalive, 0);
+			SendMessages();
+			break;
+		case ChannelStream::Close:
+			if (size)
+				m_error = std::string(payload, payload + size);
+			else if (m_exitStatus < 0)
+				m_error = "channel is closed before the command exited";
+			m_tls->close();
+			break;
+		default:
+			throw std::runtime_error("unexpected channel message " + std::to_string(type));
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::tls_emit_data(const uint8_t data[], size_t size)
+	{
+		m_outbound.Write(m_socket.get(), data, size);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::tls_alert(Botan::TLS::Alert alert)
+	{
+		if (Botan::TLS::Alert::CLOSE_NOTIFY == alert.type())
+			m_tls->close();
+		else if (m_error.empty())
+			m_error = "TLS alert: " + alert.type_string();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool FleetSession::tls_session_established(const Botan::TLS::Session& session)
+	{
+		m_isResumed = m_sessionStore.IsResumed(session);
+		DEBUG_LOG << (m_isResumed ? "resumed" : "full") << " TLS handshake with " << m_host
+			<< " completed using " << session.ciphersuite().to_string();
+		return true; // enable caching of the session in the configured session manager
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void FleetSession::tls_verify_cert_chain(
+		const std::vector<Botan::X509_Certificate>& certChain __attribute__((unused)),
+		const std::vector<std::shared_ptr<const Botan::OCSP::Response>>& ocspResponses __attribute__((unused)),
+		const std::vector<Botan::Certificate_Store*>& trustedRoots __attribute__((unused)),
+		Botan::Usage_Type usage __attribute__((unused)),
+		const std::string& hostname __attribute__((unused)),
+		const Botan::TLS::Policy& policy __attribute__((unused)))
+	{
+	}
+} // namespace Draupnir
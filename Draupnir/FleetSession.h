@@ -0,0 +1,176 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/FleetSession.h
+//
+// summary:	Declares the connection to one target of the fleet
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+#include "BufferPool.h"
+#include "OutboundQueue.h"
+#include "SessionStore.h"
+#include "CompressedStream.h"
+#include "ChannelStream.h"
+
+#include <botan/tls_client.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+
+namespace Draupnir
+{
+	class Poller;
+	class TLSPolicy;
+	class CredentialsManager;
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Connection to one target of the fleet running the command
+	/// 			over an exec channel. The socket is connected without
+	/// 			blocking and driven by the event loop shared by the whole
+	/// 			fleet. The output is collected up to the limit, the result
+	/// 			is taken once the session is over.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class FleetSession final : private Botan::TLS::Callbacks
+	{
+	public:
+		// Everything the sessions of the fleet share
+		struct Context
+		{
+			Poller& poller;
+			BufferPool& buffers;
+			const TLSPolicy& policy;
+			CredentialsManager& creds;
+			const std::vector<std::string>& protocols;
+			const std::string& sessionCache;
+			const std::string& command;
+			// Input broadcast to every command
+			const std::vector<uint8_t>& input;
+		};
+
+		// Host name, port and addresses of the target, or the reason they
+		// couldn't be found
+		struct Address
+		{
+			std::string hostName;
+			uint16_t port;
+			std::unique_ptr<struct addrinfo, void(*)(struct addrinfo*)> list;
+			std::string error;
+
+			Address()
+				: port(0)
+				, list(nullptr, freeaddrinfo)
+			{}
+		};
+
+		// Output of a stream kept for the result, the rest is dropped
+		static const size_t MaxOutput = 1024 * 1024;
+
+		// Find the addresses of the target as given in the list. It takes as
+		// long as the resolver does, so it's meant to run off the event loop
+		static Address Resolve(const std::string& host);
+
+		FleetSession(const std::string& host, Address&& address, uint64_t token, const Context& context);
+		FleetSession(const FleetSession&) = delete;
+		FleetSession& operator =(const FleetSession&) = delete;
+
+		// Handle the events of the socket registered with the token
+		void OnEvent(uint32_t events);
+		// Give up on the target, the reason goes to the result
+		void Abort(const std::string& reason);
+		// Stop polling the socket and close it, the session is disposed before destroyed
+		void Dispose();
+
+		bool IsOver() const noexcept
+		{
+			return m_isOver;
+		}
+
+		// Exit status of the command, -1 if it never got to exit
+		int GetExitStatus() const noexcept
+		{
+			return m_exitStatus;
+		}
+
+		std::chrono::steady_clock::time_point GetStartTime() const noexcept
+		{
+			return m_startTime;
+		}
+
+		// Result of the session as a single line of JSON, the output that isn't
+		// UTF-8 goes in base64 and is flagged so
+		std::string GetResult() const;
+
+	private:
+		// Target as given in the list, its host name and port
+		const std::string m_host;
+		std::string m_hostName;
+		uint16_t m_port;
+		const uint64_t m_token;
+		const Context& m_context;
+		SocketHandle m_socket;
+		OutboundQueue m_outbound;
+		uint32_t m_events;
+
+		// Addresses of the target tried in turn until one accepts the connection
+		std::unique_ptr<struct addrinfo, void(*)(struct addrinfo*)> m_addresses;
+		const struct addrinfo* m_nextAddress;
+
+		SessionStore m_sessionStore;
+		std::unique_ptr<Botan::TLS::Client> m_tls;
+		std::unique_ptr<CompressedStream> m_compression;
+		std::vector<uint8_t> m_sentFrames;
+		std::vector<uint8_t> m_receivedData;
+		ChannelStream m_channelStream;
+		std::vector<uint8_t> m_messages;
+
+		// Input the target is ready to receive and the part of it already sent
+		uint64_t m_sendWindow;
+		size_t m_inputSent;
+		bool m_isEofSent;
+		uint32_t m_pendingCredit;
+
+		std::string m_output;
+		std::string m_errorOutput;
+		bool m_isTruncated;
+		int m_exitStatus;
+		std::string m_error;
+		bool m_isResumed;
+		bool m_isOver;
+
+		const std::chrono::steady_clock::time_point m_startTime;
+		std::chrono::steady_clock::time_point m_connectTime;
+		std::chrono::steady_clock::time_point m_handshakeTime;
+		std::chrono::steady_clock::time_point m_endTime;
+
+		// Botan::TLS::Callbacks implementation
+		void tls_session_activated() final override;
+		void tls_record_received(uint64_t seqNo, const uint8_t data[], size_t size) final override;
+		void tls_emit_data(const uint8_t data[], size_t size) final override;
+		void tls_alert(Botan::TLS::Alert alert) final override;
+		bool tls_session_established(const Botan::TLS::Session& session) final override;
+		void tls_verify_cert_chain(const std::vector<Botan::X509_Certificate>& certChain,
+			const std::vector<std::shared_ptr<const Botan::OCSP::Response>>& ocspResponses,
+			const std::vector<Botan::Certificate_Store*>& trustedRoots,
+			Botan::Usage_Type usage,
+			const std::string& hostname,
+			const Botan::TLS::Policy& policy) final override;
+
+		// Start connecting to the next address, false if none is left
+		bool Connect();
+		void OnConnected();
+		void OnReadable();
+		void OnChannelMessage(ChannelStream::MessageType type, const uint8_t* payload, size_t size);
+		void SendInput();
+		void SendMessages();
+		void Collect(std::string& stream, const uint8_t* data, size_t size);
+		void Finish(const std::string& error = std::string());
+		void UpdateInterest();
+	};
+} // namespace Draupnir
@@ -0,0 +1,96 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/HandshakePool.cpp
+//
+// summary:	Implements the pool of threads running the TLS handshakes
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "HandshakePool.h"
+#include "Logger.h"
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	HandshakePool::HandshakePool(unsigned threads, unsigned maxHandshakes)
+		: m_maxHandshakes(maxHandshakes)
+		, m_inFlight(0)
+		, m_stopping(false)
+	{
+		m_threads.reserve(threads);
+		for (unsigned idx = 0; idx < threads; ++idx)
+			m_threads.emplace_back(&HandshakePool::Work, this);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	HandshakePool::~HandshakePool()
+	{
+		Stop();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void HandshakePool::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+			m_tasks.clear();
+		}
+		m_wakeup.notify_all();
+
+		for (auto& thread : m_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	HandshakePool::Ticket HandshakePool::Admit()
+	{
+		unsigned inFlight = m_inFlight.load(std::memory_order_relaxed);
+		do
+		{
+			if (inFlight >= m_maxHandshakes)
+				return Ticket();
+		}
+		while (!m_inFlight.compare_exchange_weak(inFlight, inFlight + 1, std::memory_order_acquire));
+		return Ticket(this);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void HandshakePool::Submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+		}
+		m_wakeup.notify_one();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void HandshakePool::Work()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wakeup.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+				if (m_stopping)
+					return;
+
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			// Tasks report their own failures, anything else must not kill the thread
+			try
+			{
+				task();
+			}
+			catch (const std::exception& e)
+			{
+				ERROR_LOG << "handshake task failed: " << e.what();
+			}
+		}
+	}
+} // namespace Draupnir
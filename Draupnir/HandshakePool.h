@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/HandshakePool.h
+//
+// summary:	Declares the pool of threads running the TLS handshakes
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Threads running the CPU-heavy part of the TLS handshakes, so
+	/// 			the reactors keep serving the established sessions during a
+	/// 			burst of connections. The pool also caps the number of the
+	/// 			handshakes in progress: a connection is admitted only while
+	/// 			a ticket is available. Without threads the handshakes run on
+	/// 			the reactors and the pool only admits them.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class HandshakePool
+	{
+	public:
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Move-only admission of a single handshake, returned to
+		/// 			the pool on destruction.
+		/// </summary>
+		////////////////////////////////////////////////////////////////////////////
+		class Ticket
+		{
+			friend class HandshakePool;
+			HandshakePool* m_pool;
+
+			explicit Ticket(HandshakePool* pool)
+				: m_pool(pool)
+			{}
+
+		public:
+			Ticket()
+				: m_pool(nullptr)
+			{}
+
+			Ticket(Ticket&& other) noexcept
+				: m_pool(other.m_pool)
+			{
+				other.m_pool = nullptr;
+			}
+
+			Ticket& operator =(Ticket&& other) noexcept
+			{
+				if (this != &other)
+				{
+					Reset();
+					m_pool = other.m_pool;
+					other.m_pool = nullptr;
+				}
+				return *this;
+			}
+
+			~Ticket()
+			{
+				Reset();
+			}
+
+			void Reset()
+			{
+				if (m_pool)
+					m_pool->m_inFlight.fetch_sub(1, std::memory_order_release);
+				m_pool = nullptr;
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return nullptr != m_pool;
+			}
+		};
+
+		HandshakePool(unsigned threads, unsigned maxHandshakes);
+		HandshakePool(const HandshakePool&) = delete;
+		HandshakePool& operator =(const HandshakePool&) = delete;
+		~HandshakePool();
+
+		// Admit one more handshake, returns an empty ticket over the limit
+		Ticket Admit();
+		// Run the task on one of the threads
+		void Submit(std::function<void()> task);
+		// Wait for the tasks in progress and stop the threads, the queued tasks
+		// are dropped. The tickets may still be returned afterwards
+		void Stop();
+
+		// Handshakes are run by the reactors themselves
+		bool IsInline() const noexcept
+		{
+			return m_threads.empty();
+		}
+
+		unsigned GetInFlight() const noexcept
+		{
+			return m_inFlight.load(std::memory_order_relaxed);
+		}
+
+	private:
+		const unsigned m_maxHandshakes;
+		std::atomic<unsigned> m_inFlight;
+		std::mutex m_mutex;
+		std::condition_variable m_wakeup;
+		std::deque<std::function<void()>> m_tasks;
+		bool m_stopping;
+		std::vector<std::thread> m_threads;
+
+		void Work();
+	};
+} // namespace Draupnir
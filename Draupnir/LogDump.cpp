@@ -0,0 +1,308 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/LogDump.cpp
+//
+// summary:	entry point of the decoder of the binary logs
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "BinaryLog.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+	using Draupnir::BinaryLog;
+
+	// Larger records are taken for a broken file
+	const uint32_t MaxRecord = 16 * 1024 * 1024;
+
+	const char* const LevelNames[] = { "debug", "info", "error" };
+
+	struct Format
+	{
+		uint8_t level;
+		int32_t line;
+		std::string file;
+		std::string text;
+	};
+
+	// Append the string as a JSON string literal, the bytes above ASCII go as is
+	void AppendString(std::ostringstream& out, const char* value, size_t size)
+	{
+		out << '"';
+		for (const char c : std::string(value, size))
+		{
+			switch (c)
+			{
+			case '"':
+				out << "\\\"";
+				break;
+			case '\\':
+				out << "\\\\";
+				break;
+			case '\n':
+				out << "\\n";
+				break;
+			case '\r':
+				out << "\\r";
+				break;
+			case '\t':
+				out << "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char escaped[8];
+					snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+					out << escaped;
+				}
+				else
+				{
+					out << c;
+				}
+			}
+		}
+		out << '"';
+	}
+
+	void AppendString(std::ostringstream& out, const std::string& value)
+	{
+		AppendString(out, value.data(), value.size());
+	}
+
+	// The same stamp as the text log has
+	std::string FormatTime(int64_t nanoseconds)
+	{
+		const std::time_t second = static_cast<std::time_t>(nanoseconds / 1000000000);
+		std::tm brokenTime;
+		localtime_r(&second, &brokenTime);
+		char stamp[32];
+		std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &brokenTime);
+		char text[48];
+		snprintf(text, sizeof(text), "%s.%03ld", stamp, static_cast<long>(nanoseconds % 1000000000 / 1000000));
+		return text;
+	}
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Decodes the records of a binary log into the lines of the
+	/// 			text log or into JSON lines, one per message.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class LogDecoder
+	{
+	public:
+		explicit LogDecoder(bool isJson)
+			: m_isJson(isJson)
+			, m_clockOffset(0)
+		{}
+
+		void Decode(std::istream& input, const std::string& name)
+		{
+			BinaryLog::FileHeader header;
+			if (!input.read(reinterpret_cast<char*>(&header), sizeof(header))
+				|| 0 != memcmp(header.magic, BinaryLog::Magic, sizeof(header.magic)))
+				throw std::runtime_error(name + " is not a binary log of Draupnir");
+			if (BinaryLog::ByteOrder != header.byteOrder)
+				throw std::runtime_error(name + " is written on a host of another byte order");
+			if (BinaryLog::Version != header.version)
+				throw std::runtime_error(name + " is of unsupported version " + std::to_string(header.version));
+
+			// Every file defines its own formats
+			m_formats.clear();
+			m_clockOffset = 0;
+
+			BinaryLog::RecordHeader record;
+			std::vector<uint8_t> body;
+			while (input.read(reinterpret_cast<char*>(&record), sizeof(record)))
+			{
+				if (record.size > MaxRecord)
+					throw std::runtime_error(name + " is broken: record of " + std::to_string(record.size) + " bytes");
+				body.resize(record.size);
+				if (!input.read(reinterpret_cast<char*>(body.data()), record.size))
+					break;
+				DecodeRecord(record, body.data(), body.size());
+			}
+
+			// The process may be gone in the middle of a write
+			if (input.gcount())
+				std::cerr << name << " ends with an incomplete record" << std::endl;
+		}
+
+	private:
+		const bool m_isJson;
+		int64_t m_clockOffset;
+		std::unordered_map<uint32_t, Format> m_formats;
+
+		void DecodeRecord(const BinaryLog::RecordHeader& record, const uint8_t* body, size_t size)
+		{
+			switch (record.type)
+			{
+			case BinaryLog::Clock:
+				if (size >= sizeof(m_clockOffset))
+					memcpy(&m_clockOffset, body, sizeof(m_clockOffset));
+				break;
+			case BinaryLog::Format:
+				DecodeFormat(record, body, size);
+				break;
+			case BinaryLog::Event:
+				DecodeEvent(record, body, size);
+				break;
+			case BinaryLog::Text:
+				Print(record, std::string(reinterpret_cast<const char*>(body), size), nullptr, nullptr, 0);
+				break;
+			default:
+				// The records of the later versions are skipped
+				break;
+			}
+		}
+
+		void DecodeFormat(const BinaryLog::RecordHeader& record, const uint8_t* body, size_t size)
+		{
+			uint32_t id = 0;
+			Format format;
+			format.level = record.level;
+			if (size < sizeof(id) + sizeof(format.line))
+				return;
+			memcpy(&id, body, sizeof(id));
+			memcpy(&format.line, body + sizeof(id), sizeof(format.line));
+
+			// Both strings are null-terminated
+			const char* const strings = reinterpret_cast<const char*>(body + sizeof(id) + sizeof(format.line));
+			const size_t length = size - sizeof(id) - sizeof(format.line);
+			const char* const fileEnd = static_cast<const char*>(memchr(strings, '\0', length));
+			if (!fileEnd)
+				return;
+			format.file.assign(strings, fileEnd);
+			const char* const textEnd = static_cast<const char*>(memchr(fileEnd + 1, '\0', strings + length - fileEnd - 1));
+			format.text.assign(fileEnd + 1, textEnd ? textEnd : strings + length);
+			m_formats[id] = std::move(format);
+		}
+
+		void DecodeEvent(const BinaryLog::RecordHeader& record, const uint8_t* body, size_t size)
+		{
+			uint32_t id = 0;
+			if (size < sizeof(id))
+				return;
+			memcpy(&id, body, sizeof(id));
+			const auto format = m_formats.find(id);
+			if (m_formats.end() == format)
+			{
+				Print(record, "event of unknown format " + std::to_string(id), nullptr, nullptr, 0);
+				return;
+			}
+
+			std::string message;
+			BinaryLog::Render(message, format->second.text.c_str(), body + sizeof(id), size - sizeof(id));
+			Print(record, message, &format->second, body + sizeof(id), size - sizeof(id));
+		}
+
+		void Print(const BinaryLog::RecordHeader& record, const std::string& message, const Format* format,
+			const uint8_t* arguments, size_t size)
+		{
+			const int64_t time = record.time + m_clockOffset;
+			if (!m_isJson)
+			{
+				std::cout << FormatTime(time) << ' ' << message << '\n';
+				return;
+			}
+
+			std::ostringstream out;
+			out << "{\"time\":";
+			AppendString(out, FormatTime(time));
+			out << ",\"ns\":" << time << ",\"level\":";
+			AppendString(out, record.level < sizeof(LevelNames) / sizeof(LevelNames[0])
+				? std::string(LevelNames[record.level]) : std::to_string(record.level));
+			out << ",\"message\":";
+			AppendString(out, message);
+			if (format)
+			{
+				out << ",\"format\":";
+				AppendString(out, format->text);
+				out << ",\"file\":";
+				AppendString(out, format->file);
+				out << ",\"line\":" << format->line << ",\"args\":[";
+
+				const uint8_t* const end = arguments + size;
+				BinaryLog::Argument argument;
+				for (bool isFirst = true; BinaryLog::ReadArgument(arguments, end, argument); isFirst = false)
+				{
+					if (!isFirst)
+						out << ',';
+					if (BinaryLog::String == argument.type)
+					{
+						AppendString(out, argument.text, argument.size);
+					}
+					else if (BinaryLog::Character == argument.type)
+					{
+						AppendString(out, &argument.character, 1);
+					}
+					else if (BinaryLog::Boolean == argument.type)
+					{
+						out << (argument.boolean ? "true" : "false");
+					}
+					else
+					{
+						std::string value;
+						BinaryLog::AppendArgument(value, argument);
+						// NaN and infinities have no JSON form
+						out << (value.find_first_of("ni") == std::string::npos ? value : "null");
+					}
+				}
+				out << ']';
+			}
+			out << "}\n";
+			std::cout << out.str();
+		}
+	};
+
+	[[noreturn]] void ExitWithHelp(int status)
+	{
+		std::cout << "Usage: draupnir-logdump [--json] file...\n\n"
+			<< "Decodes the binary logs written by draupnir --binary-log into the text log,\n"
+			<< "or into a JSON line per message with --json\n";
+		exit(status);
+	}
+} // namespace
+
+int main(int argc, char* const argv[])
+try
+{
+	bool isJson = false;
+	std::vector<std::string> files;
+	for (int idx = 1; idx < argc; ++idx)
+	{
+		if (0 == strcmp(argv[idx], "--json"))
+			isJson = true;
+		else if (0 == strcmp(argv[idx], "-h") || 0 == strcmp(argv[idx], "--help"))
+			ExitWithHelp(EXIT_SUCCESS);
+		else
+			files.push_back(argv[idx]);
+	}
+	if (files.empty())
+		ExitWithHelp(EXIT_FAILURE);
+
+	LogDecoder decoder(isJson);
+	for (const std::string& name : files)
+	{
+		std::ifstream input(name, std::ios::binary);
+		if (!input)
+			throw std::runtime_error("failed to open " + name + ": " + strerror(errno));
+		decoder.Decode(input, name);
+	}
+	return EXIT_SUCCESS;
+}
+catch(const std::exception& e)
+{
+	std::cerr << "draupnir-logdump: " << e.what() << std::endl;
+	return EXIT_FAILURE;
+}
@@ -6,18 +6,322 @@
 
 #include "Logger.h"
 
-#include <iostream>
-#include <iomanip>
+#include <algorithm>
 #include <cassert>
-#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
-#include <mutex>
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 
 namespace Draupnir
 {
+	//////////////////////////////////////////////////////////////////////////
+	/// <summary>
+	///   Ring of the messages of a single thread. The thread is the only
+	///   producer and the writer is the only consumer, so the positions are
+	///   the only shared state. A message is a header followed by the text
+	///   or the record of the event, the one that doesn't fit the end of the
+	///   ring starts over from the beginning.
+	/// </summary>
+	//////////////////////////////////////////////////////////////////////////
+	class LogRing
+	{
+	public:
+		struct Header
+		{
+			// Steady clock in nanoseconds
+			int64_t time;
+			uint32_t size;
+			// LOG_NONE marks the rest of the ring as unused
+			uint16_t level;
+			uint16_t isEvent;
+		};
+
+		static const size_t Capacity = 256 * 1024;
+		// Longer messages are cut
+		static const size_t MaxMessage = Capacity / 16;
+
+		LogRing()
+			: m_buffer(new uint8_t[Capacity])
+			, m_isRetired(false)
+			, m_head(0)
+			, m_tail(0)
+		{}
+
+		// Called by the thread owning the ring, false if there's no room
+		bool Push(LogLevel level, bool isEvent, int64_t time, const void* data, size_t size)
+		{
+			size = std::min(size, MaxMessage);
+			const size_t total = GetRecordSize(size);
+			size_t head = m_head.load(std::memory_order_relaxed);
+			const size_t tail = m_tail.load(std::memory_order_acquire);
+			const size_t left = Capacity - (head & (Capacity - 1));
+			if (Capacity - (head - tail) < total + (left < total ? left : 0))
+				return false;
+
+			if (left < total)
+			{
+				if (left >= sizeof(Header))
+					WriteHeader(head, LOG_NONE, false, 0, 0);
+				head += left;
+			}
+
+			WriteHeader(head, level, isEvent, time, size);
+			memcpy(&m_buffer[(head & (Capacity - 1)) + sizeof(Header)], data, size);
+			m_head.store(head + total, std::memory_order_release);
+			return true;
+		}
+
+		// Called by the writer, the data is valid during the call only
+		template<typename Handler>
+		size_t Drain(Handler&& handler)
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			const size_t head = m_head.load(std::memory_order_acquire);
+			size_t count = 0;
+			while (tail != head)
+			{
+				const size_t offset = tail & (Capacity - 1);
+				Header header;
+				if (Capacity - offset >= sizeof(Header))
+					memcpy(&header, &m_buffer[offset], sizeof(header));
+				if (Capacity - offset < sizeof(Header) || LOG_NONE == header.level)
+				{
+					tail += Capacity - offset;
+					continue;
+				}
+
+				handler(static_cast<LogLevel>(header.level), 0 != header.isEvent, header.time,
+					&m_buffer[offset + sizeof(Header)], header.size);
+				tail += GetRecordSize(header.size);
+				++count;
+			}
+			m_tail.store(tail, std::memory_order_release);
+			return count;
+		}
+
+		// The thread is over, the ring goes once it's drained
+		void Retire() noexcept
+		{
+			m_isRetired.store(true, std::memory_order_release);
+		}
+
+		bool IsRetired() const noexcept
+		{
+			return m_isRetired.load(std::memory_order_acquire);
+		}
+
+	private:
+		const std::unique_ptr<uint8_t[]> m_buffer;
+		std::atomic<bool> m_isRetired;
+		// Positions only grow, the offsets are taken modulo the capacity.
+		// They are a cache line apart not to bounce it between the threads,
+		// the over-aligned new is beyond C++14
+		std::atomic<size_t> m_head;
+		char m_padding[64 - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> m_tail;
+
+		static size_t GetRecordSize(size_t size) noexcept
+		{
+			const size_t alignment = alignof(Header);
+			return (sizeof(Header) + size + alignment - 1) & ~(alignment - 1);
+		}
+
+		void WriteHeader(size_t position, LogLevel level, bool isEvent, int64_t time, size_t size) noexcept
+		{
+			Header header;
+			header.time = time;
+			header.size = static_cast<uint32_t>(size);
+			header.level = static_cast<uint16_t>(level);
+			header.isEvent = isEvent ? 1 : 0;
+			memcpy(&m_buffer[position & (Capacity - 1)], &header, sizeof(header));
+		}
+	};
+
+	const size_t LogRing::Capacity;
+	const size_t LogRing::MaxMessage;
+} // namespace Draupnir
+
+namespace
+{
+	// Time the writer sleeps once the rings are empty
+	const std::chrono::milliseconds WriterPeriod(10);
+	// Number of the messages passed to a single writev()
+	const size_t MaxMessagesPerWrite = 256;
+	// The clock offset is written to the binary log once it drifts this far
+	const int64_t ClockDrift = 1000000;
+
+	int64_t GetNanoseconds(std::chrono::nanoseconds time)
+	{
+		return static_cast<int64_t>(time.count());
+	}
+
+	// Time the messages are stamped with
+	int64_t GetSteadyTime()
+	{
+		return GetNanoseconds(std::chrono::steady_clock::now().time_since_epoch());
+	}
+
+	// Ring of the thread, retired on its exit
+	struct RingHolder
+	{
+		std::shared_ptr<Draupnir::LogRing> ring;
+
+		~RingHolder()
+		{
+			if (ring)
+				ring->Retire();
+		}
+	};
+
+	thread_local RingHolder ThreadRing;
+} // namespace
+
+namespace Draupnir
+{
+	const size_t Logger::MessagePrinter::InlineSize;
+	std::atomic<LogLevel> Logger::s_threshold(LOG_INFO);
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter::MessagePrinter(MessagePrinter&& other)
+		: m_parent(other.m_parent)
+		, m_level(other.m_level)
+		, m_isActive(other.m_isActive)
+		, m_size(other.m_size)
+		, m_overflow(std::move(other.m_overflow))
+	{
+		memcpy(m_text, other.m_text, m_size);
+		other.m_isActive = false;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter::~MessagePrinter()
+	{
+		if (!m_isActive)
+			return;
+		if (m_overflow.empty())
+			m_parent.PutMessage(m_level, m_text, m_size);
+		else
+			m_parent.PutMessage(m_level, m_overflow.data(), m_overflow.size());
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::MessagePrinter::Append(const char* text, size_t size)
+	{
+		if (m_overflow.empty() && m_size + size <= InlineSize)
+		{
+			memcpy(m_text + m_size, text, size);
+			m_size += size;
+			return;
+		}
+
+		if (m_overflow.empty())
+			m_overflow.assign(m_text, m_size);
+		m_overflow.append(text, size);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::MessagePrinter::AppendInteger(unsigned long long value, bool isNegative)
+	{
+		char digits[24];
+		char* position = digits + sizeof(digits);
+		do
+		{
+			*--position = static_cast<char>('0' + value % 10);
+			value /= 10;
+		}
+		while (value);
+		if (isNegative)
+			*--position = '-';
+		Append(position, digits + sizeof(digits) - position);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(const std::string& data)
+	{
+		Append(data.data(), data.size());
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(const char* data)
+	{
+		if (data)
+			Append(data, strlen(data));
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(char data)
+	{
+		Append(&data, 1);
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(int data)
+	{
+		return *this << static_cast<long long>(data);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(unsigned data)
+	{
+		AppendInteger(data, false);
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(long data)
+	{
+		return *this << static_cast<long long>(data);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(unsigned long data)
+	{
+		AppendInteger(data, false);
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(long long data)
+	{
+		// The magnitude of the lowest value doesn't fit the signed type
+		const bool isNegative = data < 0;
+		const unsigned long long magnitude = isNegative
+			? 0ull - static_cast<unsigned long long>(data) : static_cast<unsigned long long>(data);
+		AppendInteger(magnitude, isNegative);
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(unsigned long long data)
+	{
+		AppendInteger(data, false);
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::MessagePrinter& Logger::MessagePrinter::operator <<(double data)
+	{
+		// The same as the default precision of the streams
+		char text[32];
+		const int size = snprintf(text, sizeof(text), "%g", data);
+		if (size > 0)
+			Append(text, std::min(static_cast<size_t>(size), sizeof(text) - 1));
+		return *this;
+	}
+
 	//////////////////////////////////////////////////////////////////////////
 	Logger& Logger::GetInstance()
 	{
@@ -28,13 +332,66 @@ namespace Draupnir
 	//////////////////////////////////////////////////////////////////////////
 	Logger::Logger()
 		: m_consoleLevel(LOG_INFO)
+		, m_consoleHandle(STDOUT_FILENO)
 		, m_fileLevel(LOG_NONE)
-	{}
+		, m_binaryLevel(LOG_NONE)
+		, m_dropped(0)
+		, m_reportedDropped(0)
+		, m_stampSecond(0)
+		, m_clockOffset(0)
+		, m_isClockDefined(false)
+		, m_definedClockOffset(0)
+		, m_isStopping(false)
+	{
+		m_stamp[0] = '\0';
+
+		// The writer is started with all the signals blocked, so none is ever
+		// delivered to it: the logger may be created before SIGCHLD is blocked
+		// for the target, and the signal would be discarded by this thread
+		sigset_t signals, previous;
+		sigfillset(&signals);
+		pthread_sigmask(SIG_SETMASK, &signals, &previous);
+		try
+		{
+			m_writer = std::thread(&Logger::Work, this);
+		}
+		catch (...)
+		{
+			pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+			throw;
+		}
+		pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	Logger::~Logger()
+	{
+		// The writer drains the rings before it stops
+		{
+			std::lock_guard<std::mutex> lock(m_wakeupLock);
+			m_isStopping = true;
+		}
+		m_wakeup.notify_one();
+		m_writer.join();
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::UpdateThreshold() noexcept
+	{
+		s_threshold.store(std::min<LogLevel>({ m_consoleLevel, m_fileLevel, m_binaryLevel }), std::memory_order_relaxed);
+	}
 
 	//////////////////////////////////////////////////////////////////////////
 	void Logger::EnableConsoleChannel(LogLevel level)
 	{
 		m_consoleLevel = level;
+		UpdateThreshold();
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::SetConsoleHandle(int fd)
+	{
+		m_consoleHandle = fd;
 	}
 
 	//////////////////////////////////////////////////////////////////////////
@@ -42,48 +399,70 @@ namespace Draupnir
 	{
 		if (LOG_NONE == level)
 		{
-			if (m_logFile.is_open())
-				m_logFile.close();
 			m_fileLevel = level;
+			m_logFile.reset();
+			UpdateThreshold();
 			return;
 		}
 
-		if (m_logFile.is_open())
+		if (m_logFile)
 		{
 			return;
 		}
 
-		try
+		const std::time_t timeNow = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+		std::tm brokenTime;
+		localtime_r(&timeNow, &brokenTime);
+		char timebuf[64];
+		std::strftime(&timebuf[0], sizeof(timebuf), "-%Y-%m-%dT%H%M%S", &brokenTime);
+		const std::string logName = "draupnir-" + std::to_string(getpid()) + timebuf + ".log";
+
+		const int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_APPEND);
+		m_logFile.reset(open(logName.c_str(), flags, 0644));
+		if (!m_logFile)
 		{
-			std::string logName;
-			{
-				const std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-				const std::time_t timeNow = std::chrono::system_clock::to_time_t(now);
-				std::tm brokenTime;
-				localtime_r(&timeNow, &brokenTime);
-
-				std::ostringstream buf;
-				char timebuf[64];
-				std::strftime(&timebuf[0], sizeof(timebuf), "-%Y-%m-%dT%H%M%S", &brokenTime);
-				buf << "draupnir-" << getpid() << timebuf << ".log";
-				logName = std::move(buf.str());
-			}
+			ERROR_LOG << "failed to open log file \"" << logName << "\" for writing: " << strerror(errno);
+		}
+		else
+		{
+			m_fileLevel = level;
+			UpdateThreshold();
+		}
+	}
 
-			const std::ios_base::openmode mode = std::ios::out | (overwrite ? std::ios::trunc : std::ios::app);
-			m_logFile.open(logName.c_str(), mode);
-			if (!m_logFile.is_open())
-			{
-				Error() << "failed to open log file \"" << logName << "\" for writing";
-			}
-			else
-			{
-				m_fileLevel = level;
-			}
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::EnableBinaryChannel(LogLevel level)
+	{
+		if (LOG_NONE == level || m_binaryFile)
+		{
+			// The file stays open, the writer may be writing it
+			m_binaryLevel = m_binaryFile ? level : LOG_NONE;
+			UpdateThreshold();
+			return;
 		}
-		catch (const std::exception& e)
+
+		const std::time_t timeNow = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+		std::tm brokenTime;
+		localtime_r(&timeNow, &brokenTime);
+		char timebuf[64];
+		std::strftime(&timebuf[0], sizeof(timebuf), "-%Y-%m-%dT%H%M%S", &brokenTime);
+		const std::string logName = "draupnir-" + std::to_string(getpid()) + timebuf + ".blog";
+
+		SocketHandle file(open(logName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+		BinaryLog::FileHeader header = {};
+		memcpy(header.magic, BinaryLog::Magic, sizeof(header.magic));
+		header.version = BinaryLog::Version;
+		header.byteOrder = BinaryLog::ByteOrder;
+		if (!file || sizeof(header) != write(file.get(), &header, sizeof(header)))
 		{
-			Error() << "failed to create log file: " << e.what();
+			ERROR_LOG << "failed to open binary log file \"" << logName << "\" for writing: " << strerror(errno);
+			return;
 		}
+
+		// The writer takes the file once the level is there
+		m_binaryFile = std::move(file);
+		m_binaryLevel = level;
+		UpdateThreshold();
 	}
 
 	//////////////////////////////////////////////////////////////////////////
@@ -91,52 +470,338 @@ namespace Draupnir
 	{
 		const LogLevel level = isVerbose ? LOG_DEBUG : LOG_INFO;
 		m_consoleLevel = level;
-		if (m_logFile.is_open())
+		if (m_logFile)
 			m_fileLevel = level;
+		if (m_binaryFile && LOG_NONE != m_binaryLevel)
+			m_binaryLevel = level;
+		UpdateThreshold();
 	}
 
 	//////////////////////////////////////////////////////////////////////////
-	void Logger::PutMessage(LogLevel level, const std::string& message)
+	LogRing& Logger::GetRing()
 	{
-		static std::mutex outputLock;
+		if (!ThreadRing.ring)
+		{
+			ThreadRing.ring.reset(new LogRing());
+			std::lock_guard<std::mutex> lock(m_ringsLock);
+			m_rings.push_back(ThreadRing.ring);
+		}
+		return *ThreadRing.ring;
+	}
 
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::PutMessage(LogLevel level, const char* text, size_t size)
+	{
 		// Check if the requested log level is allowed in any of
 		// configured channels
-		if(level < m_consoleLevel && level < m_fileLevel)
+		if (!IsEnabled(level))
 		    return;
 
-		// Prepare the preamble of the message
-		std::string preamble;
+		// The time is taken now and formatted by the writer
+		if (!GetRing().Push(level, false, GetSteadyTime(), text, size))
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::PutRecord(LogLevel level, const uint8_t* record, size_t size)
+	{
+		if (!GetRing().Push(level, true, GetSteadyTime(), record, size))
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	uint32_t Logger::RegisterFormat(LogFormat& format, const char* text)
+	{
+		std::lock_guard<std::mutex> lock(m_formatsLock);
+		uint32_t id = format.m_id.load(std::memory_order_relaxed);
+		if (!id)
+		{
+			format.m_text = text;
+			m_formats.push_back(&format);
+			id = static_cast<uint32_t>(m_formats.size());
+			format.m_id.store(id, std::memory_order_release);
+		}
+		return id;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::Work()
+	{
+		while (true)
+		{
+			bool isStopping = false;
+			{
+				std::unique_lock<std::mutex> lock(m_wakeupLock);
+				isStopping = m_isStopping;
+			}
+
+			const size_t count = Collect();
+			if (count)
+			{
+				if (m_consoleLevel != LOG_NONE)
+					Write(m_consoleHandle, m_consoleLevel, m_entries, m_text);
+				if (m_fileLevel != LOG_NONE && m_logFile)
+					Write(m_logFile.get(), m_fileLevel, m_entries, m_text);
+				if (m_binaryLevel != LOG_NONE)
+				{
+					struct iovec iov = { m_definitions.data(), m_definitions.size() };
+					if (!m_definitions.empty())
+						WriteVector(m_binaryFile.get(), &iov, 1);
+					Write(m_binaryFile.get(), m_binaryLevel, m_binaryEntries, m_binary);
+				}
+				else if (!m_definitions.empty())
+				{
+					// The channel is off since the batch was taken, the
+					// definitions are written again once it's back
+					m_definedFormats.clear();
+					m_isClockDefined = false;
+				}
+				m_entries.clear();
+				m_text.clear();
+				m_binaryEntries.clear();
+				m_binary.clear();
+				m_definitions.clear();
+			}
+
+			// The last messages are collected after the stop is requested
+			if (isStopping && !count)
+				break;
+			if (count)
+				continue;
+
+			std::unique_lock<std::mutex> lock(m_wakeupLock);
+			m_wakeup.wait_for(lock, WriterPeriod, [this]() { return m_isStopping; });
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	size_t Logger::Collect()
+	{
+		// The stamps of the batch are taken against the wall clock of now
+		const int64_t steadyNow = GetSteadyTime();
+		m_clockOffset = GetNanoseconds(std::chrono::system_clock::now().time_since_epoch()) - steadyNow;
+		if (m_binaryLevel != LOG_NONE)
+			DefineClock(steadyNow);
+
+		size_t count = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_ringsLock);
+			for (auto ring = m_rings.begin(); ring != m_rings.end(); )
+			{
+				// Checked before draining: the last messages of the thread
+				// are there by the time it's retired
+				const bool isRetired = (*ring)->IsRetired();
+				count += (*ring)->Drain([this](LogLevel level, bool isEvent, int64_t time,
+					const uint8_t* data, size_t size)
+				{
+					Dispatch(level, isEvent, time, data, size);
+				});
+				ring = isRetired ? m_rings.erase(ring) : ring + 1;
+			}
+		}
+
+		const uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+		if (dropped != m_reportedDropped)
+		{
+			const std::string text = std::to_string(dropped - m_reportedDropped)
+				+ " log message(s) dropped, the log doesn't keep up";
+			Dispatch(LOG_ERROR, false, GetSteadyTime(), reinterpret_cast<const uint8_t*>(text.data()), text.size());
+			m_reportedDropped = dropped;
+			++count;
+		}
+
+		// The threads are merged in the order of the time
+		const auto isEarlier = [](const Entry& left, const Entry& right) { return left.time < right.time; };
+		std::stable_sort(m_entries.begin(), m_entries.end(), isEarlier);
+		std::stable_sort(m_binaryEntries.begin(), m_binaryEntries.end(), isEarlier);
+		return count;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::Dispatch(LogLevel level, bool isEvent, int64_t time, const uint8_t* data, size_t size)
+	{
+		uint32_t id = 0;
+		if (isEvent && size >= sizeof(id))
+			memcpy(&id, data, sizeof(id));
+		const LogFormat* format = isEvent ? GetFormat(id) : nullptr;
+		if (isEvent && !format)
+			return;
+
+		if (level >= m_binaryLevel)
+		{
+			if (format)
+				DefineFormat(*format);
+			Entry entry;
+			entry.time = time;
+			entry.level = level;
+			entry.offset = m_binary.size();
+			AppendBinary(m_binary, isEvent ? BinaryLog::Event : BinaryLog::Text, level, time, data, size);
+			entry.size = m_binary.size() - entry.offset;
+			m_binaryEntries.push_back(entry);
+		}
+
+		// The console and the file take the same text
+		if (level < m_consoleLevel && level < m_fileLevel)
+			return;
+		if (!format)
+		{
+			Format(level, time, reinterpret_cast<const char*>(data), size);
+			return;
+		}
+		m_rendered.clear();
+		BinaryLog::Render(m_rendered, format->m_text, data + sizeof(id), size - sizeof(id));
+		Format(level, time, m_rendered.data(), m_rendered.size());
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	const LogFormat* Logger::GetFormat(uint32_t id)
+	{
+		// The formats are only added, the writer copies them once it meets a new one
+		if (id > m_knownFormats.size())
+		{
+			std::lock_guard<std::mutex> lock(m_formatsLock);
+			m_knownFormats = m_formats;
+		}
+		return id && id <= m_knownFormats.size() ? m_knownFormats[id - 1] : nullptr;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::AppendBinary(std::vector<char>& buffer, BinaryLog::RecordType type, LogLevel level,
+		int64_t time, const void* body, size_t size)
+	{
+		BinaryLog::RecordHeader header = {};
+		header.time = time;
+		header.size = static_cast<uint32_t>(size);
+		header.type = type;
+		header.level = static_cast<uint8_t>(level);
+		const char* const bytes = static_cast<const char*>(body);
+		buffer.insert(buffer.end(), reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header + 1));
+		buffer.insert(buffer.end(), bytes, bytes + size);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::DefineFormat(const LogFormat& format)
+	{
+		const uint32_t id = format.m_id.load(std::memory_order_relaxed);
+		if (id <= m_definedFormats.size() && m_definedFormats[id - 1])
+			return;
+		m_definedFormats.resize(std::max<size_t>(m_definedFormats.size(), id));
+		m_definedFormats[id - 1] = true;
+
+		// Identifier, line, file and text
+		const int32_t line = format.m_line;
+		std::string body(reinterpret_cast<const char*>(&id), sizeof(id));
+		body.append(reinterpret_cast<const char*>(&line), sizeof(line));
+		body.append(format.m_file).push_back('\0');
+		body.append(format.m_text).push_back('\0');
+		AppendBinary(m_definitions, BinaryLog::Format, format.m_level, 0, body.data(), body.size());
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::DefineClock(int64_t time)
+	{
+		// The wall clock may be stepped or slewed, the steady one is not
+		if (m_isClockDefined && std::abs(m_clockOffset - m_definedClockOffset) < ClockDrift)
+			return;
+		AppendBinary(m_definitions, BinaryLog::Clock, LOG_NONE, time, &m_clockOffset, sizeof(m_clockOffset));
+		m_definedClockOffset = m_clockOffset;
+		m_isClockDefined = true;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::Format(LogLevel level, int64_t time, const char* text, size_t size)
+	{
+		const std::chrono::system_clock::time_point point{ std::chrono::duration_cast<std::chrono::system_clock::duration>(
+			std::chrono::nanoseconds(time + m_clockOffset)) };
+		const std::time_t second = std::chrono::system_clock::to_time_t(point);
+		if (second != m_stampSecond || !m_stamp[0])
 		{
-			std::ostringstream buf;
-			const std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-			const std::time_t timeNow = std::chrono::system_clock::to_time_t(now);
 			std::tm brokenTime;
-			localtime_r(&timeNow, &brokenTime);
-			std::chrono::system_clock::duration milliseconds = now.time_since_epoch();
-			milliseconds -= std::chrono::duration_cast<std::chrono::seconds>(milliseconds);
+			localtime_r(&second, &brokenTime);
+			std::strftime(m_stamp, sizeof(m_stamp), "%Y-%m-%d %H:%M:%S", &brokenTime);
+			m_stampSecond = second;
+		}
+		const auto sinceSecond = point - std::chrono::system_clock::from_time_t(second);
+		const long milliseconds = static_cast<long>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(sinceSecond).count());
+
+		char preamble[48];
+		const int length = snprintf(preamble, sizeof(preamble), "%s.%03ld ", m_stamp, milliseconds);
 
-			buf << std::setw(4) << std::setfill('0') << brokenTime.tm_year + 1900
-			    << '-' << std::setw(2) << std::setfill('0') << brokenTime.tm_mon + 1
-			    << '-' << std::setw(2) << std::setfill('0') << brokenTime.tm_mday
-			    << ' ' << std::setw(2) << std::setfill('0') << brokenTime.tm_hour
-			    << ':' << std::setw(2) << std::setfill('0') << brokenTime.tm_min
-			    << ':' << std::setw(2) << std::setfill('0') << brokenTime.tm_sec
-			    << '.' << std::setw(3) << std::setfill('0') << milliseconds / std::chrono::milliseconds(1)
-			    << ' ';
-			preamble = std::move(buf.str());
+		Entry entry;
+		entry.time = time;
+		entry.level = level;
+		entry.offset = m_text.size();
+		m_text.insert(m_text.end(), preamble, preamble + length);
+		m_text.insert(m_text.end(), text, text + size);
+		m_text.push_back('\n');
+		entry.size = m_text.size() - entry.offset;
+		m_entries.push_back(entry);
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::Write(int fd, LogLevel level, const std::vector<Entry>& entries, std::vector<char>& text)
+	{
+		struct iovec iov[MaxMessagesPerWrite];
+		size_t count = 0;
+		for (const Entry& entry : entries)
+		{
+			if (entry.level < level)
+				continue;
+
+			// The messages of the same thread usually follow each other in the text
+			char* const data = &text[entry.offset];
+			if (count && static_cast<char*>(iov[count - 1].iov_base) + iov[count - 1].iov_len == data)
+			{
+				iov[count - 1].iov_len += entry.size;
+				continue;
+			}
+			if (MaxMessagesPerWrite == count)
+			{
+				WriteVector(fd, iov, count);
+				count = 0;
+			}
+			iov[count].iov_base = data;
+			iov[count].iov_len = entry.size;
+			++count;
 		}
+		if (count)
+			WriteVector(fd, iov, count);
+	}
 
+	//////////////////////////////////////////////////////////////////////////
+	void Logger::WriteVector(int fd, struct iovec* iov, size_t count)
+	{
+		while (count)
 		{
-			std::lock_guard<std::mutex> lock(outputLock);
-			if (level >= m_consoleLevel)
+			const ssize_t res = writev(fd, iov, static_cast<int>(count));
+			if (-1 == res)
 			{
-				std::cout << preamble << message << std::endl;
+				if (EINTR == errno)
+					continue;
+				// The terminal may be made non-blocking by the control mode,
+				// this thread is the one that can wait for it
+				if (EAGAIN == errno || EWOULDBLOCK == errno)
+				{
+					struct pollfd pfd = { fd, POLLOUT, 0 };
+					poll(&pfd, 1, -1);
+					continue;
+				}
+				// Nowhere to report the failure to
+				return;
 			}
 
-			if (level >= m_fileLevel && m_logFile.good())
+			size_t written = static_cast<size_t>(res);
+			while (count && written >= iov->iov_len)
+			{
+				written -= iov->iov_len;
+				++iov;
+				--count;
+			}
+			if (count)
 			{
-				m_logFile << preamble << message << std::endl;
+				iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+				iov->iov_len -= written;
 			}
 		}
 	}
@@ -6,13 +6,27 @@
 
 #pragma once
 
+#include "BinaryLog.h"
+#include "Posix.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <sstream>
-#include <fstream>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct iovec;
 
 namespace Draupnir
 {
+	class LogRing;
+
 	//////////////////////////////////////////////////////////////////////////
 	enum LogLevel
 	{
@@ -23,6 +37,47 @@ namespace Draupnir
 	}
 	;
 
+	//////////////////////////////////////////////////////////////////////////
+	/// <summary>
+	///   Static description of a structured logging statement, registered
+	///   on its first use. The statements keep it in a constant-initialized
+	///   static, so there's nothing to construct on the way.
+	/// </summary>
+	//////////////////////////////////////////////////////////////////////////
+	class LogFormat
+	{
+		friend class Logger;
+		const LogLevel m_level;
+		const char* const m_file;
+		const int m_line;
+		// Set on registration, along with the identifier
+		const char* m_text;
+		std::atomic<uint32_t> m_id;
+
+	public:
+		constexpr LogFormat(LogLevel level, const char* file, int line)
+			: m_level(level)
+			, m_file(file)
+			, m_line(line)
+			, m_text(nullptr)
+			, m_id(0)
+		{}
+
+		LogFormat(const LogFormat&) = delete;
+		LogFormat& operator =(const LogFormat&) = delete;
+	}
+	;
+
+	//////////////////////////////////////////////////////////////////////////
+	/// <summary>
+	///   The messages are put into the ring of the calling thread and written
+	///   by the background thread in batches, so the event loops never wait
+	///   for the terminal or the disk. The message that doesn't fit the ring
+	///   is dropped and counted, the count is reported to the log. The
+	///   events put only the identifier of their format and the raw
+	///   arguments, they are formatted by the writer for the text channels
+	///   and written as they are to the binary one.
+	/// </summary>
 	//////////////////////////////////////////////////////////////////////////
 	class Logger
 	{
@@ -31,46 +86,69 @@ namespace Draupnir
 		///   Helper class to collect the whole message via '<<' operator
 		///   and put it into the logging streams. Instances of this class
 		///   could be obtained via Logger::Debug(), Logger::Info() and
-		///   Logger::Error() methods only.
+		///   Logger::Error() methods only. The message is collected in place,
+		///   only the one longer than the buffer goes to the heap.
 		/// </summary>
 		//////////////////////////////////////////////////////////////////////////
 		class MessagePrinter
 		{
 			friend class Logger;
+			static const size_t InlineSize = 256;
+
 			Logger& m_parent;
 			LogLevel m_level;
-			std::unique_ptr<std::ostringstream> m_buf;
+			// The moved-from printer puts nothing
+			bool m_isActive;
+			size_t m_size;
+			char m_text[InlineSize];
+			std::string m_overflow;
 
 		protected:
 			MessagePrinter(Logger& parent, LogLevel level)
 				: m_parent(parent)
 				, m_level(level)
-				, m_buf(new std::ostringstream())
+				, m_isActive(true)
+				, m_size(0)
 			{}
 
+			void Append(const char* text, size_t size);
+			void AppendInteger(unsigned long long value, bool isNegative);
+
 		public:
 			//////////////////////////////////////////////////////////////////////////
-			/// Default move constructor is enabled on purpose to allow proper work of
+			/// Move constructor is enabled on purpose to allow proper work of
 			/// the Logger's methods Debug(), Info() and Error()
 			//////////////////////////////////////////////////////////////////////////
-			MessagePrinter(MessagePrinter&&) = default;
+			MessagePrinter(MessagePrinter&& other);
 
 			//////////////////////////////////////////////////////////////////////////
 			/// Message is put to the logging stream on object destruction (at the
 			/// end of the expression evaluation at the instantiation point)
 			//////////////////////////////////////////////////////////////////////////
-			~MessagePrinter()
-			{
-				m_parent.PutMessage(m_level, m_buf->str());
-			}
+			~MessagePrinter();
 
 			//////////////////////////////////////////////////////////////////////////
-			/// The only useful method here: put something into the stream
+			/// Put something into the message, the strings and the numbers are
+			/// formatted in place and anything else goes through a stream
 			//////////////////////////////////////////////////////////////////////////
+			MessagePrinter& operator <<(const std::string& data);
+			MessagePrinter& operator <<(const char* data);
+			MessagePrinter& operator <<(char data);
+			MessagePrinter& operator <<(int data);
+			MessagePrinter& operator <<(unsigned data);
+			MessagePrinter& operator <<(long data);
+			MessagePrinter& operator <<(unsigned long data);
+			MessagePrinter& operator <<(long long data);
+			MessagePrinter& operator <<(unsigned long long data);
+			MessagePrinter& operator <<(double data);
+
 			template<class T>
 			MessagePrinter& operator <<(const T& data)
 			{
-				*m_buf << data;
+				std::ostringstream stream;
+				stream << data;
+				const std::string text = stream.str();
+				Append(text.data(), text.size());
 				return *this;
 			}
 		}
@@ -84,6 +162,17 @@ namespace Draupnir
 		//////////////////////////////////////////////////////////////////////////
 		static Logger& GetInstance();
 
+		//////////////////////////////////////////////////////////////////////////
+		/// <summary>
+		///   Check if any channel takes the messages of the level, a single
+		///   load and compare without touching the instance
+		/// </summary>
+		//////////////////////////////////////////////////////////////////////////
+		static bool IsEnabled(LogLevel level) noexcept
+		{
+			return level >= s_threshold.load(std::memory_order_relaxed);
+		}
+
 		//////////////////////////////////////////////////////////////////////////
 		/// <summary>
 		///   Put the debug message into the log
@@ -123,6 +212,16 @@ namespace Draupnir
 		//////////////////////////////////////////////////////////////////////////
 		void EnableConsoleChannel(LogLevel level);
 
+		//////////////////////////////////////////////////////////////////////////
+		/// <summary>
+		///   Write the console channel to the descriptor instead of stdout,
+		///   which the output of the program may need for itself
+		/// </summary>
+		///
+		/// <param name="fd"> The descriptor of the console </param>
+		//////////////////////////////////////////////////////////////////////////
+		void SetConsoleHandle(int fd);
+
 		//////////////////////////////////////////////////////////////////////////
 		/// <summary>
 		///   Set file logging level
@@ -133,16 +232,177 @@ namespace Draupnir
 		//////////////////////////////////////////////////////////////////////////
 		void EnableFileChannel(bool overwrite = true, LogLevel level = LOG_DEBUG);
 
+		//////////////////////////////////////////////////////////////////////////
+		/// <summary>
+		///   Write the messages and the events of the level to the binary log
+		///   file, decoded by draupnir-logdump
+		/// </summary>
+		///
+		/// <param name="level"> The level of the binary logging </param>
+		//////////////////////////////////////////////////////////////////////////
+		void EnableBinaryChannel(LogLevel level = LOG_DEBUG);
+
 		void SetVerboseMode(bool isVerbose);
 
+		//////////////////////////////////////////////////////////////////////////
+		/// <summary>
+		///   Put the event of the format into the log, the arguments are copied
+		///   as they are to substitute the {} of the format later
+		/// </summary>
+		//////////////////////////////////////////////////////////////////////////
+		template<class... Args>
+		void PutEvent(LogFormat& format, const char* text, const Args&... args)
+		{
+			uint8_t record[BinaryLog::MaxEvent];
+			uint32_t id = format.m_id.load(std::memory_order_acquire);
+			if (!id)
+				id = RegisterFormat(format, text);
+			memcpy(record, &id, sizeof(id));
+
+			BinaryLog::Encoder encoder(record + sizeof(id), sizeof(record) - sizeof(id));
+			const int expansion[] = { 0, (encoder.Put(args), 0)... };
+			(void)expansion;
+			PutRecord(format.m_level, record, sizeof(id) + encoder.GetSize());
+		}
+
+		//////////////////////////////////////////////////////////////////////////
+		/// <summary>
+		///   Number of the messages dropped so far for the lack of room in the
+		///   rings
+		/// </summary>
+		//////////////////////////////////////////////////////////////////////////
+		uint64_t GetDroppedCount() const noexcept
+		{
+			return m_dropped.load(std::memory_order_relaxed);
+		}
+
 	protected:
-		void PutMessage(LogLevel level, const std::string& message);
+		void PutMessage(LogLevel level, const char* text, size_t size);
+		void PutRecord(LogLevel level, const uint8_t* record, size_t size);
+		// Returns the identifier of the format, the first statement to come registers it
+		uint32_t RegisterFormat(LogFormat& format, const char* text);
 
 	private:
+		// Message of the batch formatted in the buffer
+		struct Entry
+		{
+			int64_t time;
+			LogLevel level;
+			size_t offset;
+			size_t size;
+		};
+
 		Logger();
-		LogLevel m_consoleLevel;
-		LogLevel m_fileLevel;
-		std::ofstream m_logFile;
+		~Logger();
+		LogRing& GetRing();
+		// Background thread writing the messages of all the rings
+		void Work();
+		// Take the messages out of the rings into the batch, returns their number
+		size_t Collect();
+		// Put the message or the event into the batches of the channels taking it
+		void Dispatch(LogLevel level, bool isEvent, int64_t time, const uint8_t* data, size_t size);
+		void Format(LogLevel level, int64_t time, const char* text, size_t size);
+		const LogFormat* GetFormat(uint32_t id);
+		// The definitions of the formats and the clock go to the file before the batch
+		static void AppendBinary(std::vector<char>& buffer, BinaryLog::RecordType type, LogLevel level,
+			int64_t time, const void* body, size_t size);
+		void DefineFormat(const LogFormat& format);
+		void DefineClock(int64_t time);
+		// Write the messages of the batch the channel of the level takes
+		void Write(int fd, LogLevel level, const std::vector<Entry>& entries, std::vector<char>& text);
+		void WriteVector(int fd, struct iovec* iov, size_t count);
+
+		// Lowest level taken by any of the channels
+		static std::atomic<LogLevel> s_threshold;
+
+		// Called once any of the channel levels is changed
+		void UpdateThreshold() noexcept;
+
+		std::atomic<LogLevel> m_consoleLevel;
+		std::atomic<int> m_consoleHandle;
+		std::atomic<LogLevel> m_fileLevel;
+		SocketHandle m_logFile;
+		std::atomic<LogLevel> m_binaryLevel;
+		SocketHandle m_binaryFile;
+
+		// Formats of the events by their identifiers less one
+		std::mutex m_formatsLock;
+		std::vector<const LogFormat*> m_formats;
+
+		// Rings of the threads that have logged anything
+		std::mutex m_ringsLock;
+		std::vector<std::shared_ptr<LogRing>> m_rings;
+		std::atomic<uint64_t> m_dropped;
+		uint64_t m_reportedDropped;
+
+		// Batch of the writer, the timestamp is formatted once a second
+		std::vector<Entry> m_entries;
+		std::vector<char> m_text;
+		time_t m_stampSecond;
+		char m_stamp[32];
+		// Wall clock less the steady one the messages are stamped with,
+		// taken once a batch
+		int64_t m_clockOffset;
+		std::string m_rendered;
+
+		// Batch of the binary channel, the formats and the clock offset
+		// written to the file so far
+		std::vector<Entry> m_binaryEntries;
+		std::vector<char> m_binary;
+		std::vector<char> m_definitions;
+		std::vector<const LogFormat*> m_knownFormats;
+		std::vector<bool> m_definedFormats;
+		bool m_isClockDefined;
+		int64_t m_definedClockOffset;
+
+		std::mutex m_wakeupLock;
+		std::condition_variable m_wakeup;
+		bool m_isStopping;
+		// Started last, once everything it uses is there
+		std::thread m_writer;
 	}
 	;
 } // namespace Draupnir
+
+//////////////////////////////////////////////////////////////////////////
+/// The logging statements, the operands of '<<' are evaluated only if the
+/// level is taken by any channel. The debug ones are compiled out of the
+/// build with DRAUPNIR_NO_DEBUG_LOG defined. The loop runs the statement
+/// at most once and is safe in the unbraced if-else, as POSIX_CHECK is.
+//////////////////////////////////////////////////////////////////////////
+#define DRAUPNIR_LOG(level, printer) \
+	for (bool _isLogged = ::Draupnir::Logger::IsEnabled(level); _isLogged; _isLogged = false) \
+		::Draupnir::Logger::GetInstance().printer()
+
+#ifdef DRAUPNIR_NO_DEBUG_LOG
+#define DEBUG_LOG while (false) ::Draupnir::Logger::GetInstance().Debug()
+#else
+#define DEBUG_LOG DRAUPNIR_LOG(::Draupnir::LOG_DEBUG, Debug)
+#endif
+#define INFO_LOG DRAUPNIR_LOG(::Draupnir::LOG_INFO, Info)
+#define ERROR_LOG DRAUPNIR_LOG(::Draupnir::LOG_ERROR, Error)
+
+//////////////////////////////////////////////////////////////////////////
+/// The structured logging statements: the format is a string literal with
+/// {} for every argument, the arguments are numbers, characters or strings.
+/// The statement costs a copy of the arguments on the calling thread.
+//////////////////////////////////////////////////////////////////////////
+#define DRAUPNIR_EVENT_IF(condition, level, ...) \
+	do \
+	{ \
+		if (condition) \
+		{ \
+			static ::Draupnir::LogFormat _format(level, __FILE__, __LINE__); \
+			::Draupnir::Logger::GetInstance().PutEvent(_format, __VA_ARGS__); \
+		} \
+	} \
+	while (false)
+#define DRAUPNIR_EVENT(level, ...) DRAUPNIR_EVENT_IF(::Draupnir::Logger::IsEnabled(level), level, __VA_ARGS__)
+
+#ifdef DRAUPNIR_NO_DEBUG_LOG
+#define DEBUG_EVENT(...) DRAUPNIR_EVENT_IF(false, ::Draupnir::LOG_DEBUG, __VA_ARGS__)
+#else
+#define DEBUG_EVENT(...) DRAUPNIR_EVENT(::Draupnir::LOG_DEBUG, __VA_ARGS__)
+#endif
+#define INFO_EVENT(...) DRAUPNIR_EVENT(::Draupnir::LOG_INFO, __VA_ARGS__)
+#define ERROR_EVENT(...) DRAUPNIR_EVENT(::Draupnir::LOG_ERROR, __VA_ARGS__)
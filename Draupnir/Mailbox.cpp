@@ -0,0 +1,63 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/Mailbox.cpp
+//
+// summary:	Implements the queue of the calls posted to an event loop from other threads
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Mailbox.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	Mailbox::Mailbox()
+		: m_event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+	{
+		if (!m_event)
+			throw std::runtime_error("failed to create eventfd: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void Mailbox::Post(std::function<void()> call)
+	{
+		bool wakeup = false;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			wakeup = m_calls.empty();
+			m_calls.push_back(std::move(call));
+		}
+
+		// The loop is already notified about the non-empty mailbox
+		if (!wakeup)
+			return;
+
+		const uint64_t one = 1;
+		while (-1 == write(m_event.get(), &one, sizeof(one)) && EINTR == errno)
+			;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void Mailbox::Dispatch()
+	{
+		// Reset the counter before taking the calls, so the posts racing
+		// with the dispatch wake the loop up once again
+		uint64_t counter = 0;
+		while (-1 == read(m_event.get(), &counter, sizeof(counter)) && EINTR == errno)
+			;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_dispatched.swap(m_calls);
+		}
+
+		for (auto& call : m_dispatched)
+			call();
+		m_dispatched.clear();
+	}
+} // namespace Draupnir
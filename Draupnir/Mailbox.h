@@ -0,0 +1,46 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/Mailbox.h
+//
+// summary:	Declares the queue of the calls posted to an event loop from other threads
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Calls posted to an event loop by other threads. The loop
+	/// 			polls the eventfd of the mailbox and runs the posted calls
+	/// 			on its own thread when the descriptor becomes readable.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class Mailbox
+	{
+		SocketHandle m_event;
+		std::mutex m_mutex;
+		std::vector<std::function<void()>> m_calls;
+		// Swapped with the posted calls on dispatch, keeps the capacity
+		std::vector<std::function<void()>> m_dispatched;
+
+	public:
+		Mailbox();
+		Mailbox(const Mailbox&) = delete;
+		Mailbox& operator =(const Mailbox&) = delete;
+
+		// Queue the call and wake the loop up, may be called from any thread
+		void Post(std::function<void()> call);
+		// Run all the posted calls, must be called from the loop's thread
+		void Dispatch();
+
+		int GetHandle() const noexcept
+		{
+			return m_event.get();
+		}
+	};
+} // namespace Draupnir
@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/OutboundQueue.cpp
+//
+// summary:	Implements the queue of the data pending to be written to a non-blocking descriptor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "OutboundQueue.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+	// Number of chunks passed to a single writev()
+	const size_t MaxChunksPerWrite = 64;
+	// Size of the buffers the queued data is packed into
+	const size_t ChunkSize = 64 * 1024;
+
+	bool IsTransientError(int error)
+	{
+		return EAGAIN == error || EWOULDBLOCK == error || EINTR == error;
+	}
+} // namespace
+
+namespace Draupnir
+{
+	const size_t OutboundQueue::HighWatermark;
+	const size_t OutboundQueue::LowWatermark;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	OutboundQueue::OutboundQueue(BufferPool& buffers, bool isDeferred)
+		: m_buffers(buffers)
+		, m_size(0)
+		, m_congested(false)
+		, m_isDeferred(isDeferred)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void OutboundQueue::Write(int fd, const uint8_t* data, size_t size)
+	{
+		// Keep the order of the data: nothing goes directly while the queue isn't empty
+		while (size && IsEmpty() && !m_isDeferred)
+		{
+			const ssize_t res = write(fd, data, size);
+			if (-1 == res)
+			{
+				if (EINTR == errno)
+					continue;
+				if (!IsTransientError(errno))
+					throw std::runtime_error("failed to write: " + std::string(strerror(errno)));
+				break;
+			}
+
+			data += res;
+			size -= static_cast<size_t>(res);
+		}
+
+		if (size)
+			Append(data, size);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void OutboundQueue::Append(const uint8_t* data, size_t size)
+	{
+		m_size += size;
+		if (m_size > HighWatermark)
+			m_congested = true;
+
+		while (size)
+		{
+			// Pack the data into the tail of the last chunk first
+			if (m_chunks.empty() || m_chunks.back().end == m_chunks.back().buffer.Size())
+				m_chunks.push_back(Chunk{ m_buffers.Acquire(ChunkSize), 0, 0 });
+
+			Chunk& chunk = m_chunks.back();
+			const size_t part = std::min(size, chunk.buffer.Size() - chunk.end);
+			memcpy(chunk.buffer.Data() + chunk.end, data, part);
+			chunk.end += part;
+			data += part;
+			size -= part;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool OutboundQueue::Flush(int fd)
+	{
+		while (!IsEmpty())
+		{
+			struct iovec iov[MaxChunksPerWrite];
+			const size_t count = Prepare(iov, MaxChunksPerWrite);
+			const ssize_t res = writev(fd, iov, static_cast<int>(count));
+			if (-1 == res)
+			{
+				if (EINTR == errno)
+					continue;
+				if (!IsTransientError(errno))
+					throw std::runtime_error("failed to write: " + std::string(strerror(errno)));
+				break;
+			}
+
+			Consume(static_cast<size_t>(res));
+		}
+		return IsEmpty();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	size_t OutboundQueue::Prepare(struct iovec* iov, size_t maxCount) const
+	{
+		size_t count = 0;
+		for (auto chunk = m_chunks.begin(); chunk != m_chunks.end() && count < maxCount; ++chunk, ++count)
+		{
+			iov[count].iov_base = chunk->buffer.Data() + chunk->begin;
+			iov[count].iov_len = chunk->end - chunk->begin;
+		}
+		return count;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void OutboundQueue::Consume(size_t written)
+	{
+		// Return the fully written chunks to the pool
+		m_size -= written;
+		while (written)
+		{
+			Chunk& chunk = m_chunks.front();
+			const size_t part = std::min(written, chunk.end - chunk.begin);
+			chunk.begin += part;
+			written -= part;
+			if (chunk.begin == chunk.end)
+				m_chunks.pop_front();
+		}
+
+		if (m_size < LowWatermark)
+			m_congested = false;
+	}
+} // namespace Draupnir
@@ -0,0 +1,80 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/OutboundQueue.h
+//
+// summary:	Declares the queue of the data pending to be written to a non-blocking descriptor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "BufferPool.h"
+
+#include <deque>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Outbound data of a non-blocking descriptor. The data is
+	/// 			written directly while the descriptor keeps up; whatever it
+	/// 			does not accept is packed into pooled buffers and flushed
+	/// 			later with writev() when the descriptor becomes writable.
+	/// 			High and low watermarks tell the owner when to stop and
+	/// 			resume producing the data.
+	///
+	/// 			The deferred queue never writes by itself: the owner takes
+	/// 			the queued data with Prepare(), writes it the way it likes
+	/// 			and reports the result with Consume().
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class OutboundQueue
+	{
+		struct Chunk
+		{
+			BufferPool::Buffer buffer;
+			size_t begin;
+			size_t end;
+		};
+
+		BufferPool& m_buffers;
+		std::deque<Chunk> m_chunks;
+		size_t m_size;
+		bool m_congested;
+		const bool m_isDeferred;
+
+		void Append(const uint8_t* data, size_t size);
+
+	public:
+		static const size_t HighWatermark = 1024 * 1024;
+		static const size_t LowWatermark = 256 * 1024;
+
+		explicit OutboundQueue(BufferPool& buffers, bool isDeferred = false);
+		OutboundQueue(const OutboundQueue&) = delete;
+		OutboundQueue& operator =(const OutboundQueue&) = delete;
+
+		// Write the data or queue the part the descriptor can't take now
+		void Write(int fd, const uint8_t* data, size_t size);
+		// Write as much of the queued data as possible, returns true when drained
+		bool Flush(int fd);
+		// Describe the head of the queued data, returns the number of vectors
+		// filled. The data stays in place until it's consumed
+		size_t Prepare(struct iovec* iov, size_t maxCount) const;
+		// Drop the head of the queued data once it's written
+		void Consume(size_t written);
+
+		size_t Size() const noexcept
+		{
+			return m_size;
+		}
+
+		bool IsEmpty() const noexcept
+		{
+			return 0 == m_size;
+		}
+
+		// Set when the queue grows above the high watermark and cleared when it
+		// drains below the low watermark
+		bool IsCongested() const noexcept
+		{
+			return m_congested;
+		}
+	};
+} // namespace Draupnir
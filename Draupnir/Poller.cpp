@@ -0,0 +1,30 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/Poller.cpp
+//
+// summary:	Implements the factory of the readiness notification backends
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Poller.h"
+#include "EpollPoller.h"
+#include "UringPoller.h"
+#include "Logger.h"
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::unique_ptr<Poller> Poller::Create(Backend backend)
+	{
+		if (Uring == backend)
+		{
+			try
+			{
+				return std::unique_ptr<Poller>(new UringPoller());
+			}
+			catch (const std::exception& e)
+			{
+				INFO_LOG << e.what() << ", falling back to epoll";
+			}
+		}
+		return std::unique_ptr<Poller>(new EpollPoller());
+	}
+} // namespace Draupnir
@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/Poller.h
+//
+// summary:	Declares the interface of the readiness notification backends
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "CompletionIo.h"
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+#include <memory>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Readiness notification backend used by the event loops.
+	/// 			Events are described with EPOLL* flags and reported in
+	/// 			edge-triggered manner: once a descriptor is reported the
+	/// 			caller must read it until EAGAIN (or EOF) before it may be
+	/// 			reported again. The backends tell which descriptors are
+	/// 			ready, the I/O itself is left to the caller, unless the
+	/// 			backend offers the completion-based I/O as well.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class Poller
+	{
+	public:
+		enum Backend
+		{
+			Epoll,
+			Uring
+		};
+
+		Poller() = default;
+		Poller(const Poller&) = delete;
+		Poller& operator =(const Poller&) = delete;
+		virtual ~Poller() = default;
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Creates the poller of requested type. Falls back to epoll
+		/// 			when the requested backend is not supported by the kernel.
+		/// </summary>
+		///
+		/// <param name="backend">	The preferred backend. </param>
+		////////////////////////////////////////////////////////////////////////////
+		static std::unique_ptr<Poller> Create(Backend backend);
+
+		// Start watching the descriptor, data is reported back with every event
+		virtual void Add(int fd, uint32_t events, uint64_t data) = 0;
+		// Change the set of watched events of the descriptor
+		virtual void Modify(int fd, uint32_t events, uint64_t data) = 0;
+		// Stop watching the descriptor, must be called before it's closed
+		virtual void Remove(int fd) = 0;
+		// Wait for events, returns the number of events or -1 with errno set
+		virtual int Wait(struct epoll_event* events, int maxEvents, int timeoutMs) = 0;
+
+		// Completion-based I/O of the backend, null if it only reports readiness
+		virtual CompletionIo* GetCompletionIo() noexcept
+		{
+			return nullptr;
+		}
+
+		virtual const char* GetName() const = 0;
+	};
+} // namespace Draupnir
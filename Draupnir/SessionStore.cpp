@@ -0,0 +1,247 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/SessionStore.cpp
+//
+// summary:	Implements the on-disk store of the TLS sessions of the control mode
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "SessionStore.h"
+#include "Posix.h"
+#include "Logger.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace
+{
+	const char SessionSuffix[] = ".der";
+
+	// Create the directory along with the missing parents
+	void MakeDirectories(const std::string& path)
+	{
+		for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+		{
+			const std::string part = path.substr(0, pos);
+			if (-1 == mkdir(part.c_str(), S_IRWXU) && EEXIST != errno)
+				throw std::runtime_error("failed to create " + part + ": " + strerror(errno));
+			if (std::string::npos == pos)
+				break;
+		}
+	}
+
+	bool IsSessionFile(const char* name)
+	{
+		const size_t length = strlen(name);
+		const size_t suffixLength = sizeof(SessionSuffix) - 1;
+		return length > suffixLength && 0 == strcmp(name + length - suffixLength, SessionSuffix);
+	}
+} // namespace
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	SessionStore::SessionStore(const std::string& directory, std::chrono::seconds lifetime)
+		: m_directory(directory)
+		, m_lifetime(lifetime)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::string SessionStore::GetPath(const Botan::TLS::Server_Information& info) const
+	{
+		// Keep the host name from escaping the directory
+		std::string name = info.hostname();
+		for (auto& c : name)
+		{
+			if (!isalnum(static_cast<unsigned char>(c)) && '.' != c && '-' != c && ':' != c)
+				c = '_';
+		}
+		if (name.empty() || '.' == name[0])
+			name.insert(0, 1, '_');
+
+		return m_directory + '/' + name + '_' + std::to_string(info.port()) + SessionSuffix;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool SessionStore::LoadFile(const std::string& path, Botan::TLS::Session& session) const
+	{
+		SocketHandle file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+		if (!file)
+		{
+			if (ENOENT == errno)
+				return false;
+			throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+		}
+
+		struct stat info;
+		POSIX_CHECK(fstat(file.get(), &info));
+		std::vector<uint8_t> der(static_cast<size_t>(info.st_size));
+		size_t received = 0;
+		while (received < der.size())
+		{
+			const ssize_t count = read(file.get(), der.data() + received, der.size() - received);
+			if (-1 == count && EINTR == errno)
+				continue;
+			if (count <= 0)
+				throw std::runtime_error("failed to read " + path);
+			received += static_cast<size_t>(count);
+		}
+
+		session = Botan::TLS::Session(der.data(), der.size());
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool SessionStore::load_from_session_id(
+		const std::vector<uint8_t>& sessionId __attribute__((unused)),
+		Botan::TLS::Session& session __attribute__((unused)))
+	{
+		// The client looks the sessions up by the server only
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool SessionStore::load_from_server_info(const Botan::TLS::Server_Information& info,
+		Botan::TLS::Session& session)
+	{
+		m_offeredSessionId.clear();
+		if (m_directory.empty())
+			return false;
+
+		const std::string path = GetPath(info);
+		try
+		{
+			Botan::TLS::Session stored;
+			if (!LoadFile(path, stored))
+				return false;
+
+			if (stored.session_age() > m_lifetime)
+			{
+				DEBUG_LOG << "stored TLS session " << path << " is expired";
+				unlink(path.c_str());
+				return false;
+			}
+
+			session = stored;
+			m_offeredSessionId = session.session_id();
+			DEBUG_LOG << "TLS session " << path << " is offered for resumption";
+			return true;
+		}
+		catch (const std::exception& e)
+		{
+			// The file is of no use anymore, the next session replaces it
+			ERROR_LOG << "failed to load TLS session " << path << ": " << e.what();
+			unlink(path.c_str());
+			return false;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void SessionStore::remove_entry(const std::vector<uint8_t>& sessionId)
+	{
+		if (m_directory.empty())
+			return;
+
+		std::unique_ptr<DIR, int(*)(DIR*)> dir(opendir(m_directory.c_str()), closedir);
+		if (!dir)
+			return;
+
+		while (const struct dirent* entry = readdir(dir.get()))
+		{
+			if (!IsSessionFile(entry->d_name))
+				continue;
+
+			const std::string path = m_directory + '/' + entry->d_name;
+			try
+			{
+				Botan::TLS::Session stored;
+				if (LoadFile(path, stored) && stored.session_id() == sessionId)
+					unlink(path.c_str());
+			}
+			catch (const std::exception&)
+			{
+				unlink(path.c_str());
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	size_t SessionStore::remove_all()
+	{
+		if (m_directory.empty())
+			return 0;
+
+		std::unique_ptr<DIR, int(*)(DIR*)> dir(opendir(m_directory.c_str()), closedir);
+		if (!dir)
+			return 0;
+
+		size_t removed = 0;
+		while (const struct dirent* entry = readdir(dir.get()))
+		{
+			const std::string path = m_directory + '/' + entry->d_name;
+			if (IsSessionFile(entry->d_name) && 0 == unlink(path.c_str()))
+				++removed;
+		}
+		return removed;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void SessionStore::save(const Botan::TLS::Session& session)
+	{
+		if (m_directory.empty())
+			return;
+
+		const std::string path = GetPath(session.server_info());
+		const std::string temporary = path + ".tmp" + std::to_string(getpid());
+		try
+		{
+			MakeDirectories(m_directory);
+
+			// Write the whole file aside and replace the old one at once, so
+			// concurrent runs never read a partial session
+			const auto der = session.DER_encode();
+			{
+				SocketHandle file(open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR));
+				if (!file)
+					throw std::runtime_error("failed to create " + temporary + ": " + strerror(errno));
+
+				size_t written = 0;
+				while (written < der.size())
+				{
+					const ssize_t count = write(file.get(), der.data() + written, der.size() - written);
+					if (-1 == count && EINTR == errno)
+						continue;
+					if (-1 == count)
+						throw std::runtime_error("failed to write " + temporary + ": " + strerror(errno));
+					written += static_cast<size_t>(count);
+				}
+			}
+			POSIX_CHECK(rename(temporary.c_str(), path.c_str()));
+			DEBUG_LOG << "TLS session is stored to " << path;
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "failed to store TLS session " << path << ": " << e.what();
+			unlink(temporary.c_str());
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::chrono::seconds SessionStore::session_lifetime() const
+	{
+		return m_lifetime;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool SessionStore::IsResumed(const Botan::TLS::Session& session) const
+	{
+		return !m_offeredSessionId.empty() && m_offeredSessionId == session.session_id();
+	}
+} // namespace Draupnir
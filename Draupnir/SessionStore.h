@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/SessionStore.h
+//
+// summary:	Declares the on-disk store of the TLS sessions of the control mode
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <botan/tls_session_manager.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	TLS sessions of the control mode kept between the runs, so
+	/// 			the next connection to the same target resumes the session
+	/// 			with the abbreviated handshake. Every target has its own
+	/// 			file holding the DER-encoded session, including its ticket.
+	/// 			The files contain the master secrets and are accessible by
+	/// 			the owner only. Failures of the store are logged and never
+	/// 			break the connection: the full handshake is done instead.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class SessionStore final : public Botan::TLS::Session_Manager
+	{
+		// Empty if the store is disabled
+		const std::string m_directory;
+		const std::chrono::seconds m_lifetime;
+		// Identifier of the session offered for resumption by the last lookup
+		std::vector<uint8_t> m_offeredSessionId;
+
+		std::string GetPath(const Botan::TLS::Server_Information& info) const;
+		bool LoadFile(const std::string& path, Botan::TLS::Session& session) const;
+
+	public:
+		explicit SessionStore(const std::string& directory,
+			std::chrono::seconds lifetime = std::chrono::hours(2));
+
+		bool load_from_session_id(const std::vector<uint8_t>& sessionId,
+			Botan::TLS::Session& session) override;
+		bool load_from_server_info(const Botan::TLS::Server_Information& info,
+			Botan::TLS::Session& session) override;
+		void remove_entry(const std::vector<uint8_t>& sessionId) override;
+		size_t remove_all() override;
+		void save(const Botan::TLS::Session& session) override;
+		std::chrono::seconds session_lifetime() const override;
+
+		// Check whether the established session is the one offered for resumption
+		bool IsResumed(const Botan::TLS::Session& session) const;
+	};
+} // namespace Draupnir
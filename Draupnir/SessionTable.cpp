@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/SessionTable.cpp
+//
+// summary:	Implements the descriptor-indexed registry of the target sessions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "SessionTable.h"
+#include "TargetSession.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+	uint64_t MakeToken(int fd, uint32_t generation)
+	{
+		return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+	}
+} // namespace
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	SessionTable::SessionTable()
+		: m_count(0)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	SessionTable::~SessionTable() = default;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	SessionTable::Slot& SessionTable::GetSlot(int fd)
+	{
+		if (fd < 0)
+			throw std::invalid_argument("invalid descriptor " + std::to_string(fd));
+
+		const size_t index = static_cast<size_t>(fd);
+		if (index >= m_slots.size())
+		{
+			// Descriptors are allocated lowest-first, so the table stays dense
+			m_slots.resize(std::max(index + 1, m_slots.size() * 2));
+		}
+		return m_slots[index];
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t SessionTable::Bind(int fd, TargetSession* session, uint32_t events)
+	{
+		Slot& slot = GetSlot(fd);
+		if (slot.session)
+			throw std::logic_error("descriptor " + std::to_string(fd) + " is already registered");
+
+		slot.session = session;
+		slot.events = events;
+		return MakeToken(fd, slot.generation);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void SessionTable::Unbind(int fd)
+	{
+		const size_t index = static_cast<size_t>(fd);
+		if (fd < 0 || index >= m_slots.size())
+			return;
+
+		// New generation turns all the tokens issued for the slot into outdated ones
+		Slot& slot = m_slots[index];
+		slot.session = nullptr;
+		slot.events = 0;
+		++slot.generation;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t SessionTable::Insert(int fd, std::unique_ptr<TargetSession> session, uint32_t events)
+	{
+		const uint64_t token = Bind(fd, session.get(), events);
+		m_slots[static_cast<size_t>(fd)].owner = std::move(session);
+		++m_count;
+		return token;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t SessionTable::Attach(int fd, TargetSession& session, uint32_t events)
+	{
+		return Bind(fd, &session, events);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void SessionTable::Detach(int fd)
+	{
+		Unbind(fd);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t SessionTable::GetToken(int fd) const
+	{
+		return MakeToken(fd, m_slots.at(static_cast<size_t>(fd)).generation);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TargetSession* SessionTable::Find(uint64_t token) const noexcept
+	{
+		const size_t index = static_cast<uint32_t>(token);
+		if (index >= m_slots.size())
+			return nullptr;
+
+		const Slot& slot = m_slots[index];
+		return slot.generation == static_cast<uint32_t>(token >> 32) ? slot.session : nullptr;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::unique_ptr<TargetSession> SessionTable::Remove(TargetSession& session)
+	{
+		const int netHandle = session.GetNetworkSocket().get();
+
+		Slot& slot = GetSlot(netHandle);
+		assert(slot.owner.get() == &session && "session is not registered by its network descriptor");
+		std::unique_ptr<TargetSession> owner = std::move(slot.owner);
+
+		Unbind(netHandle);
+		for (const auto& channel : session.GetChannels())
+		{
+			for (const int handle : channel->GetHandles())
+				Unbind(handle);
+		}
+		--m_count;
+		return owner;
+	}
+} // namespace Draupnir
@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/SessionTable.h
+//
+// summary:	Declares the descriptor-indexed registry of the target sessions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace Draupnir
+{
+	class TargetSession;
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Dense registry of the sessions indexed by descriptor. Every
+	/// 			descriptor of a session is resolved by a token carried in
+	/// 			the poller event, which combines the descriptor with the
+	/// 			generation of its slot: events queued for a descriptor that
+	/// 			was closed and reused meanwhile resolve to nothing.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class SessionTable
+	{
+		struct Slot
+		{
+			// Set in the slot of the network descriptor only
+			std::unique_ptr<TargetSession> owner;
+			TargetSession* session;
+			uint32_t generation;
+			// Events the descriptor is polled for
+			uint32_t events;
+		};
+
+		std::vector<Slot> m_slots;
+		size_t m_count;
+
+		Slot& GetSlot(int fd);
+		uint64_t Bind(int fd, TargetSession* session, uint32_t events);
+		void Unbind(int fd);
+
+	public:
+		SessionTable();
+		SessionTable(const SessionTable&) = delete;
+		SessionTable& operator =(const SessionTable&) = delete;
+		~SessionTable();
+
+		// Register the new session by its network descriptor, returns the token
+		uint64_t Insert(int fd, std::unique_ptr<TargetSession> session, uint32_t events);
+		// Register one more descriptor of the session, returns the token
+		uint64_t Attach(int fd, TargetSession& session, uint32_t events);
+		// Unregister one of the descriptors of the session
+		void Detach(int fd);
+		// Resolve the token, returns nullptr for outdated tokens
+		TargetSession* Find(uint64_t token) const noexcept;
+		// Get the current token of the registered descriptor
+		uint64_t GetToken(int fd) const;
+
+		uint32_t GetEvents(int fd) const
+		{
+			return m_slots.at(static_cast<size_t>(fd)).events;
+		}
+
+		void SetEvents(int fd, uint32_t events)
+		{
+			m_slots.at(static_cast<size_t>(fd)).events = events;
+		}
+
+		// Unregister all the descriptors of the session at once and pass its ownership
+		std::unique_ptr<TargetSession> Remove(TargetSession& session);
+
+		size_t Size() const noexcept
+		{
+			return m_count;
+		}
+	};
+} // namespace Draupnir
@@ -23,8 +23,9 @@
 namespace Draupnir
 {
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	TLSCallbacks::TLSCallbacks(int sock)
+	TLSCallbacks::TLSCallbacks(int sock, BufferPool& buffers, bool isDeferred)
 		: m_socket(sock)
+		, m_outbound(buffers, isDeferred)
 	{
 		assert(-1 != m_socket && "invalid socket in TLS callback handler");
 		const int flags = fcntl(m_socket, F_GETFL, 0);
@@ -33,33 +34,32 @@ namespace Draupnir
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void TLSCallbacks::RawWrite(const std::vector<uint8_t>&& buf)
+	void TLSCallbacks::tls_emit_data(const uint8_t data[], size_t size)
 	{
-		auto size = buf.size();
-		auto pos = buf.data();
-		while (size)
-		{
-			const ssize_t res = write(m_socket, pos, size);
-			if (-1 == res && (errno != EINTR || errno != EAGAIN))
-				throw std::runtime_error("failed to write: " + std::string(strerror(errno)));
-
-			size -= static_cast<size_t>(res);
-			pos += res;
-		}
+		DEBUG_LOG << "TLS emit data: " << size << " bytes";
+		++m_emittedRecords;
+		if (m_detached)
+			m_detachedOutput.insert(m_detachedOutput.end(), data, data + size);
+		else
+			m_outbound.Write(m_socket, data, size);
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void TLSCallbacks::tls_emit_data(const uint8_t data[], size_t size)
+	void TLSCallbacks::Reattach()
 	{
-		Logger::GetInstance().Debug() << "TLS emit data: " << size << " bytes";
-		RawWrite(std::vector<uint8_t>(data, data + size));
+		m_detached = false;
+		if (m_detachedOutput.empty())
+			return;
+
+		m_outbound.Write(m_socket, m_detachedOutput.data(), m_detachedOutput.size());
+		std::vector<uint8_t>().swap(m_detachedOutput);
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void TLSCallbacks::tls_record_received(uint64_t seqNo __attribute__((unused)), const uint8_t data[], size_t size)
+	void TLSCallbacks::tls_record_received(uint64_t seqNo, const uint8_t data[] __attribute__((unused)), size_t size)
 	{
-		Logger::GetInstance().Debug() << "TLS record received: " << size << " bytes: "
-			<< std::string(data, data + size);
+		// The contents are the terminal traffic, neither worth copying nor logging
+		DEBUG_LOG << "TLS record " << seqNo << " received: " << size << " bytes";
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -67,12 +67,11 @@ namespace Draupnir
 	{
 		if (Botan::TLS::Alert::CLOSE_NOTIFY == alert.type())
 		{
-			Logger::GetInstance().Debug() << "TLS close notitification received, closing the socket";
-			close(m_socket);
+			DEBUG_LOG << "TLS close notitification received";
 		}
 		else
 		{
-			Logger::GetInstance().Error() << "TLS alert: " << alert.type_string();
+			ERROR_LOG << "TLS alert: " << alert.type_string();
 		}
 	}
 
@@ -80,9 +79,9 @@ namespace Draupnir
 	bool TLSCallbacks::tls_session_established(const Botan::TLS::Session& session)
 	{
 		const auto& info = session.server_info();
-		Logger::GetInstance().Debug() << "TLS session with " << info.hostname()
+		DEBUG_LOG << "TLS session with " << info.hostname()
 		    << ":" << info.port() << " established";
-		Logger::GetInstance().Debug() << session.version().to_string() << " using "
+		DEBUG_LOG << session.version().to_string() << " using "
 			<< session.ciphersuite().to_string();
 		return true; // enable caching of the session in the configured session manager
 	}
@@ -112,7 +111,7 @@ namespace Draupnir
 			std::chrono::system_clock::now(),
 			ocspTimeout,
 			ocspResponses);
-		Logger::GetInstance().Debug() << "certificate validation status: "
+		DEBUG_LOG << "certificate validation status: "
 			<< result.result_string();
 	}
 } // namespace Draupnir
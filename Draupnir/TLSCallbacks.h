@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include "OutboundQueue.h"
+
 #include <botan/tls_callbacks.h>
 #include <vector>
 
@@ -14,11 +16,67 @@ namespace Draupnir
 	class TLSCallbacks : public Botan::TLS::Callbacks
 	{
 		int m_socket = -1;
-		
-		void RawWrite(const std::vector<uint8_t>&& buf);			
+		OutboundQueue m_outbound;
+		// Records emitted while the connection is handled off the reactor
+		std::vector<uint8_t> m_detachedOutput;
+		bool m_detached = false;
+		// Every record Botan writes is emitted on its own
+		uint64_t m_emittedRecords = 0;
 
 	public:
-		explicit TLSCallbacks(int sock);
+		// Deferred output is only queued, the owner submits the writes itself
+		TLSCallbacks(int sock, BufferPool& buffers, bool isDeferred);
+
+		// Collect the emitted records aside while the connection is handled by
+		// another thread: the outbound queue belongs to the reactor
+		void Detach()
+		{
+			m_detached = true;
+		}
+
+		// Pass the records collected while detached to the outbound queue
+		void Reattach();
+
+		bool IsDetached() const noexcept
+		{
+			return m_detached;
+		}
+
+		// Flush the queued TLS records when the socket becomes writable,
+		// returns true when nothing is left in the queue
+		bool FlushOutput()
+		{
+			return m_outbound.Flush(m_socket);
+		}
+
+		// Describe the queued TLS records for the write of the deferred output
+		size_t PrepareOutput(struct iovec* iov, size_t maxCount) const
+		{
+			return m_outbound.Prepare(iov, maxCount);
+		}
+
+		// The write of the deferred output is over, the records leave the queue
+		void OnOutputWritten(size_t written)
+		{
+			m_outbound.Consume(written);
+		}
+
+		// TLS records written to the connection so far
+		uint64_t GetEmittedRecords() const noexcept
+		{
+			return m_emittedRecords;
+		}
+
+		bool HasPendingOutput() const noexcept
+		{
+			return !m_outbound.IsEmpty();
+		}
+
+		// The peer doesn't keep up with the output, stop producing it
+		bool IsOutputCongested() const noexcept
+		{
+			return m_outbound.IsCongested();
+		}
 
 		void tls_emit_data(const uint8_t data[], size_t size) override;
 		void tls_record_received(uint64_t seqNo, const uint8_t data[], size_t size) override;
@@ -6,12 +6,57 @@
 
 #include "TLSPolicy.h"
 
+#include <botan/cpuid.h>
+
+// Algorithm of the embedded key is chosen at the build time
+#ifndef DRAUPNIR_KEY_ALGORITHM
+#define DRAUPNIR_KEY_ALGORITHM "ECDSA"
+#endif
+
 namespace Draupnir
 {
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TLSPolicy::TLSPolicy(Cipher cipher, KeyExchange keyExchange)
+		: TLSPolicy(cipher, keyExchange, DRAUPNIR_KEY_ALGORITHM)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TLSPolicy::TLSPolicy(Cipher cipher, KeyExchange keyExchange, const std::string& signatureMethod)
+		: m_ciphers(SelectCiphers(cipher))
+		, m_keyExchange(keyExchange)
+		, m_signatureMethod(signatureMethod)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool TLSPolicy::HasHardwareAES()
+	{
+		return Botan::CPUID::has_hw_aes();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::vector<std::string> TLSPolicy::SelectCiphers(Cipher cipher)
+	{
+		switch (cipher)
+		{
+		case AES:
+			return { "AES-128/GCM", "AES-256/GCM" };
+		case ChaCha20:
+			return { "ChaCha20Poly1305" };
+		default:
+			// The server picks the first suite the client supports, so the
+			// order reflects what is faster on this CPU
+			if (HasHardwareAES())
+				return { "AES-128/GCM", "AES-256/GCM", "ChaCha20Poly1305" };
+			return { "ChaCha20Poly1305", "AES-128/GCM", "AES-256/GCM" };
+		}
+	}
+
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	std::vector<std::string> TLSPolicy::allowed_ciphers() const
 	{
-		return { "ChaCha20Poly1305" };
+		return m_ciphers;
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -23,7 +68,15 @@ namespace Draupnir
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	std::vector<std::string> TLSPolicy::allowed_key_exchange_methods() const
 	{
-		return { "CECPQ1" };
+		if (CECPQ1 == m_keyExchange)
+			return { "CECPQ1" };
+		return { "ECDH" };
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::vector<Botan::TLS::Group_Params> TLSPolicy::key_exchange_groups() const
+	{
+		return { Botan::TLS::Group_Params::X25519 };
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -35,7 +88,7 @@ namespace Draupnir
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	std::vector<std::string> TLSPolicy::allowed_signature_methods() const
 	{
-		return { "RSA" };
+		return { m_signatureMethod };
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -13,11 +13,41 @@ namespace Draupnir
 	class TLSPolicy : public Botan::TLS::Policy
 	{
 	public:
+		enum Cipher
+		{
+			// AES-GCM with the hardware AES, ChaCha20-Poly1305 otherwise
+			AutoCipher,
+			AES,
+			ChaCha20
+		};
+
+		enum KeyExchange
+		{
+			X25519,
+			CECPQ1
+		};
+
+		// Policy matching the embedded key
+		TLSPolicy(Cipher cipher, KeyExchange keyExchange);
+		// Policy for the key of the given algorithm: ECDSA or RSA
+		TLSPolicy(Cipher cipher, KeyExchange keyExchange, const std::string& signatureMethod);
+
 		std::vector<std::string> allowed_ciphers() const final override;
 		std::vector<std::string> allowed_macs() const final override;
 		std::vector<std::string> allowed_key_exchange_methods() const final override;
+		std::vector<Botan::TLS::Group_Params> key_exchange_groups() const final override;
 		std::vector<std::string> allowed_signature_hashes() const final override;
 		std::vector<std::string> allowed_signature_methods() const final override;
 		bool acceptable_protocol_version(Botan::TLS::Protocol_Version version) const final override;
+
+		// The CPU encrypts AES in hardware
+		static bool HasHardwareAES();
+
+	private:
+		const std::vector<std::string> m_ciphers;
+		const KeyExchange m_keyExchange;
+		const std::string m_signatureMethod;
+
+		static std::vector<std::string> SelectCiphers(Cipher cipher);
 	};
 } // namespace Draupnir
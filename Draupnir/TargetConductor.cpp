@@ -5,186 +5,108 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "TargetConductor.h"
-#include "CredentialsManager.h"
 #include "Config.h"
+#include "Poller.h"
 #include "Logger.h"
 
+#include <botan/system_rng.h>
+
+#include <thread>
+#include <memory>
+#include <vector>
+#include <csignal>
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
-#include <vector>
 
-#include <sys/socket.h>
 #include <sys/epoll.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <fcntl.h>
 
 namespace Draupnir
 {
 	////////////////////////////////////////////////////////////////////////////////////////////////////
 	TargetConductor::TargetConductor(std::shared_ptr<Config> config)
 		: Conductor(config)
-		, m_listeningSocket(BindSocket())
-		, m_poll(epoll_create1(0))
+		, m_children()
+		, m_creds(CredentialsManager::Server)
+		, m_policy(GetConfig().GetCipher(), GetConfig().GetKeyExchange())
+		, m_sessionCache(Botan::system_rng())
+		, m_admission(GetConfig().GetAcceptRate(), GetConfig().GetSourceRate())
+		, m_handshakes(GetConfig().GetHandshakeThreadCount(), GetConfig().GetMaxHandshakes())
 	{
+		// Bind all the listening sockets beforehand, so the configuration
+		// errors are reported before any thread is started
+		const unsigned workers = GetConfig().GetWorkerCount();
+		for (unsigned id = 0; id < workers; ++id)
+			m_reactors.emplace_back(new TargetReactor(GetConfig(), id, m_admission, m_handshakes, m_children, m_creds,
+				m_policy, m_sessionCache));
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	SocketHandle TargetConductor::BindSocket() const
+	TargetConductor::~TargetConductor()
 	{
-		const auto addr = GetConfig().GetPeerAddress();
-		SocketHandle sock(socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, 0));
-		if (!sock)
-			throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
-
-		POSIX_CHECK(bind(sock.get(), addr->ai_addr, addr->ai_addrlen));
-		POSIX_CHECK(listen(sock.get(), SOMAXCONN));
-		return sock;
+		// The tasks in progress refer to the sessions and the mailboxes of the
+		// reactors, the queued ones are dropped
+		m_handshakes.Stop();
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void TargetConductor::Run()
+	int TargetConductor::Run()
 	{
-		Logger& log = Logger::GetInstance();
-		log.Info() << "Draupnir is started in target mode";
-
+		INFO_LOG << "Draupnir is started in target mode with " << m_reactors.size() << " reactor(s) and "
+			<< GetConfig().GetHandshakeThreadCount() << " handshake thread(s)";
+		INFO_LOG << "hardware AES is " << (TLSPolicy::HasHardwareAES() ? "available" : "not available")
+			<< ", preferred cipher is " << m_policy.allowed_ciphers().front();
+
+		// A peer gone in the middle of a write is reported by EPIPE, and the
+		// commands of the sessions restore the default action before exec
+		if (SIG_ERR == signal(SIGPIPE, SIG_IGN))
+			throw std::runtime_error("failed to ignore SIGPIPE: " + std::string(strerror(errno)));
+
+		std::vector<std::thread> threads;
+		threads.reserve(m_reactors.size());
+		size_t running = m_reactors.size();
+		for (auto& reactor : m_reactors)
 		{
-			struct epoll_event event;
-			event.data.fd = m_listeningSocket.get();
-			event.events = EPOLLIN | EPOLLET;
-			POSIX_CHECK(epoll_ctl(m_poll.get(), EPOLL_CTL_ADD, m_listeningSocket.get(), &event));
-		}
-
-		std::vector<struct epoll_event> events(64);
-		while (true)
-		{
-			const int numEvents = epoll_wait(m_poll.get(), events.data(), events.size(), -1);
-			POSIX_CHECK(numEvents);
-			for (int idx = 0; idx < numEvents; ++idx)
+			TargetReactor* instance = reactor.get();
+			threads.emplace_back([this, instance, &running]()
 			{
-				const auto& event = events[idx];
-				const auto& fd = event.data.fd;
-				
-				if ((event.events & EPOLLERR) || (event.events & EPOLLHUP) ||
-					(!(event.events & EPOLLIN)))
+				try
 				{
-					log.Error() << "error reading socket " << fd;
-					if (!m_activeSessions.erase(fd))
-						log.Error() << "failed to find active session for FD "
-							<< fd << ", memory leak is possible";
-					if (event.events & EPOLLERR)
-						log.Error() << "poll error " << strerror(errno);
-					else if (event.events & EPOLLHUP)
-						log.Error() << "poll hup";
-					close(fd);
-					continue;
+					instance->Run();
 				}
-
-				if ((int)m_listeningSocket.get() == fd)
-				{
-					AcceptConnections();
-				}				
-				else
+				catch (const std::exception& e)
 				{
-					// We have a data on the socket waiting to be read. We must read whatever
-					// data is available completely, as we are running in edge-triggered mode
-					// and won't get a notification again for the same data
-					auto& session = m_activeSessions.at(fd);
-					while (true)
-					{
-						std::vector<uint8_t> buf(512);
-						const ssize_t count = read(fd, buf.data(), buf.size());
-						if (count == -1)
-						{
-							// If errno == EAGAIN, that means we have read all the data.
-							// So go back to the main loop.
-							if(EAGAIN == errno)
-								break;
-							throw std::runtime_error("socket read error: " + std::string(strerror(errno)) + ", fd=" + std::to_string(fd));
-						}
-						else if (count == 0)
-							break;
-
-						if (fd == (int)session->GetNetworkSocket().get())
-							session->OnNetworkData(buf.data(), count);
-						else if (fd == (int)session->GetPtySocket().get())
-							session->OnConsoleData(buf.data(), count);
-					}
+					ERROR_LOG << "reactor terminated: " << e.what();
 				}
-			}
+				// The connections balanced to the reactor would never be accepted
+				instance->StopListening();
+				m_mailbox.Post([&running]() { --running; });
+			});
 		}
-	}
 
-	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void TargetConductor::ActivateSession(const TargetSession& session)
-	{
-		const auto ptyHandle = session.GetPtySocket().get();
-		auto netHandle = session.GetNetworkSocket().get();
-		
-		Logger::GetInstance().Debug() << "activating session with network socket " << netHandle
-			<< " and PTY socket " << ptyHandle;
-		
-		struct epoll_event event;
-		event.data.fd = ptyHandle;
-		event.events = EPOLLIN | EPOLLET;
-		POSIX_CHECK(epoll_ctl(m_poll.get(), EPOLL_CTL_ADD, ptyHandle, &event));
-		
-		auto& activeSession = m_activeSessions.at(netHandle);
-		// Bacause of unique nature on UNIX handle we can use the single
-		// registry of sessions to look up both by network handle and PTY handle
-		m_activeSessions.emplace(std::make_pair(ptyHandle, activeSession));
-	}
-	
-	////////////////////////////////////////////////////////////////////////////////////////////////////
-	void TargetConductor::AcceptConnections()
-	{
-		// We have notification on the listening socket, which means
-		// one or more incoming connections
-		while(true)
+		// The children of all the sessions are reaped here, while the reactors run
+		std::unique_ptr<Poller> poller = Poller::Create(GetConfig().GetPollerBackend());
+		poller->Add(m_children.GetHandle(), EPOLLIN, m_children.GetHandle());
+		poller->Add(m_mailbox.GetHandle(), EPOLLIN, m_mailbox.GetHandle());
+		while (running)
 		{
-			struct sockaddr inAddr;
-			socklen_t inAddrLen = sizeof(struct sockaddr_in);
-			SocketHandle sock(accept(m_listeningSocket.get(), &inAddr, &inAddrLen));
-			if (!sock)
-			{
-				// We have processed all incoming connections
-				if(EAGAIN == errno || EWOULDBLOCK == errno)
-					break;
-
-				throw std::runtime_error("failed to accept connection: " + std::string(strerror(errno)));
-			}
-			MakeSocketNonBlocking(sock);
-
-			std::vector<char> hostname(NI_MAXHOST);
-			std::vector<char> portname(NI_MAXSERV);
+			struct epoll_event events[2];
+			const int numEvents = poller->Wait(events, 2, -1);
+			if (-1 == numEvents && EINTR == errno)
+				continue;
+			POSIX_CHECK(numEvents);
 
-			const int gaiRetVal = getnameinfo(&inAddr,
-				inAddrLen,
-				hostname.data(),
-				hostname.size(),
-				portname.data(),
-				portname.size(),
-				NI_NUMERICHOST | NI_NUMERICSERV);
-			if (0 == gaiRetVal)
-			{
-				Logger::GetInstance().Info() << "accepted connection from "
-					<< hostname.data() << ':' << portname.data();
-			}
-			else
+			for (int idx = 0; idx < numEvents; ++idx)
 			{
-				Logger::GetInstance().Error() << "failed to get peer address: "
-					<< gai_strerror(gaiRetVal);
+				if (static_cast<int>(events[idx].data.u64) == m_children.GetHandle())
+					m_children.Reap();
+				else
+					m_mailbox.Dispatch();
 			}
-
-			struct epoll_event event;
-			event.data.fd = sock.get();
-			event.events = EPOLLIN | EPOLLET;
-			POSIX_CHECK(epoll_ctl(m_poll.get(), EPOLL_CTL_ADD, sock.get(), &event));
-
-			auto handle = sock.get();
-			auto newSession = std::make_shared<TargetSession>(std::move(sock), *this);
-			m_activeSessions.emplace(std::make_pair(handle, newSession));
 		}
-	}	
+
+		for (auto& thread : threads)
+			thread.join();
+		return EXIT_SUCCESS;
+	}
 } // namespace Draupnir
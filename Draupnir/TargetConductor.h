@@ -6,32 +6,45 @@
 
 #pragma once
 
-#include "Posix.h"
 #include "Conductor.h"
-#include "TargetSession.h"
+#include "AdmissionControl.h"
+#include "ChildReaper.h"
+#include "Mailbox.h"
+#include "TargetReactor.h"
+#include "HandshakePool.h"
+#include "CredentialsManager.h"
+
+#include <botan/tls_session_manager.h>
 
-#include <map>
 #include <memory>
+#include <vector>
 
 namespace Draupnir
 {		
 	class TargetConductor final : public Conductor
 	{
-		SocketHandle m_listeningSocket;
-		SocketHandle m_poll;
-
-		using Session = std::shared_ptr<TargetSession>;		
-		std::map<int, Session> m_activeSessions;		
+		// Created first: SIGCHLD is blocked before the handshake threads are
+		// started, and the reactor threads inherit the mask as well. The only
+		// thread started before, the writer of the logger, blocks all signals
+		ChildReaper m_children;
+		// Calls of the reactor threads to the conductor's loop
+		Mailbox m_mailbox;
+		// Credentials and policy built once for all the sessions
+		CredentialsManager m_creds;
+		const TLSPolicy m_policy;
+		// TLS sessions shared by all the reactors for resumption
+		Botan::TLS::Session_Manager_In_Memory m_sessionCache;
+		// Rate limits of the connections accepted by all the reactors
+		AdmissionControl m_admission;
+		// Outlives the reactors, the tickets of their sessions are returned to
+		// it. Its threads are stopped by the destructor before the reactors
+		// they report to are destroyed
+		HandshakePool m_handshakes;
+		std::vector<std::unique_ptr<TargetReactor>> m_reactors;
 
-		SocketHandle BindSocket() const;
-		void AcceptConnections();		
-		
 	public:
-		virtual ~TargetConductor() = default;
-		void Run() override;
-		
-		// Add PTY handle of the session to the polling cycle
-		void ActivateSession(const TargetSession& session);
+		virtual ~TargetConductor();
+		int Run() override;
 
 	protected:
 		friend class Conductor;
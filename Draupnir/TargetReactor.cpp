@@ -0,0 +1,1005 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/TargetReactor.cpp
+//
+// summary:	Implements the target reactor class
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TargetReactor.h"
+#include "Config.h"
+#include "Logger.h"
+
+#include <cstring>
+#include <cerrno>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+namespace
+{
+	// Precision of the session timeouts, which are given in seconds
+	const std::chrono::milliseconds TimerResolution(100);
+	// Pause of the accepting after the descriptors or the memory have run out
+	const std::chrono::milliseconds AcceptBackoff(500);
+	// The failures of accept() are logged at most this often
+	const std::chrono::seconds AcceptErrorInterval(10);
+	// Accepts kept queued on the listening socket by the completion-based I/O
+	const size_t AcceptDepth = 8;
+	// Buffers shared by the completion-based reads of all the descriptors, one
+	// holds a full TLS record
+	const size_t ReadBufferCount = 256;
+	const size_t ReadBufferSize = 16 * 1024;
+	// Pooled chunks of the output passed to a single write request
+	const size_t WriteChunks = 64;
+} // namespace
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TargetReactor::TargetReactor(const Config& config, unsigned id, AdmissionControl& admission,
+		HandshakePool& handshakes, ChildReaper& children, CredentialsManager& creds, const TLSPolicy& policy,
+		Botan::TLS::Session_Manager& sessionCache)
+		: m_config(config)
+		, m_id(id)
+		, m_listeningSocket(BindSocket())
+		, m_poller(Poller::Create(config.GetPollerBackend()))
+		, m_io(m_poller->GetCompletionIo())
+		, m_admission(admission)
+		, m_handshakes(handshakes)
+		, m_children(children)
+		, m_creds(creds)
+		, m_policy(policy)
+		, m_sessionCache(sessionCache)
+		, m_coalescingWindow(config.GetCoalescingWindow())
+		, m_isCompressionEnabled(config.IsCompressionEnabled() && CompressedStream::IsAvailable())
+		, m_flushTimer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+		, m_timers(TimerResolution)
+		, m_handshakeTimeout(config.GetHandshakeTimeout())
+		, m_idleTimeout(config.GetIdleTimeout())
+		, m_keepaliveInterval(config.GetKeepaliveInterval())
+		, m_acceptBackoff([this]() { AcceptConnections(); })
+		, m_acceptErrors(0)
+		, m_acceptErrorReported()
+		, m_consoleBytes(0)
+		, m_consoleRecords(0)
+	{
+		if (!m_flushTimer)
+			throw std::runtime_error("failed to create timer: " + std::string(strerror(errno)));
+
+		if (m_io)
+		{
+			m_readBuffers.reserve(ReadBufferCount);
+			for (size_t idx = 0; idx < ReadBufferCount; ++idx)
+			{
+				m_readBuffers.push_back(m_buffers.Acquire(ReadBufferSize));
+				m_io->ProvideBuffer(m_readBuffers.back().Data(), m_readBuffers.back().Size());
+			}
+			m_accepts.resize(AcceptDepth);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	SocketHandle TargetReactor::BindSocket() const
+	{
+		const auto addr = m_config.GetPeerAddress();
+		SocketHandle sock(socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+		if (!sock)
+			throw std::runtime_error("failed to create socket: " + std::string(strerror(errno)));
+
+		// Every reactor binds its own socket to the same address, the kernel
+		// balances incoming connections between them
+		const int enable = 1;
+		POSIX_CHECK(setsockopt(sock.get(), SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)));
+		POSIX_CHECK(setsockopt(sock.get(), SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)));
+
+		POSIX_CHECK(bind(sock.get(), addr->ai_addr, addr->ai_addrlen));
+		POSIX_CHECK(listen(sock.get(), SOMAXCONN));
+		return sock;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::StopListening() noexcept
+	{
+		// The accepts queued to the poller hold the socket as well, they are
+		// cancelled together with the poller
+		m_io = nullptr;
+		m_poller.reset();
+		m_listeningSocket.reset();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::Run()
+	{
+		DEBUG_LOG << "reactor " << m_id << " is listening on socket " << m_listeningSocket.get()
+			<< " using " << m_poller->GetName() << (m_io ? " with completion-based I/O" : "");
+
+		if (m_io)
+			AcceptConnections();
+		else
+			m_poller->Add(m_listeningSocket.get(), EPOLLIN, ListenerToken);
+		m_poller->Add(m_mailbox.GetHandle(), EPOLLIN, MailboxToken);
+		m_poller->Add(m_flushTimer.get(), EPOLLIN, FlushTimerToken);
+		m_poller->Add(m_timers.GetHandle(), EPOLLIN, TimerWheelToken);
+
+		std::vector<struct epoll_event> events(64);
+		while (true)
+		{
+			const int numEvents = m_poller->Wait(events.data(), events.size(), -1);
+			if (-1 == numEvents && EINTR == errno)
+				continue;
+			POSIX_CHECK(numEvents);
+
+			// The completions go first, so the output a shell has left before
+			// its exit is handled before the exit reported by the mailbox
+			if (m_io)
+			{
+				m_io->TakeCompletions(m_completions);
+				for (const auto& completion : m_completions)
+				{
+					HandleCompletion(completion);
+					// The data is consumed by now, the buffer goes back to the kernel
+					if (completion.bufferId >= 0)
+						m_io->ReturnBuffer(completion.bufferId);
+				}
+			}
+
+			for (int idx = 0; idx < numEvents; ++idx)
+			{
+				const auto& event = events[idx];
+				const uint64_t token = event.data.u64;
+				if (ListenerToken == token)
+				{
+					if (event.events & (EPOLLERR | EPOLLHUP))
+						throw std::runtime_error("error on listening socket");
+					AcceptConnections();
+					continue;
+				}
+
+				if (MailboxToken == token)
+				{
+					m_mailbox.Dispatch();
+					continue;
+				}
+
+				if (FlushTimerToken == token)
+				{
+					FlushConsoles();
+					continue;
+				}
+
+				if (TimerWheelToken == token)
+				{
+					m_timers.Expire();
+					continue;
+				}
+
+				// The session could be closed or passed to the handshake thread
+				// by one of the previous events of this batch
+				TargetSession* session = m_sessions.Find(token);
+				if (!session || session->IsDetached())
+					continue;
+
+				const int fd = static_cast<int>(token & 0xFFFFFFFF);
+				try
+				{
+					if (!HandleEvent(*session, fd, event.events))
+						CloseSession(*session);
+					else if (session->HasHandshakeInput())
+						OffloadHandshake(*session);
+					else
+						UpdateInterest(*session);
+				}
+				catch (const std::exception& e)
+				{
+					ERROR_LOG << "session with network socket " << session->GetNetworkSocket().get()
+						<< " failed: " << e.what();
+					CloseSession(*session);
+				}
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool TargetReactor::HandleEvent(TargetSession& session, int fd, uint32_t events)
+	{
+		const bool fromNetwork = fd == (int)session.GetNetworkSocket().get();
+		// The input of a shell or a command has room again or was closed
+		if (!fromNetwork && session.IsConsoleInput(fd))
+		{
+			session.OnConsoleWritable(fd);
+			return !session.IsClosed();
+		}
+
+		if (events & EPOLLERR)
+		{
+			ERROR_LOG << "poll error on " << fd;
+			if (fromNetwork)
+				return false;
+			session.OnConsoleClosed(fd);
+			return !session.IsClosed();
+		}
+
+		if (fromNetwork && (events & EPOLLOUT))
+		{
+			session.FlushOutput();
+			session.OnOutputDrained();
+		}
+
+		// Hangup is handled as a readable state: the rest of the data is read
+		// before the end of file is reached
+		if (!(events & (EPOLLIN | EPOLLHUP)))
+			return !session.IsClosed();
+		if (fromNetwork)
+			session.SetLastActivity(m_timers.GetTicks());
+
+		// We have a data on the socket waiting to be read. We must read whatever
+		// data is available completely, as we are running in edge-triggered mode
+		// and won't get a notification again for the same data
+		while (true)
+		{
+			// Leave the console data in the PTY while the peer doesn't keep up
+			// with the output, the PTY is resumed when the queue drains or the
+			// peer opens the window of the channel
+			if (!fromNetwork && session.IsConsolePaused(fd))
+				break;
+
+			const ssize_t count = m_buffers.Read(fd, [&session, fd, fromNetwork](const uint8_t* data, size_t size)
+			{
+				if (fromNetwork)
+					session.OnNetworkData(data, size);
+				else
+					session.OnConsoleData(fd, data, size);
+			});
+			if (count == -1)
+			{
+				// If errno == EAGAIN, that means we have read all the data.
+				// So go back to the main loop.
+				if (EAGAIN == errno)
+					break;
+				if (EINTR == errno)
+					continue;
+				// The PTY master reports EIO once the shell has closed the slave
+				if (!fromNetwork)
+				{
+					DEBUG_EVENT("PTY {} is closed: {}", fd, strerror(errno));
+					session.OnConsoleClosed(fd);
+					break;
+				}
+				ERROR_LOG << "read error on " << fd << ": " << strerror(errno);
+				return false;
+			}
+			else if (count == 0)
+			{
+				DEBUG_EVENT("end of file reached on {}", fd);
+				// Only the channel of the PTY is over, not the connection
+				if (!fromNetwork)
+				{
+					session.OnConsoleClosed(fd);
+					break;
+				}
+				return false;
+			}
+		}
+		return !session.IsClosed();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::HandleCompletion(const CompletionIo::Completion& completion)
+	{
+		if (CompletionIo::Accept == completion.operation)
+		{
+			AcceptSlot& slot = m_accepts.at(completion.data);
+			slot.request = 0;
+			if (completion.result >= 0)
+				OnAccepted(SocketHandle(completion.result), slot.addr, slot.addrLen);
+			else if (ECANCELED != -completion.result && !OnAcceptError(-completion.result))
+				return;
+			// The accept is queued again unless the loop backs off
+			AcceptConnections();
+			return;
+		}
+
+		const int fd = static_cast<int>(completion.data & 0xFFFFFFFF);
+		PendingIo& pending = GetPendingIo(fd);
+		if (CompletionIo::Read == completion.operation && pending.read == completion.id)
+			pending.read = 0;
+		if (CompletionIo::Write == completion.operation && pending.write == completion.id)
+			pending.write = 0;
+		// The output of the closed session is over, the session can go
+		if (CompletionIo::Write == completion.operation && m_closing.erase(completion.id))
+			return;
+
+		// The descriptor could be closed or reused since the request was queued
+		TargetSession* session = m_sessions.Find(completion.data);
+		if (!session)
+			return;
+
+		// The handshake thread owns the session, only the records written
+		// before it was passed there leave the queue
+		if (session->IsDetached())
+		{
+			if (completion.result > 0)
+				session->OnOutputWritten(static_cast<size_t>(completion.result));
+			return;
+		}
+
+		try
+		{
+			const bool isOpen = CompletionIo::Read == completion.operation
+				? OnReadComplete(*session, fd, completion)
+				: OnWriteComplete(*session, fd, completion.result);
+			if (!isOpen)
+				CloseSession(*session);
+			else if (session->HasHandshakeInput())
+				OffloadHandshake(*session);
+			else
+				UpdateInterest(*session);
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "session with network socket " << session->GetNetworkSocket().get()
+				<< " failed: " << e.what();
+			CloseSession(*session);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool TargetReactor::OnReadComplete(TargetSession& session, int fd, const CompletionIo::Completion& completion)
+	{
+		const bool fromNetwork = fd == (int)session.GetNetworkSocket().get();
+		if (completion.result > 0)
+		{
+			const size_t size = static_cast<size_t>(completion.result);
+			if (fromNetwork)
+			{
+				session.SetLastActivity(m_timers.GetTicks());
+				session.OnNetworkData(completion.buffer, size);
+			}
+			else
+			{
+				session.OnConsoleData(fd, completion.buffer, size);
+			}
+			return !session.IsClosed();
+		}
+
+		if (0 == completion.result)
+		{
+			DEBUG_EVENT("end of file reached on {}", fd);
+			// Only the channel of the PTY is over, not the connection
+			if (!fromNetwork)
+			{
+				session.OnConsoleClosed(fd);
+				return !session.IsClosed();
+			}
+			return false;
+		}
+
+		// The provided buffers are all taken until the end of the batch, or the
+		// read is interrupted: the read is queued again
+		const int error = -completion.result;
+		if (ENOBUFS == error || ECANCELED == error || EAGAIN == error || EINTR == error)
+			return !session.IsClosed();
+		// The PTY master reports EIO once the shell has closed the slave
+		if (!fromNetwork)
+		{
+			DEBUG_EVENT("PTY {} is closed: {}", fd, strerror(error));
+			session.OnConsoleClosed(fd);
+			return !session.IsClosed();
+		}
+		ERROR_LOG << "read error on " << fd << ": " << strerror(error);
+		return false;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool TargetReactor::OnWriteComplete(TargetSession& session, int fd, int32_t result)
+	{
+		if (result < 0)
+		{
+			// The rest of the output is queued again
+			const int error = -result;
+			if (ECANCELED == error || EAGAIN == error || EINTR == error)
+				return !session.IsClosed();
+			throw std::runtime_error("failed to write to " + std::to_string(fd) + ": " + std::string(strerror(error)));
+		}
+
+		session.OnOutputWritten(static_cast<size_t>(result));
+		session.OnOutputDrained();
+		return !session.IsClosed();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TargetReactor::PendingIo& TargetReactor::GetPendingIo(int fd)
+	{
+		const size_t index = static_cast<size_t>(fd);
+		if (index >= m_pendingIo.size())
+			m_pendingIo.resize(index + 1, PendingIo{ 0, 0 });
+		return m_pendingIo[index];
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::QueueRead(int fd)
+	{
+		PendingIo& pending = GetPendingIo(fd);
+		if (!pending.read)
+			pending.read = m_io->QueueRead(fd, m_sessions.GetToken(fd));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::QueueOutput(TargetSession& session)
+	{
+		// One write at a time keeps the order of the records
+		const int netHandle = session.GetNetworkSocket().get();
+		PendingIo& pending = GetPendingIo(netHandle);
+		if (pending.write || !session.HasPendingOutput())
+			return;
+
+		struct iovec iov[WriteChunks];
+		const size_t count = session.PrepareOutput(iov, WriteChunks);
+		pending.write = m_io->QueueWrite(netHandle, iov, count, m_sessions.GetToken(netHandle));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t TargetReactor::CancelIo(int fd)
+	{
+		PendingIo& pending = GetPendingIo(fd);
+		const uint64_t write = pending.write;
+		if (pending.read)
+			m_io->Cancel(pending.read);
+		if (pending.write)
+			m_io->Cancel(pending.write);
+		pending = PendingIo{ 0, 0 };
+		return write;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::UpdateInterest(TargetSession& session)
+	{
+		const int netHandle = session.GetNetworkSocket().get();
+		SetInterest(netHandle, EPOLLIN | (session.HasPendingOutput() ? EPOLLOUT : 0u));
+		if (m_io)
+			QueueOutput(session);
+
+		for (const auto& channel : session.GetChannels())
+		{
+			const bool isPaused = session.IsOutputCongested() || channel->IsBlocked();
+			for (const SocketHandle* handle : { &channel->console, &channel->errors })
+			{
+				if (*handle)
+					SetInterest(handle->get(), isPaused ? 0u : static_cast<uint32_t>(EPOLLIN));
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::SetInterest(int fd, uint32_t events)
+	{
+		// The descriptors of the completion-based I/O are not polled, the read
+		// is queued again whenever the previous one is over
+		const uint32_t current = m_sessions.GetEvents(fd);
+		if (m_io && (events & EPOLLIN))
+			QueueRead(fd);
+		if (current == events)
+			return;
+
+		if ((current & EPOLLIN) && !(events & EPOLLIN))
+			DEBUG_EVENT("output of {} is congested, reading is paused", fd);
+		else if (!(current & EPOLLIN) && (events & EPOLLIN))
+			DEBUG_EVENT("output of {} is drained, reading is resumed", fd);
+
+		if (!m_io)
+			m_poller->Modify(fd, events, m_sessions.GetToken(fd));
+		m_sessions.SetEvents(fd, events);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::OffloadHandshake(TargetSession& session)
+	{
+		// The socket leaves the poller while the handshake thread owns the
+		// session: nothing is read meanwhile, and the records emitted by the
+		// thread are kept aside by the session instead of the outbound queue.
+		// No read is queued by the completion-based I/O either, the last one
+		// has brought the handshake input
+		const int netHandle = session.GetNetworkSocket().get();
+		if (!m_io)
+			m_poller->Remove(netHandle);
+		m_sessions.SetEvents(netHandle, 0);
+		session.Detach();
+
+		const uint64_t token = m_sessions.GetToken(netHandle);
+		TargetSession* instance = &session;
+		m_handshakes.Submit([this, instance, token]()
+		{
+			std::string error;
+			try
+			{
+				instance->RunHandshake();
+			}
+			catch (const std::exception& e)
+			{
+				error = e.what();
+			}
+			m_mailbox.Post([this, token, error]() { CompleteHandshake(token, error); });
+		});
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::CompleteHandshake(uint64_t token, const std::string& error)
+	{
+		TargetSession* session = m_sessions.Find(token);
+		if (!session)
+			return;
+
+		try
+		{
+			// Put the socket back first: the data received meanwhile is reported
+			// right away, and the session is closed the regular way on failure
+			const int netHandle = session->GetNetworkSocket().get();
+			if (m_io)
+				QueueRead(netHandle);
+			else
+				m_poller->Add(netHandle, EPOLLIN, token);
+			m_sessions.SetEvents(netHandle, EPOLLIN);
+
+			// Send whatever the handshake thread emitted, including the alert
+			// on failure, and start the shell if the handshake is over
+			session->CompleteHandshake();
+			if (!error.empty())
+				throw std::runtime_error("TLS handshake failed: " + error);
+
+			if (session->IsClosed())
+				CloseSession(*session);
+			else
+				UpdateInterest(*session);
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "session with network socket "
+				<< session->GetNetworkSocket().get() << " failed: " << e.what();
+			CloseSession(*session);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::CloseSession(TargetSession& session)
+	{
+		const int netHandle = session.GetNetworkSocket().get();
+
+		// The last records and the alerts are written right away, as they would
+		// be without the completion-based I/O. The peer may be gone already
+		if (m_io && !GetPendingIo(netHandle).write)
+		{
+			try
+			{
+				session.FlushOutput();
+			}
+			catch (const std::exception& e)
+			{
+				DEBUG_EVENT("output of socket {} is dropped: {}", netHandle, e.what());
+			}
+		}
+
+		// All the descriptors leave the poller and the registry together, the
+		// session closes them on destruction. The pending requests are
+		// cancelled, but the write refers to the output of the session until
+		// its completion
+		const uint64_t write = m_io ? CancelIo(netHandle) : 0;
+		m_poller->Remove(netHandle);
+		m_buffers.Forget(netHandle);
+		for (const auto& channel : session.GetChannels())
+		{
+			for (const int handle : channel->GetHandles())
+			{
+				if (-1 != handle)
+				{
+					if (m_io)
+						CancelIo(handle);
+					m_poller->Remove(handle);
+					m_buffers.Forget(handle);
+				}
+			}
+		}
+		const uint64_t consoleBytes = session.GetConsoleBytes();
+		const uint64_t consoleRecords = session.GetConsoleRecords();
+		m_consoleBytes += consoleBytes;
+		m_consoleRecords += consoleRecords;
+
+		if (const CompressedStream* compression = session.GetCompression())
+		{
+			DEBUG_LOG << "session with network socket " << netHandle << " compression: "
+				<< compression->GetStats();
+		}
+		std::unique_ptr<TargetSession> owner = m_sessions.Remove(session);
+		if (write)
+		{
+			// Kept until the cancelled write is over, nothing refers to it meanwhile
+			owner->GetTimer().Cancel();
+			m_closing.emplace(write, std::move(owner));
+		}
+
+		if (consoleRecords)
+		{
+			DEBUG_LOG << "session with network socket " << netHandle << " sent " << consoleBytes
+				<< " bytes of console output in " << consoleRecords << " records, "
+				<< consoleBytes / consoleRecords << " bytes per record";
+		}
+		if (m_consoleRecords)
+		{
+			DEBUG_LOG << "reactor " << m_id << " sent " << m_consoleBytes << " bytes of console output in "
+				<< m_consoleRecords << " records, " << m_consoleBytes / m_consoleRecords << " bytes per record";
+		}
+		DEBUG_EVENT("session with network socket {} is closed, {} session(s) left on reactor {}",
+			netHandle, m_sessions.Size(), m_id);
+
+		const auto& stats = m_buffers.GetStats();
+		DEBUG_LOG << "reactor " << m_id << " buffers: " << stats.acquired
+			<< " acquired, " << stats.allocated << " allocated, " << stats.cached << " cached";
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::AttachHandle(TargetSession& session, int handle, uint32_t events)
+	{
+		DEBUG_EVENT("activating console socket {} of session with network socket {} on reactor {}",
+			handle, session.GetNetworkSocket().get(), m_id);
+
+		// The output of the shells and the commands is read by the completion-based
+		// I/O as well, their input is polled
+		const uint64_t token = m_sessions.Attach(handle, session, events);
+		if (m_io && (events & EPOLLIN))
+			QueueRead(handle);
+		else
+			m_poller->Add(handle, events, token);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::DetachHandle(TargetSession& session __attribute__((unused)), int handle)
+	{
+		// The events of the descriptor queued in the current batch resolve to nothing
+		if (m_io)
+			CancelIo(handle);
+		m_poller->Remove(handle);
+		m_buffers.Forget(handle);
+		m_sessions.Detach(handle);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::WatchChild(TargetSession& session, pid_t pid)
+	{
+		// The status is reaped on the conductor's thread and handled on this one,
+		// by then the session may be gone
+		const uint64_t token = m_sessions.GetToken(session.GetNetworkSocket().get());
+		m_children.Watch(pid, [this, token, pid](int status)
+		{
+			m_mailbox.Post([this, token, pid, status]() { OnChildExited(token, pid, status); });
+		});
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::HangUpChild(pid_t pid)
+	{
+		// The exit status may be on its way to the mailbox, only the reaper
+		// knows for sure the process is still there
+		m_children.HangUp(pid);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::OnChildExited(uint64_t token, pid_t pid, int status)
+	{
+		TargetSession* session = m_sessions.Find(token);
+		if (!session || session->IsDetached())
+			return;
+
+		try
+		{
+			session->OnChildExited(pid, status);
+			if (session->IsClosed())
+				CloseSession(*session);
+			else
+				UpdateInterest(*session);
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "session with network socket "
+				<< session->GetNetworkSocket().get() << " failed: " << e.what();
+			CloseSession(*session);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::OffloadHashing(TargetSession& session, uint16_t channel, uint64_t task,
+		std::function<void()> hashing)
+	{
+		// The hashing reads the file back, neither the sessions nor the
+		// handshakes should wait for it
+		const uint64_t token = m_sessions.GetToken(session.GetNetworkSocket().get());
+		auto run = [this, token, channel, task, hashing]()
+		{
+			std::string error;
+			try
+			{
+				hashing();
+			}
+			catch (const std::exception& e)
+			{
+				error = e.what();
+			}
+			m_mailbox.Post([this, token, channel, task, error]() { OnFileHashed(token, channel, task, error); });
+		};
+
+		m_hashing.Submit(std::move(run));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::OnFileHashed(uint64_t token, uint16_t channel, uint64_t task, const std::string& error)
+	{
+		TargetSession* session = m_sessions.Find(token);
+		if (!session)
+			return;
+
+		try
+		{
+			session->OnFileHashed(channel, task, error);
+			if (session->IsClosed())
+				CloseSession(*session);
+			else
+				UpdateInterest(*session);
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "session with network socket "
+				<< session->GetNetworkSocket().get() << " failed: " << e.what();
+			CloseSession(*session);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::ScheduleFlush(TargetSession& session)
+	{
+		// The window is the same for everyone, so the queue stays sorted
+		const auto deadline = std::chrono::steady_clock::now() + m_coalescingWindow;
+		if (m_flushQueue.empty())
+			ArmFlushTimer(deadline);
+		m_flushQueue.emplace_back(deadline, m_sessions.GetToken(session.GetNetworkSocket().get()));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::OnSessionTimer(TargetSession& session)
+	{
+		// The handshake thread owns the session, it's checked again shortly
+		if (session.IsDetached())
+		{
+			m_timers.Arm(session.GetTimer(), m_timers.GetResolution());
+			return;
+		}
+
+		const int netHandle = session.GetNetworkSocket().get();
+		try
+		{
+			// The peers connecting and never completing the handshake hold
+			// the memory of the TLS state for nothing
+			if (!session.IsActive())
+			{
+				ERROR_LOG << "TLS handshake on socket " << netHandle << " isn't over in "
+					<< m_handshakeTimeout.count() << " s, the session is closed";
+				CloseSession(session);
+				return;
+			}
+
+			const auto idle = m_timers.GetResolution()
+				* static_cast<std::chrono::milliseconds::rep>(m_timers.GetTicks() - session.GetLastActivity());
+			if (m_idleTimeout.count() && idle >= m_idleTimeout)
+			{
+				INFO_EVENT("session with network socket {} is idle for {} s, the session is closed",
+					netHandle, std::chrono::duration_cast<std::chrono::seconds>(idle).count());
+				CloseSession(session);
+				return;
+			}
+
+			// The control answers the probe, and the peer that is gone makes
+			// the probe fail long before the idle connection would notice
+			if (m_keepaliveInterval.count() && idle >= m_keepaliveInterval && session.SendKeepalive())
+				DEBUG_EVENT("keepalive is sent on socket {}", netHandle);
+			if (session.IsClosed())
+			{
+				CloseSession(session);
+				return;
+			}
+			UpdateInterest(session);
+
+			// Checked again once the keepalive is due or the session is idle for too long
+			auto next = std::chrono::milliseconds::max();
+			if (m_keepaliveInterval.count())
+				next = idle < m_keepaliveInterval ? m_keepaliveInterval - idle : m_keepaliveInterval;
+			if (m_idleTimeout.count())
+				next = std::min<std::chrono::milliseconds>(next, m_idleTimeout - idle);
+			if (std::chrono::milliseconds::max() != next)
+				m_timers.Arm(session.GetTimer(), next);
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "session with network socket " << netHandle << " failed: " << e.what();
+			CloseSession(session);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::ArmFlushTimer(std::chrono::steady_clock::time_point deadline)
+	{
+		// steady_clock is CLOCK_MONOTONIC, the deadline is passed as is
+		const auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+		struct itimerspec spec = {};
+		spec.it_value.tv_sec = static_cast<time_t>(sinceEpoch.count() / 1000000000);
+		spec.it_value.tv_nsec = static_cast<long>(sinceEpoch.count() % 1000000000);
+		POSIX_CHECK(timerfd_settime(m_flushTimer.get(), TFD_TIMER_ABSTIME, &spec, nullptr));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::FlushConsoles()
+	{
+		uint64_t expirations = 0;
+		if (-1 == read(m_flushTimer.get(), &expirations, sizeof(expirations)) && EAGAIN != errno)
+			throw std::runtime_error("failed to read timer: " + std::string(strerror(errno)));
+
+		const auto now = std::chrono::steady_clock::now();
+		while (!m_flushQueue.empty() && m_flushQueue.front().first <= now)
+		{
+			// The session could be closed while its output was held
+			TargetSession* session = m_sessions.Find(m_flushQueue.front().second);
+			m_flushQueue.pop_front();
+			if (!session)
+				continue;
+
+			try
+			{
+				session->FlushConsoleData();
+				UpdateInterest(*session);
+			}
+			catch (const std::exception& e)
+			{
+				ERROR_LOG << "session with network socket "
+					<< session->GetNetworkSocket().get() << " failed: " << e.what();
+				CloseSession(*session);
+			}
+		}
+
+		if (!m_flushQueue.empty())
+			ArmFlushTimer(m_flushQueue.front().first);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool TargetReactor::OnAcceptError(int error)
+	{
+		switch (error)
+		{
+		case EINTR:
+			return true;
+		// The connection is gone before it's accepted or the network error
+		// pending on it is reported by accept(), the next one is fine
+		case ECONNABORTED:
+		case EPROTO:
+		case EPERM:
+		case ENETDOWN:
+		case ENETUNREACH:
+		case EHOSTDOWN:
+		case EHOSTUNREACH:
+		case ENONET:
+		case ENOPROTOOPT:
+		case EOPNOTSUPP:
+			break;
+		// Out of the descriptors or the memory, retrying right away would spin
+		// the loop: the connections wait in the backlog until the pause is over
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			m_timers.Arm(m_acceptBackoff, AcceptBackoff);
+			break;
+		default:
+			throw std::runtime_error("failed to accept connection: " + std::string(strerror(error)));
+		}
+
+		// A storm of the connections would make a flood of the log
+		++m_acceptErrors;
+		const auto now = std::chrono::steady_clock::now();
+		if (now - m_acceptErrorReported >= AcceptErrorInterval)
+		{
+			ERROR_LOG << "reactor " << m_id << " failed to accept " << m_acceptErrors
+				<< " connection(s), last time: " << strerror(error);
+			m_acceptErrors = 0;
+			m_acceptErrorReported = now;
+		}
+		return !m_acceptBackoff.IsArmed();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::AcceptConnections()
+	{
+		// The listening socket is left alone until the pause is over
+		if (m_acceptBackoff.IsArmed())
+			return;
+
+		// The accepts stay queued, the connections come with their completions
+		if (m_io)
+		{
+			for (size_t idx = 0; idx < m_accepts.size(); ++idx)
+			{
+				AcceptSlot& slot = m_accepts[idx];
+				if (slot.request)
+					continue;
+				slot.addrLen = sizeof(slot.addr);
+				slot.request = m_io->QueueAccept(m_listeningSocket.get(), &slot.addr, &slot.addrLen, idx);
+			}
+			return;
+		}
+
+		// We have notification on the listening socket, which means
+		// one or more incoming connections
+		while(true)
+		{
+			struct sockaddr_storage inAddr;
+			socklen_t inAddrLen = sizeof(inAddr);
+			SocketHandle sock(accept4(m_listeningSocket.get(),
+				reinterpret_cast<struct sockaddr*>(&inAddr), &inAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC));
+			if (!sock)
+			{
+				// We have processed all incoming connections
+				if(EAGAIN == errno || EWOULDBLOCK == errno)
+					break;
+				if (!OnAcceptError(errno))
+					break;
+				continue;
+			}
+			OnAccepted(std::move(sock), inAddr, inAddrLen);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TargetReactor::OnAccepted(SocketHandle&& sock, const struct sockaddr_storage& inAddr, socklen_t inAddrLen)
+	{
+		// Check the limits before anything is spent on the connection,
+		// rejecting it costs the close() of the socket and nothing more
+		if (!m_admission.Admit(inAddr))
+			return;
+		// Drop the connection right away while too many handshakes are in
+		// progress, the client is free to retry later
+		HandshakePool::Ticket ticket = m_handshakes.Admit();
+		if (!ticket)
+		{
+			m_admission.RejectHandshake();
+			return;
+		}
+
+		char hostname[NI_MAXHOST];
+		char portname[NI_MAXSERV];
+		const int gaiRetVal = getnameinfo(reinterpret_cast<const struct sockaddr*>(&inAddr),
+			inAddrLen,
+			hostname,
+			sizeof(hostname),
+			portname,
+			sizeof(portname),
+			NI_NUMERICHOST | NI_NUMERICSERV);
+		if (0 == gaiRetVal)
+		{
+			INFO_EVENT("accepted connection from {}:{} on reactor {}", hostname, portname, m_id);
+		}
+		else
+		{
+			ERROR_LOG << "failed to get peer address: "
+				<< gai_strerror(gaiRetVal);
+		}
+
+		const int handle = sock.get();
+		std::unique_ptr<TargetSession> newSession(new TargetSession(std::move(sock), *this, std::move(ticket)));
+		// The handshake should be over by the first check of the session
+		m_timers.Arm(newSession->GetTimer(), m_handshakeTimeout);
+		newSession->SetLastActivity(m_timers.GetTicks());
+		const uint64_t token = m_sessions.Insert(handle, std::move(newSession), EPOLLIN);
+		if (m_io)
+			QueueRead(handle);
+		else
+			m_poller->Add(handle, EPOLLIN, token);
+	}
+} // namespace Draupnir
@@ -0,0 +1,218 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/TargetReactor.h
+//
+// summary:	Declares the target reactor class
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+#include "Poller.h"
+#include "BufferPool.h"
+#include "SessionTable.h"
+#include "TargetSession.h"
+#include "AdmissionControl.h"
+#include "HandshakePool.h"
+#include "ChildReaper.h"
+#include "CredentialsManager.h"
+#include "TLSPolicy.h"
+#include "Mailbox.h"
+#include "TimerWheel.h"
+#include "TaskWorker.h"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Draupnir
+{
+	class Config;
+
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Single-threaded event loop of the target mode. Every reactor
+	/// 			owns its own listening socket bound with SO_REUSEPORT, so
+	/// 			the kernel spreads incoming connections between reactors
+	/// 			and a session never leaves the thread that accepted it.
+	///
+	/// 			When the poller offers the completion-based I/O, the accepts
+	/// 			and the reads and writes of the network sockets and of the
+	/// 			console outputs are queued to the poller instead of being
+	/// 			made on readiness, and go to the kernel in one batch per
+	/// 			turn of the loop. Only the console inputs are still polled.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class TargetReactor final
+	{
+		// Requests of the completion-based I/O pending on a descriptor
+		struct PendingIo
+		{
+			uint64_t read;
+			uint64_t write;
+		};
+
+		// Accept queued on the listening socket and the address it fills
+		struct AcceptSlot
+		{
+			uint64_t request;
+			struct sockaddr_storage addr;
+			socklen_t addrLen;
+		};
+
+		const Config& m_config;
+		const unsigned m_id;
+		SocketHandle m_listeningSocket;
+		BufferPool m_buffers;
+		// Buffers the kernel picks from for the completion-based reads
+		std::vector<BufferPool::Buffer> m_readBuffers;
+		SessionTable m_sessions;
+		// Sessions closed while the kernel writes their output, by the request
+		std::unordered_map<uint64_t, std::unique_ptr<TargetSession>> m_closing;
+		// The requests of the poller refer to the buffers and the sessions, so
+		// it goes first on destruction
+		std::unique_ptr<Poller> m_poller;
+		// Completion-based I/O of the poller, null if it only reports readiness
+		CompletionIo* m_io;
+		std::vector<PendingIo> m_pendingIo;
+		std::vector<AcceptSlot> m_accepts;
+		std::vector<CompletionIo::Completion> m_completions;
+		AdmissionControl& m_admission;
+		HandshakePool& m_handshakes;
+		ChildReaper& m_children;
+		CredentialsManager& m_creds;
+		const TLSPolicy& m_policy;
+		Botan::TLS::Session_Manager& m_sessionCache;
+		Mailbox m_mailbox;
+		// Hashing of the transferred files, reports to the mailbox
+		TaskWorker m_hashing;
+
+		// Sessions holding the console output, in the order of their deadlines
+		const std::chrono::milliseconds m_coalescingWindow;
+		// Compression of the session traffic is accepted when the control offers it
+		const bool m_isCompressionEnabled;
+		SocketHandle m_flushTimer;
+		std::deque<std::pair<std::chrono::steady_clock::time_point, uint64_t>> m_flushQueue;
+		// Handshake deadlines, idle eviction and keepalives of the sessions
+		TimerWheel m_timers;
+		const std::chrono::seconds m_handshakeTimeout;
+		const std::chrono::seconds m_idleTimeout;
+		const std::chrono::seconds m_keepaliveInterval;
+		// Accepting resumes once it's over after the descriptors or the memory
+		// have run out
+		TimerWheel::Timer m_acceptBackoff;
+		// Failures of accept() since they were logged last
+		uint64_t m_acceptErrors;
+		std::chrono::steady_clock::time_point m_acceptErrorReported;
+		// Console output sent by the closed sessions
+		uint64_t m_consoleBytes;
+		uint64_t m_consoleRecords;
+
+		// Poller tokens of the listening socket and the mailbox, never issued
+		// by the session table
+		static const uint64_t ListenerToken = ~0ull;
+		static const uint64_t MailboxToken = ~0ull - 1;
+		static const uint64_t FlushTimerToken = ~0ull - 2;
+		static const uint64_t TimerWheelToken = ~0ull - 3;
+
+		SocketHandle BindSocket() const;
+		void AcceptConnections();
+		void OnAccepted(SocketHandle&& sock, const struct sockaddr_storage& inAddr, socklen_t inAddrLen);
+		// Handle the failure of accept(), false if the loop should back off
+		bool OnAcceptError(int error);
+		bool HandleEvent(TargetSession& session, int fd, uint32_t events);
+		void HandleCompletion(const CompletionIo::Completion& completion);
+		bool OnReadComplete(TargetSession& session, int fd, const CompletionIo::Completion& completion);
+		bool OnWriteComplete(TargetSession& session, int fd, int32_t result);
+		void CloseSession(TargetSession& session);
+		void UpdateInterest(TargetSession& session);
+		void SetInterest(int fd, uint32_t events);
+		PendingIo& GetPendingIo(int fd);
+		void QueueRead(int fd);
+		void QueueOutput(TargetSession& session);
+		// Cancel the requests pending on the descriptor, returns the write if any
+		uint64_t CancelIo(int fd);
+		void OffloadHandshake(TargetSession& session);
+		void CompleteHandshake(uint64_t token, const std::string& error);
+		void OnChildExited(uint64_t token, pid_t pid, int status);
+		void OnFileHashed(uint64_t token, uint16_t channel, uint64_t task, const std::string& error);
+		void ArmFlushTimer(std::chrono::steady_clock::time_point deadline);
+		void FlushConsoles();
+
+	public:
+		TargetReactor(const Config& config, unsigned id, AdmissionControl& admission, HandshakePool& handshakes,
+			ChildReaper& children, CredentialsManager& creds, const TLSPolicy& policy,
+			Botan::TLS::Session_Manager& sessionCache);
+		TargetReactor(const TargetReactor&) = delete;
+		TargetReactor& operator =(const TargetReactor&) = delete;
+
+		void Run();
+		// Leave the group of the listening sockets once the loop is over, the
+		// kernel would keep its share of the connections for it otherwise
+		void StopListening() noexcept;
+
+		// Add PTY or pipe handle of a session channel to the polling cycle
+		void AttachHandle(TargetSession& session, int handle, uint32_t events);
+		// Take PTY or pipe handle of a session channel out of the polling cycle
+		void DetachHandle(TargetSession& session, int handle);
+		// Report the exit of the shell or the command of a session channel
+		void WatchChild(TargetSession& session, pid_t pid);
+		// Hang up the shell or the command of a session channel unless it's reaped
+		void HangUpChild(pid_t pid);
+		// Hash the transferred file of a session channel on the worker of the
+		// reactor, the session is told once the task is over
+		void OffloadHashing(TargetSession& session, uint16_t channel, uint64_t task, std::function<void()> hashing);
+		// Flush the console output of the session when the coalescing window is over
+		void ScheduleFlush(TargetSession& session);
+		// The timer of the session is due: the handshake is late, the session
+		// is idle for too long or the peer should be probed
+		void OnSessionTimer(TargetSession& session);
+
+		std::chrono::milliseconds GetCoalescingWindow() const noexcept
+		{
+			return m_coalescingWindow;
+		}
+
+		bool IsCompressionEnabled() const noexcept
+		{
+			return m_isCompressionEnabled;
+		}
+
+		// The output of the sessions is written by the requests of the reactor
+		bool IsCompletionBased() const noexcept
+		{
+			return nullptr != m_io;
+		}
+
+		BufferPool& GetBuffers() noexcept
+		{
+			return m_buffers;
+		}
+
+		// Credentials shared by all the reactors, immutable
+		CredentialsManager& GetCredentials() noexcept
+		{
+			return m_creds;
+		}
+
+		const TLSPolicy& GetPolicy() const noexcept
+		{
+			return m_policy;
+		}
+
+		// TLS sessions shared by all the reactors, thread-safe
+		Botan::TLS::Session_Manager& GetSessionCache() noexcept
+		{
+			return m_sessionCache;
+		}
+
+		// Handshakes are processed by the handshake threads, not the reactor
+		bool IsHandshakeOffloaded() const noexcept
+		{
+			return !m_handshakes.IsInline();
+		}
+	};
+} // namespace Draupnir
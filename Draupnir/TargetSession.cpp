@@ -5,149 +5,1030 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "TargetSession.h"
-#include "TargetConductor.h"
+#include "TargetReactor.h"
+#include "ChildReaper.h"
+#include "ThreadRNG.h"
 #include "Logger.h"
 #include "Posix.h"
 
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
 #include <cstring>
 #include <sstream>
 #include <cerrno>
 #include <chrono>
 #include <thread>
+#include <csignal>
 
 #include <sys/utsname.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
 
 using namespace std::literals;
 
+namespace
+{
+	// Maximum plaintext size of a TLS record
+	const size_t MaxRecordSize = 16 * 1024;
+	// Console output up to this size is considered an echo of the input
+	const size_t MaxEchoSize = 16;
+	// The only channel of the raw stream has no flow control of its own
+	const uint64_t UnlimitedWindow = std::numeric_limits<uint64_t>::max();
+	// Exit status of the child which failed to run the program
+	const int ExecFailure = 127;
+
+	// Move the descriptor above the standard ones, so it isn't overwritten by
+	// dup2() of another one in the child
+	void LiftHandle(Draupnir::SocketHandle& handle)
+	{
+		if (handle.get() > STDERR_FILENO)
+			return;
+
+		Draupnir::SocketHandle lifted(fcntl(handle.get(), F_DUPFD_CLOEXEC, STDERR_FILENO + 1));
+		if (!lifted)
+			throw std::runtime_error("failed to duplicate descriptor: " + std::string(strerror(errno)));
+		handle = std::move(lifted);
+	}
+
+	// Leave the child that failed to run the program. The other threads of
+	// the target may hold the locks of malloc or of the logger at the moment
+	// of fork(), so the child only makes plain system calls until exec()
+	[[noreturn]] void ExitChild(const char* message) noexcept
+	{
+		const ssize_t written = write(STDERR_FILENO, message, strlen(message));
+		(void)written;
+		_exit(ExecFailure);
+	}
+} // namespace
+
 namespace Draupnir
 {
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-TargetSession::TargetSession(SocketHandle&& handle, TargetConductor& parent)
-	: TLSCallbacks(handle.get())
-	, m_parent(parent)	
+TargetSession::TargetSession(SocketHandle&& handle, TargetReactor& parent, HandshakePool::Ticket&& ticket)
+	: TLSCallbacks(handle.get(), parent.GetBuffers(), parent.IsCompletionBased())
+	, m_parent(parent)
 	, m_handle(std::move(handle))
-	, m_sessionMgr(m_rng)
-	, m_tls(*this, m_sessionMgr, m_creds, m_policy, m_rng)
-{	
+	, m_acceptTime(std::chrono::steady_clock::now())
+	, m_tls(*this, parent.GetSessionCache(), parent.GetCredentials(), parent.GetPolicy(), ThreadRNG::GetInstance())
+	, m_isMultiplexed(false)
+	, m_ticket(std::move(ticket))
+	, m_startPending(false)
+	, m_isFlushScheduled(false)
+	, m_timer([this]() { m_parent.OnSessionTimer(*this); })
+	, m_lastActivity(0)
+	, m_consoleBytes(0)
+	, m_consoleRecords(0)
+	, m_hashTasks(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+TargetSession::~TargetSession()
+{
+	// The shells and the commands don't outlive the connection
+	for (const auto& channel : m_channels)
+	{
+		if (channel->pid > 0)
+			m_parent.HangUpChild(channel->pid);
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void TargetSession::OnNetworkData(const uint8_t* const data, size_t size)
 {
-	m_tls.received_data(data, size);	
+	// Leave the handshake to the handshake thread, the reactor passes the
+	// collected data there once the socket is drained
+	if (!m_tls.is_active() && m_parent.IsHandshakeOffloaded())
+	{
+		m_handshakeInput.insert(m_handshakeInput.end(), data, data + size);
+		return;
+	}
+	m_tls.received_data(data, size);
 }
-	
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void TargetSession::OnConsoleData(const uint8_t* const data, size_t size)	
-{		
-	m_tls.send(data, size);	
+void TargetSession::RunHandshake()
+{
+	std::vector<uint8_t> input;
+	input.swap(m_handshakeInput);
+	m_tls.received_data(input.data(), input.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::CompleteHandshake()
+{
+	Reattach();
+	if (!m_startPending)
+		return;
+
+	m_startPending = false;
+	Start();
+
+	std::vector<uint8_t> records;
+	records.swap(m_earlyRecords);
+	if (!records.empty() && !m_tls.is_closed())
+		tls_record_received(0, records.data(), records.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::Start()
+{
+	// The control opens the channels of the multiplexed connection itself
+	if (!m_isMultiplexed)
+		OpenChannel(0, UnlimitedWindow, ChannelStream::ShellKind, std::string());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnConsoleData(int fd, const uint8_t* const data, size_t size)
+{
+	Channel* channel = FindChannelByHandle(fd);
+	if (!channel)
+		return;
+
+	// The error output is rare and shouldn't wait for the regular one
+	if (fd == static_cast<int>(channel->errors.get()))
+	{
+		const size_t sent = SendChannelData(*channel, ChannelStream::ErrorData, data, size);
+		channel->errorOutput.insert(channel->errorOutput.end(), data + sent, data + size);
+		return;
+	}
+
+	// Keystroke echoes and alike go out right away: there's nothing to gain
+	// from holding them, and the interactive latency would suffer
+	if (m_parent.GetCoalescingWindow().count() == 0 || (channel->output.empty() && size <= MaxEchoSize))
+	{
+		const size_t sent = SendChannelData(*channel, ChannelStream::Data, data, size);
+		channel->output.insert(channel->output.end(), data + sent, data + size);
+		return;
+	}
+
+	// Send the full records at once and hold the rest until more output comes,
+	// the coalescing window is over or the peer opens its window
+	channel->output.insert(channel->output.end(), data, data + size);
+	const size_t ready = static_cast<size_t>(std::min<uint64_t>(channel->output.size(), channel->sendWindow));
+	const size_t recordPayload = GetRecordPayload();
+	const size_t fullRecords = ready - ready % recordPayload;
+	if (fullRecords)
+	{
+		// One at a time, so the frames don't split the records either
+		for (size_t pos = 0; pos < fullRecords; pos += recordPayload)
+			SendChannelData(*channel, ChannelStream::Data, channel->output.data() + pos, recordPayload);
+		channel->output.erase(channel->output.begin(), channel->output.begin() + fullRecords);
+	}
+
+	if (!channel->output.empty() && !m_isFlushScheduled)
+	{
+		m_parent.ScheduleFlush(*this);
+		m_isFlushScheduled = true;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnConsoleClosed(int fd)
+{
+	Channel* channel = FindChannelByHandle(fd);
+	if (!channel)
+		return;
+
+	// The last words of the shell shouldn't be held back
+	SendHeldOutput(*channel);
+	if (!channel->isCommand)
+	{
+		DEBUG_EVENT("shell of channel {} on socket {} is over", channel->id, m_handle.get());
+		CloseChannel(*channel);
+		return;
+	}
+
+	// The exit status is reaped separately and goes once both pipes are closed
+	ReleaseHandle(fd == static_cast<int>(channel->console.get()) ? channel->console : channel->errors);
+	FinishCommand(*channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnChildExited(pid_t pid, int status)
+{
+	const auto found = std::find_if(m_channels.begin(), m_channels.end(),
+		[pid](const std::unique_ptr<Channel>& channel) { return channel->pid == pid; });
+	// The channel may be closed meanwhile
+	if (m_channels.end() == found)
+		return;
+
+	Channel& channel = **found;
+	channel.pid = -1;
+	channel.exitStatus = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+	DEBUG_EVENT("{} of channel {} on socket {} exited with status {}",
+		channel.isCommand ? "command" : "shell", channel.id, m_handle.get(), channel.exitStatus);
+
+	// The output of the command is read to the end of the pipes first
+	if (channel.isCommand)
+	{
+		FinishCommand(channel);
+		return;
+	}
+
+	// The shell is over even if its background jobs keep the PTY open, the
+	// output left there is sent and the channel is closed right away
+	DrainConsole(channel);
+	SendHeldOutput(channel);
+	CloseChannel(channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::DrainConsole(Channel& channel)
+{
+	uint8_t buffer[16 * 1024];
+	while (channel.console)
+	{
+		const ssize_t count = read(channel.console.get(), buffer, sizeof(buffer));
+		if (-1 == count && EINTR == errno)
+			continue;
+		// EAGAIN once the PTY is empty, EIO once nothing holds the slave
+		if (count <= 0)
+			break;
+		OnConsoleData(channel.console.get(), buffer, static_cast<size_t>(count));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnConsoleWritable(int fd)
+{
+	Channel* channel = FindChannelByHandle(fd);
+	if (channel)
+		WritePendingInput(*channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool TargetSession::IsConsoleInput(int fd) const noexcept
+{
+	const Channel* channel = FindChannelByHandle(fd);
+	return channel && fd == static_cast<int>(channel->input.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnOutputDrained()
+{
+	if (IsOutputCongested())
+		return;
+
+	// A failed channel is closed, which changes the list
+	std::vector<uint16_t> senders;
+	for (const auto& channel : m_channels)
+	{
+		if (channel->sender && channel->sender->IsStarted() && !channel->sender->IsOver())
+			senders.push_back(channel->id);
+	}
+	for (const uint16_t id : senders)
+	{
+		Channel* channel = FindChannel(id);
+		try
+		{
+			SendFile(*channel);
+		}
+		catch (const std::exception& e)
+		{
+			ERROR_LOG << "channel " << id << " on socket " << m_handle.get()
+				<< " failed: " << e.what();
+			CloseChannel(*channel, e.what());
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::FlushConsoleData()
+{
+	m_isFlushScheduled = false;
+	for (const auto& channel : m_channels)
+		SendHeldOutput(*channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool TargetSession::IsConsolePaused(int fd) const noexcept
+{
+	const Channel* channel = FindChannelByHandle(fd);
+	return IsOutputCongested() || !channel || channel->IsBlocked();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::SendHeldOutput(Channel& channel)
+{
+	if (!channel.output.empty())
+	{
+		const size_t sent = SendChannelData(channel, ChannelStream::Data, channel.output.data(), channel.output.size());
+		channel.output.erase(channel.output.begin(), channel.output.begin() + sent);
+	}
+	if (!channel.errorOutput.empty())
+	{
+		const size_t sent = SendChannelData(channel, ChannelStream::ErrorData,
+			channel.errorOutput.data(), channel.errorOutput.size());
+		channel.errorOutput.erase(channel.errorOutput.begin(), channel.errorOutput.begin() + sent);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t TargetSession::SendChannelData(Channel& channel, ChannelStream::MessageType type,
+	const uint8_t* data, size_t size)
+{
+	const size_t sent = static_cast<size_t>(std::min<uint64_t>(size, channel.sendWindow));
+	if (!sent)
+		return 0;
+
+	const uint64_t records = GetEmittedRecords();
+	if (m_isMultiplexed)
+	{
+		ChannelStream::AppendData(m_messages, channel.id, data, sent, type);
+		channel.sendWindow -= sent;
+		SendMessages();
+	}
+	else
+	{
+		Send(data, sent);
+	}
+	m_consoleBytes += sent;
+	m_consoleRecords += GetEmittedRecords() - records;
+	return sent;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t TargetSession::GetRecordPayload() const noexcept
+{
+	// The headers of the channel message and of the frame share the record
+	// with the data, or Botan splits off a runt record of their size
+	size_t payload = m_isMultiplexed ? ChannelStream::MaxPayload : MaxRecordSize;
+	if (m_compression)
+		payload -= CompressedStream::HeaderSize;
+	return payload;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool TargetSession::SendKeepalive()
+{
+	if (!m_isMultiplexed || !m_tls.is_active())
+		return false;
+
+	ChannelStream::Append(m_messages, ChannelStream::Keepalive, 0);
+	SendMessages();
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::SendMessages()
+{
+	Send(m_messages.data(), m_messages.size());
+	m_messages.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::Send(const uint8_t* data, size_t size)
+{
+	if (m_compression)
+	{
+		m_sentFrames.clear();
+		m_compression->Encode(data, size, m_sentFrames);
+		data = m_sentFrames.data();
+		size = m_sentFrames.size();
+	}
+
+	// Botan splits the data into the records of the maximum size
+	m_tls.send(data, size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void TargetSession::tls_session_activated()
-{	
-	RunShell();	
+{
+	// The handshake is over, let the next connection in
+	m_ticket.Reset();
+
+	// Only the peers agreeing on the protocol know the channels
+	m_isMultiplexed = !m_tls.application_protocol().empty();
+	// Everything sent from now on is framed
+	if (m_tls.application_protocol() == CompressedStream::CompressedProtocol)
+		m_compression.reset(new CompressedStream());
+
+	// The shells are forked and polled by the reactor, not the handshake thread
+	if (IsDetached())
+	{
+		m_startPending = true;
+		return;
+	}
+	Start();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::tls_alert(Botan::TLS::Alert alert)
+{
+	TLSCallbacks::tls_alert(alert);
+	// Answer the close notification, the reactor disposes the closed session
+	if (Botan::TLS::Alert::CLOSE_NOTIFY == alert.type() && !m_tls.is_closed())
+		m_tls.close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool TargetSession::tls_session_established(const Botan::TLS::Session& session)
+{
+	const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - m_acceptTime);
+	// A resumed session keeps the start time of the original one, which is
+	// older than the connection, while the new one starts right now
+	const bool resumed = session.start_time() < std::chrono::system_clock::now() - latency;
+	INFO_EVENT("{} TLS handshake on socket {} completed in {} ms",
+		resumed ? "resumed" : "full", m_handle.get(), latency.count() / 1000.0);
+	return TLSCallbacks::tls_session_established(session);
 }
-	
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string TargetSession::tls_server_choose_app_protocol(const std::vector<std::string>& clientProtocols)
+{
+	const auto isOffered = [&clientProtocols](const char* protocol)
+	{
+		return std::find(clientProtocols.begin(), clientProtocols.end(), protocol) != clientProtocols.end();
+	};
+
+	if (m_parent.IsCompressionEnabled() && isOffered(CompressedStream::CompressedProtocol))
+		return CompressedStream::CompressedProtocol;
+	if (isOffered(CompressedStream::PlainProtocol))
+		return CompressedStream::PlainProtocol;
+	// Let the handshake go on without the protocol
+	return "";
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void TargetSession::tls_record_received(
 		uint64_t seqNo __attribute__((unused)),
 		const uint8_t data[],
 		size_t size)
 try
-{	
-	POSIX_CHECK(write(m_ptsMaster.get(), data, size));
+{
+	if (m_startPending)
+	{
+		m_earlyRecords.insert(m_earlyRecords.end(), data, data + size);
+		return;
+	}
+
+	if (m_compression)
+	{
+		m_receivedData.clear();
+		m_compression->Decode(data, size, m_receivedData);
+		data = m_receivedData.data();
+		size = m_receivedData.size();
+	}
+
+	if (m_isMultiplexed)
+	{
+		m_channelStream.Read(data, size,
+			[this](ChannelStream::MessageType type, uint16_t id, const uint8_t* payload, size_t length)
+			{
+				OnChannelMessage(type, id, payload, length);
+			});
+	}
+	else if (!m_channels.empty())
+	{
+		WriteConsole(*m_channels.front(), data, size);
+	}
 }
 catch(const std::exception& e)
 {
 	ReportError(e.what());
 }
-	
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnChannelMessage(ChannelStream::MessageType type, uint16_t id,
+	const uint8_t* payload, size_t size)
+{
+	// The answer to the keepalive, receiving it is all that matters
+	if (ChannelStream::Keepalive == type)
+		return;
+
+	if (ChannelStream::Open == type)
+	{
+		uint32_t window = 0;
+		std::string kind, argument;
+		ChannelStream::ReadOpen(payload, size, window, kind, argument);
+		if (FindChannel(id))
+			throw std::runtime_error("channel " + std::to_string(id) + " is already open");
+
+		const bool isKnown = ChannelStream::ShellKind == kind || (!argument.empty()
+			&& (ChannelStream::ExecKind == kind || ChannelStream::PushKind == kind || ChannelStream::PullKind == kind));
+		if (isKnown)
+		{
+			OpenChannel(id, window, kind, argument);
+		}
+		else
+		{
+			const std::string reason = "unknown channel kind " + kind;
+			ChannelStream::Append(m_messages, ChannelStream::Close, id,
+				reinterpret_cast<const uint8_t*>(reason.data()), reason.size());
+			SendMessages();
+		}
+		return;
+	}
+
+	// The messages of the channel closed by this end could be on their way
+	Channel* channel = FindChannel(id);
+	if (!channel)
+		return;
+
+	try
+	{
+		switch (type)
+		{
+		case ChannelStream::Data:
+			WriteConsole(*channel, payload, size);
+			break;
+		case ChannelStream::Eof:
+			// The shell reads the terminal until the user exits it
+			channel->isInputOver = true;
+			if (channel->isCommand && channel->pendingInput.empty())
+				ReleaseHandle(channel->input);
+			break;
+		case ChannelStream::Window:
+			channel->sendWindow += ChannelStream::ReadValue(payload, size);
+			SendHeldOutput(*channel);
+			if (channel->sender)
+				SendFile(*channel);
+			else if (channel->isCommand)
+				FinishCommand(*channel);
+			break;
+		case ChannelStream::Offset:
+			if (!channel->sender)
+				throw std::runtime_error("channel sends no file");
+			channel->sender->Start(ChannelStream::ReadOffset(payload, size));
+			ChannelStream::AppendOffset(m_messages, ChannelStream::Size, id, channel->sender->GetSize());
+			HashFile(*channel);
+			SendFile(*channel);
+			break;
+		case ChannelStream::Size:
+			if (!channel->receiver)
+				throw std::runtime_error("channel receives no file");
+			channel->receiver->SetSize(ChannelStream::ReadOffset(payload, size));
+			break;
+		case ChannelStream::Digest:
+		{
+			if (!channel->receiver)
+				throw std::runtime_error("channel receives no file");
+			channel->receiver->SetDigest(payload, size);
+			HashFile(*channel);
+			FinishFile(*channel);
+			break;
+		}
+		case ChannelStream::Close:
+			DEBUG_LOG << "channel " << id << " on socket " << m_handle.get()
+				<< " is closed by the peer";
+			// The peer doesn't expect anything more, not even the reply
+			RemoveChannel(*channel);
+			break;
+		default:
+			throw std::runtime_error("unexpected channel message " + std::to_string(type));
+		}
+	}
+	catch (const std::exception& e)
+	{
+		// The console or the file is gone or broken, the other channels go on
+		ERROR_LOG << "channel " << id << " on socket " << m_handle.get()
+			<< " failed: " << e.what();
+		channel->output.clear();
+		channel->errorOutput.clear();
+		CloseChannel(*channel, e.what());
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void TargetSession::RunShell()
-try		
-{		
-	// Allocate PTY
-	m_ptsMaster.reset(posix_openpt(O_RDWR | O_NOCTTY));
-	if (!m_ptsMaster)
+void TargetSession::OpenChannel(uint16_t id, uint64_t window, const std::string& kind, const std::string& argument)
+{
+	m_channels.emplace_back(new Channel());
+	Channel& channel = *m_channels.back();
+	channel.id = id;
+	channel.isCommand = ChannelStream::ExecKind == kind;
+	channel.pid = -1;
+	channel.exitStatus = -1;
+	channel.sendWindow = window;
+	channel.isInputOver = false;
+	channel.pendingCredit = 0;
+	channel.hashTask = 0;
+
+	if (m_isMultiplexed)
+	{
+		const bool isTransfer = ChannelStream::PushKind == kind || ChannelStream::PullKind == kind;
+		ChannelStream::AppendValue(m_messages, ChannelStream::Confirm, id,
+			isTransfer ? ChannelStream::TransferWindow : ChannelStream::InitialWindow);
+		SendMessages();
+	}
+	if (channel.isCommand)
+		RunCommand(channel, argument);
+	else if (ChannelStream::ShellKind == kind)
+		RunShell(channel);
+	else
+		OpenFile(channel, kind, argument);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OpenFile(Channel& channel, const std::string& kind, const std::string& path)
+try
+{
+	// The sender waits for the offset the peer resumes from, the receiver
+	// reports its own one right away
+	if (ChannelStream::PullKind == kind)
+	{
+		channel.sender.reset(new FileSender(path));
+		DEBUG_LOG << "channel " << channel.id << " sends " << path << " of "
+			<< channel.sender->GetSize() << " bytes";
+		return;
+	}
+
+	channel.receiver.reset(new FileReceiver(path));
+	DEBUG_LOG << "channel " << channel.id << " receives " << path << " from offset "
+		<< channel.receiver->GetOffset();
+	ChannelStream::AppendOffset(m_messages, ChannelStream::Offset, channel.id, channel.receiver->GetOffset());
+	SendMessages();
+}
+catch(const std::exception& e)
+{
+	ERROR_LOG << "failed to open file of channel " << channel.id << ": " << e.what();
+	CloseChannel(channel, e.what());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::SendFile(Channel& channel)
+{
+	// The file goes as fast as the window lets it, the digest follows the data.
+	// The window is larger than the outbound queue should grow, though, the
+	// rest waits until the queue drains
+	if (!IsOutputCongested())
+	{
+		const size_t sent = channel.sender->Append(m_messages, channel.id, channel.sendWindow);
+		channel.sendWindow -= sent;
+	}
+	if (!m_messages.empty())
+		SendMessages();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::HashFile(Channel& channel)
+{
+	// The file is read back and hashed off the reactor, one slice at a time
+	std::function<void()> hashing;
+	if (channel.sender && channel.sender->IsHashingDue())
+		hashing = channel.sender->StartHashing();
+	else if (channel.receiver && channel.receiver->IsHashingDue())
+		hashing = channel.receiver->StartHashing();
+	if (!hashing)
+		return;
+
+	channel.hashTask = ++m_hashTasks;
+	m_parent.OffloadHashing(*this, channel.id, channel.hashTask, std::move(hashing));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::OnFileHashed(uint16_t id, uint64_t task, const std::string& error)
+{
+	// The channel may be closed meanwhile, and its identifier taken again
+	Channel* channel = FindChannel(id);
+	if (!channel || channel->hashTask != task)
+		return;
+
+	try
+	{
+		if (!error.empty())
+			throw std::runtime_error("failed to hash file: " + error);
+
+		channel->hashTask = 0;
+		// The next slice, if any, is hashed next
+		if (channel->sender)
+		{
+			channel->sender->OnHashed();
+			HashFile(*channel);
+			SendFile(*channel);
+			return;
+		}
+
+		// The data received meanwhile is hashed next
+		channel->receiver->OnHashed();
+		HashFile(*channel);
+		FinishFile(*channel);
+	}
+	catch (const std::exception& e)
+	{
+		ERROR_LOG << "channel " << id << " on socket " << m_handle.get()
+			<< " failed: " << e.what();
+		CloseChannel(*channel, e.what());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::FinishFile(Channel& channel)
+{
+	if (!channel.receiver->IsOver())
+		return;
+
+	const bool isValid = channel.receiver->Finish();
+	DEBUG_LOG << "channel " << channel.id << " on socket " << m_handle.get() << " received "
+		<< channel.receiver->GetReceived() << " bytes of the file, " << (isValid ? "valid" : "corrupted");
+	ChannelStream::AppendValue(m_messages, ChannelStream::Exit, channel.id, isValid ? 0 : 1);
+	CloseChannel(channel, isValid ? std::string() : "digest of the received file doesn't match");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::CloseChannel(Channel& channel, const std::string& reason)
+{
+	if (m_isMultiplexed)
+	{
+		ChannelStream::Append(m_messages, ChannelStream::Close, channel.id,
+			reinterpret_cast<const uint8_t*>(reason.data()), reason.size());
+		SendMessages();
+	}
+	else if (!m_tls.is_closed())
+	{
+		// The raw stream is over with its only shell
+		m_tls.close();
+	}
+	RemoveChannel(channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::RemoveChannel(Channel& channel)
+{
+	// Closing the PTY master hangs the shell up, closing the pipes breaks
+	// them for the command. A process still running is hung up anyway, its
+	// group is the session created by setsid()
+	if (channel.pid > 0)
+		m_parent.HangUpChild(channel.pid);
+	ReleaseHandle(channel.console);
+	ReleaseHandle(channel.errors);
+	ReleaseHandle(channel.input);
+	m_channels.erase(std::find_if(m_channels.begin(), m_channels.end(),
+		[&channel](const std::unique_ptr<Channel>& item) { return item.get() == &channel; }));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::ReleaseHandle(SocketHandle& handle)
+{
+	if (!handle)
+		return;
+
+	m_parent.DetachHandle(*this, handle.get());
+	handle.reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::FinishCommand(Channel& channel)
+{
+	// The status goes after all the output, which may still wait for the window
+	if (channel.exitStatus < 0 || channel.console || channel.errors
+		|| !channel.output.empty() || !channel.errorOutput.empty())
+		return;
+
+	ChannelStream::AppendValue(m_messages, ChannelStream::Exit, channel.id, static_cast<uint32_t>(channel.exitStatus));
+	SendMessages();
+	CloseChannel(channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::WriteConsole(Channel& channel, const uint8_t* data, size_t size)
+{
+	if (channel.receiver)
+	{
+		channel.receiver->Write(data, size);
+		ReturnCredit(channel, size);
+		HashFile(channel);
+		return;
+	}
+
+	if (channel.isCommand && channel.isInputOver)
+		throw std::runtime_error("input of the command is over");
+	// The pipe or the PTY holds less than the window, the rest waits for the
+	// command or the shell, and is returned to the window once written
+	channel.pendingInput.insert(channel.pendingInput.end(), data, data + size);
+	WritePendingInput(channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::WritePendingInput(Channel& channel)
+{
+	size_t written = 0;
+	while (channel.input && written < channel.pendingInput.size())
+	{
+		const ssize_t count = write(channel.input.get(), channel.pendingInput.data() + written,
+			channel.pendingInput.size() - written);
+		if (-1 == count)
+		{
+			if (EINTR == errno)
+				continue;
+			if (EAGAIN == errno)
+				break;
+			// The command doesn't read its input anymore or the shell has
+			// closed the terminal, the rest is dropped
+			DEBUG_LOG << "input of channel " << channel.id << " on socket "
+				<< m_handle.get() << " is closed: " << strerror(errno);
+			written = channel.pendingInput.size();
+			ReleaseHandle(channel.input);
+			break;
+		}
+		written += static_cast<size_t>(count);
+	}
+
+	channel.pendingInput.erase(channel.pendingInput.begin(), channel.pendingInput.begin() + written);
+	ReturnCredit(channel, written);
+	if (channel.isCommand && channel.isInputOver && channel.pendingInput.empty())
+		ReleaseHandle(channel.input);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::ReturnCredit(Channel& channel, size_t size)
+{
+	if (!m_isMultiplexed || !size)
+		return;
+
+	// Return the consumed input to the peer's window in batches
+	channel.pendingCredit += static_cast<uint32_t>(size);
+	if (channel.pendingCredit >= (channel.receiver ? ChannelStream::TransferCreditThreshold
+		: ChannelStream::CreditThreshold))
+	{
+		ChannelStream::AppendValue(m_messages, ChannelStream::Window, channel.id, channel.pendingCredit);
+		channel.pendingCredit = 0;
+		SendMessages();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+TargetSession::Channel* TargetSession::FindChannel(uint16_t id) const noexcept
+{
+	for (const auto& channel : m_channels)
+	{
+		if (channel->id == id)
+			return channel.get();
+	}
+	return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+TargetSession::Channel* TargetSession::FindChannelByHandle(int fd) const noexcept
+{
+	for (const auto& channel : m_channels)
+	{
+		const auto handles = channel->GetHandles();
+		if (std::find(handles.begin(), handles.end(), fd) != handles.end())
+			return channel.get();
+	}
+	return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::RunShell(Channel& channel)
+try
+{
+	// Allocate PTY. Both ends are closed on exec, so the shells of the other
+	// channels never keep this one open
+	SocketHandle ptsMaster(posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC));
+	if (!ptsMaster)
 		throw std::runtime_error("failed to open master PT: " + std::string(strerror(errno)));
-		
-	POSIX_CHECK(grantpt(m_ptsMaster.get()));
-	POSIX_CHECK(unlockpt(m_ptsMaster.get()));
+
+	POSIX_CHECK(grantpt(ptsMaster.get()));
+	POSIX_CHECK(unlockpt(ptsMaster.get()));
 	std::array<char, 256> masterPtsName;
-	POSIX_CHECK(ptsname_r(m_ptsMaster.get(), masterPtsName.data(), masterPtsName.size()));
-	
-	m_ptsSlave.reset(open(masterPtsName.data(), O_RDWR | O_NOCTTY));
-	if (!m_ptsSlave)
+	POSIX_CHECK(ptsname_r(ptsMaster.get(), masterPtsName.data(), masterPtsName.size()));
+
+	SocketHandle ptsSlave(open(masterPtsName.data(), O_RDWR | O_NOCTTY | O_CLOEXEC));
+	if (!ptsSlave)
 		throw std::runtime_error("failed to open slave PT: " + std::string(strerror(errno)));
-	
+	// The slave becomes the standard streams of the shell
+	LiftHandle(ptsSlave);
+
 	// Send basic information to the control node about the connecting host
 	struct utsname sysInfo;
 	POSIX_CHECK(uname(&sysInfo));
-	
+
 	std::ostringstream introMessage;
 	introMessage << "Draupnir server version 1.0, built at \n"
 		<< "Running at " << sysInfo.nodename << ' ' << sysInfo.sysname
 		<< '/' << sysInfo.release << ' ' << sysInfo.machine << '\n';
-	
+
 	introMessage << "Real user: " << GetUserName(getpwuid(getuid())) << '\n';
 	introMessage << "Effective user: " << GetUserName(getpwuid(geteuid())) << '\n';
 	introMessage << "PTS: " << masterPtsName.data() << '\n';
-	m_tls.send(introMessage.str());
-	
+	const std::string intro = introMessage.str();
+	channel.output.assign(intro.begin(), intro.end());
+
 	// Forking the child process to run the shell
 	const auto forkResult = fork();
 	if (-1 == forkResult)
 		throw std::runtime_error("failed to run child process " + std::string(strerror(errno)));
-	
+
 	// Parent process
 	if (forkResult)
 	{
-		// Parent process will use m_ptsMaster to communicate with the child
-		m_ptsSlave.reset();
-		MakeSocketNonBlocking(m_ptsMaster);		
+		// Parent process will use the master to communicate with the child
+		DEBUG_LOG << "shell of channel " << channel.id << " is running as process " << forkResult;
+		channel.pid = forkResult;
+		m_parent.WatchChild(*this, forkResult);
+		channel.console = std::move(ptsMaster);
+		MakeSocketNonBlocking(channel.console);
+		// The duplicate shares the non-blocking mode and is watched for room
+		// separately, like the input pipe of a command
+		channel.input.reset(fcntl(channel.console.get(), F_DUPFD_CLOEXEC, 0));
+		if (!channel.input)
+			throw std::runtime_error("failed to duplicate master PT: " + std::string(strerror(errno)));
 		// Add our PTY handle to the polling cycle
-		m_parent.ActivateSession(*this);		
+		m_parent.AttachHandle(*this, channel.console.get(), EPOLLIN);
+		// Reported once the PTY has room again after a short write
+		m_parent.AttachHandle(*this, channel.input.get(), EPOLLOUT);
+		SendHeldOutput(channel);
 	}
-	// Child process
+	// Child process, which never returns to the reactor's code: no logging,
+	// no allocation and no exceptions, see ExitChild()
 	else
-	{		
-		Logger::GetInstance().Debug() << "child is executing, m_ptsSlave=" << m_ptsSlave.get();
-		m_ptsMaster.reset();
-		// We're trying to set up the m_ptsSlave to be STDIN, STDOUT and STDERR
-		// before exec() so everything looks normal to the shell. Unfortunately,
-		// m_ptsSlave may end up as one of the STDIN_FILENO, STDOUT_FILENO or
-		// STDERR_FILEN values by the chance. Set it to STDERR_FILENO + 1 to clear
-		// the way for the following dup2()
-		if(m_ptsSlave.get() < STDERR_FILENO + 1)
-		{
-			POSIX_CHECK(dup2(m_ptsSlave.get(), STDERR_FILENO + 1));
-			m_ptsSlave.reset(STDERR_FILENO + 1);
-		}
-		
-		POSIX_CHECK(dup2(m_ptsSlave.get(), STDIN_FILENO));
-		POSIX_CHECK(dup2(m_ptsSlave.get(), STDOUT_FILENO));
-		POSIX_CHECK(dup2(m_ptsSlave.get(), STDERR_FILENO));
-		m_ptsSlave.reset();
-		
+	{
+		// The slave is set up as STDIN, STDOUT and STDERR before exec() so
+		// everything looks normal to the shell. It's lifted above them, and
+		// both ends of the PTY are closed on exec
+		const int slave = ptsSlave.get();
+		if (-1 == dup2(slave, STDIN_FILENO) || -1 == dup2(slave, STDOUT_FILENO) || -1 == dup2(slave, STDERR_FILENO))
+			ExitChild("draupnir: failed to attach the terminal\n");
+
 		// Set the PTY as controlling
-		POSIX_CHECK(setsid());
-		POSIX_CHECK(ioctl(STDIN_FILENO, TIOCSCTTY, 0));
-		
-		// Invoke the shell		
-		POSIX_CHECK(execl("/bin/sh", "/bin/sh", nullptr));
-	}		
+		if (-1 == setsid() || -1 == ioctl(STDIN_FILENO, TIOCSCTTY, 0))
+			ExitChild("draupnir: failed to set the controlling terminal\n");
+
+		// The reactor ignores SIGPIPE and blocks SIGCHLD, the shell shouldn't
+		signal(SIGPIPE, SIG_DFL);
+		ChildReaper::RestoreSignals();
+
+		// Invoke the shell
+		execl("/bin/sh", "/bin/sh", nullptr);
+		ExitChild("draupnir: failed to run /bin/sh\n");
+	}
 }
 catch(const std::exception& e)
 {
-	ReportError(e.what());
-	m_tls.close();	
+	channel.output.clear();
+	if (m_isMultiplexed)
+		ERROR_LOG << "failed to run shell of channel " << channel.id << ": " << e.what();
+	else
+		ReportError(e.what());
+	CloseChannel(channel, e.what());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void TargetSession::RunCommand(Channel& channel, const std::string& command)
+try
+{
+	// The pipes carry the standard streams of the command separately, there's
+	// no terminal to allocate and no line discipline to pass the data through
+	int ends[2];
+	POSIX_CHECK(pipe2(ends, O_CLOEXEC));
+	SocketHandle inputRead(ends[0]), inputWrite(ends[1]);
+	POSIX_CHECK(pipe2(ends, O_CLOEXEC));
+	SocketHandle outputRead(ends[0]), outputWrite(ends[1]);
+	POSIX_CHECK(pipe2(ends, O_CLOEXEC));
+	SocketHandle errorRead(ends[0]), errorWrite(ends[1]);
+	LiftHandle(inputRead);
+	LiftHandle(outputWrite);
+	LiftHandle(errorWrite);
+
+	const auto forkResult = fork();
+	if (-1 == forkResult)
+		throw std::runtime_error("failed to run child process " + std::string(strerror(errno)));
+
+	// Parent process keeps its ends of the pipes, the child's ones are closed here
+	if (forkResult)
+	{
+		DEBUG_LOG << "command of channel " << channel.id << " is running as process " << forkResult;
+		channel.pid = forkResult;
+		m_parent.WatchChild(*this, forkResult);
+		channel.console = std::move(outputRead);
+		channel.errors = std::move(errorRead);
+		channel.input = std::move(inputWrite);
+		MakeSocketNonBlocking(channel.console);
+		MakeSocketNonBlocking(channel.errors);
+		MakeSocketNonBlocking(channel.input);
+		m_parent.AttachHandle(*this, channel.console.get(), EPOLLIN);
+		m_parent.AttachHandle(*this, channel.errors.get(), EPOLLIN);
+		// Reported once the pipe has room again after a short write
+		m_parent.AttachHandle(*this, channel.input.get(), EPOLLOUT);
+	}
+	// Child process, the same restrictions as for the shell apply
+	else
+	{
+		// The duplicates don't inherit close-on-exec, unlike the originals
+		if (-1 == dup2(inputRead.get(), STDIN_FILENO) || -1 == dup2(outputWrite.get(), STDOUT_FILENO)
+			|| -1 == dup2(errorWrite.get(), STDERR_FILENO))
+			ExitChild("draupnir: failed to attach the pipes\n");
+		if (-1 == setsid())
+			ExitChild("draupnir: failed to start the session\n");
+		signal(SIGPIPE, SIG_DFL);
+		ChildReaper::RestoreSignals();
+
+		execl("/bin/sh", "/bin/sh", "-c", command.c_str(), nullptr);
+		ExitChild("draupnir: failed to run /bin/sh\n");
+	}
+}
+catch(const std::exception& e)
+{
+	ERROR_LOG << "failed to run command of channel " << channel.id << ": " << e.what();
+	CloseChannel(channel, e.what());
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -159,16 +1040,25 @@ std::string TargetSession::GetUserName(const struct passwd* userInfo)
 	}
 	else
 	{
-		return "user have no name";		
+		return "user have no name";
 	}
 }
-	
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 void TargetSession::ReportError(const std::string& message)
 {
-	Logger::GetInstance().Error() << message;
-	if (m_tls.is_active())
-		m_tls.send("Error: " + message);	
+	ERROR_LOG << message;
+	if (!m_tls.is_active())
+		return;
+
+	// The broken channel stream can't be trusted anymore
+	if (m_isMultiplexed)
+	{
+		m_tls.close();
+		return;
+	}
+	const std::string text = "Error: " + message;
+	Send(reinterpret_cast<const uint8_t*>(text.data()), text.size());
 }
-	
+
 } // namespace Draupnir
@@ -7,65 +7,248 @@
 #pragma once
 
 #include "Posix.h"
-#include "TLSPolicy.h"
 #include "TLSCallbacks.h"
-#include "CredentialsManager.h"
+#include "HandshakePool.h"
+#include "CompressedStream.h"
+#include "ChannelStream.h"
+#include "FileTransfer.h"
+#include "TimerWheel.h"
 
-#include <botan/auto_rng.h>
 #include <botan/tls_server.h>
 #include <botan/tls_session_manager.h>
 
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
 #include <type_traits>
+#include <vector>
 
 struct passwd;
 
 namespace Draupnir
 {
 
-class TargetConductor;
-	
+class TargetReactor;
+
 class TargetSession : private TLSCallbacks
 {
-	TargetConductor& m_parent;	
-	TLSPolicy m_policy;
+public:
+	// Shell running on a PTY, command running over pipes or file transfer,
+	// one of the channels of the connection
+	struct Channel
+	{
+		uint16_t id;
+		bool isCommand;
+		// PTY master of the shell or the pipe of the command's stdout
+		SocketHandle console;
+		// Pipe of the command's stderr
+		SocketHandle errors;
+		// Pipe of the command's stdin or the duplicate of the PTY master,
+		// watched for room apart from the output of the shell
+		SocketHandle input;
+		// Process of the shell or the command, -1 once it's reaped
+		pid_t pid;
+		// Exit status of the command, -1 while it's running
+		int exitStatus;
+		// Data the peer is ready to receive and the output held to be sent
+		// in fewer records or until the peer opens the window
+		uint64_t sendWindow;
+		std::vector<uint8_t> output;
+		std::vector<uint8_t> errorOutput;
+		// Input the shell or the command hasn't read yet
+		std::vector<uint8_t> pendingInput;
+		bool isInputOver;
+		// Input consumed and not yet returned to the peer's window
+		uint32_t pendingCredit;
+		// File pulled by the peer or pushed to this end
+		std::unique_ptr<FileSender> sender;
+		std::unique_ptr<FileReceiver> receiver;
+		// Hashing task of the file in progress, matched to its completion
+		uint64_t hashTask;
+
+		// Nothing more should be read from the console until the window opens
+		bool IsBlocked() const noexcept
+		{
+			return output.size() + errorOutput.size() >= sendWindow;
+		}
+
+		// Descriptors of the channel, -1 for the closed ones
+		std::array<int, 3> GetHandles() const noexcept
+		{
+			return {{ console.get(), errors.get(), input.get() }};
+		}
+	};
+
+private:
+	TargetReactor& m_parent;
 	SocketHandle m_handle;
-	CredentialsManager m_creds;
-	Botan::AutoSeeded_RNG m_rng;
-	Botan::TLS::Session_Manager_In_Memory m_sessionMgr;
-	Botan::TLS::Server m_tls;		
-		
-	SocketHandle m_ptsMaster;
-	SocketHandle m_ptsSlave;
-	
-	pid_t m_pid;
+	const std::chrono::steady_clock::time_point m_acceptTime;
+	Botan::TLS::Server m_tls;
+
+	std::vector<std::unique_ptr<Channel>> m_channels;
+	// The traffic is split into channels, the peers negotiating no application
+	// protocol get a single shell over the raw stream
+	bool m_isMultiplexed;
+	ChannelStream m_channelStream;
+	std::vector<uint8_t> m_messages;
+
+	// Admission of the handshake in progress
+	HandshakePool::Ticket m_ticket;
+	// Network data waiting for the handshake thread
+	std::vector<uint8_t> m_handshakeInput;
+	// Records received after the handshake completed on another thread but
+	// before the session is started on the reactor
+	std::vector<uint8_t> m_earlyRecords;
+	bool m_startPending;
+
+	bool m_isFlushScheduled;
+	// Deadline of the handshake, then the next idle check of the session
+	TimerWheel::Timer m_timer;
+	// Tick of the reactor's wheel the peer has sent anything last
+	uint64_t m_lastActivity;
+	uint64_t m_consoleBytes;
+	uint64_t m_consoleRecords;
+	// Hashing tasks of the transferred files started so far
+	uint64_t m_hashTasks;
+
+	// Compression stage if negotiated in the handshake
+	std::unique_ptr<CompressedStream> m_compression;
+	std::vector<uint8_t> m_sentFrames;
+	std::vector<uint8_t> m_receivedData;
 
 	// Overrides some of TLSCallbacks
 	void tls_session_activated() final override;
 	void tls_record_received(uint64_t seqNo, const uint8_t data[], size_t size) final override;
-		
-	void RunShell();
+	void tls_alert(Botan::TLS::Alert alert) final override;
+	bool tls_session_established(const Botan::TLS::Session& session) final override;
+	std::string tls_server_choose_app_protocol(const std::vector<std::string>& clientProtocols) final override;
+
+	void Start();
+	void OnChannelMessage(ChannelStream::MessageType type, uint16_t id, const uint8_t* payload, size_t size);
+	void OpenChannel(uint16_t id, uint64_t window, const std::string& kind, const std::string& argument);
+	void CloseChannel(Channel& channel, const std::string& reason = std::string());
+	void RemoveChannel(Channel& channel);
+	void ReleaseHandle(SocketHandle& handle);
+	void RunShell(Channel& channel);
+	void RunCommand(Channel& channel, const std::string& command);
+	void OpenFile(Channel& channel, const std::string& kind, const std::string& path);
+	void SendFile(Channel& channel);
+	void HashFile(Channel& channel);
+	void FinishFile(Channel& channel);
+	void FinishCommand(Channel& channel);
+	void DrainConsole(Channel& channel);
+	void WriteConsole(Channel& channel, const uint8_t* data, size_t size);
+	void WritePendingInput(Channel& channel);
+	void ReturnCredit(Channel& channel, size_t size);
+	void SendHeldOutput(Channel& channel);
+	size_t SendChannelData(Channel& channel, ChannelStream::MessageType type, const uint8_t* data, size_t size);
+	// Console data filling a TLS record once sent
+	size_t GetRecordPayload() const noexcept;
+	void SendMessages();
+	void Send(const uint8_t* data, size_t size);
 	void ReportError(const std::string& message);
+	Channel* FindChannel(uint16_t id) const noexcept;
+	Channel* FindChannelByHandle(int fd) const noexcept;
 	std::string GetUserName(const struct passwd* userName);
 
 public:
-	explicit TargetSession(SocketHandle&& handle, TargetConductor& parent);
-	
+	TargetSession(SocketHandle&& handle, TargetReactor& parent, HandshakePool::Ticket&& ticket);
+	~TargetSession();
+
+	using TLSCallbacks::Detach;
+	using TLSCallbacks::IsDetached;
+	using TLSCallbacks::FlushOutput;
+	using TLSCallbacks::PrepareOutput;
+	using TLSCallbacks::OnOutputWritten;
+	using TLSCallbacks::HasPendingOutput;
+	using TLSCallbacks::IsOutputCongested;
+
 	void OnNetworkData(const uint8_t* const data, size_t count);
-	void OnConsoleData(const uint8_t* const data, size_t count);
-	
-	const SocketHandle& GetPtySocket() const noexcept
+	void OnConsoleData(int fd, const uint8_t* const data, size_t count);
+	// The shell of the PTY or the output pipe of the command is closed
+	void OnConsoleClosed(int fd);
+	// The shell or the command is ready to read more of the input
+	void OnConsoleWritable(int fd);
+	// The shell or the command has exited with the status reported by waitpid()
+	void OnChildExited(pid_t pid, int status);
+	// The hashing task of the transferred file is over, with the error if failed
+	void OnFileHashed(uint16_t id, uint64_t task, const std::string& error);
+	// The descriptor is the input of a shell or a command
+	bool IsConsoleInput(int fd) const noexcept;
+
+	// The outbound queue may be below the congestion, the files held back go on
+	void OnOutputDrained();
+	// Send the held console output, called by the reactor when the coalescing window is over
+	void FlushConsoleData();
+
+	// The console shouldn't be read until the peer catches up with the output
+	bool IsConsolePaused(int fd) const noexcept;
+
+	// Console output sent and the number of TLS records it took
+	uint64_t GetConsoleBytes() const noexcept
+	{
+		return m_consoleBytes;
+	}
+	uint64_t GetConsoleRecords() const noexcept
+	{
+		return m_consoleRecords;
+	}
+
+	// Compression stage of the session, null if not negotiated
+	const CompressedStream* GetCompression() const noexcept
 	{
-		return m_ptsMaster;
+		return m_compression.get();
+	}
+
+	// The handshake data is received and should be passed to the handshake thread
+	bool HasHandshakeInput() const noexcept
+	{
+		return !m_handshakeInput.empty();
+	}
+
+	// Process the received handshake data, called on the handshake thread
+	void RunHandshake();
+	// Take the session back to the reactor after RunHandshake()
+	void CompleteHandshake();
+
+	const std::vector<std::unique_ptr<Channel>>& GetChannels() const noexcept
+	{
+		return m_channels;
 	}
 	const SocketHandle& GetNetworkSocket() const noexcept
 	{
 		return m_handle;
 	}
-	
-	pid_t GetPID() const noexcept
+
+	TimerWheel::Timer& GetTimer() noexcept
+	{
+		return m_timer;
+	}
+
+	uint64_t GetLastActivity() const noexcept
 	{
-		return m_pid;
+		return m_lastActivity;
+	}
+	void SetLastActivity(uint64_t tick) noexcept
+	{
+		m_lastActivity = tick;
+	}
+
+	// Probe the idle peer, false if the raw stream has no room for the probe
+	bool SendKeepalive();
+
+	// The TLS handshake is over
+	bool IsActive() const
+	{
+		return m_tls.is_active();
+	}
+
+	// The TLS connection is over and the session can be disposed
+	bool IsClosed() const
+	{
+		return m_tls.is_closed();
 	}
 };
-	
+
 } // namespace Draupnir
@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/TaskWorker.cpp
+//
+// summary:	Implements the thread running the long tasks of an event loop
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TaskWorker.h"
+#include "Logger.h"
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TaskWorker::TaskWorker()
+		: m_stopping(false)
+		, m_thread(&TaskWorker::Work, this)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TaskWorker::~TaskWorker()
+	{
+		Stop();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TaskWorker::Submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+		}
+		m_wakeup.notify_one();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TaskWorker::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+			m_tasks.clear();
+		}
+		m_wakeup.notify_one();
+
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TaskWorker::Work()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wakeup.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+				if (m_stopping)
+					return;
+
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			// Tasks report their own failures, anything else must not kill the thread
+			try
+			{
+				task();
+			}
+			catch (const std::exception& e)
+			{
+				ERROR_LOG << "worker task failed: " << e.what();
+			}
+		}
+	}
+} // namespace Draupnir
@@ -0,0 +1,46 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/TaskWorker.h
+//
+// summary:	Declares the thread running the long tasks of an event loop
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Thread of an event loop running its long tasks one at a time
+	/// 			in the order they are submitted, so neither the loop nor the
+	/// 			handshake threads wait for them. The tasks report back to
+	/// 			the loop through its mailbox.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class TaskWorker
+	{
+	public:
+		TaskWorker();
+		TaskWorker(const TaskWorker&) = delete;
+		TaskWorker& operator =(const TaskWorker&) = delete;
+		~TaskWorker();
+
+		// Queue the task, may be called from any thread
+		void Submit(std::function<void()> task);
+		// Wait for the task in progress and stop the thread, the queued tasks are dropped
+		void Stop();
+
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_wakeup;
+		std::deque<std::function<void()>> m_tasks;
+		bool m_stopping;
+		std::thread m_thread;
+
+		void Work();
+	};
+} // namespace Draupnir
@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/ThreadRNG.cpp
+//
+// summary:	Implements the random number generator shared by the TLS endpoints
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "ThreadRNG.h"
+
+#include <botan/hmac_drbg.h>
+#include <botan/mac.h>
+#include <botan/system_rng.h>
+
+namespace Draupnir
+{
+	const size_t ThreadRNG::ReseedInterval;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	ThreadRNG& ThreadRNG::GetInstance()
+	{
+		static ThreadRNG rng;
+		return rng;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	Botan::RandomNumberGenerator& ThreadRNG::GetLocal()
+	{
+		// Seeded from the system RNG on the first request and every
+		// ReseedInterval requests after, and after fork() as well
+		thread_local Botan::HMAC_DRBG rng(
+			Botan::MessageAuthenticationCode::create_or_throw("HMAC(SHA-512)"),
+			Botan::system_rng(),
+			ReseedInterval);
+		return rng;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ThreadRNG::randomize(uint8_t output[], size_t length)
+	{
+		GetLocal().randomize(output, length);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ThreadRNG::randomize_with_input(uint8_t output[], size_t outputLength,
+		const uint8_t input[], size_t inputLength)
+	{
+		GetLocal().randomize_with_input(output, outputLength, input, inputLength);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool ThreadRNG::accepts_input() const
+	{
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ThreadRNG::add_entropy(const uint8_t input[], size_t length)
+	{
+		GetLocal().add_entropy(input, length);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	std::string ThreadRNG::name() const
+	{
+		return "Thread(" + GetLocal().name() + ")";
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void ThreadRNG::clear()
+	{
+		GetLocal().clear();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool ThreadRNG::is_seeded() const
+	{
+		// The generator of the thread seeds itself on the first request
+		return true;
+	}
+} // namespace Draupnir
@@ -0,0 +1,46 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/ThreadRNG.h
+//
+// summary:	Declares the random number generator shared by the TLS endpoints
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <botan/rng.h>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Random number generator shared by all the TLS endpoints of
+	/// 			the process. Every thread using it gets its own HMAC_DRBG,
+	/// 			seeded from the system RNG on the first use and reseeded
+	/// 			periodically, so the generator needs no locking and the
+	/// 			sessions carry no state of their own.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class ThreadRNG final : public Botan::RandomNumberGenerator
+	{
+		ThreadRNG() = default;
+
+		// The generator of the calling thread
+		static Botan::RandomNumberGenerator& GetLocal();
+
+	public:
+		// Number of requests served before the generator is reseeded
+		static const size_t ReseedInterval = 1024;
+
+		static ThreadRNG& GetInstance();
+
+		ThreadRNG(const ThreadRNG&) = delete;
+		ThreadRNG& operator =(const ThreadRNG&) = delete;
+
+		void randomize(uint8_t output[], size_t length) override;
+		void randomize_with_input(uint8_t output[], size_t outputLength,
+			const uint8_t input[], size_t inputLength) override;
+		bool accepts_input() const override;
+		void add_entropy(const uint8_t input[], size_t length) override;
+		std::string name() const override;
+		void clear() override;
+		bool is_seeded() const override;
+	};
+} // namespace Draupnir
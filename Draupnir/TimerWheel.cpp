@@ -0,0 +1,197 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/TimerWheel.cpp
+//
+// summary:	Implements the hierarchical timer wheel of an event loop
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace Draupnir
+{
+	const unsigned TimerWheel::LevelBits;
+	const unsigned TimerWheel::Levels;
+	const unsigned TimerWheel::Slots;
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TimerWheel::Timer::Timer(Handler handler)
+		: m_handler(std::move(handler))
+		, m_wheel(nullptr)
+		, m_slot(nullptr)
+		, m_prev(nullptr)
+		, m_next(nullptr)
+		, m_expiry(0)
+	{
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TimerWheel::Timer::~Timer()
+	{
+		Cancel();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Timer::Cancel() noexcept
+	{
+		if (m_wheel)
+			m_wheel->Unlink(*this);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	TimerWheel::TimerWheel(std::chrono::milliseconds resolution)
+		: m_resolution(resolution)
+		, m_start(std::chrono::steady_clock::now())
+		, m_timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+		, m_isTicking(false)
+		, m_current(0)
+		, m_count(0)
+		, m_slots()
+	{
+		if (!m_timer)
+			throw std::runtime_error("failed to create timer: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t TimerWheel::GetTicksAt(std::chrono::steady_clock::time_point time) const
+	{
+		return static_cast<uint64_t>((time - m_start) / m_resolution);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Arm(Timer& timer, std::chrono::milliseconds delay)
+	{
+		timer.Cancel();
+
+		// The wheel may be behind while the loop is busy or stopped while
+		// empty, the delay counts from now anyway
+		const uint64_t now = GetTicksAt(std::chrono::steady_clock::now());
+		if (0 == m_count)
+			m_current = std::max(m_current, now);
+		const uint64_t ticks = (delay.count() + m_resolution.count() - 1) / m_resolution.count();
+		timer.m_expiry = std::max(now, m_current) + std::max<uint64_t>(ticks, 1);
+
+		Insert(timer);
+		++m_count;
+		if (!m_isTicking)
+			SetTicking(true);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Insert(Timer& timer)
+	{
+		// The levels beyond the last one would take more memory than they're worth
+		const uint64_t limit = (1ull << (LevelBits * Levels)) - 1;
+		if (timer.m_expiry - m_current > limit)
+			timer.m_expiry = m_current + limit;
+
+		// The lowest level whose round covers the expiry
+		const uint64_t delta = timer.m_expiry - m_current;
+		unsigned level = 0;
+		while (level + 1 < Levels && delta >= (1ull << (LevelBits * (level + 1))))
+			++level;
+
+		Timer*& head = m_slots[level][(timer.m_expiry >> (LevelBits * level)) & (Slots - 1)];
+		timer.m_wheel = this;
+		timer.m_slot = &head;
+		timer.m_prev = nullptr;
+		timer.m_next = head;
+		if (head)
+			head->m_prev = &timer;
+		head = &timer;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Unlink(Timer& timer) noexcept
+	{
+		if (timer.m_prev)
+			timer.m_prev->m_next = timer.m_next;
+		else
+			*timer.m_slot = timer.m_next;
+		if (timer.m_next)
+			timer.m_next->m_prev = timer.m_prev;
+
+		timer.m_wheel = nullptr;
+		timer.m_slot = nullptr;
+		timer.m_prev = nullptr;
+		timer.m_next = nullptr;
+		--m_count;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Cascade(unsigned level)
+	{
+		// The round of the slot begins, its timers move to the lower levels
+		Timer* timer = m_slots[level][(m_current >> (LevelBits * level)) & (Slots - 1)];
+		m_slots[level][(m_current >> (LevelBits * level)) & (Slots - 1)] = nullptr;
+		while (timer)
+		{
+			Timer* next = timer->m_next;
+			Insert(*timer);
+			timer = next;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Tick()
+	{
+		++m_current;
+		for (unsigned level = 1; level < Levels; ++level)
+		{
+			if (m_current & ((1ull << (LevelBits * level)) - 1))
+				break;
+			Cascade(level);
+		}
+
+		// The handler may arm, cancel or destroy any timer, the slot is taken
+		// from the head every time
+		Timer*& head = m_slots[0][m_current & (Slots - 1)];
+		while (head)
+		{
+			Timer& timer = *head;
+			Unlink(timer);
+			timer.m_handler();
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::Expire()
+	{
+		uint64_t expirations = 0;
+		if (-1 == read(m_timer.get(), &expirations, sizeof(expirations)) && EAGAIN != errno)
+			throw std::runtime_error("failed to read timer: " + std::string(strerror(errno)));
+
+		// The ticks missed while the loop was busy are caught up at once
+		const uint64_t now = GetTicksAt(std::chrono::steady_clock::now());
+		while (m_count && m_current < now)
+			Tick();
+
+		if (0 == m_count)
+		{
+			m_current = std::max(m_current, now);
+			SetTicking(false);
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void TimerWheel::SetTicking(bool isTicking)
+	{
+		const auto resolution = std::chrono::duration_cast<std::chrono::nanoseconds>(m_resolution);
+		struct itimerspec spec = {};
+		if (isTicking)
+		{
+			spec.it_interval.tv_sec = static_cast<time_t>(resolution.count() / 1000000000);
+			spec.it_interval.tv_nsec = static_cast<long>(resolution.count() % 1000000000);
+			spec.it_value = spec.it_interval;
+		}
+		POSIX_CHECK(timerfd_settime(m_timer.get(), 0, &spec, nullptr));
+		m_isTicking = isTicking;
+	}
+} // namespace Draupnir
@@ -0,0 +1,119 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/TimerWheel.h
+//
+// summary:	Declares the hierarchical timer wheel of an event loop
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Posix.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Timers of an event loop kept in a hierarchical wheel. Every
+	/// 			level has a round of slots, a slot of the lower level lasts
+	/// 			one tick and a slot of every next level lasts the whole
+	/// 			round of the previous one. A timer is linked into the slot
+	/// 			of its expiry, so arming and cancelling it takes constant
+	/// 			time whatever the number of timers. The timers of an upper
+	/// 			slot move down once its round begins. The loop polls the
+	/// 			timerfd of the wheel, which ticks only while any timer is
+	/// 			armed.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class TimerWheel
+	{
+	public:
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Timer owned by its user and linked into the wheel while
+		/// 			armed. The timer is disarmed before the handler is
+		/// 			called, so the handler may arm it again or destroy it.
+		/// </summary>
+		////////////////////////////////////////////////////////////////////////////
+		class Timer
+		{
+		public:
+			typedef std::function<void()> Handler;
+
+			explicit Timer(Handler handler);
+			Timer(const Timer&) = delete;
+			Timer& operator =(const Timer&) = delete;
+			~Timer();
+
+			void Cancel() noexcept;
+
+			bool IsArmed() const noexcept
+			{
+				return nullptr != m_wheel;
+			}
+
+		private:
+			friend class TimerWheel;
+
+			Handler m_handler;
+			// Wheel and slot of the armed timer, null otherwise
+			TimerWheel* m_wheel;
+			Timer** m_slot;
+			Timer* m_prev;
+			Timer* m_next;
+			// Tick the timer expires on
+			uint64_t m_expiry;
+		};
+
+		// Slots in a round of every level, as the bits of the tick
+		static const unsigned LevelBits = 6;
+		static const unsigned Levels = 4;
+		static const unsigned Slots = 1u << LevelBits;
+
+		explicit TimerWheel(std::chrono::milliseconds resolution);
+		TimerWheel(const TimerWheel&) = delete;
+		TimerWheel& operator =(const TimerWheel&) = delete;
+
+		////////////////////////////////////////////////////////////////////////////
+		/// <summary>	Arms the timer, rearms it if already armed. The delay is
+		/// 			rounded up to the ticks, the delays beyond the last level
+		/// 			expire at its end.
+		/// </summary>
+		////////////////////////////////////////////////////////////////////////////
+		void Arm(Timer& timer, std::chrono::milliseconds delay);
+		// Run the handlers of the expired timers, called once the handle is readable
+		void Expire();
+
+		// Ticks passed by the wheel, the time of the events of the loop in its resolution
+		uint64_t GetTicks() const noexcept
+		{
+			return m_current;
+		}
+
+		std::chrono::milliseconds GetResolution() const noexcept
+		{
+			return m_resolution;
+		}
+
+		int GetHandle() const noexcept
+		{
+			return m_timer.get();
+		}
+
+	private:
+		const std::chrono::milliseconds m_resolution;
+		const std::chrono::steady_clock::time_point m_start;
+		SocketHandle m_timer;
+		bool m_isTicking;
+		uint64_t m_current;
+		size_t m_count;
+		Timer* m_slots[Levels][Slots];
+
+		uint64_t GetTicksAt(std::chrono::steady_clock::time_point time) const;
+		void Insert(Timer& timer);
+		void Unlink(Timer& timer) noexcept;
+		void Cascade(unsigned level);
+		void Tick();
+		void SetTicking(bool isTicking);
+	};
+} // namespace Draupnir
@@ -0,0 +1,509 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/UringPoller.cpp
+//
+// summary:	Implements the poller and the completion-based I/O built on io_uring
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "UringPoller.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <string>
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+	// Number of submission queue entries, the queue is submitted once full
+	const unsigned QueueDepth = 256;
+	// Number of completion queue entries: the reads and the writes of all the
+	// sessions may complete between two waits
+	const unsigned CompletionDepth = 8192;
+	// Capacity of the ring of the provided buffers, a power of two
+	const unsigned BufferRingEntries = 1024;
+	// Group of the provided buffers, the only one
+	const uint16_t BufferGroup = 0;
+	// user_data of the requests which completions are not interesting
+	const uint64_t IgnoredRequest = 0;
+	// Set in user_data of the accepts, the reads and the writes, which carry
+	// the index of the request instead of the polled descriptor
+	const uint64_t RequestFlag = 1ull << 63;
+	// Generations take 31 bits, the top one is the flag above
+	const uint32_t GenerationMask = 0x7FFFFFFF;
+
+	uint64_t MakeUserData(int fd, uint32_t generation)
+	{
+		return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+	}
+
+	void* MapRing(int ring, size_t size, off_t offset)
+	{
+		void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+		if (MAP_FAILED == ptr)
+			throw std::runtime_error("failed to map io_uring: " + std::string(strerror(errno)));
+		return ptr;
+	}
+} // namespace
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	UringPoller::UringPoller()
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = CompletionDepth;
+		m_ring.reset(static_cast<int>(syscall(__NR_io_uring_setup, QueueDepth, &params)));
+		if (!m_ring)
+			throw std::runtime_error("io_uring is not available: " + std::string(strerror(errno)));
+
+		// Completions must never be dropped, reads of the sockets must wait
+		// for the data without the worker threads, and the requests must not
+		// refer to the memory of the caller after the submission
+		const unsigned required = IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_SUBMIT_STABLE;
+		if ((params.features & required) != required)
+			throw std::runtime_error("io_uring of the kernel is too old");
+
+		try
+		{
+			m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+				m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+			m_sqRing = MapRing(m_ring.get(), m_sqRingSize, IORING_OFF_SQ_RING);
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+				m_cqRing = m_sqRing;
+			else
+				m_cqRing = MapRing(m_ring.get(), m_cqRingSize, IORING_OFF_CQ_RING);
+
+			m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+			m_sqes = static_cast<struct io_uring_sqe*>(MapRing(m_ring.get(), m_sqesSize, IORING_OFF_SQES));
+			RegisterBufferRing();
+		}
+		catch (...)
+		{
+			Unmap();
+			throw;
+		}
+
+		uint8_t* sq = static_cast<uint8_t*>(m_sqRing);
+		m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		m_sqEntries = params.sq_entries;
+
+		uint8_t* cq = static_cast<uint8_t*>(m_cqRing);
+		m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+		m_sqLocalTail = *m_sqTail;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	UringPoller::~UringPoller()
+	{
+		// The pending requests are cancelled with the ring, before the memory
+		// they refer to is gone
+		m_ring.reset();
+		Unmap();
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::Unmap()
+	{
+		if (m_sqes)
+			munmap(m_sqes, m_sqesSize);
+		if (m_cqRing && m_cqRing != m_sqRing)
+			munmap(m_cqRing, m_cqRingSize);
+		if (m_sqRing)
+			munmap(m_sqRing, m_sqRingSize);
+		if (m_bufRing)
+			munmap(m_bufRing, m_bufRingSize);
+		m_sqes = nullptr;
+		m_cqRing = m_sqRing = nullptr;
+		m_bufRing = nullptr;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::RegisterBufferRing()
+	{
+		m_bufRingSize = BufferRingEntries * sizeof(struct io_uring_buf);
+		void* ring = mmap(nullptr, m_bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == ring)
+			throw std::runtime_error("failed to map io_uring buffers: " + std::string(strerror(errno)));
+		m_bufRing = static_cast<struct io_uring_buf*>(ring);
+
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+		reg.ring_entries = BufferRingEntries;
+		reg.bgid = BufferGroup;
+		if (-1 == syscall(__NR_io_uring_register, m_ring.get(), IORING_REGISTER_PBUF_RING, &reg, 1))
+			throw std::runtime_error("failed to register io_uring buffers: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::PublishBuffer(int bufferId)
+	{
+		const ProvidedBuffer& buffer = m_providedBuffers.at(static_cast<size_t>(bufferId));
+		struct io_uring_buf& entry = m_bufRing[m_bufTail & (BufferRingEntries - 1)];
+		entry.addr = reinterpret_cast<uint64_t>(buffer.data);
+		entry.len = buffer.size;
+		entry.bid = static_cast<__u16>(bufferId);
+
+		// The tail of the ring overlays the reserved field of the first entry
+		++m_bufTail;
+		__atomic_store_n(&m_bufRing[0].resv, m_bufTail, __ATOMIC_RELEASE);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint32_t UringPoller::NextGeneration()
+	{
+		// Zero generation is reserved for the requests we are not interested in
+		m_generation = (m_generation + 1) & GenerationMask;
+		if (0 == m_generation)
+			++m_generation;
+		return m_generation;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	struct io_uring_sqe* UringPoller::GetSqe()
+	{
+		if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+		{
+			// Submission queue is full, pass the queued requests to the kernel
+			if (-1 == Enter(0) && EINTR != errno)
+				throw std::runtime_error("failed to submit io_uring requests: " + std::string(strerror(errno)));
+			if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+				throw std::runtime_error("io_uring submission queue overflow");
+		}
+
+		const unsigned index = m_sqLocalTail & m_sqMask;
+		struct io_uring_sqe* sqe = &m_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		m_sqArray[index] = index;
+		++m_sqLocalTail;
+		return sqe;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::QueuePoll(int fd, Registration& reg)
+	{
+		struct io_uring_sqe* sqe = GetSqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		// EPOLL* flags share their values with POLL* ones
+		sqe->poll_events = static_cast<__u16>(reg.events & ~(EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE));
+		sqe->user_data = MakeUserData(fd, reg.generation);
+		reg.armed = true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::QueueCancel(const Registration& reg, int fd)
+	{
+		struct io_uring_sqe* sqe = GetSqe();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = MakeUserData(fd, reg.generation);
+		sqe->user_data = IgnoredRequest;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int UringPoller::Enter(unsigned minComplete)
+	{
+		__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+		const unsigned toSubmit = m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		if (0 == toSubmit && 0 == minComplete)
+			return 0;
+
+		const unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+		++m_systemCalls;
+		return static_cast<int>(syscall(__NR_io_uring_enter, m_ring.get(), toSubmit, minComplete, flags, nullptr, 0));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::Add(int fd, uint32_t events, uint64_t data)
+	{
+		Registration reg = { events, data, NextGeneration(), false };
+		auto res = m_registrations.emplace(fd, reg);
+		if (!res.second)
+		{
+			errno = EEXIST;
+			throw std::runtime_error("descriptor " + std::to_string(fd) + " is already polled");
+		}
+		QueuePoll(fd, res.first->second);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::Modify(int fd, uint32_t events, uint64_t data)
+	{
+		auto& reg = m_registrations.at(fd);
+		if (reg.armed)
+			QueueCancel(reg, fd);
+
+		reg.events = events;
+		reg.data = data;
+		reg.generation = NextGeneration();
+		QueuePoll(fd, reg);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::Remove(int fd)
+	{
+		auto reg = m_registrations.find(fd);
+		if (m_registrations.end() == reg)
+			return;
+
+		if (reg->second.armed)
+		{
+			// The pending request holds a reference to the file, submit the
+			// cancellation right away so the descriptor is really closed
+			QueueCancel(reg->second, fd);
+			Enter(0);
+		}
+		m_registrations.erase(reg);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int UringPoller::Harvest(struct epoll_event* events, int maxEvents)
+	{
+		int count = 0;
+		unsigned head = *m_cqHead;
+		const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		while (head != tail)
+		{
+			// Completions of the requests are collected regardless of the
+			// room for the events
+			const struct io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+			if (Complete(cqe))
+			{
+				++head;
+				continue;
+			}
+			if (count == maxEvents)
+				break;
+			++head;
+
+			const uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 32);
+			const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+			if (0 == generation)
+				continue;
+
+			// Skip the completions of the cancelled and outdated requests
+			auto reg = m_registrations.find(fd);
+			if (m_registrations.end() == reg || reg->second.generation != generation)
+				continue;
+
+			reg->second.armed = false;
+			m_rearm.push_back(fd);
+
+			events[count].events = cqe.res < 0 ? EPOLLERR : static_cast<uint32_t>(cqe.res);
+			events[count].data.u64 = reg->second.data;
+			++count;
+		}
+		__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int UringPoller::Wait(struct epoll_event* events, int maxEvents, int timeoutMs)
+	{
+		// Re-arm the descriptors reported by the previous call, the caller has
+		// drained them already. Requests are submitted together with the wait
+		for (const int fd : m_rearm)
+		{
+			auto reg = m_registrations.find(fd);
+			if (m_registrations.end() != reg && !reg->second.armed)
+				QueuePoll(fd, reg->second);
+		}
+		m_rearm.clear();
+
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		while (true)
+		{
+			const int count = Harvest(events, maxEvents);
+			if (count || !m_completions.empty() || 0 == timeoutMs)
+			{
+				// Overflown completion queue refuses the submission until the
+				// caller takes the completions
+				if (-1 == Enter(0) && EBUSY != errno)
+					return -1;
+				return count;
+			}
+
+			if (timeoutMs > 0)
+			{
+				const auto left = deadline - std::chrono::steady_clock::now();
+				if (left <= std::chrono::steady_clock::duration::zero())
+					return Enter(0) == -1 && EBUSY != errno ? -1 : 0;
+
+				const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+				m_timeout.tv_sec = ns / 1000000000;
+				m_timeout.tv_nsec = ns % 1000000000;
+
+				// The timeout completes either on expiration or after the first
+				// other completion, so it never outlives this call
+				struct io_uring_sqe* sqe = GetSqe();
+				sqe->opcode = IORING_OP_TIMEOUT;
+				sqe->fd = -1;
+				sqe->addr = reinterpret_cast<uint64_t>(&m_timeout);
+				sqe->len = 1;
+				sqe->off = 1;
+				sqe->user_data = IgnoredRequest;
+			}
+
+			if (-1 == Enter(1) && EBUSY != errno)
+				return -1;
+		}
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	struct io_uring_sqe* UringPoller::QueueRequest(Operation operation, int fd, uint64_t data)
+	{
+		struct io_uring_sqe* sqe = GetSqe();
+
+		uint32_t index = static_cast<uint32_t>(m_requests.size());
+		if (m_freeRequests.empty())
+		{
+			m_requests.emplace_back();
+		}
+		else
+		{
+			index = m_freeRequests.back();
+			m_freeRequests.pop_back();
+		}
+
+		Request& request = m_requests[index];
+		request.data = data;
+		request.operation = operation;
+		request.generation = NextGeneration();
+		request.isPending = true;
+
+		sqe->fd = fd;
+		sqe->user_data = RequestFlag | (static_cast<uint64_t>(request.generation) << 32) | index;
+		return sqe;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t UringPoller::QueueAccept(int fd, struct sockaddr_storage* addr, socklen_t* addrLen, uint64_t data)
+	{
+		struct io_uring_sqe* sqe = QueueRequest(Accept, fd, data);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = reinterpret_cast<uint64_t>(addr);
+		sqe->addr2 = reinterpret_cast<uint64_t>(addrLen);
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		return sqe->user_data;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t UringPoller::QueueRead(int fd, uint64_t data)
+	{
+		// Zero length reads up to the size of the buffer picked by the kernel
+		struct io_uring_sqe* sqe = QueueRequest(Read, fd, data);
+		sqe->opcode = IORING_OP_READ;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BufferGroup;
+		sqe->len = 0;
+		sqe->off = static_cast<__u64>(-1);
+		return sqe->user_data;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	uint64_t UringPoller::QueueWrite(int fd, const struct iovec* iov, size_t count, uint64_t data)
+	{
+		struct io_uring_sqe* sqe = QueueRequest(Write, fd, data);
+		Request& request = m_requests[sqe->user_data & 0xFFFFFFFF];
+		request.iov.assign(iov, iov + count);
+
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = reinterpret_cast<uint64_t>(request.iov.data());
+		sqe->len = static_cast<__u32>(count);
+		sqe->off = static_cast<__u64>(-1);
+		return sqe->user_data;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::Cancel(uint64_t id)
+	{
+		const size_t index = id & 0xFFFFFFFF;
+		if (!(id & RequestFlag) || index >= m_requests.size())
+			return;
+
+		const Request& request = m_requests[index];
+		if (!request.isPending || request.generation != ((id >> 32) & GenerationMask))
+			return;
+
+		struct io_uring_sqe* sqe = GetSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = id;
+		sqe->user_data = IgnoredRequest;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::Submit()
+	{
+		if (-1 == Enter(0) && EINTR != errno && EBUSY != errno)
+			throw std::runtime_error("failed to submit io_uring requests: " + std::string(strerror(errno)));
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	bool UringPoller::Complete(const struct io_uring_cqe& cqe)
+	{
+		if (!(cqe.user_data & RequestFlag))
+			return false;
+
+		const size_t index = cqe.user_data & 0xFFFFFFFF;
+		Request& request = m_requests.at(index);
+		request.isPending = false;
+		m_freeRequests.push_back(static_cast<uint32_t>(index));
+
+		Completion completion;
+		completion.id = cqe.user_data;
+		completion.data = request.data;
+		completion.operation = request.operation;
+		completion.result = cqe.res;
+		completion.bufferId = -1;
+		completion.buffer = nullptr;
+		if (cqe.flags & IORING_CQE_F_BUFFER)
+		{
+			completion.bufferId = static_cast<int>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			completion.buffer = m_providedBuffers.at(static_cast<size_t>(completion.bufferId)).data;
+		}
+		m_completions.push_back(completion);
+		return true;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	int UringPoller::ProvideBuffer(uint8_t* data, size_t size)
+	{
+		if (m_providedBuffers.size() >= BufferRingEntries)
+			throw std::runtime_error("too many buffers are provided to io_uring");
+
+		const int bufferId = static_cast<int>(m_providedBuffers.size());
+		m_providedBuffers.push_back(ProvidedBuffer{ data, static_cast<uint32_t>(size) });
+		PublishBuffer(bufferId);
+		return bufferId;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::ReturnBuffer(int bufferId)
+	{
+		PublishBuffer(bufferId);
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////////
+	void UringPoller::TakeCompletions(std::vector<Completion>& completions)
+	{
+		// Both vectors keep their capacity
+		completions.clear();
+		completions.swap(m_completions);
+	}
+} // namespace Draupnir
@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// file:	Draupnir/UringPoller.h
+//
+// summary:	Declares the poller and the completion-based I/O built on io_uring
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Poller.h"
+#include "Posix.h"
+
+#include <linux/io_uring.h>
+
+#include <unordered_map>
+#include <vector>
+
+namespace Draupnir
+{
+	////////////////////////////////////////////////////////////////////////////
+	/// <summary>	Poller built on io_uring. Readiness is waited for with one-shot
+	/// 			IORING_OP_POLL_ADD requests: the descriptors reported by
+	/// 			Wait() are re-armed on the next call to Wait(), so the
+	/// 			re-arm requests of the whole batch are submitted together
+	/// 			with the wait in a single io_uring_enter.
+	///
+	/// 			The poller also offers the completion-based I/O: accepts,
+	/// 			reads and writes queued by the event loop go to the kernel
+	/// 			in the same io_uring_enter, and the reads land in the
+	/// 			buffers of the ring registered with IORING_REGISTER_PBUF_RING.
+	/// 			Returning such a buffer is a store to the shared memory,
+	/// 			not a system call.
+	/// </summary>
+	////////////////////////////////////////////////////////////////////////////
+	class UringPoller final : public Poller, public CompletionIo
+	{
+		struct Registration
+		{
+			uint32_t events;
+			uint64_t data;
+			uint32_t generation;
+			bool armed;
+		};
+
+		struct Request
+		{
+			uint64_t data;
+			Operation operation;
+			uint32_t generation;
+			bool isPending;
+			// Copy of the vector of the write, it may be read by the kernel
+			// after the caller's one is gone
+			std::vector<struct iovec> iov;
+		};
+
+		struct ProvidedBuffer
+		{
+			uint8_t* data;
+			uint32_t size;
+		};
+
+		SocketHandle m_ring;
+		void* m_sqRing = nullptr;
+		size_t m_sqRingSize = 0;
+		void* m_cqRing = nullptr;
+		size_t m_cqRingSize = 0;
+		struct io_uring_sqe* m_sqes = nullptr;
+		size_t m_sqesSize = 0;
+
+		unsigned* m_sqHead = nullptr;
+		unsigned* m_sqTail = nullptr;
+		unsigned* m_sqArray = nullptr;
+		unsigned m_sqMask = 0;
+		unsigned m_sqEntries = 0;
+		unsigned m_sqLocalTail = 0;
+		unsigned* m_cqHead = nullptr;
+		unsigned* m_cqTail = nullptr;
+		unsigned m_cqMask = 0;
+		struct io_uring_cqe* m_cqes = nullptr;
+
+		// Ring of the provided buffers, the tail overlays the first entry
+		struct io_uring_buf* m_bufRing = nullptr;
+		size_t m_bufRingSize = 0;
+		uint16_t m_bufTail = 0;
+		std::vector<ProvidedBuffer> m_providedBuffers;
+
+		std::unordered_map<int, Registration> m_registrations;
+		std::vector<int> m_rearm;
+		uint32_t m_generation = 0;
+		struct __kernel_timespec m_timeout;
+
+		std::vector<Request> m_requests;
+		std::vector<uint32_t> m_freeRequests;
+		std::vector<Completion> m_completions;
+		uint64_t m_systemCalls = 0;
+
+		struct io_uring_sqe* GetSqe();
+		void QueuePoll(int fd, Registration& reg);
+		void QueueCancel(const Registration& reg, int fd);
+		int Enter(unsigned minComplete);
+		int Harvest(struct epoll_event* events, int maxEvents);
+		void Unmap();
+		void RegisterBufferRing();
+		void PublishBuffer(int bufferId);
+		uint32_t NextGeneration();
+		struct io_uring_sqe* QueueRequest(Operation operation, int fd, uint64_t data);
+		bool Complete(const struct io_uring_cqe& cqe);
+
+	public:
+		UringPoller();
+		~UringPoller();
+
+		void Add(int fd, uint32_t events, uint64_t data) override;
+		void Modify(int fd, uint32_t events, uint64_t data) override;
+		void Remove(int fd) override;
+		int Wait(struct epoll_event* events, int maxEvents, int timeoutMs) override;
+
+		CompletionIo* GetCompletionIo() noexcept override
+		{
+			return this;
+		}
+
+		uint64_t QueueAccept(int fd, struct sockaddr_storage* addr, socklen_t* addrLen, uint64_t data) override;
+		uint64_t QueueRead(int fd, uint64_t data) override;
+		uint64_t QueueWrite(int fd, const struct iovec* iov, size_t count, uint64_t data) override;
+		void Cancel(uint64_t id) override;
+		void Submit() override;
+		int ProvideBuffer(uint8_t* data, size_t size) override;
+		void ReturnBuffer(int bufferId) override;
+		void TakeCompletions(std::vector<Completion>& completions) override;
+
+		uint64_t GetSystemCalls() const noexcept override
+		{
+			return m_systemCalls;
+		}
+
+		const char* GetName() const override
+		{
+			return "io_uring";
+		}
+	};
+} // namespace Draupnir